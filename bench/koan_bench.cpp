@@ -0,0 +1,378 @@
+/*
+** Copyright 2020 Bloomberg Finance L.P.
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+// Microbenchmarks of koan kernels and utilities. Results are written as
+// JSON, and inputs are generated from fixed seeds, so that runs before and
+// after a change can be compared.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include <Eigen/Dense>
+
+#include <koan/bench.h>
+#include <koan/cli.h>
+#include <koan/def.h>
+#include <koan/indexmap.h>
+#include <koan/reader.h>
+#include <koan/sample.h>
+#include <koan/sigmoid.h>
+#include <koan/synth.h>
+#include <koan/trainer.h>
+#include <koan/util.h>
+
+using namespace koan;
+using bench::keep;
+
+/// Synthetic vocabulary and sentences of words drawn from a Zipf
+/// distribution, like those of natural language.
+struct Corpus {
+  std::vector<std::string> words;
+  std::vector<Real> probs;
+  std::vector<Sentence> sentences;
+
+  Corpus(size_t vocab_size, size_t sents, size_t len, unsigned seed)
+      : probs(zipf_probs(vocab_size)) {
+    std::mt19937 rng(seed);
+    for (size_t i = 0; i < vocab_size; i++) {
+      words.push_back("w" + std::to_string(rng() % 100000) + "_" +
+                      std::to_string(i));
+    }
+    std::discrete_distribution<Word> dist(probs.begin(), probs.end());
+    sentences.resize(sents);
+    for (auto& s : sentences) {
+      for (size_t i = 0; i < len; i++) { s.push_back(dist(rng)); }
+    }
+  }
+
+  std::string line(const Sentence& s) const {
+    std::string line;
+    for (auto w : s) { line += (line.empty() ? "" : " ") + words[w]; }
+    return line;
+  }
+};
+
+/// Negative sampling distribution, i.e. unigram probabilities to the 3/4.
+std::vector<Real> negative_probs(const std::vector<Real>& probs) {
+  std::vector<Real> neg(probs.size());
+  Real sum = 0;
+  for (size_t i = 0; i < probs.size(); i++) {
+    sum += neg[i] = std::pow(probs[i], 0.75_R);
+  }
+  for (auto& p : neg) { p /= sum; }
+  return neg;
+}
+
+/// Random embeddings of small magnitude, so that sigmoids are not saturated.
+Table random_table(size_t size, unsigned dim) {
+  Table table;
+  for (size_t i = 0; i < size; i++) {
+    table.push_back(Vector::Random(dim) / Real(dim));
+  }
+  return table;
+}
+
+void bench_sigmoid(bench::Runner& runner, unsigned seed) {
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<Real> dist(-10, 10);
+  std::vector<Real> xs(4096);
+  for (auto& x : xs) { x = dist(rng); }
+  runner.run("sigmoid", {}, "call", xs.size(), [&](size_t n) {
+    for (size_t i = 0; i < n; i++) {
+      Real sum = 0;
+      for (auto x : xs) { sum += sigmoid(x); }
+      keep(sum);
+    }
+  });
+}
+
+void bench_alias_sampler(bench::Runner& runner, unsigned seed) {
+  for (size_t vocab : {1000, 100000, 1000000}) {
+    AliasSampler sampler(negative_probs(zipf_probs(vocab)));
+    sampler.set_seed(seed);
+    runner.run(
+        "alias_sample", {{"vocab", double(vocab)}}, "sample", 1, [&](size_t n) {
+          for (size_t i = 0; i < n; i++) { keep(sampler.sample()); }
+        });
+  }
+}
+
+void bench_updates(bench::Runner& runner, unsigned seed) {
+  const size_t vocab = 10000, ctxs = 5;
+  Corpus corpus(vocab, 1, 1000, seed);
+  auto& sent = corpus.sentences[0];
+  auto neg_probs = negative_probs(corpus.probs);
+  for (unsigned dim : {50, 100, 300}) {
+    for (unsigned negatives : {1, 5, 15}) {
+      srand(seed);
+      Table table = random_table(vocab, dim), ctx = random_table(vocab, dim);
+      Trainer trainer(Trainer::Params{.dim = dim,
+                                      .ctxs = ctxs,
+                                      .negatives = negatives,
+                                      .threads = 1},
+                      table,
+                      ctx,
+                      std::vector<Real>(vocab, 0),
+                      neg_probs);
+      bench::Params params{{"dim", double(dim)},
+                            {"negatives", double(negatives)}};
+      for (bool cbow : {true, false}) {
+        runner.run(cbow ? "cbow_update" : "sg_update",
+                   params,
+                   "update",
+                   1,
+                   [&](size_t n) {
+                     for (size_t i = 0; i < n; i++) {
+                       size_t c = ctxs + i % (sent.size() - 2 * ctxs);
+                       if (cbow) {
+                         trainer.cbow_update(
+                             sent, c, c - ctxs, c + ctxs + 1, 0, 0.001);
+                       } else {
+                         trainer.sg_update(
+                             sent, c, c - ctxs, c + ctxs + 1, 0, 0.001);
+                       }
+                     }
+                   });
+      }
+    }
+  }
+}
+
+void bench_train(bench::Runner& runner, unsigned seed) {
+  const size_t vocab = 10000, sents = 1000, len = 20;
+  const unsigned dim = 100;
+  Corpus corpus(vocab, sents, len, seed);
+  // word2vec downsampling with threshold 1e-4
+  std::vector<Real> filter_probs(vocab);
+  for (size_t i = 0; i < vocab; i++) {
+    filter_probs[i] =
+        std::max(0_R, 1_R - std::sqrt(1e-4_R / corpus.probs[i]));
+  }
+  srand(seed);
+  Table table = random_table(vocab, dim), ctx = random_table(vocab, dim);
+  Trainer trainer(
+      Trainer::Params{.dim = dim, .ctxs = 5, .negatives = 5, .threads = 1},
+      table,
+      ctx,
+      filter_probs,
+      negative_probs(corpus.probs));
+  for (bool cbow : {true, false}) {
+    runner.run("train",
+               {{"dim", double(dim)}, {"cbow", double(cbow)}},
+               "token",
+               sents * len,
+               [&](size_t n) {
+                 for (size_t i = 0; i < n; i++) {
+                   for (auto& s : corpus.sentences) {
+                     keep(trainer.train(s, 0, 0.001, cbow));
+                   }
+                 }
+               });
+  }
+}
+
+void bench_split(bench::Runner& runner, unsigned seed) {
+  Corpus corpus(10000, 64, 20, seed);
+  std::vector<std::string> lines;
+  for (auto& s : corpus.sentences) { lines.push_back(corpus.line(s)); }
+  std::vector<std::string_view> words;
+  runner.run("split", {{"words", 20}}, "line", lines.size(), [&](size_t n) {
+    for (size_t i = 0; i < n; i++) {
+      for (auto& line : lines) {
+        words.clear();
+        split(words, line, ' ');
+        keep(words.size());
+      }
+    }
+  });
+}
+
+void bench_indexmap(bench::Runner& runner, unsigned seed) {
+  for (size_t vocab : {10000, 1000000}) {
+    Corpus corpus(vocab, 1, 4096, seed);
+    IndexMap<std::string_view> map;
+    for (auto& w : corpus.words) { map.insert(w); }
+    std::vector<std::string_view> queries;
+    for (auto w : corpus.sentences[0]) { queries.push_back(corpus.words[w]); }
+    runner.run("indexmap_find",
+               {{"vocab", double(vocab)}},
+               "lookup",
+               queries.size(),
+               [&](size_t n) {
+                 for (size_t i = 0; i < n; i++) {
+                   for (auto& q : queries) { keep(map.find(q)->second); }
+                 }
+               });
+  }
+}
+
+void bench_readlines(bench::Runner& runner, unsigned seed) {
+  const size_t sents = 10000;
+  Corpus corpus(10000, sents, 20, seed);
+  const std::string path =
+      "/tmp/koan_bench_" + std::to_string(::getpid()) + ".txt";
+  {
+    std::ofstream out(path);
+    for (auto& s : corpus.sentences) { out << corpus.line(s) << '\n'; }
+  }
+  runner.run("readlines", {{"words", 20}}, "line", sents, [&](size_t n) {
+    for (size_t i = 0; i < n; i++) {
+      size_t bytes = 0;
+      readlines(
+          path, [&](std::string_view line) { bytes += line.size(); }, "auto",
+          false);
+      keep(bytes);
+    }
+  });
+  std::remove(path.c_str());
+}
+
+void bench_parallel_for(bench::Runner& runner) {
+  std::vector<unsigned> threads{1, 2, 4};
+  unsigned hw = std::thread::hardware_concurrency();
+  if (hw > threads.back()) { threads.push_back(hw); }
+  for (unsigned t : threads) {
+    runner.run(
+        "parallel_for", {{"threads", double(t)}}, "call", 1, [&](size_t n) {
+          for (size_t i = 0; i < n; i++) {
+            parallel_for(0, t, [](size_t j, size_t) { keep(j); }, t);
+          }
+        });
+  }
+}
+
+int main(int argc, char** argv) {
+  std::string output = "-";
+  std::string filter;
+  double min_time = 0.1;
+  unsigned repetitions = 5;
+  unsigned seed = 123457;
+  std::string results_path, baseline_dir;
+  bool save_baseline = false;
+  double alpha = 0.01;
+  double threshold = 0.05;
+
+  Args args;
+  args.add(output,
+           "output",
+           "path",
+           "Path to write JSON results to, or - for stdout (unless comparing "
+           "to a baseline)");
+  args.add(filter,
+           "filter",
+           "str",
+           "Only run benchmarks whose id (e.g. \"sg_update/dim=100/"
+           "negatives=5\") contains this");
+  args.add(min_time,
+           "min-time",
+           "seconds",
+           "Minimum time of each timed repetition of a benchmark");
+  args.add(repetitions,
+           "repetitions",
+           "n",
+           "Number of timed repetitions, of which the median is reported");
+  args.add(seed, "seed", "n", "Seed of random inputs");
+  args.add(results_path,
+           "results",
+           "path",
+           "If nonempty, load results saved with --output instead of "
+           "running benchmarks");
+  args.add(baseline_dir,
+           "baseline-dir",
+           "path",
+           "If nonempty, compare results to the baseline stored there for "
+           "this CPU and configuration, if any, and exit with status 1 if "
+           "any benchmark got significantly slower");
+  args.add_flag(save_baseline,
+                "save-baseline",
+                "If passed, store results as the baseline of this CPU and "
+                "configuration in --baseline-dir");
+  args.add(alpha,
+           "alpha",
+           "p",
+           "Significance level of the Mann-Whitney U test comparing the "
+           "repetitions of each benchmark to those of the baseline");
+  args.add(threshold,
+           "threshold",
+           "ratio",
+           "Minimum relative change of median time to report");
+  args.add_help();
+  args.parse(argc, argv);
+  KOAN_ASSERT(not save_baseline or not baseline_dir.empty(),
+              "\"--save-baseline\" requires \"--baseline-dir\"!");
+
+  bench::Results results;
+  if (not results_path.empty()) {
+    results = bench::Results::load(results_path);
+  } else {
+    bench::Runner runner(min_time, repetitions, filter, true);
+    bench_sigmoid(runner, seed);
+    bench_alias_sampler(runner, seed);
+    bench_updates(runner, seed);
+    bench_train(runner, seed);
+    bench_split(runner, seed);
+    bench_indexmap(runner, seed);
+    bench_readlines(runner, seed);
+    bench_parallel_for(runner);
+    results.results = runner.results();
+    results.context = {
+        {"date", "\"" + date_time("%F %T") + "\""},
+        {"cpu", "\"" + bench::cpu_name() + "\""},
+        {"real_bytes", std::to_string(sizeof(Real))},
+        {"hardware_threads",
+         std::to_string(std::thread::hardware_concurrency())},
+        {"min_time", bench::json_number(min_time)},
+        {"repetitions", std::to_string(repetitions)},
+        {"seed", std::to_string(seed)},
+    };
+  }
+  if (output != "-") {
+    results.save(output);
+  } else if (baseline_dir.empty()) {
+    std::cout << results.json();
+  }
+
+  int status = 0;
+  if (not baseline_dir.empty()) {
+    const std::string path = baseline_dir + "/" + results.baseline_name();
+    if (std::ifstream(path)) {
+      std::cout << "Comparing to baseline " << path << std::endl;
+      auto baseline = bench::Results::load(path);
+      auto changes = bench::compare(baseline.results, results.results);
+      if (bench::print_changes(changes, alpha, threshold) > 0) { status = 1; }
+    } else {
+      std::cout << "No baseline for this CPU and configuration at " << path
+                << std::endl;
+    }
+    if (save_baseline) {
+      std::filesystem::create_directories(baseline_dir);
+      results.save(path);
+      std::cout << "Saved baseline " << path << std::endl;
+    }
+  }
+  return status;
+}
@@ -16,26 +16,61 @@
 
 #include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <csignal>
 #include <cstdio>
+#include <deque>
 #include <fstream>
+#include <functional>
+#include <future>
 #include <iomanip>
 #include <iostream>
 #include <limits>
 #include <memory>
+#include <optional>
+#include <random>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
 #include <Eigen/Dense>
 
 #include "extern/mew.h"
 
+#include <koan/autotune.h>
+#include <koan/bench.h>
 #include <koan/cli.h>
+#include <koan/contention.h>
+#include <koan/compress.h>
+#include <koan/cooccur.h>
 #include <koan/def.h>
+#include <koan/embed.h>
+#include <koan/evaluate.h>
+#include <koan/glove.h>
+#include <koan/heldout.h>
+#include <koan/hnsw.h>
+#include <koan/huffman.h>
 #include <koan/indexmap.h>
+#include <koan/memory.h>
+#include <koan/metrics.h>
+#include <koan/neighbors.h>
+#include <koan/perf.h>
+#include <koan/phrases.h>
+#include <koan/model.h>
 #include <koan/reader.h>
+#include <koan/serve.h>
+#include <koan/stats.h>
+#include <koan/subword.h>
+#include <koan/synth.h>
 #include <koan/timer.h>
+#include <koan/trace.h>
 #include <koan/trainer.h>
 #include <koan/util.h>
 
@@ -44,7 +79,8 @@ using namespace koan;
 auto build_vocab(const std::vector<std::string>& fnames,
                  const std::string& read_mode,
                  bool enforce_max_line_length,
-                 bool no_progress) {
+                 bool no_progress,
+                 const Phraser& phraser) {
   std::unordered_map<std::string, unsigned long long> freqs;
   freqs.reserve(INITIAL_INDEX_SIZE);
 
@@ -60,12 +96,18 @@ auto build_vocab(const std::vector<std::string>& fnames,
   Timer t;
   std::vector<std::string> s;
   s.reserve(100);
+  std::string phrased;
 
   readlines(
       fnames,
       [&](const std::string_view& line) {
         s.clear();
-        split(s, line, ' ');
+        if (phraser.empty()) {
+          split(s, line, ' ');
+        } else {
+          phraser.apply(line, phrased);
+          split(s, phrased, ' ');
+        }
         for (auto& w : s) { freqs[w]++; }
         lines++;
       },
@@ -78,6 +120,53 @@ auto build_vocab(const std::vector<std::string>& fnames,
   return std::make_tuple(freqs, lines);
 }
 
+Phraser detect_phrases(const std::vector<std::string>& fnames,
+                       const std::string& read_mode,
+                       bool enforce_max_line_length,
+                       unsigned passes,
+                       const PhraseParams& params) {
+  Phraser phraser;
+  for (unsigned pass = 0; pass < passes; pass++) {
+    std::cout << "Detecting phrases (pass " << pass + 1 << "/" << passes
+              << ")..." << std::endl;
+    Timer t;
+    auto phrases = detect_phrases(
+        [&](auto f) {
+          readlines(fnames, f, read_mode, enforce_max_line_length);
+        },
+        phraser,
+        params);
+    std::cout << "Found " << phrases.size() << " phrases in " << unsigned(t.s())
+              << "s." << std::endl;
+    phraser.add_pass(std::move(phrases));
+  }
+  return phraser;
+}
+
+void save_phrased_corpus(const std::vector<std::string>& fnames,
+                         const std::string& read_mode,
+                         bool enforce_max_line_length,
+                         const Phraser& phraser,
+                         const std::string& out_path) {
+  std::cout << "Saving training files with phrases to " << out_path << "..."
+            << std::endl;
+  FILE* out = fopen(out_path.c_str(), "w");
+  KOAN_ASSERT(out);
+  std::string buf;
+  buf.reserve(MAX_LINE_LEN);
+  readlines(
+      fnames,
+      [&](const std::string_view& line) {
+        phraser.apply(line, buf);
+        buf += "\n";
+        fputs(buf.data(), out);
+      },
+      read_mode,
+      enforce_max_line_length);
+  fclose(out);
+  std::cout << "Done." << std::endl;
+}
+
 void save_vocab_file(
     const std::string& vocab_load_path,
     const std::vector<std::string>& ordered_vocab,
@@ -100,6 +189,356 @@ void save_vocab_file(
   std::cout << "Done." << std::endl;
 }
 
+/// Count co-occurrences in the corpus and train GloVe embeddings on them.
+///
+/// @param[in] reader corpus reader
+/// @param[in,out] table initial word embeddings, final embeddings (sum of word
+/// and context embeddings) are written here
+/// @param[out] ctx context embeddings
+/// @param[in] cooccur_params co-occurrence counting parameters
+/// @param[in] glove_params GloVe training parameters
+/// @param[in] epochs number of passes over the co-occurrence matrix
+/// @param[in] lr learning rate
+/// @param[in] no_progress if true, do not display counters
+void train_glove(Reader& reader,
+                 Table& table,
+                 Table& ctx,
+                 const CooccurrenceCounter::Params& cooccur_params,
+                 const GloveTrainer::Params& glove_params,
+                 unsigned epochs,
+                 Real lr,
+                 bool no_progress) {
+  Timer t;
+  std::atomic<size_t> sents{0};
+  auto counter = mew::Counter(
+      sents, "Counting co-occurrences", "lin/s", mew::Speed::Last, 1.);
+  if (no_progress) {
+    std::cout << "Counting co-occurrences..." << std::endl;
+  } else {
+    counter.start();
+  }
+
+  CooccurrenceCounter cooccur(cooccur_params);
+  Sentences sentences;
+  while (reader.get_next(sentences)) {
+    parallel_for(
+        0,
+        sentences.size(),
+        [&](size_t i, size_t tid) {
+          cooccur.add(sentences[i], tid);
+          sents++;
+        },
+        cooccur_params.threads);
+  }
+  if (not no_progress) { counter.done(); }
+
+  std::cout << "Merging co-occurrences..." << std::endl;
+  auto shards = cooccur.finish();
+  size_t nnz = 0;
+  for (auto& shard : shards) { nnz += shard.size(); }
+  std::cout << "Done in " << unsigned(t.s()) << "s. " << nnz
+            << " nonzero co-occurrences." << std::endl;
+
+  for (auto& v : ctx) {
+    v.setRandom();
+    v *= (0.5 / v.size());
+  }
+  GloveTrainer trainer(glove_params, table, ctx);
+  for (unsigned e = 0; e < epochs; e++) {
+    Timer te;
+    Real loss = trainer.train_epoch(shards, lr);
+    std::cout << "Epoch " << e << ", loss: " << loss << " ("
+              << unsigned(nnz / te.s()) << " nonzeros/s)" << std::endl;
+  }
+  trainer.finalize();
+  std::cout << "Took " << unsigned(t.s()) << "s. (excluding vocab build)"
+            << std::endl;
+}
+
+/// Compose final embeddings of the first n words from their character n-grams,
+/// if using subwords. Otherwise, rows of the table are final, and out is left
+/// empty.
+///
+/// @param[in] table embedding table
+/// @param[in] n number of words
+/// @param[in] subwords character n-grams of the vocabulary, if used
+/// @param[in] threads number of threads to use
+/// @param[out] out composed word embeddings
+void compose_words(const Table& table,
+                   size_t n,
+                   const Subwords& subwords,
+                   unsigned threads,
+                   Table& out) {
+  out.clear();
+  if (subwords.empty()) { return; }
+  out.resize(n);
+  parallel_for(
+      0,
+      n,
+      [&](size_t w, size_t) { subwords.compose(w, table, out[w]); },
+      threads);
+}
+
+/// Compute exact top-k neighbors of the most frequent words and save them in
+/// binary format (see Neighbors).
+///
+/// @param[in] path output path
+/// @param[in] table embedding table
+/// @param[in] head number of most frequent words to consider, both as queries
+/// and as neighbors
+/// @param[in] subwords character n-grams of the vocabulary, if used
+/// @param[in] k number of neighbors per word
+/// @param[in] threads number of threads to use
+void save_neighbors(const std::string& path,
+                    const Table& table,
+                    size_t head,
+                    const Subwords& subwords,
+                    unsigned k,
+                    unsigned threads) {
+  Timer t;
+  std::cout << "Computing top " << k << " neighbors of " << head
+            << " most frequent words..." << std::endl;
+  Table composed;
+  compose_words(table, head, subwords, threads, composed);
+  auto m = normalized_rows(composed.empty() ? table : composed, head, threads);
+  composed.clear();
+  exact_neighbors(m, k, threads).save(path);
+  std::cout << "Saved neighbors to " << path << " (took " << unsigned(t.s())
+            << "s)" << std::endl;
+}
+
+/// Start building an HNSW index over word embeddings in the background, to
+/// overlap it with saving embeddings.
+///
+/// @param[in] path output path of the index
+/// @param[in] table embedding table
+/// @param[in] vocab_size number of word rows in table to index
+/// @param[in] subwords if nonempty, index words composed from their n-grams
+/// @param[in] params build parameters
+/// @returns future to wait on until the index is saved
+std::future<void> save_hnsw_async(const std::string& path,
+                                  const Table& table,
+                                  size_t vocab_size,
+                                  const Subwords& subwords,
+                                  const HnswBuilder::Params& params) {
+  return std::async(std::launch::async, [=, &table, &subwords]() {
+    Timer t;
+    Table composed;
+    compose_words(table, vocab_size, subwords, params.threads, composed);
+    HnswBuilder index(composed.empty() ? table : composed, vocab_size, params);
+    index.save(path);
+    std::cout << "Saved HNSW index to " << path << " (built in "
+              << unsigned(t.s()) << "s)" << std::endl;
+  });
+}
+
+/// Save embeddings in word2vec text format (without the header line).
+///
+/// @param[in] embedding_path path to save to
+/// @param[in] word_map vocabulary
+/// @param[in] table input embeddings
+/// @param[in] subwords if nonempty, save the composition of each word and its
+/// character n-grams instead of the word embedding alone
+void save_embeddings(const std::string& embedding_path,
+                     const IndexMap<std::string_view>& word_map,
+                     const Table& table,
+                     const Subwords& subwords) {
+  std::cout << "Saving to " << embedding_path << std::endl;
+  FILE* out = fopen(embedding_path.c_str(), "w");
+  KOAN_ASSERT(out);
+  std::string buf;
+  buf.reserve(MAX_LINE_LEN);
+  Vector v;
+  for (auto& w : word_map.keys()) {
+    buf.clear();
+    buf += w;
+    if (subwords.empty()) {
+      v = table[word_map.lookup(w)];
+    } else {
+      subwords.compose(word_map.lookup(w), table, v);
+    }
+    for (int j = 0; j < v.size(); j++) {
+      buf += " ";
+      buf += std::to_string(v(j));
+    }
+    buf += "\n";
+    fputs(buf.data(), out);
+  }
+  fclose(out);
+}
+
+/// Save character n-gram bucket embeddings. Header is
+/// "<buckets> <dim> <minn> <maxn>", followed by one row per bucket, so OOV
+/// words can be embedded with Subwords::compose_oov().
+///
+/// @param[in] subwords_path path to save to
+/// @param[in] vocab_size number of words, preceding buckets in table
+/// @param[in] table input embeddings of words and buckets
+/// @param[in] subwords n-gram decomposition used in training
+void save_subwords(const std::string& subwords_path,
+                   size_t vocab_size,
+                   const Table& table,
+                   const Subwords& subwords) {
+  std::cout << "Saving n-gram buckets to " << subwords_path << std::endl;
+  FILE* out = fopen(subwords_path.c_str(), "w");
+  KOAN_ASSERT(out);
+  const size_t buckets = subwords.num_buckets();
+  std::string buf = std::to_string(buckets) + " " +
+                    std::to_string(table.at(vocab_size).size()) + " " +
+                    std::to_string(subwords.minn()) + " " +
+                    std::to_string(subwords.maxn()) + "\n";
+  fputs(buf.data(), out);
+  for (size_t b = 0; b < buckets; b++) {
+    buf.clear();
+    auto& v = table[vocab_size + b];
+    for (int j = 0; j < v.size(); j++) {
+      if (j > 0) { buf += " "; }
+      buf += std::to_string(v(j));
+    }
+    buf += "\n";
+    fputs(buf.data(), out);
+  }
+  fclose(out);
+}
+
+/// Save word embeddings as a memory mappable model, to be served with
+/// `koan serve` (see koan/model.h).
+///
+/// @param[in] model_path path to save to
+/// @param[in] word_map vocabulary
+/// @param[in] table input embeddings
+/// @param[in] subwords if nonempty, save the composition of each word and its
+/// character n-grams instead of the word embedding alone
+/// @param[in] threads number of threads to use
+void save_model(const std::string& model_path,
+                const IndexMap<std::string_view>& word_map,
+                const Table& table,
+                const Subwords& subwords,
+                unsigned threads) {
+  std::cout << "Saving model to " << model_path << std::endl;
+  Table composed;
+  compose_words(table, word_map.size(), subwords, threads, composed);
+  Model::save(
+      model_path, word_map.keys(), composed.empty() ? table : composed);
+}
+
+/// Benchmark scores of a matrix of word vectors, as (name, score) pairs.
+using ScoreFunction =
+    std::function<std::vector<std::pair<std::string, Real>>(const RowMatrix&)>;
+
+/// Compress word embeddings by reducing their dimension with PCA and/or by
+/// product quantization, and report how much is lost.
+///
+/// Embeddings are normalized to unit norm first. PCA reduced embeddings are
+/// saved in text format with a .pca suffix, and quantized ones in binary format
+/// with a .pq suffix (see PqModel), with the PCA basis if any, so that they
+/// can be decoded in the original space. Reports sizes, mean squared
+/// reconstruction error, and benchmark scores of the reconstructed vectors
+/// along with their deltas from the original ones.
+///
+/// @param[in] embedding_path path of embeddings, to add suffixes to
+/// @param[in] word_map vocabulary
+/// @param[in] table embedding table
+/// @param[in] subwords character n-grams of the vocabulary, if used
+/// @param[in] pca_dim if nonzero, reduce to pca_dim dimensions
+/// @param[in] pq_params if subspaces is nonzero, product quantize (the PCA
+/// reduced embeddings, if any) with these parameters
+/// @param[in] threads number of threads to use
+/// @param[in] scores benchmark scores to report
+void save_compressed(const std::string& embedding_path,
+                     const IndexMap<std::string_view>& word_map,
+                     const Table& table,
+                     const Subwords& subwords,
+                     unsigned pca_dim,
+                     ProductQuantizer::Params pq_params,
+                     unsigned threads,
+                     const ScoreFunction& scores) {
+  Timer t;
+  Table composed;
+  compose_words(table, word_map.size(), subwords, threads, composed);
+  auto m = normalized_rows(
+      composed.empty() ? table : composed, word_map.size(), threads);
+  composed.clear();
+
+  std::vector<std::string> names{"Original"};
+  std::vector<Real> megabytes{Real(m.size() * 4 / 1e6)};
+  std::vector<Real> errors{0};
+  std::vector<std::vector<std::pair<std::string, Real>>> results{scores(m)};
+
+  Pca pca;
+  RowMatrix reduced;
+  if (pca_dim > 0) {
+    pca = randomized_pca(m, pca_dim, threads);
+    reduced = pca.project(m, threads);
+    Table out(reduced.rows());
+    for (size_t i = 0; i < out.size(); i++) {
+      out[i] = reduced.row(i).transpose().cast<Real>();
+    }
+    save_embeddings(embedding_path + ".pca", word_map, out, Subwords());
+    auto r = pca.reconstruct(reduced);
+    names.push_back("PCA " + std::to_string(pca.k()));
+    megabytes.push_back((reduced.size() + pca.components.size()) * 4 / 1e6);
+    errors.push_back(reconstruction_error(m, r));
+    results.push_back(scores(r));
+    std::cout << "PCA explains "
+              << 100 * pca.variances.sum() /
+                     std::max<Real>(pca.total_variance, 1e-12)
+              << "% of variance" << std::endl;
+  }
+
+  if (pq_params.subspaces > 0) {
+    const RowMatrix& x = pca_dim > 0 ? reduced : m;
+    pq_params.threads = threads;
+    auto pq = ProductQuantizer::train(x, pq_params);
+    auto codes = pq.encode(x, threads);
+    auto path = embedding_path + ".pq";
+    std::cout << "Saving product quantized embeddings to " << path
+              << std::endl;
+    PqModel::save(
+        path, word_map.keys(), pca_dim > 0 ? &pca : nullptr, pq, codes);
+    RowMatrix r(x.rows(), x.cols());
+    parallel_for(
+        0,
+        r.rows(),
+        [&](size_t i, size_t) {
+          pq.decode(&codes[i * pq.subspaces()], r.data() + i * r.cols());
+        },
+        threads);
+    if (pca_dim > 0) { r = pca.reconstruct(r); }
+    names.push_back("PQ " + std::to_string(pq.subspaces()) + "B");
+    megabytes.push_back(
+        (codes.size() + 4 * (ProductQuantizer::CENTROIDS * x.cols() +
+                             (pca_dim > 0 ? pca.components.size() : 0))) /
+        1e6);
+    errors.push_back(reconstruction_error(m, r));
+    results.push_back(scores(r));
+  }
+
+  tblr::Table report;
+  std::vector<tblr::Align> aligns{tblr::Left, tblr::Right};
+  report << "Compression" << names[0];
+  for (size_t c = 1; c < names.size(); c++) {
+    report << names[c] << "Delta";
+    aligns.insert(aligns.end(), {tblr::Right, tblr::Right});
+  }
+  report.layout(tblr::markdown()).aligns(aligns).precision(4).fixed();
+  report << tblr::endr;
+  auto row = [&](const std::string& name, auto value) {
+    report << name << value(0);
+    for (size_t c = 1; c < names.size(); c++) {
+      report << value(c) << value(c) - value(0);
+    }
+    report << tblr::endr;
+  };
+  row("Size (MB)", [&](size_t c) { return megabytes[c]; });
+  row("Reconstruction error", [&](size_t c) { return errors[c]; });
+  for (size_t i = 0; i < results[0].size(); i++) {
+    row(results[0][i].first, [&](size_t c) { return results[c][i].second; });
+  }
+  report.print();
+  std::cout << "Compressed in " << unsigned(t.s()) << "s." << std::endl;
+}
+
 auto load_vocab_file(const std::string& vocab_load_path) {
   std::vector<std::string> ordered_vocab;
   std::unordered_map<std::string, unsigned long long> freqs;
@@ -181,7 +620,551 @@ auto load_pretrained_embeddings(const std::string& pretrained_path,
   return pretrained_table;
 }
 
+/// `koan embed`: embed each line of files as a document vector.
+int embed_main(int argc, char** argv) {
+  std::vector<std::string> fnames;
+  std::string model_path, output_path, vocab_path;
+  std::string weighting = "mean";
+  Real sif_a = 1e-3;
+  bool remove_common_component = false;
+  unsigned num_threads = 1;
+  size_t buffer_size = 100'000;
+  std::string read_mode = "auto";
+
+  Args args;
+  args.add(fnames,
+           "f,files",
+           "paths",
+           "Documents to embed, one per line, tokenized as training files",
+           Required);
+  args.add(model_path,
+           "model",
+           "path",
+           "Word embeddings, as saved with --save-model",
+           Required);
+  args.add(output_path,
+           "o,output",
+           "path",
+           "Output document vectors, in binary format (see koan/embed.h)",
+           Required);
+  args.add(weighting,
+           "weighting",
+           "mean|sif",
+           "Average word vectors uniformly, or by smooth inverse frequency "
+           "a / (a + p(w)) computed from --vocab");
+  args.add(vocab_path,
+           "vocab",
+           "path",
+           "Vocab file with word counts, as saved during training");
+  args.add(sif_a, "sif-a", "x", "Smoothing parameter a of SIF weighting");
+  args.add(remove_common_component,
+           "remove-common-component",
+           "true|false",
+           "If true, remove the projection of document vectors onto their "
+           "first singular vector. Takes another pass over the output.");
+  args.add(num_threads, "t,threads", "n", "Number of worker threads");
+  args.add(buffer_size,
+           "buffer-size",
+           "n",
+           "Number of documents to embed at a time");
+  args.add(read_mode,
+           "read-mode",
+           "text|gzip|auto",
+           "How to read files, see --read-mode of training");
+  args.add_help();
+  args.parse(argc, argv);
+
+  KOAN_ASSERT(weighting == "mean" or weighting == "sif",
+              "Unknown weighting: " + weighting);
+  KOAN_ASSERT(weighting == "mean" or not vocab_path.empty(),
+              "SIF weighting requires --vocab!");
+  KOAN_ASSERT(buffer_size > 0);
+
+  Timer t;
+  Model model(model_path);
+  DocumentEmbedder embedder(model, num_threads);
+  if (weighting == "sif") {
+    auto [ordered_vocab, freqs] = load_vocab_file(vocab_path);
+    std::vector<std::pair<std::string, unsigned long long>> counts;
+    for (auto& w : ordered_vocab) { counts.emplace_back(w, freqs[w]); }
+    embedder.set_sif_weights(counts, sif_a);
+  }
+
+  // Embed and write each buffer in the background while reading the next
+  MatrixWriter writer(output_path, model.dim());
+  std::vector<std::string> lines, embedding;
+  RowMatrix vectors;
+  std::future<void> pending;
+  auto flush = [&]() {
+    if (pending.valid()) { pending.get(); }
+    std::swap(lines, embedding);
+    lines.clear();
+    pending = std::async(std::launch::async, [&]() {
+      embedder.embed(embedding, vectors, remove_common_component);
+      writer.write(vectors.data(), vectors.rows());
+    });
+  };
+  readlines(
+      fnames,
+      [&](const std::string_view& line) {
+        lines.emplace_back(line);
+        if (lines.size() == buffer_size) { flush(); }
+      },
+      read_mode);
+  flush();
+  pending.get();
+  const size_t documents = writer.rows();
+  writer.close();
+
+  if (remove_common_component) {
+    remove_component(output_path, embedder.common_component());
+  }
+  std::cout << "Embedded " << documents << " documents to " << output_path
+            << " (" << unsigned(documents / std::max<double>(t.s(), 1e-3))
+            << " docs/s)" << std::endl;
+  return 0;
+}
+
+/// `koan serve`: serve a model over a Unix domain socket until interrupted.
+/// SIGHUP reloads the model from its path.
+int serve_main(int argc, char** argv) {
+  std::string socket_path = "koan.sock";
+  std::string model_path, index_path;
+  bool reload_any_path = false;
+
+  Args args;
+  args.add(model_path,
+           "model",
+           "path",
+           "Model to serve, as saved with --save-model",
+           Required);
+  args.add(socket_path, "socket", "path", "Unix domain socket to listen on");
+  args.add(index_path,
+           "index",
+           "path",
+           "HNSW index of the model (see --hnsw) to answer neighbor queries "
+           "approximately. If empty, they are answered exactly.");
+  args.add_flag(reload_any_path,
+                "reload-any-path",
+                "Let clients reload any model path, rather than only the "
+                "served one. Anyone who can connect to the socket can then "
+                "make the server map any file it can read.");
+  args.add_help();
+  args.parse(argc, argv);
+
+  static serve::Server* server = nullptr;
+  serve::Server s(socket_path, model_path, index_path, reload_any_path);
+  server = &s;
+  std::signal(SIGINT, [](int) { server->request_stop(); });
+  std::signal(SIGTERM, [](int) { server->request_stop(); });
+  std::signal(SIGHUP, [](int) { server->request_reload(); });
+  std::cout << "Serving " << s.model().size() << " words of dimension "
+            << s.model().dim() << " on " << socket_path << std::endl;
+  s.run();
+  return 0;
+}
+
+/// `koan serve-bench`: generate load against a running `koan serve` and
+/// report throughput and latency.
+int serve_bench_main(int argc, char** argv) {
+  std::string socket_path = "koan.sock";
+  std::string type = "vectors";
+  unsigned connections = 1;
+  unsigned pipeline = 16;
+  unsigned batch = 32;
+  unsigned k = 10;
+  unsigned sentence_length = 10;
+  Real duration = 5;
+
+  Args args;
+  args.add(socket_path, "socket", "path", "Unix domain socket of server");
+  args.add(type,
+           "type",
+           "lookup|vectors|sentences|neighbors",
+           "Type of requests to send");
+  args.add(connections, "connections", "n", "Number of client connections");
+  args.add(pipeline,
+           "pipeline",
+           "n",
+           "Number of requests in flight on each connection");
+  args.add(batch, "batch", "n", "Number of words or sentences per request");
+  args.add(k, "k", "n", "Number of neighbors for neighbor requests");
+  args.add(sentence_length,
+           "sentence-length",
+           "n",
+           "Number of words per sentence for sentence requests");
+  args.add(duration, "duration", "seconds", "How long to send requests");
+  args.add_help();
+  args.parse(argc, argv);
+
+  const std::unordered_map<std::string, serve::Type> types{
+      {"lookup", serve::Lookup},
+      {"vectors", serve::Vectors},
+      {"sentences", serve::Sentences},
+      {"neighbors", serve::Neighbors}};
+  KOAN_ASSERT(types.count(type), "Unknown request type: " + type);
+  KOAN_ASSERT(connections > 0 and pipeline > 0 and batch > 0);
+
+  // Build a pool of distinct request payloads from random words of the model
+  serve::Client client(socket_path);
+  std::vector<char> response;
+  client.send(serve::Info, 0, nullptr, 0);
+  const size_t vocab_size = client.receive(response).count;
+  KOAN_ASSERT(vocab_size > 0, "Model is empty!");
+  const size_t num_payloads = 64;
+  const size_t words_per_payload =
+      batch * (type == "sentences" ? sentence_length : 1);
+  std::mt19937 rng(12345);
+  std::vector<std::vector<uint32_t>> ids(num_payloads);
+  for (auto& v : ids) {
+    for (size_t i = 0; i < words_per_payload; i++) {
+      v.push_back(rng() % vocab_size);
+    }
+  }
+  std::vector<std::string> payloads;
+  for (auto& v : ids) {
+    if (type == "vectors" or type == "neighbors") {
+      payloads.emplace_back(reinterpret_cast<const char*>(v.data()),
+                            v.size() * sizeof(uint32_t));
+      continue;
+    }
+    client.send(serve::Words, 0, v);
+    auto h = client.receive(response);
+    KOAN_ASSERT(h.status == serve::Ok);
+    std::string text(response.begin(), response.end());
+    if (type == "sentences") { // join words of each sentence with spaces
+      size_t words = 0;
+      for (auto& c : text) {
+        if (c == '\n' and ++words % sentence_length != 0) { c = ' '; }
+      }
+    }
+    payloads.push_back(std::move(text));
+  }
+
+  std::vector<std::vector<float>> latencies(connections); // one per thread
+  Timer t;
+  std::vector<std::thread> threads;
+  for (unsigned c = 0; c < connections; c++) {
+    threads.emplace_back([&, c]() {
+      using clock = std::chrono::steady_clock;
+      serve::Client client(socket_path);
+      std::vector<char> response;
+      std::deque<clock::time_point> sent; // responses come in order
+      size_t next = c;
+      auto send = [&]() {
+        auto& payload = payloads[next++ % payloads.size()];
+        sent.push_back(clock::now());
+        client.send(types.at(type), 0, payload, k);
+      };
+      for (unsigned i = 0; i < pipeline; i++) { send(); }
+      while (not sent.empty()) {
+        auto h = client.receive(response);
+        KOAN_ASSERT(h.status == serve::Ok,
+                    std::string(response.begin(), response.end()));
+        std::chrono::duration<float, std::micro> us = clock::now() - sent[0];
+        latencies[c].push_back(us.count());
+        sent.pop_front();
+        if (t.s() < duration) { send(); }
+      }
+    });
+  }
+  for (auto& thread : threads) { thread.join(); }
+  const double seconds = t.s();
+
+  std::vector<float> all;
+  for (auto& l : latencies) { all.insert(all.end(), l.begin(), l.end()); }
+  std::sort(all.begin(), all.end());
+  auto percentile = [&](double p) {
+    return all[std::min<size_t>(all.size() - 1, p * all.size())];
+  };
+  tblr::Table report;
+  report.layout(tblr::markdown())
+      .aligns({tblr::Left, tblr::Right})
+      .precision(1)
+      .fixed();
+  report << "Serve benchmark (" + type + ")" << "" << tblr::endr;
+  report << "Requests" << std::to_string(all.size()) << tblr::endr;
+  report << "Requests/s" << all.size() / seconds << tblr::endr;
+  report << "Items/s" << all.size() * batch / seconds << tblr::endr;
+  report << "p50 latency (us)" << percentile(0.5) << tblr::endr;
+  report << "p99 latency (us)" << percentile(0.99) << tblr::endr;
+  report << "p99.9 latency (us)" << percentile(0.999) << tblr::endr;
+  report.print();
+  return 0;
+}
+
+/// Add options of a synthetic corpus to args.
+void add_synth_args(Args& args, SyntheticCorpus::Params& params) {
+  args.add(params.vocab_size, "vocab-size", "n", "Number of distinct words");
+  args.add(params.zipf,
+           "zipf",
+           "s",
+           "Zipf exponent, i.e. the word of frequency rank r has probability "
+           "proportional to 1 / r^s");
+  args.add(params.tokens, "tokens", "n", "Number of words in total");
+  args.add(params.sentence_length,
+           "sentence-length",
+           "n",
+           "Mean number of words per sentence");
+  args.add(params.lengths,
+           "length-distribution",
+           "fixed|uniform|poisson",
+           "Distribution of sentence lengths: the mean, uniform over [1, 2 * "
+           "mean - 1], or one plus a Poisson",
+           RequireFromSet({"fixed", "uniform", "poisson"}));
+  args.add(params.seed, "seed", "n", "Seed of the generator");
+}
+
+/// `koan synth`: generate a synthetic corpus with Zipfian word frequencies.
+int synth_main(int argc, char** argv) {
+  std::string output_path;
+  std::string format = "text";
+  SyntheticCorpus::Params params;
+
+  Args args;
+  args.add(output_path, "o,output", "path", "Corpus to write", Required);
+  args.add(format,
+           "format",
+           "text|gzip|binary",
+           "Format of corpus. Binary stores word indices after the "
+           "vocabulary (see koan/synth.h).",
+           RequireFromSet({"text", "gzip", "binary"}));
+  add_synth_args(args, params);
+  args.add_help();
+  args.parse(argc, argv);
+
+  Timer t;
+  size_t sentences = SyntheticCorpus(params).write(output_path, format);
+  std::cout << "Wrote " << sentences << " sentences of " << params.tokens
+            << " words to " << output_path << " in " << t.s() << "s."
+            << std::endl;
+  return 0;
+}
+
+/// Output and resource usage of a child koan process.
+struct ChildRun {
+  std::string output; // stdout
+  int status;         // exit status, or -1 if it did not exit normally
+  size_t peak_rss;    // bytes
+  double seconds;
+};
+
+/// Run this koan binary with args in a child process, and capture its stdout.
+///
+/// @param[in] args arguments, starting with the program name
+ChildRun run_koan(const std::vector<std::string>& args) {
+  int fds[2];
+  KOAN_ASSERT(pipe(fds) == 0, "Could not create a pipe!");
+  Timer t;
+  pid_t pid = fork();
+  KOAN_ASSERT(pid >= 0, "Could not fork!");
+  if (pid == 0) {
+    dup2(fds[1], STDOUT_FILENO);
+    close(fds[0]);
+    close(fds[1]);
+    std::vector<char*> argv;
+    for (auto& a : args) { argv.push_back(const_cast<char*>(a.c_str())); }
+    argv.push_back(nullptr);
+    execv("/proc/self/exe", argv.data());
+    _exit(127);
+  }
+  close(fds[1]);
+  ChildRun run;
+  char buf[4096];
+  ssize_t n;
+  while ((n = read(fds[0], buf, sizeof(buf))) > 0) {
+    run.output.append(buf, n);
+  }
+  close(fds[0]);
+  int status;
+  rusage usage;
+  wait4(pid, &status, 0, &usage);
+  run.status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+  run.peak_rss = size_t(usage.ru_maxrss) * 1024; // ru_maxrss is in kB
+  run.seconds = t.s();
+  return run;
+}
+
+/// `koan train-bench`: train on a (by default synthetic) corpus over a grid
+/// of threads, dimensions and objectives, each in a child process, and report
+/// throughput, scaling efficiency and peak RSS.
+int train_bench_main(int argc, char** argv) {
+  std::string corpus_path, output_path;
+  std::vector<unsigned> threads, dims;
+  std::vector<std::string> modes;
+  unsigned epochs = 1;
+  SyntheticCorpus::Params params;
+  params.tokens = 5'000'000;
+
+  Args args;
+  args.add(corpus_path,
+           "corpus",
+           "path",
+           "Training corpus. If empty, a synthetic one is generated (see "
+           "koan synth) and removed at the end.");
+  args.add(threads, "threads", "n", "Numbers of threads (default 1 2 4)");
+  args.add(dims, "dims", "n", "Embedding dimensions (default 100 300)");
+  args.add(modes,
+           "modes",
+           "cbow|sg",
+           "Objectives (default both)");
+  args.add(epochs, "e,epochs", "n", "Training epochs of each run");
+  args.add(output_path,
+           "o,output",
+           "path",
+           "If nonempty, save results as JSON");
+  add_synth_args(args, params);
+  args.add_help();
+  args.parse(argc, argv);
+
+  if (threads.empty()) { threads = {1, 2, 4}; }
+  if (dims.empty()) { dims = {100, 300}; }
+  if (modes.empty()) { modes = {"cbow", "sg"}; }
+  for (auto& mode : modes) {
+    KOAN_ASSERT(mode == "cbow" or mode == "sg", "Unknown mode: " + mode);
+  }
+  std::sort(threads.begin(), threads.end());
+  KOAN_ASSERT(threads[0] > 0, "Numbers of threads should be > 0!");
+
+  const std::string tmp = "/tmp/koan_train_bench_" + std::to_string(getpid());
+  // Removes temporary files however this returns. Errors are returned rather
+  // than thrown below, since an uncaught exception does not unwind the stack.
+  struct Cleanup {
+    std::vector<std::string> paths;
+    ~Cleanup() {
+      for (auto& path : paths) { std::remove(path.c_str()); }
+    }
+  } cleanup{{tmp + ".emb", tmp + ".emb.vocab"}};
+  bool synthetic = corpus_path.empty();
+  if (synthetic) {
+    corpus_path = tmp + ".txt";
+    cleanup.paths.push_back(corpus_path);
+    std::cout << "Generating " << params.tokens << " words..." << std::endl;
+    try {
+      SyntheticCorpus(params).write(corpus_path, "text");
+    } catch (const RuntimeError& e) {
+      std::cerr << e.what() << std::endl;
+      return 1;
+    }
+  }
+
+  struct Run {
+    std::string mode;
+    unsigned dim, threads;
+    double tokens_per_second, efficiency;
+    size_t peak_rss;
+    double seconds;
+  };
+  std::vector<Run> runs;
+  for (auto& mode : modes) {
+    for (unsigned dim : dims) {
+      const size_t base = runs.size(); // run with the fewest threads
+      for (unsigned t : threads) {
+        auto child = run_koan({"koan",
+                               "-f",
+                               corpus_path,
+                               "-t",
+                               std::to_string(t),
+                               "-d",
+                               std::to_string(dim),
+                               "-b",
+                               mode == "cbow" ? "true" : "false",
+                               "-e",
+                               std::to_string(epochs),
+                               "-p",
+                               tmp + ".emb",
+                               "-P"});
+        const std::string speed = "Overall speed was ";
+        auto pos = child.output.find(speed);
+        if (child.status != 0 or pos == std::string::npos) {
+          std::cerr << "Training failed:\n" << child.output << std::endl;
+          return 1;
+        }
+        Run r{mode,
+              dim,
+              t,
+              std::stod(child.output.substr(pos + speed.size())),
+              1,
+              child.peak_rss,
+              child.seconds};
+        if (runs.size() > base) { // speedup over the base, per added thread
+          r.efficiency =
+              (r.tokens_per_second / runs[base].tokens_per_second) /
+              (double(t) / runs[base].threads);
+        }
+        std::cout << mode << " dim=" << dim << " threads=" << t << ": "
+                  << unsigned(r.tokens_per_second) << " tok/s" << std::endl;
+        runs.push_back(r);
+      }
+    }
+  }
+  tblr::Table report;
+  report.layout(tblr::markdown())
+      .aligns({tblr::Left,
+               tblr::Right,
+               tblr::Right,
+               tblr::Right,
+               tblr::Right,
+               tblr::Right,
+               tblr::Right})
+      .precision(2)
+      .fixed();
+  report << "Mode" << "Dim" << "Threads" << "Tok/s" << "Scaling efficiency"
+         << "Peak RSS (MB)" << "Seconds" << tblr::endr;
+  for (auto& r : runs) {
+    report << r.mode << std::to_string(r.dim) << std::to_string(r.threads)
+           << std::to_string(size_t(r.tokens_per_second)) << r.efficiency
+           << r.peak_rss / 1e6 << r.seconds << tblr::endr;
+  }
+  report.print();
+
+  if (not output_path.empty()) {
+    using bench::json_number;
+    std::ofstream out(output_path);
+    KOAN_ASSERT(out, "Could not open '" + output_path + "' to save results!");
+    out << "{\n  \"corpus\": ";
+    if (synthetic) {
+      out << "{\"vocab_size\": " << params.vocab_size
+          << ", \"zipf\": " << json_number(params.zipf)
+          << ", \"tokens\": " << params.tokens
+          << ", \"sentence_length\": " << json_number(params.sentence_length)
+          << ", \"length_distribution\": \"" << params.lengths
+          << "\", \"seed\": " << params.seed << "}";
+    } else {
+      out << "\"" << corpus_path << "\"";
+    }
+    out << ",\n  \"epochs\": " << epochs << ",\n  \"runs\": [";
+    for (size_t i = 0; i < runs.size(); i++) {
+      auto& r = runs[i];
+      out << (i > 0 ? ",\n    " : "\n    ") << "{\"mode\": \"" << r.mode
+          << "\", \"dim\": " << r.dim << ", \"threads\": " << r.threads
+          << ", \"tokens_per_second\": " << json_number(r.tokens_per_second)
+          << ", \"scaling_efficiency\": " << json_number(r.efficiency)
+          << ", \"peak_rss_bytes\": " << r.peak_rss
+          << ", \"seconds\": " << json_number(r.seconds) << "}";
+    }
+    out << "\n  ]\n}\n";
+  }
+  return 0;
+}
+
 int main(int argc, char** argv) {
+  if (argc > 1 and std::string(argv[1]) == "embed") {
+    return embed_main(argc - 1, argv + 1);
+  }
+  if (argc > 1 and std::string(argv[1]) == "serve") {
+    return serve_main(argc - 1, argv + 1);
+  }
+  if (argc > 1 and std::string(argv[1]) == "serve-bench") {
+    return serve_bench_main(argc - 1, argv + 1);
+  }
+  if (argc > 1 and std::string(argv[1]) == "synth") {
+    return synth_main(argc - 1, argv + 1);
+  }
+  if (argc > 1 and std::string(argv[1]) == "train-bench") {
+    return train_bench_main(argc - 1, argv + 1);
+  }
+
   srand(123457);
   std::vector<std::string> fnames;
   unsigned dim = 200;
@@ -193,6 +1176,14 @@ int main(int argc, char** argv) {
   bool discard = true;
   bool cbow = false;
   bool use_bad_update = false;
+  bool hs = false;
+  Real loss_sample = 1e-3;
+  unsigned minn = 3;
+  unsigned maxn = 0;
+  size_t buckets = 2'000'000;
+  bool glove = false;
+  CooccurrenceCounter::Params cooccur_params;
+  GloveTrainer::Params glove_params;
   Real downsample_th = 1e-3;
   Real init_lr = 0.025; // If cbow, initial learning rate 0.075 recommended.
   Real min_lr = 1e-4;
@@ -204,9 +1195,25 @@ int main(int argc, char** argv) {
   std::string embedding_path = "";
   bool shuffle = false;
   bool no_progress = false;
+  bool print_profile = false;
+  std::string trace_path;
+  bool perf_counters = false;
+  bool memory_report = false;
+  std::string metrics_log, metrics_prometheus;
+  double metrics_interval = 10;
+  bool contention_profile = false;
+  size_t contention_hot_rows = 1000;
+  size_t contention_sample_every = 64;
   bool partitioned = false;
+  bool autotune = false;
+  size_t autotune_tokens = 1'000'000;
+  bool dry_run = false;
   bool enforce_max_line_length = false;
 
+  unsigned phrase_passes = 0;
+  PhraseParams phrase_params;
+  std::string phrases_output;
+
   std::string pretrained_path;
   std::string continue_vocab = "union";
   std::string read_mode = "auto";
@@ -214,6 +1221,26 @@ int main(int argc, char** argv) {
   unsigned start_lr_schedule_epoch = 0;
   unsigned max_lr_schedule_epochs = 0;
 
+  bool hnsw = false;
+  HnswBuilder::Params hnsw_params;
+
+  std::vector<std::string> analogy_paths, similarity_paths;
+  size_t eval_restrict = 30'000;
+  bool eval_each_epoch = false;
+
+  unsigned neighbors_k = 0;
+  size_t neighbors_head = 200'000;
+
+  bool save_model_file = false;
+
+  unsigned pca_dim = 0;
+  ProductQuantizer::Params pq_params;
+  pq_params.subspaces = 0;
+
+  size_t heldout_sentences = 0;
+  size_t eval_every = 0;
+  Real early_stop_threshold = 0;
+
   Args args;
   args.add(fnames, "f,files", "paths", "Paths to training files", Required);
   args.add(dim, "d,dim", "n", "Word vector dimension");
@@ -255,6 +1282,33 @@ int main(int argc, char** argv) {
            "u,use-bad-update",
            "true|false",
            "If true, use faulty CBOW update");
+  args.add(hs,
+           "H,hierarchical-softmax",
+           "true|false",
+           "If true, use hierarchical softmax over a Huffman tree of the "
+           "vocabulary instead of negative sampling (see --negatives)");
+  args.add(loss_sample,
+           "loss-sample",
+           "r",
+           "Fraction of updates whose loss is computed from the sigmoids "
+           "they already evaluate, to report a running training loss with "
+           "the progress (0 to disable)");
+  args.add(minn,
+           "minn",
+           "n",
+           "Minimum length of character n-grams when using subwords (see "
+           "--maxn)");
+  args.add(maxn,
+           "maxn",
+           "n",
+           "Maximum length of character n-grams. If nonzero, input embedding "
+           "of each word is composed from the word and its hashed character "
+           "n-grams as in fastText, and n-gram bucket embeddings are saved to "
+           "embedding path with additional '.subwords' suffix.");
+  args.add(buckets,
+           "buckets",
+           "n",
+           "Number of hash buckets for character n-grams (see --maxn)");
   args.add(
       downsample_th, "o,downsample-threshold", "x", "Downsample threshold");
   args.add(ns_exponent,
@@ -327,6 +1381,26 @@ int main(int argc, char** argv) {
            "Can be faster due to a lack of std::atomic use, but also slower "
            "due to workers with less work waiting for others. Changes "
            "sentence processing order.");
+  args.add_flag(autotune,
+                "autotune",
+                "Before training, time short runs on the corpus with the "
+                "requested number of threads and the numbers of physical and "
+                "logical cores, with either scheduler (see \"partitioned\") "
+                "and buffer sizes around the requested one, then train with "
+                "the fastest settings. The short runs make throwaway updates: "
+                "training then starts from the original embeddings and random "
+                "state. The embeddings are copied for that, which temporarily "
+                "doubles their memory.");
+  args.add(autotune_tokens,
+           "autotune-tokens",
+           "n",
+           "Tokens read by each short run of \"autotune\"");
+  args.add_flag(dry_run,
+                "dry-run",
+                "Build the vocabulary (unless loaded) and read the corpus "
+                "once with the configured reader, discarding the sentences "
+                "instead of training, then report the throughput of both and "
+                "the OOV rate, to tell whether reading caps training speed");
   args.add(start_lr_schedule_epoch,
            "S,start-lr-schedule-epoch",
            "n",
@@ -341,6 +1415,60 @@ int main(int argc, char** argv) {
   args.add_flag(no_progress,
                 "P,no-progress",
                 "If passed, do not display counters and progress bars.");
+  args.add_flag(print_profile,
+                "profile",
+                "If passed, time each sentence update, and print time spent "
+                "in each phase of training (including waiting on the reader "
+                "and idling at the end of each buffer) at the end.");
+  args.add_flag(perf_counters,
+                "perf-counters",
+                "If passed, count cycles, instructions, LLC and dTLB misses "
+                "and backend stalls of all training threads with "
+                "perf_event_open, and print them per token for each phase at "
+                "the end of each epoch. Unavailable counters are skipped.");
+  args.add_flag(memory_report,
+                "memory-report",
+                "If passed, print memory at startup, and at exit the resident "
+                "set size and estimated memory of the main data structures "
+                "after each phase, and which of them drove the peak.");
+  args.add(metrics_log,
+           "metrics-log",
+           "path",
+           "If nonempty, append throughput, learning rate, retained token "
+           "ratio, reader stall time, RSS and loss as a JSON object per line "
+           "to this file every \"metrics-interval\" seconds of training");
+  args.add(metrics_prometheus,
+           "metrics-prometheus",
+           "path",
+           "If nonempty, atomically rewrite the same metrics to this file in "
+           "Prometheus text format every \"metrics-interval\" seconds, e.g. "
+           "for the textfile collector of node-exporter");
+  args.add(metrics_interval, "metrics-interval", "s", "See \"metrics-log\"");
+  args.add_flag(contention_profile,
+                "contention-profile",
+                "If passed, tag sampled embedding rows with the thread that "
+                "wrote them last, and print the rows most often written by "
+                "different threads in a row, conflict rates by frequency rank "
+                "and the estimated coherence traffic at the end.");
+  args.add(contention_hot_rows,
+           "contention-hot-rows",
+           "n",
+           "Number of most frequent rows whose writes are all tagged when "
+           "profiling contention");
+  args.add(contention_sample_every,
+           "contention-sample-every",
+           "n",
+           "Tag every n-th of the remaining rows when profiling contention");
+  args.add(trace_path,
+           "trace",
+           "path",
+#ifdef KOAN_ENABLE_TRACE
+           "If nonempty, save a Chrome trace of reading, batches, sentence "
+           "updates, evaluation and export at the end (open it in "
+           "chrome://tracing or https://ui.perfetto.dev)");
+#else
+           "Tracing is not supported. Build koan with KOAN_ENABLE_TRACE.");
+#endif
   args.add_flag(enforce_max_line_length,
                 "!,enforce-max-line-length",
                 "If passed, will throw an error if any line in training file "
@@ -348,6 +1476,143 @@ int main(int argc, char** argv) {
                     std::to_string(MAX_LINE_LEN) +
                     " characters. Otherwise, will silently "
                     "truncate any lines to this value.");
+  args.add(phrase_passes,
+           "phrase-passes",
+           "n",
+           "If nonzero, detect frequent bigrams (as in word2phrase) in n "
+           "passes over training files before building vocab, and join them "
+           "with '_' while training. Each pass can join phrases found in "
+           "previous passes.");
+  args.add(phrase_params.threshold,
+           "phrase-threshold",
+           "x",
+           "Score threshold to accept a bigram as a phrase. Higher means fewer "
+           "phrases.");
+  args.add(phrase_params.min_count,
+           "phrase-min-count",
+           "n",
+           "Ignore words and bigrams with lower counts when detecting phrases");
+  args.add(phrase_params.max_entries,
+           "phrase-max-entries",
+           "n",
+           "Bound on distinct words and bigrams held in memory when detecting "
+           "phrases. Rare ones are pruned beyond this.");
+  args.add(phrases_output,
+           "phrases-output",
+           "path",
+           "If passed (nonempty), write training files with detected phrases "
+           "joined to this path and exit without training");
+  args.add(heldout_sentences,
+           "heldout-sentences",
+           "n",
+           "If nonzero, hold out the first n sentences of training files, "
+           "which are never trained on, and report the loss over them after "
+           "each epoch. Loss is computed in the background on a snapshot of "
+           "embeddings, with the full context window and no downsampling.");
+  args.add(eval_every,
+           "eval-every",
+           "n",
+           "If nonzero, also report held-out loss every n training "
+           "sentences. Checked in between buffers (see --buffer-size).");
+  args.add(early_stop_threshold,
+           "early-stop-threshold",
+           "x",
+           "If nonzero, stop training when the relative improvement of "
+           "held-out loss over the previous epoch is below x, and keep "
+           "embeddings from the end of the last evaluated epoch");
+  args.add(hnsw,
+           "hnsw",
+           "true|false",
+           "If true, also build an HNSW index for approximate nearest neighbor "
+           "search over the final word embeddings, and save it next to them "
+           "with a .hnsw suffix. See koan/hnsw.h to query it.");
+  args.add(hnsw_params.m,
+           "hnsw-m",
+           "n",
+           "Maximum number of links per node in upper levels of HNSW index");
+  args.add(hnsw_params.ef_construction,
+           "hnsw-ef-construction",
+           "n",
+           "Size of search beam when building HNSW index");
+  args.add(analogy_paths,
+           "analogies",
+           "paths",
+           "Analogy benchmarks in word2vec's questions-words.txt format, to "
+           "evaluate embeddings on by 3CosAdd and 3CosMul after training");
+  args.add(similarity_paths,
+           "similarities",
+           "paths",
+           "Word similarity benchmarks with \"word1 word2 score\" lines, to "
+           "evaluate embeddings on by Spearman correlation after training");
+  args.add(eval_restrict,
+           "eval-restrict",
+           "n",
+           "Answer analogies among the n most frequent words only, and skip "
+           "queries with other words");
+  args.add(eval_each_epoch,
+           "eval-each-epoch",
+           "true|false",
+           "If true, evaluate on --analogies and --similarities at the end of "
+           "each epoch instead of only after training");
+  args.add(neighbors_k,
+           "neighbors",
+           "k",
+           "If nonzero, compute exact top-k cosine neighbors of the most "
+           "frequent words (see --neighbors-head) after training and save "
+           "them in binary format (see koan/neighbors.h) next to embeddings "
+           "with a .neighbors suffix.");
+  args.add(neighbors_head,
+           "neighbors-head",
+           "n",
+           "Number of most frequent words to compute neighbors among");
+  args.add(save_model_file,
+           "save-model",
+           "true|false",
+           "If true, also save word embeddings in binary format next to them "
+           "with a .model suffix, to be served with `koan serve`");
+  args.add(pca_dim,
+           "pca-dim",
+           "n",
+           "If nonzero, also save (unit norm) word embeddings reduced to n "
+           "dimensions by randomized PCA next to them with a .pca suffix");
+  args.add(pq_params.subspaces,
+           "pq-subspaces",
+           "n",
+           "If nonzero, also product quantize (unit norm, and PCA reduced if "
+           "--pca-dim is given) word embeddings to n bytes each, and save "
+           "them next to embeddings with a .pq suffix (see koan/compress.h). "
+           "Must divide dimension.");
+  args.add(pq_params.iterations,
+           "pq-iterations",
+           "n",
+           "Number of k-means iterations to train product quantizer");
+  args.add(pq_params.sample,
+           "pq-sample",
+           "n",
+           "Number of words to train product quantizer on");
+  args.add(glove,
+           "G,glove",
+           "true|false",
+           "If true, count a co-occurrence matrix over training files (with "
+           "context-size as window) and train GloVe embeddings on it instead "
+           "of word2vec. Learning rate of 0.05 is recommended.");
+  args.add(glove_params.x_max,
+           "glove-x-max",
+           "x",
+           "Co-occurrence count at which GloVe weighting function saturates");
+  args.add(glove_params.alpha,
+           "glove-alpha",
+           "x",
+           "Exponent of GloVe weighting function");
+  args.add(cooccur_params.max_entries,
+           "cooccur-max-entries",
+           "n",
+           "Bound on co-occurrence matrix entries held in memory while "
+           "counting. Sorted runs are spilled to tmp-dir beyond this.");
+  args.add(cooccur_params.tmp_dir,
+           "tmp-dir",
+           "path",
+           "Directory for temporary files");
 
   args.add_help();
   args.parse(argc, argv);
@@ -374,29 +1639,121 @@ int main(int argc, char** argv) {
                 "preloading a vocabulary file!");
   }
 
+  if (not phrases_output.empty()) {
+    KOAN_ASSERT(phrase_passes > 0,
+                "\"--phrases-output\" requires \"--phrase-passes\" > 0!");
+  }
+  if (glove) {
+    KOAN_ASSERT(not hs and maxn == 0,
+                "GloVe cannot be trained with hierarchical softmax or "
+                "subwords!");
+    KOAN_ASSERT(heldout_sentences == 0,
+                "Held-out evaluation is not supported for GloVe!");
+    KOAN_ASSERT(not perf_counters and not contention_profile and
+                    metrics_log.empty() and metrics_prometheus.empty(),
+                "\"--perf-counters\", \"--contention-profile\" and metrics "
+                "are not supported for GloVe!");
+    KOAN_ASSERT(not autotune, "\"--autotune\" is not supported for GloVe!");
+  }
+  if (eval_every > 0 or early_stop_threshold > 0) {
+    KOAN_ASSERT(heldout_sentences > 0,
+                "\"--eval-every\" and \"--early-stop-threshold\" require "
+                "\"--heldout-sentences\" > 0!");
+  }
+  KOAN_ASSERT(metrics_interval > 0, "\"--metrics-interval\" should be > 0!");
+  KOAN_ASSERT(loss_sample >= 0 and loss_sample <= 1,
+              "\"--loss-sample\" should be in [0, 1]!");
+  KOAN_ASSERT(autotune_tokens > 0, "\"--autotune-tokens\" should be > 0!");
+  KOAN_ASSERT(trace_path.empty() or trace::ENABLED,
+              "\"--trace\" requires koan to be built with "
+              "KOAN_ENABLE_TRACE!");
+
   if (embedding_path.empty()) {
     embedding_path = "embeddings_" + date_time("%F_%T") + ".txt";
   }
 
+  // Per-thread state is sized for the most threads autotuning may pick
+  std::vector<unsigned> thread_candidates;
+  if (autotune) {
+    thread_candidates =
+        Autotuner::thread_candidates(num_threads, CpuTopology::detect());
+    num_threads = thread_candidates.back();
+  }
+
+  Profile profile(num_threads);
+  const auto vocab_phase = profile.phase("vocab");
+  const auto finalize_phase = profile.phase("vocab/finalize");
+  const auto init_phase = profile.phase("init");
+  const auto autotune_phase = profile.phase("autotune");
+  const auto train_phase = profile.phase("train");
+  const auto wait_phase = profile.phase("train/wait for reader");
+  const auto fill_phase = profile.phase("train/reader fill (background)");
+  const auto batch_phase = profile.phase("train/batch");
+  const auto kernel_phase = profile.phase("train/batch/kernel");
+  const auto idle_phase = profile.phase("train/batch/idle");
+  const auto evaluate_phase = profile.phase("evaluate");
+  const auto export_phase = profile.phase("export");
+
+  Phraser phraser;
+  if (phrase_passes > 0) {
+    phrase_params.threads = num_threads;
+    phraser = detect_phrases(fnames,
+                             read_mode,
+                             enforce_max_line_length,
+                             phrase_passes,
+                             phrase_params);
+    if (not phrases_output.empty()) {
+      save_phrased_corpus(fnames,
+                          read_mode,
+                          enforce_max_line_length,
+                          phraser,
+                          phrases_output);
+      return 0;
+    }
+  }
+
   Table table, ctx, local(num_threads, Vector::Zero(dim));
   std::vector<std::string> ordered_vocab;
   IndexMap<std::string_view> word_map; // ordered_vocab will own the
                                        // actual strings.
 
   std::unordered_map<std::string, Vector> pretrained_table;
+  std::unordered_map<std::string, unsigned long long> freqs;
+
+  // Subsystems are only measured when sampled, at the end of phases
+  MemoryLedger memory;
+  memory.track("freqs", [&]() { return heap_bytes(freqs); });
+  memory.track("vocab", [&]() {
+    return heap_bytes(ordered_vocab) + word_map.bytes();
+  });
+  memory.track("pretrained table",
+               [&]() { return heap_bytes(pretrained_table); });
+  memory.track("tables", [&]() { return heap_bytes(table) + heap_bytes(ctx); });
+  auto sample_memory = [&](const std::string& phase) {
+    if (memory_report) { memory.sample(phase); }
+  };
+  if (memory_report) { memory.print_startup(); }
 
   if (not pretrained_path.empty()) {
     pretrained_table = load_pretrained_embeddings(
         pretrained_path, read_mode, dim, enforce_max_line_length, no_progress);
+    sample_memory("pretrained");
   }
 
   bool read_whole_data = false;
 
-  std::unordered_map<std::string, unsigned long long> freqs;
-
+  std::optional<Profile::Scope> phase_scope;
+  phase_scope.emplace(profile, vocab_phase);
+  double vocab_seconds = 0;
+  unsigned long long vocab_tokens = 0;
   if (vocab_load_path.empty()) { // build vocab from corpus
+    Timer vocab_timer;
     std::tie(freqs, total_sentences) =
-        build_vocab(fnames, read_mode, enforce_max_line_length, no_progress);
+        build_vocab(
+            fnames, read_mode, enforce_max_line_length, no_progress, phraser);
+    vocab_seconds = vocab_timer.s();
+    for (auto& [word, count] : freqs) { vocab_tokens += count; }
+    auto finalize_scope = profile.scope(finalize_phase);
 
     if (not discard) {
       ordered_vocab.push_back(UNKSTR);
@@ -443,8 +1800,12 @@ int main(int argc, char** argv) {
     }
   }
 
+  sample_memory("vocab");
+
+  phase_scope.emplace(profile, init_phase);
   for (const auto& w : ordered_vocab) {
     word_map.insert(std::string_view(w));
+    if (dry_run) { continue; } // nothing to train
     assert(word_map.lookup(w) == table.size());
     assert(word_map.lookup(w) == ctx.size());
     table.push_back(Vector::Zero(dim));
@@ -462,14 +1823,85 @@ int main(int argc, char** argv) {
     read_whole_data = true;
   }
 
+  auto make_reader = [&](size_t buffer) -> std::unique_ptr<Reader> {
+    if (read_whole_data) {
+      return std::make_unique<OnceReader>(word_map,
+                                          fnames,
+                                          discard,
+                                          read_mode,
+                                          enforce_max_line_length,
+                                          phraser.empty() ? nullptr
+                                                          : &phraser);
+    }
+    return std::make_unique<AsyncReader>(word_map,
+                                         fnames,
+                                         buffer,
+                                         discard,
+                                         read_mode,
+                                         enforce_max_line_length,
+                                         phraser.empty() ? nullptr : &phraser);
+  };
+
+  if (dry_run) {
+    Timer timer;
+    auto reader = make_reader(buffer_size);
+    Sentences sentences;
+    while (reader->get_next(sentences)) {}
+    double seconds = timer.s();
+    auto counts = reader->counts();
+
+    size_t input_bytes = 0; // on disk, i.e. compressed if gzipped
+    for (auto& fname : fnames) {
+      struct stat st;
+      if (stat(fname.c_str(), &st) == 0) { input_bytes += st.st_size; }
+    }
+    std::cout << "Dry run, " << (read_whole_data ? "OnceReader" : "AsyncReader")
+              << ":" << std::endl;
+    tblr::Table report;
+    report.layout(tblr::markdown())
+        .aligns({tblr::Left,
+                 tblr::Right,
+                 tblr::Right,
+                 tblr::Right,
+                 tblr::Right,
+                 tblr::Right,
+                 tblr::Right})
+        .precision(2)
+        .fixed();
+    report << "Pass" << "Seconds" << "Lines/s" << "Tokens/s" << "Input MB/s"
+           << "Text MB/s" << "OOV rate" << tblr::endr;
+    auto row = [&](const std::string& pass,
+                   double secs,
+                   double lines,
+                   double tokens,
+                   const std::string& oov) {
+      secs = std::max(secs, 1e-9);
+      report << pass << secs << lines / secs << tokens / secs
+             << input_bytes / secs / 1e6 << counts.bytes / secs / 1e6 << oov
+             << tblr::endr;
+    };
+    if (vocab_load_path.empty()) {
+      row("vocab build", vocab_seconds, total_sentences, vocab_tokens, "-");
+    }
+    std::ostringstream oov;
+    oov << std::fixed << std::setprecision(2)
+        << 100. * counts.oov / std::max(counts.words, size_t(1)) << "%";
+    row("reader", seconds, counts.lines, counts.words, oov.str());
+    report.print();
+    return 0;
+  }
+
+
   unsigned long long tot = 0;                       // total count of all words
   std::vector<Real> prob(ordered_vocab.size());     // filter probs
   std::vector<Real> neg_prob(ordered_vocab.size()); // neg sampling probs
+  std::vector<unsigned long long> counts(ordered_vocab.size());
 
   if (not discard) { freqs[UNKSTR] = 0; }
   for (Word w = 0; w < prob.size(); w++) {
     auto count = freqs.at(std::string(word_map.reverse_lookup(w)));
     prob[w] = neg_prob[w] = count;
+    counts[w] = count;
     tot += count;
   }
 
@@ -498,8 +1930,20 @@ int main(int argc, char** argv) {
                    [total](auto& x) { return x / total; });
   }
 
+  Subwords subwords;
+  if (maxn > 0) {
+    KOAN_ASSERT(minn > 0 and minn <= maxn,
+                "\"--minn\" should be in [1, maxn] when using subwords!");
+    std::cout << "Computing character n-grams..." << std::endl;
+    subwords = Subwords(word_map.keys(), minn, maxn, buckets, num_threads);
+    for (size_t b = 0; b < buckets; b++) {
+      table.push_back(Vector::Random(dim) * (0.5 / dim));
+    }
+    std::cout << "Done." << std::endl;
+  }
+
   // Randomly initialize embeddings for words not present in pretrained_table
-  for (size_t w = 0; w < table.size(); w++) {
+  for (size_t w = 0; w < word_map.size(); w++) {
     std::string word(word_map.reverse_lookup(w));
     if (pretrained_table.find(word) != pretrained_table.end()) {
       table[w] = std::move(pretrained_table[word]);
@@ -518,29 +1962,373 @@ int main(int argc, char** argv) {
       .negatives = negatives,
       .threads = num_threads,
       .use_bad_update = use_bad_update,
+      .hs = hs,
+      .loss_sample = loss_sample,
   };
 
-  Trainer trainer(params, table, ctx, prob, neg_prob);
+  Trainer trainer(params,
+                  table,
+                  ctx,
+                  prob,
+                  neg_prob,
+                  hs ? HuffmanTree(counts) : HuffmanTree(),
+                  std::move(subwords));
+  std::unique_ptr<ContentionProfiler> contention;
+  if (contention_profile) {
+    contention = std::make_unique<ContentionProfiler>(table.size(),
+                                                      ctx.size(),
+                                                      num_threads,
+                                                      contention_hot_rows,
+                                                      contention_sample_every);
+    trainer.set_contention_profiler(contention.get());
+  }
   std::mt19937 g(12345);
 
-  std::atomic<size_t> tokens{0}, sents{0}, total_tokens{0};
-  std::atomic<float> curr_lr{0};
+  // Load benchmarks once, mapped through the vocabulary
+  const bool benchmarks = not analogy_paths.empty() or
+                          not similarity_paths.empty();
+  eval_restrict = std::min(eval_restrict, word_map.size());
+  std::vector<std::vector<AnalogySection>> analogies;
+  std::vector<std::vector<SimilarityPair>> similarities;
+  std::vector<size_t> similarities_skipped(similarity_paths.size());
+  for (auto& path : analogy_paths) {
+    analogies.push_back(
+        read_analogies(path, word_map, eval_restrict, read_mode));
+  }
+  for (size_t i = 0; i < similarity_paths.size(); i++) {
+    similarities.push_back(read_similarities(
+        similarity_paths[i], word_map, similarities_skipped[i], read_mode));
+  }
+
+  auto evaluate_embeddings = [&]() {
+    auto scope = profile.scope(evaluate_phase);
+    KOAN_TRACE_SCOPE("evaluate");
+    Timer t;
+    Table composed;
+    compose_words(
+        table, word_map.size(), trainer.subwords(), num_threads, composed);
+    const Table& words = composed.empty() ? table : composed;
+
+    if (not analogies.empty()) {
+      auto m = normalized_rows(words, eval_restrict, num_threads);
+      tblr::Table report;
+      report.layout(tblr::markdown())
+          .aligns({tblr::Left, tblr::Right, tblr::Right, tblr::Right})
+          .precision(2)
+          .fixed();
+      report << "Analogy" << "Queries (skipped)" << "3CosAdd %" << "3CosMul %"
+             << tblr::endr;
+      for (size_t i = 0; i < analogies.size(); i++) {
+        AnalogyResult all;
+        all.name = analogy_paths[i];
+        for (auto& r : evaluate_analogies(m, analogies[i], num_threads)) {
+          report << "  " + r.name
+                 << std::to_string(r.total) + " (" +
+                        std::to_string(r.skipped) + ")"
+                 << 100. * r.correct_add / std::max<size_t>(r.total, 1)
+                 << 100. * r.correct_mul / std::max<size_t>(r.total, 1)
+                 << tblr::endr;
+          all.total += r.total;
+          all.skipped += r.skipped;
+          all.correct_add += r.correct_add;
+          all.correct_mul += r.correct_mul;
+        }
+        report << all.name
+               << std::to_string(all.total) + " (" +
+                      std::to_string(all.skipped) + ")"
+               << 100. * all.correct_add / std::max<size_t>(all.total, 1)
+               << 100. * all.correct_mul / std::max<size_t>(all.total, 1)
+               << tblr::endr;
+      }
+      report.print();
+    }
+
+    if (not similarities.empty()) {
+      tblr::Table report;
+      report.layout(tblr::markdown())
+          .aligns({tblr::Left, tblr::Right, tblr::Right})
+          .precision(4)
+          .fixed();
+      report << "Similarity" << "Pairs (skipped)" << "Spearman" << tblr::endr;
+      for (size_t i = 0; i < similarities.size(); i++) {
+        report << similarity_paths[i]
+               << std::to_string(similarities[i].size()) + " (" +
+                      std::to_string(similarities_skipped[i]) + ")"
+               << evaluate_similarity(words, similarities[i]) << tblr::endr;
+      }
+      report.print();
+    }
+    std::cout << "Evaluated in " << t.s() << "s." << std::endl;
+  };
+
+  std::unique_ptr<HeldoutEvaluator> heldout;
+  if (heldout_sentences > 0) {
+    heldout = std::make_unique<HeldoutEvaluator>(cbow,
+                                                 params,
+                                                 table,
+                                                 ctx,
+                                                 prob,
+                                                 neg_prob,
+                                                 trainer.tree(),
+                                                 trainer.subwords());
+  }
+  memory.track("alias tables", [&]() { return trainer.sampler_bytes(); });
+  memory.track("held-out", [&]() { return heldout ? heldout->bytes() : 0; });
+  sample_memory("init");
+  int eval_epoch = -1; // epoch at whose end the evaluation in flight started,
+                       // -1 if it started mid-epoch
+  Real last_epoch_loss = 0; // 0 until the end of an epoch is evaluated
+  size_t trained_sents = 0, next_eval = eval_every;
+  bool stop = false;
+
+  // Report the held-out loss if an evaluation finished (or wait for it), and
+  // decide whether to stop early. On stopping, embeddings are rolled back to
+  // the evaluated snapshot.
+  std::atomic<double> heldout_loss{std::nan("")}; // read by metrics
+  auto collect_eval = [&](bool wait) {
+    if (not heldout or not heldout->pending()) { return; }
+    if (not wait and not heldout->ready()) { return; }
+    Real loss = heldout->get();
+    heldout_loss = loss;
+    if (eval_epoch < 0) {
+      std::cout << "Held-out loss: " << loss << std::endl;
+      return;
+    }
+    std::cout << "Held-out loss after epoch " << eval_epoch << ": " << loss;
+    if (last_epoch_loss > 0) {
+      Real improvement = (last_epoch_loss - loss) / last_epoch_loss;
+      std::cout << " (" << std::showpos << 100 * improvement << std::noshowpos
+                << "%)";
+      if (early_stop_threshold > 0 and improvement < early_stop_threshold and
+          size_t(eval_epoch) + 1 < epochs) {
+        std::cout << std::endl
+                  << "Improvement is below threshold, stopping early with "
+                     "embeddings from the end of epoch "
+                  << eval_epoch;
+        heldout->restore(table, ctx);
+        stop = true;
+      }
+    }
+    std::cout << std::endl;
+    last_epoch_loss = loss;
+  };
+
+  // Benchmark scores of a matrix of word vectors, to compare compressions
+  auto benchmark_scores = [&](const RowMatrix& m) {
+    std::vector<std::pair<std::string, Real>> scores;
+    if (not analogies.empty()) {
+      RowMatrix head = m.topRows(eval_restrict).rowwise().normalized();
+      for (size_t i = 0; i < analogies.size(); i++) {
+        AnalogyResult all;
+        for (auto& r : evaluate_analogies(head, analogies[i], num_threads)) {
+          all.total += r.total;
+          all.correct_add += r.correct_add;
+          all.correct_mul += r.correct_mul;
+        }
+        Real total = std::max<size_t>(all.total, 1);
+        scores.emplace_back(analogy_paths[i] + " 3CosAdd %",
+                            100. * all.correct_add / total);
+        scores.emplace_back(analogy_paths[i] + " 3CosMul %",
+                            100. * all.correct_mul / total);
+      }
+    }
+    for (size_t i = 0; i < similarities.size(); i++) {
+      scores.emplace_back(similarity_paths[i] + " Spearman",
+                          evaluate_similarity(m, similarities[i]));
+    }
+    return scores;
+  };
+
+  // Save embeddings and everything derived from them
+  auto export_embeddings = [&]() {
+    auto scope = profile.scope(export_phase);
+    KOAN_TRACE_SCOPE("export");
+    std::future<void> index;
+    if (hnsw) {
+      hnsw_params.threads = num_threads;
+      index = save_hnsw_async(embedding_path + ".hnsw",
+                              table,
+                              word_map.size(),
+                              trainer.subwords(),
+                              hnsw_params);
+    }
+    save_embeddings(embedding_path, word_map, table, trainer.subwords());
+    if (maxn > 0) {
+      save_subwords(embedding_path + ".subwords",
+                    word_map.size(),
+                    table,
+                    trainer.subwords());
+    }
+    if (save_model_file) {
+      save_model(embedding_path + ".model",
+                 word_map,
+                 table,
+                 trainer.subwords(),
+                 num_threads);
+    }
+    if (pca_dim > 0 or pq_params.subspaces > 0) {
+      save_compressed(embedding_path,
+                      word_map,
+                      table,
+                      trainer.subwords(),
+                      pca_dim,
+                      pq_params,
+                      num_threads,
+                      benchmark_scores);
+    }
+    if (index.valid()) { index.get(); }
+    if (neighbors_k > 0) {
+      save_neighbors(embedding_path + ".neighbors",
+                     table,
+                     std::min(neighbors_head, word_map.size()),
+                     trainer.subwords(),
+                     neighbors_k,
+                     num_threads);
+    }
+  };
+
+  TrainStats stats(num_threads); // one block per thread
+  auto total_tokens = stats.sum(&ThreadStats::total_tokens);
 
   Sentences sentences;
+  memory.track("reader buffers", [&]() { // the next one is being read
+    return heap_bytes(sentences) * (read_whole_data ? 1 : 2);
+  });
+
+  Table table_before, ctx_before; // copies of the embeddings while autotuning
+  if (autotune) {
+    phase_scope.emplace(profile, autotune_phase);
+    memory.track("autotune copies", [&]() {
+      return heap_bytes(table_before) + heap_bytes(ctx_before);
+    });
+    // Embeddings and random state are put back after the calibration runs,
+    // which are not profiled either, so that training afterwards learns the
+    // same as without autotuning
+    table_before = table;
+    ctx_before = ctx;
+    trainer.set_contention_profiler(nullptr);
+    Sentences loaded; // the whole corpus, read once for all runs if it fits
+    if (read_whole_data) { make_reader(buffer_size)->get_next(loaded); }
+
+    // Time training on the first autotune_tokens tokens after the held-out
+    // sentences, excluding the first fill of the reader, which every run
+    // waits for once
+    auto measure = [&](const LoopSettings& s) {
+      std::unique_ptr<Reader> r;
+      if (not read_whole_data) { r = make_reader(s.buffer_size); }
+      Sentences streamed;
+      bool first = true;
+      auto next = [&]() -> const Sentences* { // next batch, or null at the end
+        if (read_whole_data) { return first ? &loaded : nullptr; }
+        return r->get_next(streamed) ? &streamed : nullptr;
+      };
+      size_t seen = 0, read = 0;
+      Timer timer;
+      while (read < autotune_tokens) {
+        const Sentences* next_batch = next();
+        if (not next_batch) { break; }
+        auto& batch = *next_batch;
+        if (first) { timer = Timer(); }
+        first = false;
+        size_t begin = 0, end;
+        if (seen < heldout_sentences) {
+          begin = std::min(heldout_sentences - seen, batch.size());
+        }
+        for (end = begin; end < batch.size() and read < autotune_tokens;) {
+          read += batch[end++].size();
+        }
+        seen += batch.size();
+        auto work = [&](size_t i, size_t tid) {
+          trainer.train(batch[i], tid, init_lr, cbow);
+        };
+        if (s.partitioned) {
+          parallel_for_partitioned(begin, end, work, s.threads);
+        } else {
+          parallel_for(begin, end, work, s.threads);
+        }
+      }
+      return read / std::max(double(timer.s()), 1e-9);
+    };
+    std::vector<size_t> buffer_sizes{buffer_size};
+    if (not read_whole_data and total_sentences > 0 and tot > 0) {
+      buffer_sizes = Autotuner::buffer_candidates(
+          buffer_size, autotune_tokens * total_sentences / tot);
+    }
+    Autotuner tuner(measure);
+    auto best = tuner.tune(thread_candidates, buffer_sizes);
+    sample_memory("autotune");
+    table = std::move(table_before);
+    ctx = std::move(ctx_before);
+    trainer.set_contention_profiler(contention.get());
+    trainer.reset_random();
+    tuner.print();
+    std::cout << "Autotune picked: " << best.str() << std::endl;
+    num_threads = best.threads;
+    partitioned = best.partitioned;
+    buffer_size = best.buffer_size;
+  }
 
-  Timer t;
-  std::unique_ptr<Reader> reader;
-  if (read_whole_data) {
-    reader = std::make_unique<OnceReader>(
-        word_map, fnames, discard, read_mode, enforce_max_line_length);
-  } else {
-    reader = std::make_unique<AsyncReader>(word_map,
-                                           fnames,
-                                           buffer_size,
-                                           discard,
-                                           read_mode,
-                                           enforce_max_line_length);
+  phase_scope.emplace(profile, train_phase);
+  // Opened before the reader, so that its background threads are counted
+  std::unique_ptr<PerfCounters> perf;
+  if (perf_counters) {
+    perf = std::make_unique<PerfCounters>();
+    if (not perf->any_available()) {
+      std::cerr << "WARN: Hardware performance counters are unavailable ("
+                << perf->error() << "), continuing without them." << std::endl;
+      perf.reset();
+    } else if (not perf->error().empty()) {
+      std::cerr << "WARN: Some hardware performance counters are unavailable ("
+                << perf->error() << ")." << std::endl;
+    }
   }
+  PerfCounters::Values perf_epoch, perf_batch, perf_wait, perf_before;
+
+  // Reported from a background thread, only updated once per buffer
+  std::atomic<size_t> current_epoch{0};
+  std::atomic<double> reader_stall_seconds{0};
+  std::unique_ptr<MetricsReporter> metrics;
+  if (not metrics_log.empty() or not metrics_prometheus.empty()) {
+    auto collect = [&, last_tokens = size_t(0), last = Timer()]() mutable {
+      size_t tokens = total_tokens;
+      double seconds = last.s();
+      double rate = (tokens - last_tokens) / std::max(seconds, 1e-9);
+      last_tokens = tokens;
+      last = Timer();
+      double epoch = current_epoch;
+      double sents = stats.sum(&ThreadStats::sents);
+      double read = stats.sum(&ThreadStats::read_tokens);
+      double progress = std::nan("");
+      if (total_sentences > 0) {
+        progress = std::min((epoch + sents / total_sentences) / epochs, 1.);
+      }
+      return std::vector<Metric>{
+          {"epoch", epoch, "Current epoch"},
+          {"progress", progress, "Fraction of training done"},
+          {"sentences", sents, "Sentences trained on in the current epoch"},
+          {"tokens_total", double(tokens), "Tokens trained on", true},
+          {"tokens_per_second", rate, "Tokens per second since last report"},
+          {"learning_rate", float(stats.lr()), "Current learning rate"},
+          {"retained_token_ratio",
+           read > 0 ? stats.sum(&ThreadStats::tokens) / read : std::nan(""),
+           "Fraction of tokens of the current epoch kept by downsampling"},
+          {"reader_stall_seconds_total",
+           reader_stall_seconds,
+           "Time spent waiting for the reader",
+           true},
+          {"rss_bytes", double(MemoryLedger::rss()), "Resident set size"},
+          {"train_loss",
+           trainer.sampled_loss(),
+           "Mean loss of sampled updates in the current epoch"},
+          {"heldout_loss", heldout_loss, "Last held-out loss"},
+      };
+    };
+    metrics = std::make_unique<MetricsReporter>(
+        collect, metrics_log, metrics_prometheus, metrics_interval);
+  }
+
+  Timer t;
+  auto reader = make_reader(buffer_size);
 
   if (total_sentences == 0) {
     std::cerr << "WARN: Total number of sentences is unknown, therefore "
@@ -550,21 +2338,50 @@ int main(int argc, char** argv) {
               << std::endl;
   }
 
-  for (size_t e = 0; e < epochs; e++) {
-    std::atomic<size_t> filtered_tokens_in_epoch{0}, total_tokens_in_epoch{0};
+  if (glove) {
+    cooccur_params.window = ctxs;
+    cooccur_params.threads = glove_params.threads = num_threads;
+    train_glove(*reader,
+                table,
+                ctx,
+                cooccur_params,
+                glove_params,
+                epochs,
+                init_lr,
+                no_progress);
+    phase_scope.reset();
+    if (benchmarks) { evaluate_embeddings(); }
+    sample_memory("train");
+    export_embeddings();
+    sample_memory("export");
+    if (print_profile) { profile.print(); }
+    if (memory_report) { memory.print(); }
+    if (not trace_path.empty()) { trace::Tracer::get().dump(trace_path); }
+    return 0;
+  }
 
-    tokens = 0;
-    sents = 0;
+  if (metrics) { metrics->start(); }
+  for (size_t e = 0; e < epochs; e++) {
+    current_epoch = e;
+    stats.new_epoch();
+    auto sents = stats.sum(&ThreadStats::sents);
+    auto tokens = stats.sum(&ThreadStats::tokens);
+    auto read_tokens = stats.sum(&ThreadStats::read_tokens);
+    auto curr_lr = stats.lr();
+    Gauge<float> train_loss([&]() { return trainer.sampled_loss(); });
     size_t global_i = 0;
+    trainer.reset_sampled_loss();
 
     std::cout << "Epoch " << e << std::endl;
 
     auto bar = mew::ProgressBar(sents, total_sentences, "Sents:") |
                mew::Counter(tokens, "Toks:", "tok/s", mew::Speed::Last) |
-               mew::Counter(curr_lr, "LR:", "", mew::Speed::None);
+               mew::Counter(curr_lr, "LR:", "", mew::Speed::None) |
+               mew::Counter(train_loss, "Loss:", "", mew::Speed::None);
     auto ctr = mew::Counter(sents, "Sents:", "lin/s", mew::Speed::Last) |
                mew::Counter(tokens, "Toks:", "tok/s", mew::Speed::Last) |
-               mew::Counter(curr_lr, "LR:", "", mew::Speed::None);
+               mew::Counter(curr_lr, "LR:", "", mew::Speed::None) |
+               mew::Counter(train_loss, "Loss:", "", mew::Speed::None);
     if (not no_progress) {
       if (total_sentences > 0) {
         bar.start();
@@ -573,9 +2390,34 @@ int main(int argc, char** argv) {
       }
     }
 
+    if (perf) {
+      perf_batch.fill(0);
+      perf_wait.fill(0);
+      perf_epoch = perf_before = perf->read();
+    }
+
+    std::optional<Profile::Scope> wait_scope;
+    wait_scope.emplace(profile, wait_phase);
     while (reader->get_next(sentences)) {
-      std::vector<size_t> perm(sentences.size());
-      std::iota(perm.begin(), perm.end(), 0);
+      wait_scope.reset();
+      reader_stall_seconds = profile.seconds(wait_phase);
+      if (perf) { // includes the reader thread, which exits in get_next()
+        auto now = perf->read();
+        perf_wait += now - perf_before;
+        perf_before = now;
+      }
+      profile.add(fill_phase, reader->fill_seconds());
+
+      // Held-out sentences come first in every epoch, skip them
+      size_t skip = 0;
+      if (global_i < heldout_sentences) {
+        skip = std::min(heldout_sentences - global_i, sentences.size());
+        if (e == 0) {
+          for (size_t i = 0; i < skip; i++) { heldout->add(sentences[i]); }
+        }
+      }
+      std::vector<size_t> perm(sentences.size() - skip);
+      std::iota(perm.begin(), perm.end(), skip);
 
       if (shuffle) { std::shuffle(perm.begin(), perm.end(), g); }
 
@@ -591,55 +2433,112 @@ int main(int argc, char** argv) {
               (Real(i + global_i) / total_sentences) / max_lr_schedule_epochs;
           lr = init_lr - (init_lr - min_lr) * lr_sched;
         }
-        curr_lr = lr;
-
-        size_t remaining_toks = trainer.train(s, tid, lr, cbow);
-        sents++;
-        tokens += remaining_toks;
-        total_tokens += remaining_toks;
-        filtered_tokens_in_epoch += remaining_toks;
-        total_tokens_in_epoch += s.size();
+
+        std::optional<Profile::Scope> kernel_scope;
+        if (print_profile) { kernel_scope.emplace(profile, kernel_phase, tid); }
+        size_t remaining_toks;
+        {
+          KOAN_TRACE_SCOPE("sentence");
+          remaining_toks = trainer.train(s, tid, lr, cbow);
+        }
+        kernel_scope.reset();
+        stats[tid].add_sentence(remaining_toks, s.size(), lr);
       };
 
-      if (partitioned) {
-        parallel_for_partitioned(0, sentences.size(), work, num_threads);
-      } else {
-        parallel_for(0, sentences.size(), work, num_threads);
+      Timer batch;
+      double kernel_seconds = profile.seconds(kernel_phase);
+      {
+        KOAN_TRACE_SCOPE("batch");
+        if (partitioned) {
+          parallel_for_partitioned(0, perm.size(), work, num_threads);
+        } else {
+          parallel_for(0, perm.size(), work, num_threads);
+        }
+      }
+      profile.add(batch_phase, batch.s());
+      if (perf) {
+        auto now = perf->read();
+        perf_batch += now - perf_before;
+        perf_before = now;
+      }
+      if (print_profile) { // thread time not spent in kernels
+        kernel_seconds = profile.seconds(kernel_phase) - kernel_seconds;
+        profile.add(idle_phase, num_threads * batch.s() - kernel_seconds);
       }
 
       global_i += sentences.size();
+      trained_sents += perm.size();
+
+      if (heldout) {
+        collect_eval(false);
+        if (stop) { break; }
+        if (eval_every > 0 and trained_sents >= next_eval and
+            not heldout->pending()) {
+          eval_epoch = -1;
+          heldout->start(table, ctx);
+          next_eval = trained_sents + eval_every;
+        }
+      }
+      wait_scope.emplace(profile, wait_phase);
     }
+    wait_scope.reset();
 
     bar.done();
     ctr.done();
 
+    if (heldout and not stop) {
+      collect_eval(true);
+      if (not stop) {
+        eval_epoch = e;
+        heldout->start(table, ctx);
+        if (e + 1 == epochs) { collect_eval(true); }
+      }
+    }
+    if (stop) { break; }
+
     std::cout << std::fixed << std::setprecision(2)
-              << 100. * filtered_tokens_in_epoch / total_tokens_in_epoch
+              << 100. * tokens / read_tokens
               << "% of tokens were retained while filtering." << std::endl;
+    if (loss_sample > 0) {
+      std::cout << "Sampled training loss: " << std::setprecision(4)
+                << trainer.sampled_loss() << std::endl;
+    }
+    if (perf) {
+      print_per_token({{"train/batch", perf_batch},
+                       {"train/wait for reader", perf_wait},
+                       {"epoch", perf->read() - perf_epoch}},
+                      tokens);
+    }
+
+    if (benchmarks and eval_each_epoch) { evaluate_embeddings(); }
+    sample_memory("epoch " + std::to_string(e));
   }
   auto total_secs = t.s();
+  phase_scope.reset();
+  if (metrics) { metrics->stop(); }
   std::cout << "Took " << unsigned(total_secs) << "s. (excluding vocab build)"
             << std::endl
             << "Overall speed was " << total_tokens / total_secs << " toks/s"
             << std::endl;
-
-  {
-    std::cout << "Saving to " << embedding_path << std::endl;
-    FILE* out = fopen(embedding_path.c_str(), "w");
-    KOAN_ASSERT(out);
-    std::string buf;
-    buf.reserve(MAX_LINE_LEN);
-    for (auto& w : word_map.keys()) {
-      buf.clear();
-      buf += w;
-      auto v = table[word_map.lookup(w)];
-      for (int j = 0; j < v.size(); j++) {
-        buf += " ";
-        buf += std::to_string(v(j));
-      }
-      buf += "\n";
-      fputs(buf.data(), out);
-    }
-    fclose(out);
+  if (contention) {
+    auto words = word_map.keys();
+    contention->print(
+        [&](ContentionProfiler::Side side, size_t row) {
+          if (side == ContentionProfiler::Output and hs) {
+            return std::string("(node)");
+          }
+          return std::string(row < words.size() ? words[row] : "(bucket)");
+        },
+        dim,
+        total_secs,
+        total_tokens);
   }
+
+  if (benchmarks and (not eval_each_epoch or stop)) { evaluate_embeddings(); }
+
+  export_embeddings();
+  sample_memory("export");
+  if (print_profile) { profile.print(); }
+  if (memory_report) { memory.print(); }
+  if (not trace_path.empty()) { trace::Tracer::get().dump(trace_path); }
 }
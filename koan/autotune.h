@@ -0,0 +1,204 @@
+/*
+** Copyright 2020 Bloomberg Finance L.P.
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef KOAN_AUTOTUNE_H
+#define KOAN_AUTOTUNE_H
+
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <sched.h>
+
+#include "def.h"
+#include "extern/tblr.h"
+#include "util.h"
+
+namespace koan {
+
+/// CPUs the process may run on, counted by hardware thread (logical) and by
+/// core (physical, i.e. counting SMT siblings of a core once).
+struct CpuTopology {
+  unsigned logical = 1;
+  unsigned physical = 1;
+
+  /// Read from the affinity mask of the process and the core ids of its CPUs
+  /// in sysfs. Falls back to std::thread::hardware_concurrency() for both
+  /// counts if either is unavailable.
+  ///
+  /// @param[in] sysfs directory with a cpu<i>/topology directory per CPU
+  static CpuTopology detect(const std::string& sysfs =
+                                "/sys/devices/system/cpu") {
+    unsigned hw = std::max(std::thread::hardware_concurrency(), 1u);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) { return {hw, hw}; }
+
+    unsigned logical = 0;
+    std::set<std::pair<long, long>> cores; // (package, core)
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (not CPU_ISSET(cpu, &set)) { continue; }
+      logical++;
+      auto dir = sysfs + "/cpu" + std::to_string(cpu) + "/topology/";
+      std::ifstream package(dir + "physical_package_id");
+      std::ifstream core(dir + "core_id");
+      long p, c;
+      if (not(package >> p) or not(core >> c)) { return {hw, hw}; }
+      cores.emplace(p, c);
+    }
+    if (logical == 0) { return {hw, hw}; }
+    return {logical, unsigned(cores.size())};
+  }
+};
+
+/// Settings of the training loop that change its throughput but not what is
+/// learned (beyond the order of updates).
+struct LoopSettings {
+  unsigned threads = 1;
+  bool partitioned = false; // parallel_for_partitioned() or parallel_for()
+  size_t buffer_size = 500'000;
+
+  bool operator==(const LoopSettings& other) const {
+    return threads == other.threads and partitioned == other.partitioned and
+           buffer_size == other.buffer_size;
+  }
+
+  /// @returns the command-line arguments selecting these settings
+  std::string str() const {
+    return "-t " + std::to_string(threads) + " -L " +
+           (partitioned ? "true" : "false") + " -B " +
+           std::to_string(buffer_size);
+  }
+};
+
+/// Picks the loop settings with the highest throughput by timing a short
+/// calibration run of each candidate.
+///
+/// Thread counts and schedulers are searched jointly, since how well a
+/// scheduler balances work depends on the number of threads. Buffer sizes are
+/// then searched with the best of them: they mostly decide whether the reader
+/// keeps up, and hardly interact with how training scales.
+class Autotuner {
+ public:
+  /// Calibration run of a candidate, returning tokens per second.
+  using Measure = std::function<double(const LoopSettings&)>;
+
+  struct Trial {
+    LoopSettings settings;
+    double tokens_per_sec;
+  };
+
+ private:
+  Measure measure_;
+  std::vector<Trial> trials_;
+  LoopSettings best_;
+
+  const Trial& run(const LoopSettings& s) {
+    for (auto& t : trials_) {
+      if (t.settings == s) { return t; }
+    }
+    trials_.push_back({s, measure_(s)});
+    return trials_.back();
+  }
+
+ public:
+  Autotuner(Measure measure) : measure_(std::move(measure)) {}
+
+  /// Candidate thread counts: the requested one, and the numbers of physical
+  /// and logical cores, so that SMT siblings are only used if they help.
+  static std::vector<unsigned> thread_candidates(unsigned requested,
+                                                 const CpuTopology& cpus) {
+    std::vector<unsigned> threads{
+        std::max(requested, 1u), cpus.physical, cpus.logical};
+    std::sort(threads.begin(), threads.end());
+    threads.erase(std::unique(threads.begin(), threads.end()), threads.end());
+    return threads;
+  }
+
+  /// Candidate buffer sizes: half, the same and twice the requested one.
+  /// Buffer sizes only show their effect if a calibration run reads several
+  /// buffers, so the sizes of which fewer than three fit in a run are
+  /// dropped, and if the requested one is among them, it is not tuned.
+  ///
+  /// @param[in] requested buffer size, in sentences
+  /// @param[in] run_sentences sentences read by a calibration run
+  static std::vector<size_t> buffer_candidates(size_t requested,
+                                               size_t run_sentences) {
+    if (3 * requested > run_sentences) { return {requested}; }
+    std::vector<size_t> sizes;
+    for (size_t b : {requested / 2, requested, 2 * requested}) {
+      if (b > 0 and 3 * b <= run_sentences) { sizes.push_back(b); }
+    }
+    return sizes;
+  }
+
+  /// Measure the candidates, and return the fastest settings.
+  ///
+  /// @param[in] threads candidate thread counts
+  /// @param[in] buffer_sizes candidate buffer sizes. The first stage uses the
+  /// one in the middle.
+  LoopSettings tune(const std::vector<unsigned>& threads,
+                    const std::vector<size_t>& buffer_sizes) {
+    KOAN_ASSERT(not threads.empty() and not buffer_sizes.empty());
+    trials_.clear();
+    auto faster = [](const Trial& a, const Trial& b) {
+      return a.tokens_per_sec > b.tokens_per_sec;
+    };
+    Trial best{{threads[0], false, buffer_sizes[buffer_sizes.size() / 2]}, -1};
+    for (unsigned t : threads) {
+      for (bool partitioned : {false, true}) {
+        auto& trial = run({t, partitioned, best.settings.buffer_size});
+        if (faster(trial, best)) { best = trial; }
+      }
+    }
+    for (size_t b : buffer_sizes) {
+      auto& trial = run({best.settings.threads, best.settings.partitioned, b});
+      if (faster(trial, best)) { best = trial; }
+    }
+    return best_ = best.settings;
+  }
+
+  const std::vector<Trial>& trials() const { return trials_; }
+
+  /// Print the calibration runs, marking the settings that were picked.
+  void print() const {
+    tblr::Table table;
+    table.layout(tblr::markdown())
+        .aligns({tblr::Right, tblr::Left, tblr::Right, tblr::Right, tblr::Left})
+        .precision(0)
+        .fixed();
+    table << "Threads" << "Scheduler" << "Buffer size" << "Read tok/s" << ""
+          << tblr::endr;
+    for (auto& t : trials_) {
+      table << std::to_string(t.settings.threads)
+            << (t.settings.partitioned ? "partitioned" : "atomic")
+            << std::to_string(t.settings.buffer_size) << t.tokens_per_sec
+            << (t.settings == best_ ? "picked" : "") << tblr::endr;
+    }
+    table.print();
+  }
+};
+
+} // namespace koan
+
+#endif
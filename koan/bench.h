@@ -0,0 +1,523 @@
+/*
+** Copyright 2020 Bloomberg Finance L.P.
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef KOAN_BENCH_H
+#define KOAN_BENCH_H
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "def.h"
+#include "extern/tblr.h"
+#include "timer.h"
+#include "util.h"
+
+namespace koan {
+namespace bench {
+
+/// Make the compiler assume that x is used, so that the computation of a
+/// benchmarked result is not optimized away.
+template <typename T>
+inline void keep(const T& x) {
+  asm volatile("" : : "r,m"(x) : "memory");
+}
+
+/// Format a number for JSON, as null if it is not finite.
+inline std::string json_number(double x) {
+  if (not is_finite(x)) { return "null"; }
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.15g", x);
+  return buf;
+}
+
+/// Minimal JSON document model and parser, enough to read back results.
+struct Json {
+  enum Type { Null, Bool, Number, String, Array, Object };
+
+  Type type = Null;
+  double number = 0; // also 0 or 1 for Bool
+  std::string string;
+  std::vector<Json> array;
+  std::vector<std::pair<std::string, Json>> object; // in document order
+
+  /// @returns member of an object, or nullptr if there is none
+  const Json* get(const std::string& key) const {
+    for (auto& [k, v] : object) {
+      if (k == key) { return &v; }
+    }
+    return nullptr;
+  }
+
+  static Json parse(const std::string& text) {
+    size_t pos = 0;
+    Json json = parse(text, pos);
+    skip_space(text, pos);
+    KOAN_ASSERT(pos == text.size(), "Trailing characters after JSON!");
+    return json;
+  }
+
+ private:
+  static void skip_space(const std::string& text, size_t& pos) {
+    while (pos < text.size() and std::isspace((unsigned char)text[pos])) {
+      pos++;
+    }
+  }
+
+  static void expect(const std::string& text, size_t& pos, char c) {
+    skip_space(text, pos);
+    KOAN_ASSERT(pos < text.size() and text[pos] == c,
+                std::string("Expected '") + c + "' in JSON at offset " +
+                    std::to_string(pos) + "!");
+    pos++;
+  }
+
+  static std::string parse_string(const std::string& text, size_t& pos) {
+    expect(text, pos, '"');
+    std::string s;
+    while (pos < text.size() and text[pos] != '"') {
+      char c = text[pos++];
+      if (c == '\\' and pos < text.size()) {
+        c = text[pos++];
+        if (c == 'n') { c = '\n'; }
+        if (c == 't') { c = '\t'; }
+      }
+      s += c;
+    }
+    expect(text, pos, '"');
+    return s;
+  }
+
+  static Json parse(const std::string& text, size_t& pos) {
+    Json json;
+    skip_space(text, pos);
+    KOAN_ASSERT(pos < text.size(), "Unexpected end of JSON!");
+    char c = text[pos];
+    auto literal = [&](const std::string& word) {
+      bool match = text.compare(pos, word.size(), word) == 0;
+      if (match) { pos += word.size(); }
+      return match;
+    };
+    // @returns whether there is another element of an array or object
+    auto next = [&](char close) {
+      skip_space(text, pos);
+      if (pos < text.size() and text[pos] == ',') {
+        pos++;
+        return true;
+      }
+      expect(text, pos, close);
+      return false;
+    };
+    auto empty = [&](char close) {
+      pos++; // opening bracket
+      skip_space(text, pos);
+      bool empty = pos < text.size() and text[pos] == close;
+      if (empty) { pos++; }
+      return empty;
+    };
+    if (c == '{') {
+      json.type = Object;
+      if (empty('}')) { return json; }
+      do {
+        auto key = parse_string(text, pos);
+        expect(text, pos, ':');
+        json.object.emplace_back(key, parse(text, pos));
+      } while (next('}'));
+    } else if (c == '[') {
+      json.type = Array;
+      if (empty(']')) { return json; }
+      do {
+        json.array.push_back(parse(text, pos));
+      } while (next(']'));
+    } else if (c == '"') {
+      json.type = String;
+      json.string = parse_string(text, pos);
+    } else if (literal("null")) {
+      json.type = Null;
+    } else if (literal("true")) {
+      json.type = Bool;
+      json.number = 1;
+    } else if (literal("false")) {
+      json.type = Bool;
+    } else {
+      json.type = Number;
+      const char* begin = text.c_str() + pos;
+      char* end;
+      json.number = std::strtod(begin, &end);
+      KOAN_ASSERT(end != begin,
+                  "Invalid JSON at offset " + std::to_string(pos) + "!");
+      pos += end - begin;
+    }
+    return json;
+  }
+};
+
+/// @returns CPU model name of the host, from /proc/cpuinfo
+inline std::string cpu_name() {
+  std::ifstream in("/proc/cpuinfo");
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.compare(0, 10, "model name") == 0) {
+      auto pos = line.find(':');
+      if (pos != std::string::npos and pos + 2 <= line.size()) {
+        return line.substr(pos + 2);
+      }
+    }
+  }
+  return "unknown";
+}
+
+using Params = std::vector<std::pair<std::string, double>>;
+
+/// Timing of one benchmark.
+struct Result {
+  std::string name;       // e.g. "sg_update"
+  Params params;          // e.g. {{"dim", 100}, {"negatives", 5}}
+  std::string unit;       // what time is reported per, e.g. "token"
+  size_t iterations;      // of the benchmarked body per repetition
+  double ns_per_unit;     // median over repetitions
+  double ns_per_unit_min; // over repetitions
+  std::vector<double> samples; // ns per unit of each repetition
+
+  /// @returns name followed by parameters, e.g. "sg_update/dim=100", which
+  /// identifies a benchmark across runs
+  std::string id() const {
+    std::string id = name;
+    for (auto& [key, value] : params) {
+      id += "/" + key + "=" + json_number(value);
+    }
+    return id;
+  }
+
+  std::string json() const {
+    std::string s = "{\"id\": \"" + id() + "\", \"name\": \"" + name +
+                    "\", \"params\": {";
+    for (size_t i = 0; i < params.size(); i++) {
+      s += (i > 0 ? ", \"" : "\"") + params[i].first +
+           "\": " + json_number(params[i].second);
+    }
+    s += "}, \"unit\": \"" + unit +
+         "\", \"iterations\": " + std::to_string(iterations) +
+         ", \"ns_per_unit\": " + json_number(ns_per_unit) +
+         ", \"ns_per_unit_min\": " + json_number(ns_per_unit_min) +
+         ", \"samples\": [";
+    for (size_t i = 0; i < samples.size(); i++) {
+      s += (i > 0 ? ", " : "") + json_number(samples[i]);
+    }
+    return s + "]}";
+  }
+
+  /// Read back a result saved with json().
+  static Result parse(const Json& json) {
+    auto field = [&](const std::string& key) -> const Json& {
+      auto value = json.get(key);
+      KOAN_ASSERT(value, "Benchmark result without \"" + key + "\"!");
+      return *value;
+    };
+    Result r{field("name").string,
+             {},
+             field("unit").string,
+             size_t(field("iterations").number),
+             field("ns_per_unit").number,
+             field("ns_per_unit_min").number,
+             {}};
+    for (auto& [key, value] : field("params").object) {
+      r.params.emplace_back(key, value.number);
+    }
+    for (auto& x : field("samples").array) { r.samples.push_back(x.number); }
+    return r;
+  }
+};
+
+/// Results of a run of benchmarks, and (key, JSON encoded value) pairs
+/// describing where and how they were run.
+struct Results {
+  std::vector<std::pair<std::string, std::string>> context;
+  std::vector<Result> results;
+
+  std::string json() const {
+    std::string s = "{\n  \"context\": {";
+    for (size_t i = 0; i < context.size(); i++) {
+      s += (i > 0 ? ", \"" : "\"") + context[i].first +
+           "\": " + context[i].second;
+    }
+    s += "},\n  \"benchmarks\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+      s += (i > 0 ? ",\n    " : "\n    ") + results[i].json();
+    }
+    s += "\n  ]\n}\n";
+    return s;
+  }
+
+  void save(const std::string& path) const {
+    std::ofstream out(path);
+    KOAN_ASSERT(out, "Could not open '" + path + "' to save results!");
+    out << json();
+  }
+
+  static Results load(const std::string& path) {
+    std::ifstream in(path);
+    KOAN_ASSERT(in, "Could not open results '" + path + "'!");
+    std::stringstream text;
+    text << in.rdbuf();
+    auto json = Json::parse(text.str());
+    Results r;
+    if (auto context = json.get("context")) {
+      for (auto& [key, value] : context->object) {
+        r.context.emplace_back(key,
+                               value.type == Json::String
+                                   ? "\"" + value.string + "\""
+                                   : json_number(value.number));
+      }
+    }
+    if (auto benchmarks = json.get("benchmarks")) {
+      for (auto& b : benchmarks->array) {
+        r.results.push_back(Result::parse(b));
+      }
+    }
+    return r;
+  }
+
+  /// @returns value of a context entry, or "" if there is none
+  std::string get(const std::string& key) const {
+    for (auto& [k, v] : context) {
+      if (k == key) { return v; }
+    }
+    return "";
+  }
+
+  /// @returns file name under which to store these results as a baseline,
+  /// from the host CPU and configuration they were measured with, so that
+  /// results are only compared to baselines from comparable setups
+  std::string baseline_name() const {
+    std::string name;
+    for (auto key : {"cpu", "hardware_threads", "real_bytes", "min_time"}) {
+      auto value = get(key);
+      if (value.empty()) { continue; }
+      if (not name.empty()) { name += "_"; }
+      for (char c : value) {
+        if (std::isalnum((unsigned char)c)) {
+          name += c;
+        } else if (c != '"' and (name.empty() or name.back() != '-')) {
+          name += '-';
+        }
+      }
+    }
+    return name + ".json";
+  }
+};
+
+/// Two-sided p-value of the Mann-Whitney U test of whether samples x and y
+/// come from the same distribution, which makes no assumption about the
+/// (typically skewed) distribution of timings. Exact for small samples (ties
+/// get mid-ranks), and by the normal approximation otherwise.
+inline double mann_whitney_p(const std::vector<double>& x,
+                             const std::vector<double>& y) {
+  const size_t n = x.size(), m = y.size();
+  if (n == 0 or m == 0) { return 1; }
+  double u = 0; // number of pairs with x < y, counting ties as a half
+  for (auto a : x) {
+    for (auto b : y) { u += a < b ? 1 : a == b ? 0.5 : 0; }
+  }
+  const double mean = n * m / 2.;
+  const double dev = std::abs(u - mean);
+  if (n * m <= 2500) {
+    // counts[i][k]: number of orderings of i values of x and j of y with
+    // U = k, for j = 0, 1, ..., m. The largest value is either an x, adding
+    // nothing to U, or a y, which adds i.
+    std::vector<std::vector<double>> counts(
+        n + 1, std::vector<double>(n * m + 1, 0));
+    for (size_t i = 0; i <= n; i++) { counts[i][0] = 1; }
+    for (size_t j = 1; j <= m; j++) {
+      for (size_t i = 1; i <= n; i++) {
+        for (size_t k = n * m; k >= i; k--) {
+          counts[i][k] = counts[i - 1][k] + counts[i][k - i];
+        }
+        for (size_t k = 0; k < i; k++) { counts[i][k] = counts[i - 1][k]; }
+      }
+    }
+    double total = 0, extreme = 0;
+    for (size_t k = 0; k <= n * m; k++) {
+      total += counts[n][k];
+      if (std::abs(k - mean) >= dev - 1e-9) { extreme += counts[n][k]; }
+    }
+    return std::min(1., extreme / total);
+  }
+  const double sd = std::sqrt(n * m * (n + m + 1) / 12.);
+  return std::min(1., std::erfc((dev - 0.5) / sd / std::sqrt(2.)));
+}
+
+/// Change of a benchmark between a baseline and current results.
+struct Change {
+  std::string id;
+  std::string unit;
+  double baseline; // median ns per unit
+  double current;  // median ns per unit
+  double ratio;    // current / baseline, > 1 means slower
+  double p;        // of the Mann-Whitney U test of their samples
+};
+
+/// @returns changes of benchmarks present in both baseline and current
+inline std::vector<Change> compare(const std::vector<Result>& baseline,
+                                   const std::vector<Result>& current) {
+  std::vector<Change> changes;
+  for (auto& c : current) {
+    auto id = c.id();
+    auto b = std::find_if(baseline.begin(),
+                          baseline.end(),
+                          [&](const Result& r) { return r.id() == id; });
+    if (b == baseline.end()) { continue; }
+    changes.push_back({id,
+                       c.unit,
+                       b->ns_per_unit,
+                       c.ns_per_unit,
+                       c.ns_per_unit / b->ns_per_unit,
+                       mann_whitney_p(b->samples, c.samples)});
+  }
+  return changes;
+}
+
+/// Print the significant changes as a table.
+///
+/// @param[in] changes changes of benchmarks
+/// @param[in] alpha significance level of the test
+/// @param[in] threshold minimum relative change to report, since many
+/// repetitions make even negligible changes significant
+/// @returns number of significant slowdowns, i.e. regressions
+inline size_t print_changes(const std::vector<Change>& changes,
+                            double alpha = 0.05,
+                            double threshold = 0.05) {
+  tblr::Table table;
+  table.layout(tblr::markdown())
+      .aligns({tblr::Left,
+               tblr::Right,
+               tblr::Right,
+               tblr::Right,
+               tblr::Right,
+               tblr::Left})
+      .precision(1)
+      .fixed();
+  table << "Benchmark" << "Baseline (ns)" << "Current (ns)" << "Change"
+        << "p" << "Verdict" << tblr::endr;
+  size_t slower = 0, faster = 0;
+  for (auto& c : changes) {
+    if (c.p >= alpha or std::abs(c.ratio - 1) < threshold) { continue; }
+    bool slowdown = c.ratio > 1;
+    (slowdown ? slower : faster)++;
+    char change[32], p[32];
+    snprintf(change, sizeof(change), "%+.1f%%", 100 * (c.ratio - 1));
+    snprintf(p, sizeof(p), "%.2g", c.p);
+    table << c.id + " (per " + c.unit + ")" << c.baseline << c.current
+          << std::string(change) << std::string(p)
+          << (slowdown ? "slower" : "faster") << tblr::endr;
+  }
+  if (slower + faster > 0) { table.print(); }
+  std::cout << changes.size() << " benchmarks compared: " << slower
+            << " significantly slower, " << faster
+            << " significantly faster (p < " << alpha << ", change >= "
+            << 100 * threshold << "%)." << std::endl;
+  return slower;
+}
+
+/// Runs benchmarks and collects their results. Each benchmark body is run
+/// with a growing number of iterations until a run takes long enough to time
+/// (which also warms up caches), and then timed for a number of repetitions.
+class Runner {
+ private:
+  double min_time_;
+  unsigned repetitions_;
+  std::string filter_;
+  bool verbose_;
+  std::vector<Result> results_;
+
+ public:
+  /// @param[in] min_time seconds that each timed repetition should last
+  /// @param[in] repetitions number of timed repetitions
+  /// @param[in] filter only benchmarks whose id contains this are run
+  /// @param[in] verbose whether to print each result to stderr
+  Runner(double min_time = 0.1,
+         unsigned repetitions = 5,
+         std::string filter = "",
+         bool verbose = false)
+      : min_time_(min_time),
+        repetitions_(std::max(repetitions, 1u)),
+        filter_(std::move(filter)),
+        verbose_(verbose) {}
+
+  /// Run a benchmark, unless filtered out.
+  ///
+  /// @param[in] name name of benchmark
+  /// @param[in] params parameters of benchmark
+  /// @param[in] unit what time is reported per
+  /// @param[in] units number of units per iteration of the body
+  /// @param[in] body callable on size_t n, runs n iterations
+  template <typename F>
+  void run(const std::string& name,
+           Params params,
+           const std::string& unit,
+           double units,
+           F body) {
+    Result r{name, std::move(params), unit, 1, 0, 0, {}};
+    if (r.id().find(filter_) == std::string::npos) { return; }
+    for (;;) {
+      Timer t;
+      body(r.iterations);
+      double s = t.s();
+      if (s >= min_time_) { break; }
+      // aim slightly above min_time_, growing at most 100x per step
+      double grow = s > 0 ? 1.2 * min_time_ / s : 100;
+      r.iterations = std::max<size_t>(r.iterations * std::min(grow, 100.),
+                                      r.iterations + 1);
+    }
+    for (unsigned i = 0; i < repetitions_; i++) {
+      Timer t;
+      body(r.iterations);
+      r.samples.push_back(t.s() * 1e9 / (r.iterations * units));
+    }
+    auto ns = r.samples;
+    std::sort(ns.begin(), ns.end());
+    r.ns_per_unit = ns[ns.size() / 2];
+    r.ns_per_unit_min = ns[0];
+    if (verbose_) {
+      std::cerr << r.id() << ": " << r.ns_per_unit << " ns/" << r.unit
+                << std::endl;
+    }
+    results_.push_back(std::move(r));
+  }
+
+  const std::vector<Result>& results() const { return results_; }
+
+  /// @param[in] context (key, value) pairs describing the run, where values
+  /// are already JSON encoded
+  /// @returns all results as a JSON document
+  std::string
+  json(const std::vector<std::pair<std::string, std::string>>& context) const {
+    return Results{context, results_}.json();
+  }
+};
+
+} // namespace bench
+} // namespace koan
+
+#endif
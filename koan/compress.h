@@ -0,0 +1,587 @@
+/*
+** Copyright 2020 Bloomberg Finance L.P.
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef KOAN_COMPRESS_H
+#define KOAN_COMPRESS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <Eigen/Dense>
+
+#include "def.h"
+#include "neighbors.h"
+#include "util.h"
+
+namespace koan {
+
+/// Principal components of the rows of a matrix.
+struct Pca {
+  Eigen::RowVectorXf mean;   // mean row
+  RowMatrix components;      // k x dim, orthonormal rows
+  Eigen::VectorXf variances; // variance along each component, decreasing
+  Real total_variance = 0;   // sum of variances along all dimensions
+
+  size_t dim() const { return mean.size(); }
+  size_t k() const { return components.rows(); }
+
+  /// @returns rows of x in the component basis, i.e. (x - mean) C^T
+  RowMatrix project(const RowMatrix& x, unsigned threads = 1) const {
+    RowMatrix y(x.rows(), k());
+    const size_t block = 4096;
+    parallel_for(
+        0,
+        (x.rows() + block - 1) / block,
+        [&](size_t b, size_t) {
+          const size_t begin = b * block;
+          const size_t size = std::min<size_t>(block, x.rows() - begin);
+          y.middleRows(begin, size).noalias() =
+              (x.middleRows(begin, size).rowwise() - mean) *
+              components.transpose();
+        },
+        threads);
+    return y;
+  }
+
+  /// @returns rows of y mapped back from the component basis, y C + mean
+  RowMatrix reconstruct(const RowMatrix& y) const {
+    RowMatrix x = y * components;
+    x.rowwise() += mean;
+    return x;
+  }
+};
+
+/// Compute Xc^T (Xc V) in a single pass over X, where Xc is X with mean
+/// subtracted from each row, spreading blocks of rows over threads.
+inline Eigen::MatrixXf centered_gram_product(const RowMatrix& x,
+                                             const Eigen::RowVectorXf& mean,
+                                             const Eigen::MatrixXf& v,
+                                             unsigned threads = 1,
+                                             size_t block = 4096) {
+  std::vector<Eigen::MatrixXf> partial( // one per thread
+      threads,
+      Eigen::MatrixXf::Zero(x.cols(), v.cols()));
+  std::vector<RowMatrix> centered(threads); // one per thread
+  parallel_for(
+      0,
+      (x.rows() + block - 1) / block,
+      [&](size_t b, size_t tid) {
+        const size_t begin = b * block;
+        const size_t size = std::min<size_t>(block, x.rows() - begin);
+        auto& c = centered[tid];
+        c = x.middleRows(begin, size).rowwise() - mean;
+        partial[tid].noalias() += c.transpose() * (c * v);
+      },
+      threads);
+  for (unsigned t = 1; t < threads; t++) { partial[0] += partial[t]; }
+  return partial[0];
+}
+
+/// Top principal components of the rows of a matrix by randomized subspace
+/// iteration (Halko et al., 2011).
+///
+/// Only dim x (k + oversample) matrices are kept besides x: every step is a
+/// product with the covariance Xc^T Xc, computed block by block over rows in
+/// parallel (see centered_gram_product()), so that the cost is a few passes
+/// over x.
+///
+/// @param[in] x matrix with one sample per row
+/// @param[in] k number of components. Capped at x.cols().
+/// @param[in] threads number of threads to use
+/// @param[in] iterations number of power iterations, more is more accurate
+/// when the spectrum decays slowly
+/// @param[in] oversample number of extra random directions
+/// @param[in] seed seed of random directions
+inline Pca randomized_pca(const RowMatrix& x,
+                          unsigned k,
+                          unsigned threads = 1,
+                          unsigned iterations = 3,
+                          unsigned oversample = 10,
+                          unsigned seed = 12345) {
+  const size_t n = x.rows(), dim = x.cols();
+  k = std::min<size_t>(k, dim);
+  const size_t l = std::min<size_t>(k + oversample, dim);
+  Pca pca;
+
+  // Mean and total variance
+  std::vector<Eigen::RowVectorXd> sums(threads, // one per thread
+                                       Eigen::RowVectorXd::Zero(dim));
+  std::vector<Real> squares(threads, 0); // one per thread
+  parallel_for(
+      0,
+      n,
+      [&](size_t i, size_t tid) {
+        sums[tid] += x.row(i).cast<double>();
+        squares[tid] += x.row(i).squaredNorm();
+      },
+      threads);
+  for (unsigned t = 1; t < threads; t++) {
+    sums[0] += sums[t];
+    squares[0] += squares[t];
+  }
+  Eigen::RowVectorXd mean = sums[0] / std::max<size_t>(n, 1);
+  pca.mean = mean.cast<float>();
+  pca.total_variance = squares[0] / std::max<size_t>(n, 1) -
+                       mean.squaredNorm();
+
+  auto orthonormalize = [](const Eigen::MatrixXf& z) {
+    Eigen::HouseholderQR<Eigen::MatrixXf> qr(z);
+    return Eigen::MatrixXf(qr.householderQ() *
+                           Eigen::MatrixXf::Identity(z.rows(), z.cols()));
+  };
+
+  std::mt19937 rng(seed);
+  std::normal_distribution<float> normal;
+  Eigen::MatrixXf q = Eigen::MatrixXf::NullaryExpr(
+      dim, l, [&]() { return normal(rng); });
+  for (unsigned it = 0; it <= iterations; it++) {
+    q = orthonormalize(centered_gram_product(x, pca.mean, q, threads));
+  }
+
+  // Rayleigh-Ritz: eigenvectors of the covariance restricted to span(q)
+  Eigen::MatrixXf g = q.transpose() *
+                      centered_gram_product(x, pca.mean, q, threads);
+  Eigen::SelfAdjointEigenSolver<Eigen::MatrixXf> solver(
+      (g + g.transpose()) / 2);
+  pca.components.resize(k, dim);
+  pca.variances.resize(k);
+  for (size_t j = 0; j < k; j++) { // eigenvalues are in increasing order
+    pca.components.row(j) = (q * solver.eigenvectors().col(l - 1 - j))
+                                .transpose()
+                                .normalized();
+    pca.variances[j] =
+        std::max(0.f, solver.eigenvalues()[l - 1 - j]) / std::max<size_t>(n, 1);
+  }
+  return pca;
+}
+
+/// Product quantizer: splits vectors into equal subspaces, and encodes each
+/// subvector as the nearest of 256 centroids learned by k-means, i.e. as one
+/// byte (Jégou et al., 2011).
+class ProductQuantizer {
+ public:
+  static constexpr unsigned CENTROIDS = 256;
+
+  struct Params {
+    unsigned subspaces = 8;  // bytes per vector, must divide dimension
+    unsigned iterations = 20; // of k-means
+    size_t sample = 100'000;  // number of rows to train k-means on
+    unsigned threads = 1;
+    unsigned seed = 12345;
+  };
+
+ private:
+  unsigned dim_ = 0;
+  unsigned sub_dim_ = 0;
+  std::vector<RowMatrix> codebooks_; // one per subspace, CENTROIDS x sub_dim
+
+  /// Index of nearest centroid of each row of a subspace block.
+  static void assign(const RowMatrix& c,
+                     const Eigen::VectorXf& c_norms,
+                     const RowMatrix& xs,
+                     RowMatrix& scores,
+                     std::vector<uint8_t>& out) {
+    scores.noalias() = xs * c.transpose();
+    for (Eigen::Index i = 0; i < xs.rows(); i++) {
+      // |x - c|^2 = |x|^2 - 2 x.c + |c|^2, where |x|^2 does not matter
+      Eigen::Index best;
+      (c_norms.transpose() - 2 * scores.row(i)).minCoeff(&best);
+      out[i] = best;
+    }
+  }
+
+ public:
+  ProductQuantizer() = default;
+
+  /// @param[in] codebooks centroids of each subspace, CENTROIDS x sub_dim
+  ProductQuantizer(std::vector<RowMatrix> codebooks)
+      : codebooks_(std::move(codebooks)) {
+    sub_dim_ = codebooks_.empty() ? 0 : codebooks_[0].cols();
+    dim_ = sub_dim_ * codebooks_.size();
+  }
+
+  unsigned dim() const { return dim_; }
+  unsigned subspaces() const { return codebooks_.size(); }
+  unsigned sub_dim() const { return sub_dim_; }
+  const RowMatrix& codebook(unsigned s) const { return codebooks_[s]; }
+
+  /// Learn codebooks by k-means on a random sample of rows, in parallel over
+  /// subspaces.
+  ///
+  /// @param[in] x matrix with one vector per row
+  /// @param[in] params parameters
+  static ProductQuantizer train(const RowMatrix& x, const Params& params) {
+    const size_t dim = x.cols();
+    KOAN_ASSERT(params.subspaces > 0 and dim % params.subspaces == 0,
+                "Number of subspaces must divide dimension " +
+                    std::to_string(dim) + "!");
+    KOAN_ASSERT(x.rows() > 0, "Cannot train product quantizer on no rows!");
+    const size_t sub_dim = dim / params.subspaces;
+
+    std::mt19937 rng(params.seed);
+    std::vector<size_t> rows(x.rows());
+    std::iota(rows.begin(), rows.end(), 0);
+    std::shuffle(rows.begin(), rows.end(), rng);
+    rows.resize(std::min(rows.size(), params.sample));
+    const size_t n = rows.size();
+
+    std::vector<RowMatrix> codebooks(params.subspaces);
+    parallel_for(
+        0,
+        params.subspaces,
+        [&](size_t s, size_t) {
+          RowMatrix xs(n, sub_dim);
+          for (size_t i = 0; i < n; i++) {
+            xs.row(i) = x.row(rows[i]).segment(s * sub_dim, sub_dim);
+          }
+          auto& c = codebooks[s];
+          c.resize(CENTROIDS, sub_dim);
+          for (size_t j = 0; j < CENTROIDS; j++) { c.row(j) = xs.row(j % n); }
+
+          std::mt19937 rng(params.seed + s);
+          std::vector<uint8_t> assignment(n);
+          std::vector<size_t> sizes(CENTROIDS);
+          RowMatrix scores;
+          for (unsigned it = 0; it < params.iterations; it++) {
+            Eigen::VectorXf c_norms = c.rowwise().squaredNorm();
+            assign(c, c_norms, xs, scores, assignment);
+            c.setZero();
+            std::fill(sizes.begin(), sizes.end(), 0);
+            for (size_t i = 0; i < n; i++) {
+              c.row(assignment[i]) += xs.row(i);
+              sizes[assignment[i]]++;
+            }
+            for (size_t j = 0; j < CENTROIDS; j++) {
+              if (sizes[j] > 0) {
+                c.row(j) /= sizes[j];
+              } else { // restart empty clusters from a random point
+                c.row(j) = xs.row(rng() % n);
+              }
+            }
+          }
+        },
+        params.threads);
+    return ProductQuantizer(std::move(codebooks));
+  }
+
+  /// Encode rows of a matrix.
+  ///
+  /// @param[in] x matrix with dim() columns
+  /// @param[in] threads number of threads to use
+  /// @returns subspaces() bytes per row
+  std::vector<uint8_t> encode(const RowMatrix& x, unsigned threads = 1) const {
+    KOAN_ASSERT(size_t(x.cols()) == dim_);
+    const size_t m = subspaces(), block = 4096;
+    std::vector<uint8_t> codes(x.rows() * m);
+    std::vector<Eigen::VectorXf> c_norms;
+    for (auto& c : codebooks_) { c_norms.push_back(c.rowwise().squaredNorm()); }
+    std::vector<RowMatrix> xs(threads), scores(threads); // one per thread
+    std::vector<std::vector<uint8_t>> column(threads);   // one per thread
+    parallel_for(
+        0,
+        (x.rows() + block - 1) / block,
+        [&](size_t b, size_t tid) {
+          const size_t begin = b * block;
+          const size_t size = std::min<size_t>(block, x.rows() - begin);
+          column[tid].resize(size);
+          for (size_t s = 0; s < m; s++) {
+            xs[tid] = x.block(begin, s * sub_dim_, size, sub_dim_);
+            assign(
+                codebooks_[s], c_norms[s], xs[tid], scores[tid], column[tid]);
+            for (size_t i = 0; i < size; i++) {
+              codes[(begin + i) * m + s] = column[tid][i];
+            }
+          }
+        },
+        threads);
+    return codes;
+  }
+
+  /// Decode a code into dim() floats.
+  void decode(const uint8_t* code, float* out) const {
+    for (size_t s = 0; s < codebooks_.size(); s++) {
+      Eigen::Map<Eigen::RowVectorXf>(out + s * sub_dim_, sub_dim_) =
+          codebooks_[s].row(code[s]);
+    }
+  }
+
+  /// Inner products of each subvector of a query with each centroid of its
+  /// subspace, so that the inner product of the query with a decoded vector
+  /// is the sum of subspaces() table entries (asymmetric distance).
+  ///
+  /// @param[in] query dim() floats
+  /// @param[out] table subspaces() * CENTROIDS floats
+  void inner_product_table(const float* query, float* table) const {
+    for (size_t s = 0; s < codebooks_.size(); s++) {
+      Eigen::Map<Eigen::VectorXf>(table + s * CENTROIDS, CENTROIDS) =
+          codebooks_[s] *
+          Eigen::Map<const Eigen::VectorXf>(query + s * sub_dim_, sub_dim_);
+    }
+  }
+};
+
+/// Compressed word embeddings: unit norm word vectors, optionally reduced by
+/// PCA, then product quantized.
+///
+/// Binary file layout is a header (magic "KOANPQMD", uint32 version, uint32
+/// dim, uint32 pca_dim or 0 if no PCA, uint32 subspaces, uint64 size)
+/// followed by:
+///
+///   float   mean[dim], components[pca_dim * dim] if pca_dim > 0
+///   float   codebooks[subspaces * 256 * sub_dim]
+///   uint8   codes[size * subspaces]
+///   uint64  offsets[size + 1]
+///   char    strings[offsets[size]]
+class PqModel {
+ public:
+  static constexpr char MAGIC[8] = {'K', 'O', 'A', 'N', 'P', 'Q', 'M', 'D'};
+  static constexpr uint32_t VERSION = 1;
+  static constexpr uint32_t NONE = 0xFFFFFFFF;
+
+ private:
+  Pca pca_; // empty if vectors were not reduced
+  ProductQuantizer pq_;
+  std::vector<uint8_t> codes_;
+  std::vector<uint64_t> offsets_;
+  std::string strings_;
+  std::unordered_map<std::string_view, Word> word_map_;
+  unsigned dim_ = 0;
+
+ public:
+  /// Save compressed embeddings.
+  ///
+  /// @param[in] path output path
+  /// @param[in] words vocabulary, in index order
+  /// @param[in] pca PCA applied before quantization, or nullptr
+  /// @param[in] pq product quantizer
+  /// @param[in] codes codes of words, from pq.encode()
+  static void save(const std::string& path,
+                   const std::vector<std::string_view>& words,
+                   const Pca* pca,
+                   const ProductQuantizer& pq,
+                   const std::vector<uint8_t>& codes) {
+    KOAN_ASSERT(codes.size() == words.size() * pq.subspaces());
+    KOAN_ASSERT(not pca or pca->k() == pq.dim());
+    uint32_t version = VERSION;
+    uint32_t dim = pca ? pca->dim() : pq.dim(), pca_dim = pca ? pca->k() : 0;
+    uint32_t subspaces = pq.subspaces();
+    uint64_t size = words.size();
+    std::vector<uint64_t> offsets(words.size() + 1, 0);
+    for (size_t i = 0; i < words.size(); i++) {
+      offsets[i + 1] = offsets[i] + words[i].size();
+    }
+
+    FILE* out = fopen(path.c_str(), "wb");
+    KOAN_ASSERT(out, "Could not open '" + path + "' to save model!");
+    bool ok = true;
+    auto write = [&](const void* p, size_t bytes) {
+      ok = ok and (bytes == 0 or fwrite(p, bytes, 1, out) == 1);
+    };
+    write(MAGIC, sizeof(MAGIC));
+    write(&version, sizeof(version));
+    write(&dim, sizeof(dim));
+    write(&pca_dim, sizeof(pca_dim));
+    write(&subspaces, sizeof(subspaces));
+    write(&size, sizeof(size));
+    if (pca) {
+      write(pca->mean.data(), dim * sizeof(float));
+      write(pca->components.data(), pca_dim * dim * sizeof(float));
+    }
+    for (unsigned s = 0; s < subspaces; s++) {
+      write(pq.codebook(s).data(), pq.codebook(s).size() * sizeof(float));
+    }
+    write(codes.data(), codes.size());
+    write(offsets.data(), offsets.size() * sizeof(uint64_t));
+    for (auto& w : words) { write(w.data(), w.size()); }
+    ok = (fclose(out) == 0) and ok;
+    KOAN_ASSERT(ok, "Could not write model to '" + path + "'!");
+  }
+
+  /// Load compressed embeddings.
+  ///
+  /// @param[in] path path to model
+  PqModel(const std::string& path) {
+    FILE* in = fopen(path.c_str(), "rb");
+    KOAN_ASSERT(in, "Could not open model '" + path + "'!");
+    bool ok = true;
+    auto read = [&](void* p, size_t bytes) {
+      ok = ok and (bytes == 0 or fread(p, bytes, 1, in) == 1);
+    };
+    char magic[8];
+    uint32_t version = 0, pca_dim = 0, subspaces = 0;
+    uint64_t size = 0;
+    read(magic, sizeof(magic));
+    read(&version, sizeof(version));
+    ok = ok and std::memcmp(magic, MAGIC, sizeof(MAGIC)) == 0 and
+         version == VERSION;
+    read(&dim_, sizeof(dim_));
+    read(&pca_dim, sizeof(pca_dim));
+    read(&subspaces, sizeof(subspaces));
+    read(&size, sizeof(size));
+    const uint32_t pq_dim = pca_dim > 0 ? pca_dim : dim_;
+    ok = ok and subspaces > 0 and pq_dim % subspaces == 0;
+
+    // Sizes in the header are checked against the rest of the file before
+    // allocating anything
+    const long header_end = ftell(in);
+    ok = ok and header_end >= 0 and fseek(in, 0, SEEK_END) == 0;
+    const long file_end = ok ? ftell(in) : -1;
+    ok = ok and file_end >= header_end and
+         fseek(in, header_end, SEEK_SET) == 0;
+    uint64_t left = ok ? file_end - header_end : 0;
+    auto take = [&](uint64_t count, uint64_t bytes_each) {
+      ok = ok and (bytes_each == 0 or count <= left / bytes_each);
+      if (ok) { left -= count * bytes_each; }
+    };
+    if (pca_dim > 0) {
+      take(dim_, sizeof(float));
+      take(pca_dim, uint64_t(dim_) * sizeof(float));
+    }
+    take(ProductQuantizer::CENTROIDS, uint64_t(pq_dim) * sizeof(float));
+    take(size, subspaces);
+    take(size, sizeof(uint64_t));
+    take(1, sizeof(uint64_t));
+
+    if (ok and pca_dim > 0) {
+      pca_.mean.resize(dim_);
+      pca_.components.resize(pca_dim, dim_);
+      read(pca_.mean.data(), dim_ * sizeof(float));
+      read(pca_.components.data(), pca_dim * dim_ * sizeof(float));
+    }
+    if (ok) {
+      std::vector<RowMatrix> codebooks(subspaces);
+      for (auto& c : codebooks) {
+        c.resize(ProductQuantizer::CENTROIDS, pq_dim / subspaces);
+        read(c.data(), c.size() * sizeof(float));
+      }
+      pq_ = ProductQuantizer(std::move(codebooks));
+      codes_.resize(size * subspaces);
+      read(codes_.data(), codes_.size());
+      offsets_.resize(size + 1);
+      read(offsets_.data(), offsets_.size() * sizeof(uint64_t));
+    }
+    if (ok) { // offsets delimit the strings, which end the file
+      ok = offsets_[0] == 0 and offsets_.back() == left;
+      for (size_t i = 0; ok and i < size; i++) {
+        ok = offsets_[i] <= offsets_[i + 1];
+      }
+    }
+    if (ok) {
+      strings_.resize(offsets_.back());
+      read(strings_.data(), strings_.size());
+    }
+    fclose(in);
+    KOAN_ASSERT(ok, "Invalid model '" + path + "'!");
+    for (Word i = 0; i < size; i++) { word_map_.emplace(word(i), i); }
+  }
+
+  PqModel(const PqModel&) = delete;
+  PqModel& operator=(const PqModel&) = delete;
+
+  size_t size() const { return offsets_.size() - 1; }
+  unsigned dim() const { return dim_; }
+  const ProductQuantizer& quantizer() const { return pq_; }
+
+  std::string_view word(Word i) const {
+    return {strings_.data() + offsets_[i],
+            size_t(offsets_[i + 1] - offsets_[i])};
+  }
+
+  /// @returns index of word, or NONE if out of vocabulary
+  Word lookup(std::string_view word) const {
+    auto it = word_map_.find(word);
+    return it == word_map_.end() ? NONE : it->second;
+  }
+
+  /// Decode the (approximately unit norm) vector of a word.
+  ///
+  /// @param[out] out dim() floats
+  void decode(Word i, float* out) const {
+    const uint8_t* code = &codes_[size_t(i) * pq_.subspaces()];
+    if (pca_.k() == 0) { return pq_.decode(code, out); }
+    static thread_local Eigen::RowVectorXf y;
+    y.resize(pca_.k());
+    pq_.decode(code, y.data());
+    Eigen::Map<Eigen::RowVectorXf>(out, dim_) =
+        y * pca_.components + pca_.mean;
+  }
+
+  /// Approximate top-k words by cosine similarity to a query vector, scanning
+  /// codes with a table of inner products of the query with centroids
+  /// (asymmetric distance computation), without decoding any vector.
+  ///
+  /// @param[in] query dim() floats, need not be normalized
+  /// @param[in] k number of neighbors
+  /// @param[in] exclude word to leave out of results (e.g. the query word)
+  /// @returns (word, approximate cosine similarity) pairs, most similar first
+  std::vector<std::pair<Word, float>>
+  top_k(const float* query, size_t k, Word exclude = NONE) const {
+    Eigen::VectorXf q = Eigen::Map<const Eigen::VectorXf>(query, dim_);
+    if (q.norm() > 0) { q.normalize(); }
+    float bias = 0;
+    if (pca_.k() > 0) { // q.x = q.mean + (C q).y
+      bias = pca_.mean.dot(q.transpose());
+      q = pca_.components * q;
+    }
+    const unsigned m = pq_.subspaces();
+    static thread_local std::vector<float> table;
+    table.resize(m * ProductQuantizer::CENTROIDS);
+    pq_.inner_product_table(q.data(), table.data());
+
+    using Entry = std::pair<float, Word>;
+    std::vector<Entry> heap; // min-heap on similarity
+    for (Word i = 0; i < size(); i++) {
+      if (i == exclude) { continue; }
+      const uint8_t* code = &codes_[size_t(i) * m];
+      float sim = bias;
+      for (unsigned s = 0; s < m; s++) {
+        sim += table[s * ProductQuantizer::CENTROIDS + code[s]];
+      }
+      if (heap.size() < k) {
+        heap.emplace_back(sim, i);
+        std::push_heap(heap.begin(), heap.end(), std::greater<>());
+      } else if (k > 0 and sim > heap.front().first) {
+        std::pop_heap(heap.begin(), heap.end(), std::greater<>());
+        heap.back() = {sim, i};
+        std::push_heap(heap.begin(), heap.end(), std::greater<>());
+      }
+    }
+    std::sort_heap(heap.begin(), heap.end(), std::greater<>());
+    std::vector<std::pair<Word, float>> result;
+    for (auto& [sim, i] : heap) { result.emplace_back(i, sim); }
+    return result;
+  }
+};
+
+/// Mean squared distance between corresponding rows of two matrices.
+inline Real reconstruction_error(const RowMatrix& x, const RowMatrix& y) {
+  KOAN_ASSERT(x.rows() == y.rows() and x.cols() == y.cols());
+  return x.rows() > 0 ? Real((x - y).squaredNorm()) / x.rows() : 0;
+}
+
+} // namespace koan
+
+#endif
@@ -0,0 +1,253 @@
+/*
+** Copyright 2020 Bloomberg Finance L.P.
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef KOAN_CONTENTION_H
+#define KOAN_CONTENTION_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "def.h"
+#include "extern/tblr.h"
+
+namespace koan {
+
+/// Estimates how often Hogwild updates of one embedding row by different
+/// threads conflict, i.e. how often the cache lines of a row have to move
+/// from the core of one thread to another.
+///
+/// A subset of rows is sampled: the first hot_rows rows (the most frequent
+/// words, since the vocabulary is sorted by count) and every
+/// sample_every-th row after them. Each sampled row has an ownership tag
+/// holding the thread that wrote it last. A write by any other thread is a
+/// conflict, and takes over the tag. Counts of unsampled rows are estimated
+/// by scaling those of the sampled rows after the hot ones.
+///
+/// Conflicts are an upper bound on coherence transfers: the lines of rarely
+/// written rows may well have been evicted between two writes anyway.
+class ContentionProfiler {
+ public:
+  enum Side { Input, Output }; // table (syn1), ctx (syn0 or tree nodes)
+
+  /// Write counts of a sampled row, summed over threads.
+  struct Row {
+    Side side;
+    size_t row;
+    uint64_t writes;
+    uint64_t conflicts;
+  };
+
+ private:
+  static constexpr uint32_t NONE = 0xFFFFFFFF;
+
+  struct Sampled {
+    std::vector<uint32_t> slot;                   // of each row, or NONE
+    std::vector<size_t> rows;                     // of each slot
+    std::unique_ptr<std::atomic<uint32_t>[]> tag; // last writer of each slot
+    std::vector<std::vector<uint64_t>> writes;    // one per thread
+    std::vector<std::vector<uint64_t>> conflicts; // one per thread
+  };
+
+  std::array<Sampled, 2> sides_;
+  size_t hot_rows_;
+  size_t sample_every_;
+
+ public:
+  /// @param[in] input_rows number of rows of the input table
+  /// @param[in] output_rows number of rows of the output table
+  /// @param[in] threads number of threads writing rows
+  /// @param[in] hot_rows number of leading rows that are all sampled
+  /// @param[in] sample_every sampling period of the remaining rows
+  ContentionProfiler(size_t input_rows,
+                     size_t output_rows,
+                     unsigned threads,
+                     size_t hot_rows = 1000,
+                     size_t sample_every = 64)
+      : hot_rows_(hot_rows), sample_every_(std::max<size_t>(sample_every, 1)) {
+    const std::array<size_t, 2> sizes{input_rows, output_rows};
+    for (size_t s = 0; s < 2; s++) {
+      auto& d = sides_[s];
+      d.slot.assign(sizes[s], NONE);
+      for (size_t r = 0; r < sizes[s]; r++) {
+        if (sampled(r)) {
+          d.slot[r] = d.rows.size();
+          d.rows.push_back(r);
+        }
+      }
+      d.tag.reset(new std::atomic<uint32_t>[d.rows.size()]);
+      for (size_t i = 0; i < d.rows.size(); i++) { d.tag[i] = NONE; }
+      d.writes.assign(threads, std::vector<uint64_t>(d.rows.size(), 0));
+      d.conflicts.assign(threads, std::vector<uint64_t>(d.rows.size(), 0));
+    }
+  }
+
+  bool sampled(size_t row) const {
+    return row < hot_rows_ or (row - hot_rows_) % sample_every_ == 0;
+  }
+
+  /// @returns number of rows a sampled row stands for in estimates
+  size_t weight(size_t row) const {
+    return row < hot_rows_ ? 1 : sample_every_;
+  }
+
+  /// Record a write of a row by thread tid.
+  void write(Side side, size_t row, size_t tid) {
+    auto& d = sides_[side];
+    uint32_t slot = d.slot[row];
+    if (slot == NONE) { return; }
+    d.writes[tid][slot]++;
+    auto& tag = d.tag[slot];
+    uint32_t last = tag.load(std::memory_order_relaxed);
+    if (last != tid) { // only write the tag when ownership changes
+      if (last != NONE) { d.conflicts[tid][slot]++; }
+      tag.store(tid, std::memory_order_relaxed);
+    }
+  }
+
+  /// @returns counts of sampled rows of a side, in row order
+  std::vector<Row> rows(Side side) const {
+    auto& d = sides_[side];
+    std::vector<Row> rows;
+    for (size_t i = 0; i < d.rows.size(); i++) {
+      Row r{side, d.rows[i], 0, 0};
+      for (size_t t = 0; t < d.writes.size(); t++) {
+        r.writes += d.writes[t][i];
+        r.conflicts += d.conflicts[t][i];
+      }
+      rows.push_back(r);
+    }
+    return rows;
+  }
+
+  /// Print the rows with the most conflicts, estimated conflict rates by row
+  /// (frequency rank) range, and the estimated coherence traffic.
+  ///
+  /// @param[in] name name of a row of a side, e.g. its word
+  /// @param[in] dim embedding dimension
+  /// @param[in] seconds training time, to convert traffic to a rate
+  /// @param[in] tokens number of tokens trained on
+  /// @param[in] top number of hottest rows to print
+  void print(const std::function<std::string(Side, size_t)>& name,
+             size_t dim,
+             double seconds,
+             double tokens,
+             size_t top = 20) const {
+    const char* side_names[] = {"input", "output"};
+    std::vector<Row> all;
+    for (auto side : {Input, Output}) {
+      auto r = rows(side);
+      all.insert(all.end(), r.begin(), r.end());
+    }
+
+    auto hottest = all;
+    top = std::min(top, hottest.size());
+    std::partial_sort(hottest.begin(),
+                      hottest.begin() + top,
+                      hottest.end(),
+                      [](const Row& a, const Row& b) {
+                        return a.conflicts > b.conflicts;
+                      });
+    std::cout << "Hottest rows:" << std::endl;
+    tblr::Table rows_table;
+    rows_table.layout(tblr::markdown())
+        .aligns({tblr::Left,
+                 tblr::Right,
+                 tblr::Left,
+                 tblr::Right,
+                 tblr::Right,
+                 tblr::Right})
+        .precision(3)
+        .fixed();
+    rows_table << "Table" << "Row" << "Word" << "Writes" << "Conflicts"
+               << "Conflict rate" << tblr::endr;
+    for (size_t i = 0; i < top; i++) {
+      auto& r = hottest[i];
+      rows_table << side_names[r.side] << std::to_string(r.row)
+                 << name(r.side, r.row) << std::to_string(r.writes)
+                 << std::to_string(r.conflicts)
+                 << (r.writes > 0 ? double(r.conflicts) / r.writes : 0.)
+                 << tblr::endr;
+    }
+    rows_table.print();
+
+    // Rank ranges [0, 10), [10, 100), ... estimated from sampled rows
+    struct Range {
+      double writes = 0, conflicts = 0;
+      size_t sampled = 0;
+    };
+    std::array<std::vector<Range>, 2> ranges;
+    double total_conflicts = 0;
+    for (auto& r : all) {
+      size_t range = 0;
+      for (size_t end = 10; r.row >= end; end *= 10) { range++; }
+      auto& side_ranges = ranges[r.side];
+      if (side_ranges.size() <= range) { side_ranges.resize(range + 1); }
+      double w = weight(r.row);
+      side_ranges[range].writes += w * r.writes;
+      side_ranges[range].conflicts += w * r.conflicts;
+      side_ranges[range].sampled++;
+      total_conflicts += w * r.conflicts;
+    }
+    std::cout << "Conflicts by row (frequency rank) range:" << std::endl;
+    tblr::Table range_table;
+    range_table.layout(tblr::markdown())
+        .aligns({tblr::Left,
+                 tblr::Left,
+                 tblr::Right,
+                 tblr::Right,
+                 tblr::Right,
+                 tblr::Right})
+        .precision(3)
+        .fixed();
+    range_table << "Table" << "Rows" << "Sampled rows" << "Est. conflicts"
+                << "Conflict rate" << "Share of conflicts" << tblr::endr;
+    for (auto side : {Input, Output}) {
+      size_t begin = 0, end = 10;
+      for (auto& range : ranges[side]) {
+        end = std::min(end, sides_[side].slot.size());
+        range_table << side_names[side]
+                    << std::to_string(begin) + "-" + std::to_string(end - 1)
+                    << std::to_string(range.sampled)
+                    << std::to_string(uint64_t(range.conflicts))
+                    << (range.writes > 0 ? range.conflicts / range.writes : 0.)
+                    << (total_conflicts > 0 ? range.conflicts / total_conflicts
+                                            : 0.)
+                    << tblr::endr;
+        begin = end;
+        end *= 10;
+      }
+    }
+    range_table.print();
+
+    const size_t row_bytes = (dim * sizeof(Real) + 63) / 64 * 64;
+    const double bytes = total_conflicts * row_bytes;
+    std::cout << "Estimated coherence traffic: " << bytes / 1e9 << " GB ("
+              << (tokens > 0 ? bytes / tokens : 0) << " bytes/token, "
+              << (seconds > 0 ? bytes / seconds / 1e9 : 0) << " GB/s)"
+              << std::endl;
+  }
+};
+
+} // namespace koan
+
+#endif
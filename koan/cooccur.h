@@ -0,0 +1,224 @@
+/*
+** Copyright 2020 Bloomberg Finance L.P.
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef KOAN_COOCCUR_H
+#define KOAN_COOCCUR_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <queue>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <unistd.h>
+
+#include "def.h"
+#include "util.h"
+
+namespace koan {
+
+/// A single nonzero of the co-occurrence matrix.
+struct Cooccurrence {
+  Word row;
+  Word col;
+  Real value;
+
+  bool operator<(const Cooccurrence& other) const {
+    return row < other.row or (row == other.row and col < other.col);
+  }
+};
+
+/// Builds a windowed, distance weighted (1/d) co-occurrence matrix with bounded
+/// memory.
+///
+/// Each thread counts into its own hash table. When a table grows beyond its
+/// share of the memory budget it is split into shards by row, and each shard
+/// is sorted and spilled to disk as a run. At the end, shards are merged in
+/// parallel (one k-way merge of sorted runs per shard), summing duplicates.
+class CooccurrenceCounter {
+ public:
+  struct Params {
+    // One-sided window size
+    unsigned window = 10;
+    // Also count (context, center) for every (center, context)
+    bool symmetric = true;
+    // Bound on the number of entries held in memory over all threads
+    size_t max_entries = 100'000'000;
+    // Directory to write sorted runs to
+    std::string tmp_dir = "/tmp";
+    unsigned threads = 1;
+  };
+
+ private:
+  Params params_;
+  size_t shards_;
+  size_t max_entries_per_thread_;
+  std::vector<std::unordered_map<uint64_t, Real>> counts_; // one per thread
+  // Paths of sorted runs, indexed by [thread][shard]
+  std::vector<std::vector<std::vector<std::string>>> runs_;
+  std::vector<size_t> num_runs_; // one per thread
+  std::string prefix_;
+
+  static uint64_t key(Word row, Word col) {
+    return (uint64_t(row) << 32) | uint64_t(col);
+  }
+
+  /// Sort the table of thread tid by shard and write a run per shard.
+  void spill(size_t tid) {
+    auto& counts = counts_[tid];
+    if (counts.empty()) { return; }
+    std::vector<std::vector<Cooccurrence>> shards(shards_);
+    for (auto& [k, v] : counts) {
+      Word row = k >> 32, col = k & 0xFFFFFFFF;
+      shards[row % shards_].push_back({row, col, v});
+    }
+    counts.clear();
+    for (size_t s = 0; s < shards_; s++) {
+      auto& cells = shards[s];
+      if (cells.empty()) { continue; }
+      std::sort(cells.begin(), cells.end());
+      std::string path = prefix_ + std::to_string(tid) + "_" +
+                         std::to_string(num_runs_[tid]) + "_" +
+                         std::to_string(s) + ".bin";
+      FILE* out = fopen(path.c_str(), "wb");
+      KOAN_ASSERT(out, "Could not open '" + path + "' to spill counts!");
+      size_t written =
+          fwrite(cells.data(), sizeof(Cooccurrence), cells.size(), out);
+      // Write errors may only be reported when the file is flushed
+      bool ok = fclose(out) == 0 and written == cells.size();
+      KOAN_ASSERT(ok, "Could not write to '" + path + "'!");
+      runs_[tid][s].push_back(path);
+    }
+    num_runs_[tid]++;
+  }
+
+  /// Buffered sequential reader over a sorted run.
+  class Run {
+   private:
+    FILE* in_;
+    std::vector<Cooccurrence> buf_;
+    size_t pos_ = 0, size_ = 0;
+
+   public:
+    Run(const std::string& path) : buf_(1 << 16) {
+      in_ = fopen(path.c_str(), "rb");
+      KOAN_ASSERT(in_, "Could not open run '" + path + "'!");
+    }
+    ~Run() { fclose(in_); }
+
+    bool next(Cooccurrence& c) {
+      if (pos_ == size_) {
+        size_ = fread(buf_.data(), sizeof(Cooccurrence), buf_.size(), in_);
+        pos_ = 0;
+        if (size_ == 0) { return false; }
+      }
+      c = buf_[pos_++];
+      return true;
+    }
+  };
+
+  /// k-way merge of the runs of a shard, summing duplicates.
+  std::vector<Cooccurrence> merge(size_t s) {
+    std::vector<Cooccurrence> merged;
+    std::vector<std::unique_ptr<Run>> runs;
+    using Head = std::pair<Cooccurrence, size_t>; // (cell, run index)
+    auto greater = [](const Head& a, const Head& b) {
+      return b.first < a.first;
+    };
+    std::priority_queue<Head, std::vector<Head>, decltype(greater)> heap(
+        greater);
+    std::vector<std::string> paths;
+    for (auto& thread_runs : runs_) {
+      for (auto& path : thread_runs[s]) {
+        paths.push_back(path);
+        runs.push_back(std::make_unique<Run>(path));
+        Cooccurrence c;
+        if (runs.back()->next(c)) { heap.push({c, runs.size() - 1}); }
+      }
+      thread_runs[s].clear();
+    }
+    while (not heap.empty()) {
+      auto [c, i] = heap.top();
+      heap.pop();
+      if (not merged.empty() and merged.back().row == c.row and
+          merged.back().col == c.col) {
+        merged.back().value += c.value;
+      } else {
+        merged.push_back(c);
+      }
+      if (runs[i]->next(c)) { heap.push({c, i}); }
+    }
+    runs.clear();
+    for (auto& path : paths) { std::remove(path.c_str()); }
+    return merged;
+  }
+
+ public:
+  CooccurrenceCounter(Params params)
+      : params_(std::move(params)),
+        shards_(params_.threads),
+        max_entries_per_thread_(
+            std::max<size_t>(params_.max_entries / params_.threads, 1)),
+        counts_(params_.threads),
+        runs_(params_.threads,
+              std::vector<std::vector<std::string>>(params_.threads)),
+        num_runs_(params_.threads, 0),
+        prefix_(params_.tmp_dir + "/koan_cooccur_" +
+                std::to_string(getpid()) + "_") {}
+
+  /// Count co-occurrences in a sentence.
+  ///
+  /// @param[in] sent input sentence
+  /// @param[in] tid thread index
+  void add(const Sentence& sent, size_t tid) {
+    auto& counts = counts_[tid];
+    for (size_t i = 0; i < sent.size(); i++) {
+      size_t end = std::min<size_t>(sent.size(), i + params_.window + 1);
+      for (size_t j = i + 1; j < end; j++) {
+        Real weight = 1_R / (j - i);
+        counts[key(sent[i], sent[j])] += weight;
+        if (params_.symmetric) { counts[key(sent[j], sent[i])] += weight; }
+      }
+    }
+    if (counts.size() > max_entries_per_thread_) { spill(tid); }
+  }
+
+  /// Spill remaining counts and merge all runs, one shard per thread.
+  ///
+  /// @returns nonzeros of the co-occurrence matrix, one list per shard, each
+  /// sorted by (row, col). Shard s has the rows r with r % shards == s.
+  std::vector<std::vector<Cooccurrence>> finish() {
+    parallel_for(
+        0,
+        counts_.size(),
+        [&](size_t tid, size_t) { spill(tid); },
+        params_.threads);
+    std::vector<std::vector<Cooccurrence>> shards(shards_);
+    parallel_for(
+        0,
+        shards_,
+        [&](size_t s, size_t) { shards[s] = merge(s); },
+        params_.threads);
+    return shards;
+  }
+};
+
+} // namespace koan
+
+#endif
@@ -0,0 +1,269 @@
+/*
+** Copyright 2020 Bloomberg Finance L.P.
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef KOAN_EMBED_H
+#define KOAN_EMBED_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <Eigen/Dense>
+
+#include "def.h"
+#include "indexmap.h"
+#include "model.h"
+#include "neighbors.h"
+#include "reader.h"
+#include "util.h"
+
+namespace koan {
+
+/// Dense float matrix file: a header (magic "KOANMTRX", uint32 version,
+/// uint32 cols, uint64 rows) followed by rows * cols floats in row major
+/// order. Rows are appended as they are computed, and the row count is filled
+/// in on close().
+class MatrixWriter {
+ public:
+  static constexpr char MAGIC[8] = {'K', 'O', 'A', 'N', 'M', 'T', 'R', 'X'};
+  static constexpr uint32_t VERSION = 1;
+  static constexpr size_t HEADER_BYTES = 8 + 4 + 4 + 8;
+
+ private:
+  std::string path_;
+  FILE* out_ = nullptr;
+  uint32_t cols_ = 0;
+  uint64_t rows_ = 0;
+  bool ok_ = true;
+
+  void write_header() {
+    uint32_t version = VERSION;
+    ok_ = ok_ and fwrite(MAGIC, sizeof(MAGIC), 1, out_) == 1 and
+          fwrite(&version, sizeof(version), 1, out_) == 1 and
+          fwrite(&cols_, sizeof(cols_), 1, out_) == 1 and
+          fwrite(&rows_, sizeof(rows_), 1, out_) == 1;
+  }
+
+ public:
+  /// @param[in] path output path
+  /// @param[in] cols number of columns of each row
+  MatrixWriter(const std::string& path, unsigned cols)
+      : path_(path), cols_(cols) {
+    out_ = fopen(path.c_str(), "wb");
+    KOAN_ASSERT(out_, "Could not open '" + path + "' to save matrix!");
+    write_header();
+  }
+
+  MatrixWriter(const MatrixWriter&) = delete;
+  MatrixWriter& operator=(const MatrixWriter&) = delete;
+
+  ~MatrixWriter() {
+    if (out_) { fclose(out_); }
+  }
+
+  /// Append rows.
+  ///
+  /// @param[in] data rows * cols floats
+  /// @param[in] rows number of rows
+  void write(const float* data, size_t rows) {
+    ok_ = ok_ and (rows == 0 or fwrite(data, sizeof(float) * cols_, rows,
+                                       out_) == rows);
+    rows_ += rows;
+  }
+
+  size_t rows() const { return rows_; }
+
+  /// Fill in the row count and close the file.
+  void close() {
+    ok_ = ok_ and fseek(out_, 0, SEEK_SET) == 0;
+    write_header();
+    ok_ = (fclose(out_) == 0) and ok_;
+    out_ = nullptr;
+    KOAN_ASSERT(ok_, "Could not write matrix to '" + path_ + "'!");
+  }
+};
+
+/// Read a matrix saved by MatrixWriter.
+///
+/// @param[in] path path to matrix
+inline RowMatrix load_matrix(const std::string& path) {
+  FILE* in = fopen(path.c_str(), "rb");
+  KOAN_ASSERT(in, "Could not open matrix '" + path + "'!");
+  char magic[8];
+  uint32_t version, cols;
+  uint64_t rows;
+  bool ok = fread(magic, sizeof(magic), 1, in) == 1 and
+            std::memcmp(magic, MatrixWriter::MAGIC, sizeof(magic)) == 0 and
+            fread(&version, sizeof(version), 1, in) == 1 and
+            version == MatrixWriter::VERSION and
+            fread(&cols, sizeof(cols), 1, in) == 1 and
+            fread(&rows, sizeof(rows), 1, in) == 1;
+  RowMatrix m;
+  if (ok) {
+    m.resize(rows, cols);
+    ok = m.size() == 0 or
+         fread(m.data(), sizeof(float) * cols, rows, in) == rows;
+  }
+  fclose(in);
+  KOAN_ASSERT(ok, "Invalid matrix '" + path + "'!");
+  return m;
+}
+
+/// Computes document embeddings as (weighted) averages of word embeddings of
+/// a Model.
+///
+/// Documents are lines of text, tokenized and looked up exactly as training
+/// files are (see Reader), with out-of-vocabulary words ignored. Each document
+/// vector is sum_w weight(w) * v_w / |d| over its in-vocabulary words, where
+/// weights are either uniform (the mean), or the smooth inverse frequency
+/// a / (a + p(w)) of Arora et al. (2017). The latter may also have the
+/// projection onto the first singular vector of all document vectors removed.
+class DocumentEmbedder {
+ private:
+  /// Reader used only for its tokenization, one per thread.
+  class Parser : public Reader {
+   private:
+    static std::vector<std::string>& no_files() {
+      static std::vector<std::string> none;
+      return none;
+    }
+
+   public:
+    Parser(IndexMap<std::string_view>& word_map)
+        : Reader(word_map, no_files(), true, "text") {}
+    using Reader::parseline;
+    bool get_next(Sentences&) override { return false; }
+  };
+
+  const Model& model_;
+  IndexMap<std::string_view> word_map_;
+  std::vector<float> weights_;
+  std::vector<std::unique_ptr<Parser>> parsers_; // one per thread
+  unsigned threads_;
+  Eigen::MatrixXd gram_; // sum of x x^T over embedded document vectors x
+
+ public:
+  /// @param[in] model word embeddings
+  /// @param[in] threads number of threads to use
+  DocumentEmbedder(const Model& model, unsigned threads = 1)
+      : model_(model), weights_(model.size(), 1), threads_(threads) {
+    for (Word i = 0; i < model.size(); i++) { word_map_.insert(model.word(i)); }
+    for (unsigned t = 0; t < threads; t++) {
+      parsers_.push_back(std::make_unique<Parser>(word_map_));
+    }
+    gram_ = Eigen::MatrixXd::Zero(model.dim(), model.dim());
+  }
+
+  /// Use smooth inverse frequency weights a / (a + p(w)) instead of uniform.
+  ///
+  /// @param[in] counts (word, count) pairs, e.g. from a saved vocab file.
+  /// Words of the model without a count get weight 1.
+  /// @param[in] a smoothing parameter
+  void set_sif_weights(
+      const std::vector<std::pair<std::string, unsigned long long>>& counts,
+      Real a = 1e-3) {
+    Real total = 0;
+    for (auto& [word, count] : counts) { total += count; }
+    std::fill(weights_.begin(), weights_.end(), 1.f);
+    if (total == 0) { return; }
+    for (auto& [word, count] : counts) {
+      Word i = model_.lookup(word);
+      if (i != Model::NONE) { weights_[i] = a / (a + count / total); }
+    }
+  }
+
+  float weight(Word w) const { return weights_[w]; }
+
+  /// Embed a batch of documents in parallel.
+  ///
+  /// @param[in] lines documents, one per line
+  /// @param[out] out lines.size() x dim matrix of document vectors
+  /// @param[in] accumulate if true, also accumulate the document vectors for
+  /// common_component()
+  void embed(const std::vector<std::string>& lines,
+             RowMatrix& out,
+             bool accumulate = false) {
+    const unsigned dim = model_.dim();
+    out.resize(lines.size(), dim);
+    parallel_for(
+        0,
+        lines.size(),
+        [&](size_t i, size_t tid) {
+          Sentence s = parsers_[tid]->parseline(lines[i]);
+          auto v = out.row(i);
+          v.setZero();
+          for (Word w : s) {
+            v += weights_[w] *
+                 Eigen::Map<const Eigen::RowVectorXf>(model_.vector(w), dim);
+          }
+          if (not s.empty()) { v /= s.size(); }
+        },
+        threads_);
+    if (accumulate) { gram_ += (out.transpose() * out).cast<double>(); }
+  }
+
+  /// First right singular vector of the matrix of all document vectors
+  /// accumulated by embed(), i.e. their common component.
+  Eigen::VectorXf common_component() const {
+    Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> solver(gram_);
+    return solver.eigenvectors().col(gram_.rows() - 1).cast<float>();
+  }
+};
+
+/// Remove the projection of every row of a matrix file onto a unit vector, in
+/// place, one block of rows at a time.
+///
+/// @param[in] path matrix saved by MatrixWriter
+/// @param[in] u unit vector with as many entries as matrix columns
+/// @param[in] block number of rows in each block
+inline void remove_component(const std::string& path,
+                             const Eigen::VectorXf& u,
+                             size_t block = 65536) {
+  FILE* f = fopen(path.c_str(), "r+b");
+  KOAN_ASSERT(f, "Could not open matrix '" + path + "'!");
+  char header[MatrixWriter::HEADER_BYTES];
+  bool ok = fread(header, sizeof(header), 1, f) == 1 and
+            std::memcmp(header, MatrixWriter::MAGIC, 8) == 0;
+  uint32_t cols = 0;
+  uint64_t rows = 0;
+  if (ok) {
+    std::memcpy(&cols, header + 12, sizeof(cols));
+    std::memcpy(&rows, header + 16, sizeof(rows));
+    ok = cols == u.size();
+  }
+  RowMatrix m;
+  for (uint64_t begin = 0; ok and begin < rows; begin += block) {
+    const size_t n = std::min<uint64_t>(block, rows - begin);
+    const long offset = MatrixWriter::HEADER_BYTES + begin * cols * 4;
+    m.resize(n, cols);
+    ok = fseek(f, offset, SEEK_SET) == 0 and
+         fread(m.data(), sizeof(float) * cols, n, f) == n;
+    if (not ok) { break; }
+    m -= (m * u) * u.transpose();
+    ok = fseek(f, offset, SEEK_SET) == 0 and
+         fwrite(m.data(), sizeof(float) * cols, n, f) == n;
+  }
+  ok = (fclose(f) == 0) and ok;
+  KOAN_ASSERT(ok, "Could not update matrix '" + path + "'!");
+}
+
+} // namespace koan
+
+#endif
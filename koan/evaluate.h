@@ -0,0 +1,337 @@
+/*
+** Copyright 2020 Bloomberg Finance L.P.
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef KOAN_EVALUATE_H
+#define KOAN_EVALUATE_H
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <numeric>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "def.h"
+#include "indexmap.h"
+#include "neighbors.h"
+#include "reader.h"
+#include "util.h"
+
+namespace koan {
+
+/// Analogy query a : b :: c : d, where d is to be predicted.
+struct Analogy {
+  Word a, b, c, d;
+};
+
+/// Analogy queries of a section (": name" lines in word2vec format).
+struct AnalogySection {
+  std::string name;
+  std::vector<Analogy> queries;
+  size_t skipped = 0; // queries with a word out of (restricted) vocabulary
+};
+
+/// Accuracies of a section of analogy queries.
+struct AnalogyResult {
+  std::string name;
+  size_t total = 0;
+  size_t skipped = 0;
+  size_t correct_add = 0; // by 3CosAdd
+  size_t correct_mul = 0; // by 3CosMul
+};
+
+/// Pair of words with a gold similarity score.
+struct SimilarityPair {
+  Word a, b;
+  Real gold;
+};
+
+/// Split a line on spaces, tabs and commas.
+inline std::vector<std::string_view> eval_tokens(std::string_view line) {
+  std::vector<std::string_view> tokens;
+  size_t i = 0;
+  auto is_sep = [](char c) {
+    return c == ' ' or c == '\t' or c == ',' or c == '\r';
+  };
+  while (i < line.size()) {
+    while (i < line.size() and is_sep(line[i])) { i++; }
+    size_t j = i;
+    while (j < line.size() and not is_sep(line[j])) { j++; }
+    if (j > i) { tokens.push_back(line.substr(i, j - i)); }
+    i = j;
+  }
+  return tokens;
+}
+
+/// Look up a word, falling back to its (ASCII) lowercased form, since
+/// evaluation sets are often capitalized while corpora are lowercased.
+///
+/// @returns word index, or -1 if the word is not in the vocabulary
+inline long long eval_lookup(const IndexMap<std::string_view>& word_map,
+                             std::string_view word) {
+  if (word_map.has(word)) { return word_map.lookup(word); }
+  std::string lower(word);
+  std::transform(lower.begin(), lower.end(), lower.begin(), [](char c) {
+    return std::tolower(static_cast<unsigned char>(c));
+  });
+  if (word_map.has(lower)) { return word_map.lookup(lower); }
+  return -1;
+}
+
+/// Read analogy queries in the format of word2vec's questions-words.txt, i.e.
+/// "a b c d" lines grouped under ": section" lines.
+///
+/// @param[in] path path to analogy file
+/// @param[in] word_map vocabulary
+/// @param[in] restrict only use the restrict most frequent words, queries
+/// with any other word are skipped
+/// @param[in] read_mode how to read the file, see readlines()
+inline std::vector<AnalogySection>
+read_analogies(const std::string& path,
+               const IndexMap<std::string_view>& word_map,
+               size_t restrict,
+               const std::string& read_mode = "auto") {
+  std::vector<AnalogySection> sections;
+  readlines(
+      path,
+      [&](const std::string_view& line) {
+        auto tokens = eval_tokens(line);
+        if (tokens.empty()) { return; }
+        if (tokens[0][0] == ':') {
+          auto name = line.substr(line.find(':') + 1);
+          while (not name.empty() and name.front() == ' ') {
+            name.remove_prefix(1);
+          }
+          sections.emplace_back();
+          sections.back().name = std::string(name);
+          return;
+        }
+        if (tokens.size() != 4) { return; }
+        if (sections.empty()) { sections.emplace_back(); }
+        auto& section = sections.back();
+        Word ids[4];
+        for (size_t i = 0; i < 4; i++) {
+          auto id = eval_lookup(word_map, tokens[i]);
+          if (id < 0 or size_t(id) >= restrict) {
+            section.skipped++;
+            return;
+          }
+          ids[i] = id;
+        }
+        section.queries.push_back({ids[0], ids[1], ids[2], ids[3]});
+      },
+      read_mode,
+      false);
+  return sections;
+}
+
+/// Read word similarity pairs, one "word1 word2 score" per line (space, tab or
+/// comma separated, as in WordSim353 or SimLex-999). Lines whose last field is
+/// not a number, such as headers, are ignored.
+///
+/// @param[in] path path to similarity file
+/// @param[in] word_map vocabulary
+/// @param[out] skipped number of pairs with a word out of vocabulary
+/// @param[in] read_mode how to read the file, see readlines()
+inline std::vector<SimilarityPair>
+read_similarities(const std::string& path,
+                  const IndexMap<std::string_view>& word_map,
+                  size_t& skipped,
+                  const std::string& read_mode = "auto") {
+  std::vector<SimilarityPair> pairs;
+  skipped = 0;
+  readlines(
+      path,
+      [&](const std::string_view& line) {
+        auto tokens = eval_tokens(line);
+        if (tokens.size() < 3) { return; }
+        std::string score(tokens.back());
+        char* end;
+        Real gold = std::strtod(score.c_str(), &end);
+        if (end == score.c_str() or *end != '\0') { return; }
+        auto a = eval_lookup(word_map, tokens[0]);
+        auto b = eval_lookup(word_map, tokens[1]);
+        if (a < 0 or b < 0) {
+          skipped++;
+          return;
+        }
+        pairs.push_back({Word(a), Word(b), gold});
+      },
+      read_mode,
+      false);
+  return pairs;
+}
+
+/// Answer analogy queries by 3CosAdd (Mikolov et al., 2013) and 3CosMul (Levy
+/// & Goldberg, 2014) over the rows of a normalized matrix, excluding the query
+/// words from the answers.
+///
+/// Queries are answered in blocks: similarities of a, b and c of each query in
+/// a block to every candidate are computed by three matrix-matrix products,
+/// and blocks are spread over threads.
+///
+/// @param[in] m candidate embeddings with unit norm rows, e.g. the restricted
+/// vocabulary from normalized_rows(). All query words must be rows of m.
+/// @param[in] sections analogy queries
+/// @param[in] threads number of threads to use
+/// @param[in] block number of queries in each block
+inline std::vector<AnalogyResult>
+evaluate_analogies(const RowMatrix& m,
+                   const std::vector<AnalogySection>& sections,
+                   unsigned threads = 1,
+                   size_t block = 64) {
+  std::vector<const Analogy*> queries;
+  std::vector<size_t> section_of;
+  std::vector<AnalogyResult> results(sections.size());
+  for (size_t s = 0; s < sections.size(); s++) {
+    results[s].name = sections[s].name;
+    results[s].skipped = sections[s].skipped;
+    results[s].total = sections[s].queries.size();
+    for (auto& q : sections[s].queries) {
+      queries.push_back(&q);
+      section_of.push_back(s);
+    }
+  }
+
+  const size_t n = queries.size(), dim = m.cols();
+  const Word rows = m.rows();
+  std::vector<uint8_t> correct_add(n, 0), correct_mul(n, 0);
+  std::vector<RowMatrix> qa(threads), qb(threads), qc(threads); // per thread
+  std::vector<RowMatrix> sa(threads), sb(threads), sc(threads); // per thread
+
+  parallel_for(
+      0,
+      (n + block - 1) / block,
+      [&](size_t bi, size_t tid) {
+        const size_t begin = bi * block, size = std::min(block, n - begin);
+        auto &a = qa[tid], &b = qb[tid], &c = qc[tid];
+        a.resize(size, dim);
+        b.resize(size, dim);
+        c.resize(size, dim);
+        for (size_t i = 0; i < size; i++) {
+          a.row(i) = m.row(queries[begin + i]->a);
+          b.row(i) = m.row(queries[begin + i]->b);
+          c.row(i) = m.row(queries[begin + i]->c);
+        }
+        sa[tid].noalias() = a * m.transpose();
+        sb[tid].noalias() = b * m.transpose();
+        sc[tid].noalias() = c * m.transpose();
+
+        for (size_t i = 0; i < size; i++) {
+          auto& q = *queries[begin + i];
+          const float* ra = sa[tid].data() + i * rows;
+          const float* rb = sb[tid].data() + i * rows;
+          const float* rc = sc[tid].data() + i * rows;
+          float best_add = -std::numeric_limits<float>::infinity();
+          float best_mul = best_add;
+          Word arg_add = 0, arg_mul = 0;
+          for (Word j = 0; j < rows; j++) {
+            if (j == q.a or j == q.b or j == q.c) { continue; }
+            float add = rb[j] - ra[j] + rc[j];
+            // Shift cosines to [0, 1] as in Levy & Goldberg
+            float mul = ((rb[j] + 1) * (rc[j] + 1) / 4) /
+                        ((ra[j] + 1) / 2 + 1e-3f);
+            if (add > best_add) {
+              best_add = add;
+              arg_add = j;
+            }
+            if (mul > best_mul) {
+              best_mul = mul;
+              arg_mul = j;
+            }
+          }
+          correct_add[begin + i] = arg_add == q.d;
+          correct_mul[begin + i] = arg_mul == q.d;
+        }
+      },
+      threads);
+
+  for (size_t i = 0; i < n; i++) {
+    results[section_of[i]].correct_add += correct_add[i];
+    results[section_of[i]].correct_mul += correct_mul[i];
+  }
+  return results;
+}
+
+/// Rank values, giving tied values the average of their ranks.
+inline std::vector<Real> fractional_ranks(const std::vector<Real>& values) {
+  std::vector<size_t> order(values.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(), [&](size_t i, size_t j) {
+    return values[i] < values[j];
+  });
+  std::vector<Real> ranks(values.size());
+  for (size_t i = 0; i < order.size();) {
+    size_t j = i;
+    while (j < order.size() and values[order[j]] == values[order[i]]) { j++; }
+    for (size_t k = i; k < j; k++) { ranks[order[k]] = (i + j - 1) / 2.; }
+    i = j;
+  }
+  return ranks;
+}
+
+/// Spearman rank correlation of two lists of values.
+///
+/// @returns correlation, 0 if there are fewer than two values
+inline Real rank_correlation(const std::vector<Real>& xs,
+                             const std::vector<Real>& ys) {
+  if (xs.size() < 2) { return 0; }
+  auto x = fractional_ranks(xs), y = fractional_ranks(ys);
+  Real mean = (x.size() - 1) / 2.;
+  Real cov = 0, var_x = 0, var_y = 0;
+  for (size_t i = 0; i < x.size(); i++) {
+    cov += (x[i] - mean) * (y[i] - mean);
+    var_x += (x[i] - mean) * (x[i] - mean);
+    var_y += (y[i] - mean) * (y[i] - mean);
+  }
+  return var_x > 0 and var_y > 0 ? cov / std::sqrt(var_x * var_y) : 0;
+}
+
+/// Spearman rank correlation of cosine similarities of word pairs with their
+/// gold scores.
+///
+/// @param[in] table word embeddings
+/// @param[in] pairs word pairs with gold scores
+/// @returns correlation, 0 if there are fewer than two pairs
+inline Real evaluate_similarity(const Table& table,
+                                const std::vector<SimilarityPair>& pairs) {
+  std::vector<Real> sims, golds;
+  for (auto& p : pairs) {
+    Real norms = table[p.a].norm() * table[p.b].norm();
+    sims.push_back(norms > 0 ? table[p.a].dot(table[p.b]) / norms : 0);
+    golds.push_back(p.gold);
+  }
+  return rank_correlation(sims, golds);
+}
+
+/// Same as above, over the rows of a matrix.
+inline Real evaluate_similarity(const RowMatrix& m,
+                                const std::vector<SimilarityPair>& pairs) {
+  std::vector<Real> sims, golds;
+  for (auto& p : pairs) {
+    Real norms = m.row(p.a).norm() * m.row(p.b).norm();
+    sims.push_back(norms > 0 ? m.row(p.a).dot(m.row(p.b)) / norms : 0);
+    golds.push_back(p.gold);
+  }
+  return rank_correlation(sims, golds);
+}
+
+} // namespace koan
+
+#endif
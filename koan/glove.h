@@ -0,0 +1,150 @@
+/*
+** Copyright 2020 Bloomberg Finance L.P.
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef KOAN_GLOVE_H
+#define KOAN_GLOVE_H
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include "cooccur.h"
+#include "def.h"
+#include "util.h"
+
+namespace koan {
+
+/// Trains GloVe embeddings by AdaGrad on the weighted least squares objective
+/// over the nonzeros of a co-occurrence matrix, following the reference
+/// implementation: https://github.com/stanfordnlp/GloVe/blob/master/src/glove.c
+class GloveTrainer {
+ public:
+  struct Params {
+    // Co-occurrence count at which the weighting function saturates
+    Real x_max = 100;
+    // Exponent of the weighting function
+    Real alpha = 0.75;
+    // Number of worker threads, one shard of nonzeros each
+    unsigned threads = 8;
+  };
+
+ private:
+  Params params_;
+  Table& table_; // Word embeddings
+  Table& ctx_;   // Context embeddings
+  std::vector<Real> bias_, ctx_bias_;
+  // Sums of squared (scaled) gradients for AdaGrad
+  Table grad_sq_, ctx_grad_sq_;
+  std::vector<Real> bias_grad_sq_, ctx_bias_grad_sq_;
+  std::vector<Vector> scratch_;    // one per thread
+  std::vector<Vector> scratch2_;   // one per thread
+  std::vector<std::mt19937> gens_; // one per thread
+
+ public:
+  /// Create trainer. Biases start at zero.
+  ///
+  /// @param[in] params training parameters
+  /// @param[in] table initial word embeddings
+  /// @param[in] ctx initial context embeddings
+  GloveTrainer(Params params, Table& table, Table& ctx)
+      : params_(params),
+        table_(table),
+        ctx_(ctx),
+        bias_(table.size(), 0),
+        ctx_bias_(ctx.size(), 0),
+        bias_grad_sq_(table.size(), 1),
+        ctx_bias_grad_sq_(ctx.size(), 1),
+        scratch_(params_.threads),
+        scratch2_(params_.threads) {
+    KOAN_ASSERT(table_.size() == ctx_.size());
+    for (auto& v : table_) { grad_sq_.push_back(Vector::Ones(v.size())); }
+    for (auto& v : ctx_) { ctx_grad_sq_.push_back(Vector::Ones(v.size())); }
+    for (unsigned i = 0; i < params_.threads; i++) {
+      gens_.emplace_back(123457 + i);
+    }
+  }
+
+  /// Take an AdaGrad step on a single nonzero of the co-occurrence matrix.
+  ///
+  /// @param[in] c nonzero cell
+  /// @param[in] tid thread index
+  /// @param[in] lr learning rate
+  /// @returns weighted squared loss of the cell before the update
+  Real update(const Cooccurrence& c, size_t tid, Real lr) {
+    auto& w = table_[c.row];
+    auto& cw = ctx_[c.col];
+    Real diff = w.dot(cw) + bias_[c.row] + ctx_bias_[c.col] - std::log(c.value);
+    Real weight = c.value > params_.x_max
+                      ? 1_R
+                      : std::pow(c.value / params_.x_max, params_.alpha);
+    Real fdiff = weight * diff;
+    Real loss = 0.5_R * fdiff * diff;
+    fdiff *= lr;
+
+    auto& w_grad = scratch_[tid];
+    auto& cw_grad = scratch2_[tid];
+    w_grad = cw * fdiff;
+    cw_grad = w * fdiff;
+    w.array() -= w_grad.array() / grad_sq_[c.row].array().sqrt();
+    cw.array() -= cw_grad.array() / ctx_grad_sq_[c.col].array().sqrt();
+    grad_sq_[c.row].array() += w_grad.array().square();
+    ctx_grad_sq_[c.col].array() += cw_grad.array().square();
+
+    bias_[c.row] -= fdiff / std::sqrt(bias_grad_sq_[c.row]);
+    ctx_bias_[c.col] -= fdiff / std::sqrt(ctx_bias_grad_sq_[c.col]);
+    bias_grad_sq_[c.row] += fdiff * fdiff;
+    ctx_bias_grad_sq_[c.col] += fdiff * fdiff;
+
+    return loss;
+  }
+
+  /// Train for one epoch, each thread going over its own shard of nonzeros in
+  /// a random order.
+  ///
+  /// @param[in,out] shards nonzeros of the co-occurrence matrix. Shuffled in
+  /// place.
+  /// @param[in] lr learning rate
+  /// @returns average loss over nonzeros
+  Real train_epoch(std::vector<std::vector<Cooccurrence>>& shards, Real lr) {
+    std::vector<double> losses(params_.threads, 0);
+    parallel_for_partitioned(
+        0,
+        shards.size(),
+        [&](size_t s, size_t tid) {
+          auto& shard = shards[s];
+          std::shuffle(shard.begin(), shard.end(), gens_[tid]);
+          for (auto& c : shard) { losses[tid] += update(c, tid, lr); }
+        },
+        params_.threads);
+
+    size_t nnz = 0;
+    for (auto& shard : shards) { nnz += shard.size(); }
+    double loss = 0;
+    for (auto l : losses) { loss += l; }
+    return nnz > 0 ? loss / nnz : 0;
+  }
+
+  /// Sum context embeddings into word embeddings, which is what GloVe saves by
+  /// default.
+  void finalize() {
+    for (size_t i = 0; i < table_.size(); i++) { table_[i] += ctx_[i]; }
+  }
+};
+
+} // namespace koan
+
+#endif
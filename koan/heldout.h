@@ -0,0 +1,146 @@
+/*
+** Copyright 2020 Bloomberg Finance L.P.
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef KOAN_HELDOUT_H
+#define KOAN_HELDOUT_H
+
+#include <chrono>
+#include <future>
+#include <vector>
+
+#include "def.h"
+#include "huffman.h"
+#include "memory.h"
+#include "subword.h"
+#include "trace.h"
+#include "trainer.h"
+
+namespace koan {
+
+/// Computes the loss over held-out sentences in a background thread, on a
+/// snapshot of the embeddings, so that training does not need to pause (or
+/// race with the evaluation) beyond the time it takes to copy the tables.
+///
+/// Only a single evaluation can be in flight at once.
+class HeldoutEvaluator {
+ private:
+  Sentences sents_;
+  bool cbow_;
+  Table table_;     // Snapshot of input embeddings
+  Table ctx_;       // Snapshot of output embeddings
+  Trainer trainer_; // Bound to the snapshot, only used to compute the loss
+  std::future<Real> pending_;
+
+  static Trainer::Params single_threaded(Trainer::Params params) {
+    params.threads = 1;
+    return params;
+  }
+
+ public:
+  /// Create evaluator. Parameters are the same as the ones of the Trainer
+  /// being evaluated.
+  ///
+  /// @param[in] cbow true if using CBOW loss, else SG
+  /// @param[in] params training parameters
+  /// @param[in] table input embeddings, to size the snapshot
+  /// @param[in] ctx output embeddings, to size the snapshot
+  /// @param[in] filter_probs probability of skipping each word
+  /// @param[in] neg_probs negative sampling probability over vocabulary
+  /// @param[in] tree Huffman tree over vocabulary if params.hs
+  /// @param[in] subwords character n-grams of the vocabulary, if used
+  HeldoutEvaluator(bool cbow,
+                   Trainer::Params params,
+                   const Table& table,
+                   const Table& ctx,
+                   const std::vector<Real>& filter_probs,
+                   const std::vector<Real>& neg_probs,
+                   HuffmanTree tree,
+                   Subwords subwords)
+      : cbow_(cbow),
+        table_(table),
+        ctx_(ctx),
+        trainer_(single_threaded(params),
+                 table_,
+                 ctx_,
+                 filter_probs,
+                 neg_probs,
+                 std::move(tree),
+                 std::move(subwords)) {}
+
+  ~HeldoutEvaluator() {
+    if (pending_.valid()) { pending_.wait(); }
+  }
+
+  /// Add a sentence to the held-out set. Should not be called while an
+  /// evaluation is in flight.
+  void add(const Sentence& sent) { sents_.push_back(sent); }
+
+  size_t size() const { return sents_.size(); }
+
+  /// @returns heap memory of held-out sentences and snapshots
+  size_t bytes() const {
+    return heap_bytes(sents_) + heap_bytes(table_) + heap_bytes(ctx_) +
+           trainer_.sampler_bytes();
+  }
+
+  /// Whether an evaluation was started and its result not yet retrieved.
+  bool pending() const { return pending_.valid(); }
+
+  /// Whether the result of the evaluation in flight is available.
+  bool ready() const {
+    return pending_.valid() and pending_.wait_for(std::chrono::seconds(0)) ==
+                                    std::future_status::ready;
+  }
+
+  /// Snapshot the embeddings and start computing the held-out loss in the
+  /// background. Embeddings must not be modified during the call.
+  ///
+  /// @param[in] table input embeddings
+  /// @param[in] ctx output embeddings
+  void start(const Table& table, const Table& ctx) {
+    KOAN_ASSERT(not pending_.valid(), "An evaluation is already in flight!");
+    KOAN_TRACE_SCOPE("heldout snapshot");
+    for (size_t i = 0; i < table.size(); i++) { table_[i] = table[i]; }
+    for (size_t i = 0; i < ctx.size(); i++) { ctx_[i] = ctx[i]; }
+    pending_ = std::async(std::launch::async,
+                          [this]() {
+                            KOAN_TRACE_SCOPE("heldout loss");
+                            return trainer_.loss(sents_, cbow_);
+                          });
+  }
+
+  /// Wait for the evaluation in flight and return its result.
+  ///
+  /// @returns average loss per held-out center word
+  Real get() {
+    KOAN_ASSERT(pending_.valid(), "No evaluation in flight!");
+    return pending_.get();
+  }
+
+  /// Copy the last evaluated snapshot back into the embeddings, e.g. to keep
+  /// the best model when stopping early.
+  ///
+  /// @param[out] table input embeddings
+  /// @param[out] ctx output embeddings
+  void restore(Table& table, Table& ctx) const {
+    for (size_t i = 0; i < table.size(); i++) { table[i] = table_[i]; }
+    for (size_t i = 0; i < ctx.size(); i++) { ctx[i] = ctx_[i]; }
+  }
+};
+
+} // namespace koan
+
+#endif
@@ -0,0 +1,492 @@
+/*
+** Copyright 2020 Bloomberg Finance L.P.
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef KOAN_HNSW_H
+#define KOAN_HNSW_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "def.h"
+#include "util.h"
+
+namespace koan {
+
+/// Hierarchical navigable small world graph (Malkov & Yashunin, 2016) for
+/// approximate nearest neighbor search by cosine similarity.
+///
+/// The graph is kept in a few flat arrays which are written to disk as is, so
+/// that a saved index can be memory mapped and queried without parsing:
+///
+///   Header
+///   uint64  upper_offsets[size + 1] start of each node's upper level links
+///   float   vectors[size * dim]     unit normalized vectors
+///   uint32  level0[size * (1 + 2m)] (count, neighbors...) of each node
+///   uint32  upper[upper_offsets[size]]
+///
+/// Node i has (upper_offsets[i + 1] - upper_offsets[i]) / (1 + m) levels above
+/// level 0, each stored as (count, neighbors...). Node ids are row indices of
+/// the indexed table, i.e. line order of the saved embeddings.
+class HnswGraph {
+ public:
+  struct Header {
+    char magic[8]; // "KOANHNSW"
+    uint32_t version;
+    uint32_t dim;
+    uint64_t size;
+    uint32_t m;
+    int32_t max_level;
+    uint32_t entry;
+    uint32_t reserved;
+  };
+
+  static constexpr char MAGIC[8] = {'K', 'O', 'A', 'N', 'H', 'N', 'S', 'W'};
+  static constexpr uint32_t VERSION = 1;
+
+  /// (distance, node) where distance is 1 - cosine similarity
+  using Candidate = std::pair<float, Word>;
+
+ protected:
+  size_t size_ = 0;
+  unsigned dim_ = 0;
+  unsigned m_ = 0;
+  int max_level_ = -1;
+  Word entry_ = 0;
+  const uint64_t* upper_offsets_ = nullptr;
+  const float* vectors_ = nullptr;
+  const uint32_t* level0_ = nullptr;
+  const uint32_t* upper_ = nullptr;
+  std::mutex* locks_ = nullptr; // one per node, only set while building
+
+  size_t max_links(unsigned level) const { return level == 0 ? 2 * m_ : m_; }
+
+  /// (count, neighbors...) of node at level
+  const uint32_t* links(Word node, unsigned level) const {
+    if (level == 0) { return level0_ + size_t(node) * (1 + 2 * m_); }
+    return upper_ + upper_offsets_[node] + size_t(level - 1) * (1 + m_);
+  }
+
+  float distance(const float* a, const float* b) const {
+    float dot = 0;
+    for (unsigned i = 0; i < dim_; i++) { dot += a[i] * b[i]; }
+    return 1 - dot;
+  }
+
+  float distance(const float* q, Word node) const {
+    return distance(q, vectors_ + size_t(node) * dim_);
+  }
+
+  template <typename F>
+  void for_each_link(Word node, unsigned level, F f) const {
+    const uint32_t* l = links(node, level);
+    if (not locks_) {
+      for (uint32_t i = 1; i <= l[0]; i++) { f(l[i]); }
+      return;
+    }
+    static thread_local std::vector<Word> copy;
+    {
+      std::lock_guard<std::mutex> lock(locks_[node]);
+      copy.assign(l + 1, l + 1 + l[0]);
+    }
+    for (auto n : copy) { f(n); }
+  }
+
+  /// Walk greedily towards q on a single level.
+  Word greedy(const float* q, Word entry, unsigned level) const {
+    Word cur = entry;
+    float cur_dist = distance(q, cur);
+    for (bool changed = true; changed;) {
+      changed = false;
+      Word next = cur;
+      for_each_link(cur, level, [&](Word n) {
+        float d = distance(q, n);
+        if (d < cur_dist) {
+          cur_dist = d;
+          next = n;
+          changed = true;
+        }
+      });
+      cur = next;
+    }
+    return cur;
+  }
+
+  /// Best first search on a single level.
+  ///
+  /// @returns up to ef closest nodes found, closest first
+  std::vector<Candidate> search_layer(const float* q,
+                                      Word entry,
+                                      size_t ef,
+                                      unsigned level) const {
+    static thread_local std::vector<uint32_t> visited;
+    static thread_local uint32_t mark = 0;
+    if (visited.size() != size_ or ++mark == 0) {
+      visited.assign(size_, 0);
+      mark = 1;
+    }
+
+    std::priority_queue<Candidate> top; // farthest on top
+    std::priority_queue<Candidate,
+                        std::vector<Candidate>,
+                        std::greater<Candidate>>
+        frontier; // closest on top
+    float d = distance(q, entry);
+    top.emplace(d, entry);
+    frontier.emplace(d, entry);
+    visited[entry] = mark;
+
+    while (not frontier.empty()) {
+      auto [dist, node] = frontier.top();
+      if (dist > top.top().first and top.size() >= ef) { break; }
+      frontier.pop();
+      for_each_link(node, level, [&](Word n) {
+        if (visited[n] == mark) { return; }
+        visited[n] = mark;
+        float dn = distance(q, n);
+        if (top.size() < ef or dn < top.top().first) {
+          frontier.emplace(dn, n);
+          top.emplace(dn, n);
+          if (top.size() > ef) { top.pop(); }
+        }
+      });
+    }
+
+    std::vector<Candidate> result(top.size());
+    for (size_t i = result.size(); i-- > 0;) {
+      result[i] = top.top();
+      top.pop();
+    }
+    return result;
+  }
+
+  /// Search all levels for the closest nodes to a normalized query.
+  std::vector<Candidate> search_normalized(const float* q,
+                                           size_t k,
+                                           size_t ef) const {
+    if (size_ == 0) { return {}; }
+    Word cur = entry_;
+    for (int level = max_level_; level > 0; level--) {
+      cur = greedy(q, cur, level);
+    }
+    auto result = search_layer(q, cur, std::max(ef, k), 0);
+    if (result.size() > k) { result.resize(k); }
+    return result;
+  }
+
+ public:
+  size_t size() const { return size_; }
+  unsigned dim() const { return dim_; }
+
+  /// Unit normalized vector of a node
+  const float* vector(Word node) const {
+    return vectors_ + size_t(node) * dim_;
+  }
+
+  /// Approximate k nearest neighbors of a query vector by cosine similarity.
+  ///
+  /// @param[in] query query vector of dim() entries, need not be normalized
+  /// @param[in] k number of neighbors
+  /// @param[in] ef size of the search beam, larger is slower but more accurate
+  /// @returns (node, cosine similarity) pairs, most similar first
+  std::vector<std::pair<Word, float>>
+  search(const float* query, size_t k, size_t ef = 64) const {
+    static thread_local std::vector<float> q;
+    q.assign(query, query + dim_);
+    float norm = 0;
+    for (auto x : q) { norm += x * x; }
+    norm = std::sqrt(norm);
+    if (norm > 0) {
+      for (auto& x : q) { x /= norm; }
+    }
+    std::vector<std::pair<Word, float>> result;
+    for (auto [d, n] : search_normalized(q.data(), k, ef)) {
+      result.emplace_back(n, 1 - d);
+    }
+    return result;
+  }
+
+  /// Approximate k nearest neighbors of an indexed node, excluding itself.
+  ///
+  /// @param[in] node query node
+  /// @param[in] k number of neighbors
+  /// @param[in] ef size of the search beam
+  /// @returns (node, cosine similarity) pairs, most similar first
+  std::vector<std::pair<Word, float>>
+  neighbors(Word node, size_t k, size_t ef = 64) const {
+    std::vector<std::pair<Word, float>> result;
+    for (auto [d, n] : search_normalized(vector(node), k + 1, ef)) {
+      if (n != node and result.size() < k) { result.emplace_back(n, 1 - d); }
+    }
+    return result;
+  }
+};
+
+/// Builds an HNSW graph over an embedding table, inserting nodes in parallel
+/// (with a lock per node, as in hnswlib), and saves it.
+class HnswBuilder : public HnswGraph {
+ public:
+  struct Params {
+    // Maximum number of links per node on upper levels, twice that on level 0
+    unsigned m = 16;
+    // Size of the search beam when inserting
+    unsigned ef_construction = 200;
+    unsigned threads = 8;
+    unsigned seed = 12345;
+  };
+
+ private:
+  Params params_;
+  std::vector<uint64_t> upper_offsets_data_;
+  std::vector<float> vectors_data_;
+  std::vector<uint32_t> level0_data_;
+  std::vector<uint32_t> upper_data_;
+  std::unique_ptr<std::mutex[]> node_locks_;
+  std::mutex global_lock_; // guards entry point and max level
+
+  int level(Word node) const {
+    return (upper_offsets_[node + 1] - upper_offsets_[node]) / (1 + m_);
+  }
+
+  uint32_t* mutable_links(Word node, unsigned level) {
+    return const_cast<uint32_t*>(links(node, level));
+  }
+
+  /// Pick up to max neighbors among candidates (closest first), skipping
+  /// the ones that are closer to an already picked neighbor than to the base
+  /// node, so that links spread in different directions.
+  void select(std::vector<Candidate>& candidates, size_t max) const {
+    if (candidates.size() <= max) { return; }
+    std::vector<Candidate> picked;
+    for (auto& c : candidates) {
+      if (picked.size() >= max) { break; }
+      bool good = true;
+      for (auto& p : picked) {
+        if (distance(vector(c.second), p.second) < c.first) {
+          good = false;
+          break;
+        }
+      }
+      if (good) { picked.push_back(c); }
+    }
+    candidates.swap(picked);
+  }
+
+  /// Add a link from node to new_node at level, pruning node's links if full.
+  void connect(Word node, Word new_node, unsigned level) {
+    std::lock_guard<std::mutex> lock(locks_[node]);
+    uint32_t* l = mutable_links(node, level);
+    if (l[0] < max_links(level)) {
+      l[++l[0]] = new_node;
+      return;
+    }
+    const float* v = vector(node);
+    std::vector<Candidate> candidates{{distance(v, new_node), new_node}};
+    for (uint32_t i = 1; i <= l[0]; i++) {
+      candidates.emplace_back(distance(v, l[i]), l[i]);
+    }
+    std::sort(candidates.begin(), candidates.end());
+    select(candidates, max_links(level));
+    l[0] = candidates.size();
+    for (size_t i = 0; i < candidates.size(); i++) {
+      l[i + 1] = candidates[i].second;
+    }
+  }
+
+  void insert(Word node) {
+    const int node_level = level(node);
+    std::unique_lock<std::mutex> global(global_lock_);
+    const int max_level = max_level_;
+    Word cur = entry_;
+    // Keep holding the global lock if node becomes the new entry point
+    if (node_level <= max_level) { global.unlock(); }
+
+    const float* q = vector(node);
+    for (int l = max_level; l > node_level; l--) { cur = greedy(q, cur, l); }
+    for (int l = std::min(node_level, max_level); l >= 0; l--) {
+      auto candidates = search_layer(q, cur, params_.ef_construction, l);
+      cur = candidates.front().second;
+      select(candidates, m_);
+      {
+        std::lock_guard<std::mutex> lock(locks_[node]);
+        uint32_t* links = mutable_links(node, l);
+        links[0] = candidates.size();
+        for (size_t i = 0; i < candidates.size(); i++) {
+          links[i + 1] = candidates[i].second;
+        }
+      }
+      for (auto& c : candidates) { connect(c.second, node, l); }
+    }
+
+    if (node_level > max_level) {
+      entry_ = node;
+      max_level_ = node_level;
+    }
+  }
+
+ public:
+  /// Build the index.
+  ///
+  /// @param[in] table embedding table
+  /// @param[in] size index the first size rows of table (e.g. to leave out
+  /// subword buckets)
+  /// @param[in] params build parameters
+  HnswBuilder(const Table& table, size_t size, Params params)
+      : params_(params) {
+    KOAN_ASSERT(size <= table.size());
+    KOAN_ASSERT(params_.m > 1, "HNSW needs at least 2 links per node!");
+    size_ = size;
+    dim_ = size > 0 ? table[0].size() : 0;
+    m_ = params_.m;
+
+    // Draw levels up front, so that all links can be allocated once
+    std::mt19937 gen(params_.seed);
+    std::uniform_real_distribution<double> uniform(0., 1.);
+    const double mult = 1 / std::log(double(m_));
+    upper_offsets_data_.assign(size_ + 1, 0);
+    for (size_t i = 0; i < size_; i++) {
+      size_t levels = -std::log(1 - uniform(gen)) * mult;
+      upper_offsets_data_[i + 1] = upper_offsets_data_[i] + levels * (1 + m_);
+    }
+    vectors_data_.resize(size_ * dim_);
+    level0_data_.assign(size_ * (1 + 2 * m_), 0);
+    upper_data_.assign(upper_offsets_data_[size_], 0);
+    node_locks_ = std::make_unique<std::mutex[]>(size_);
+
+    upper_offsets_ = upper_offsets_data_.data();
+    vectors_ = vectors_data_.data();
+    level0_ = level0_data_.data();
+    upper_ = upper_data_.data();
+    locks_ = node_locks_.get();
+
+    parallel_for(
+        0,
+        size_,
+        [&](size_t i, size_t) {
+          float* v = vectors_data_.data() + i * dim_;
+          Real norm = table[i].norm();
+          for (unsigned j = 0; j < dim_; j++) {
+            v[j] = norm > 0 ? table[i][j] / norm : 0;
+          }
+        },
+        params_.threads);
+
+    if (size_ == 0) { return; }
+    entry_ = 0;
+    max_level_ = level(0);
+    parallel_for(
+        1, size_, [&](size_t i, size_t) { insert(i); }, params_.threads);
+    locks_ = nullptr;
+  }
+
+  /// Save the index in a layout that HnswIndex can memory map.
+  ///
+  /// @param[in] path output path
+  void save(const std::string& path) const {
+    FILE* out = fopen(path.c_str(), "wb");
+    KOAN_ASSERT(out, "Could not open '" + path + "' to save index!");
+    Header header{};
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.dim = dim_;
+    header.size = size_;
+    header.m = m_;
+    header.max_level = max_level_;
+    header.entry = entry_;
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+    auto write = [&](auto& v) {
+      using T = typename std::decay_t<decltype(v)>::value_type;
+      ok = ok and fwrite(v.data(), sizeof(T), v.size(), out) == v.size();
+    };
+    write(upper_offsets_data_);
+    write(vectors_data_);
+    write(level0_data_);
+    write(upper_data_);
+    ok = (fclose(out) == 0) and ok;
+    KOAN_ASSERT(ok, "Could not write index to '" + path + "'!");
+  }
+};
+
+/// Read-only HNSW index memory mapped from a file saved by HnswBuilder.
+class HnswIndex : public HnswGraph {
+ private:
+  void* data_ = nullptr;
+  size_t bytes_ = 0;
+
+ public:
+  /// Map an index file.
+  ///
+  /// @param[in] path path to the index
+  HnswIndex(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    KOAN_ASSERT(fd >= 0, "Could not open index '" + path + "'!");
+    struct stat st;
+    fstat(fd, &st);
+    bytes_ = st.st_size;
+    KOAN_ASSERT(bytes_ >= sizeof(Header), "Invalid index '" + path + "'!");
+    data_ = mmap(nullptr, bytes_, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    KOAN_ASSERT(data_ != MAP_FAILED, "Could not map index '" + path + "'!");
+
+    auto header = static_cast<const Header*>(data_);
+    KOAN_ASSERT(std::memcmp(header->magic, MAGIC, sizeof(MAGIC)) == 0 and
+                    header->version == VERSION,
+                "Invalid index '" + path + "'!");
+    size_ = header->size;
+    dim_ = header->dim;
+    m_ = header->m;
+    max_level_ = header->max_level;
+    entry_ = header->entry;
+
+    size_t expected = sizeof(Header) + (size_ + 1) * sizeof(uint64_t) +
+                      size_ * dim_ * sizeof(float) +
+                      size_ * (1 + 2 * m_) * sizeof(uint32_t);
+    KOAN_ASSERT(bytes_ >= expected, "Truncated index '" + path + "'!");
+    auto bytes = static_cast<const char*>(data_) + sizeof(Header);
+    upper_offsets_ = reinterpret_cast<const uint64_t*>(bytes);
+    vectors_ = reinterpret_cast<const float*>(upper_offsets_ + size_ + 1);
+    level0_ = reinterpret_cast<const uint32_t*>(vectors_ + size_ * dim_);
+    upper_ = level0_ + size_ * (1 + 2 * m_);
+    KOAN_ASSERT(bytes_ == expected + upper_offsets_[size_] * sizeof(uint32_t),
+                "Truncated index '" + path + "'!");
+  }
+
+  HnswIndex(const HnswIndex&) = delete;
+  HnswIndex& operator=(const HnswIndex&) = delete;
+
+  ~HnswIndex() {
+    if (data_) { munmap(data_, bytes_); }
+  }
+};
+
+} // namespace koan
+
+#endif
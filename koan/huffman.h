@@ -0,0 +1,140 @@
+/*
+** Copyright 2020 Bloomberg Finance L.P.
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef KOAN_HUFFMAN_H
+#define KOAN_HUFFMAN_H
+
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <vector>
+
+#include "def.h"
+#include "util.h"
+
+namespace koan {
+
+/// Huffman tree over the vocabulary for hierarchical softmax.
+///
+/// Inner nodes are numbered in breadth-first order starting from the root
+/// (root == 0), so the top of the tree, which is visited by every word, sits in
+/// the first few rows of the inner node table. The path of each word (inner
+/// node and branch taken at that node) is stored contiguously in a single
+/// array, indexed by per-word offsets.
+class HuffmanTree {
+ public:
+  /// A single step on the path from the root to a word.
+  struct Step {
+    Word node;    // inner node index (BFS order)
+    uint8_t code; // branch taken at this node, 0 (left) or 1 (right)
+  };
+
+ private:
+  std::vector<size_t> offsets_; // path of word w is steps_[offsets_[w],
+                                // offsets_[w + 1])
+  std::vector<Step> steps_;
+  size_t num_inner_ = 0;
+
+ public:
+  HuffmanTree() : offsets_(1, 0) {}
+
+  /// Build the tree from raw word counts.
+  ///
+  /// @param[in] counts frequency count of each word, indexed by word id.
+  /// Does not need to be sorted.
+  HuffmanTree(const std::vector<unsigned long long>& counts) {
+    const size_t n = counts.size();
+    offsets_.assign(n + 1, 0);
+    if (n < 2) { return; }
+    num_inner_ = n - 1;
+
+    // Nodes 0..n-1 are leaves, n..2n-2 are inner nodes in order of creation.
+    // Since leaves are visited in ascending count order and merged nodes are
+    // created with non-decreasing counts, two queues suffice (as in word2vec).
+    std::vector<Word> leaves(n);
+    std::iota(leaves.begin(), leaves.end(), 0);
+    std::stable_sort(leaves.begin(), leaves.end(), [&](Word a, Word b) {
+      return counts[a] < counts[b];
+    });
+
+    std::vector<unsigned long long> count(2 * n - 1);
+    std::vector<size_t> parent(2 * n - 1, 0);
+    std::vector<uint8_t> branch(2 * n - 1, 0);
+    for (size_t i = 0; i < n; i++) { count[i] = counts[i]; }
+
+    size_t leaf_pos = 0, inner_pos = n;
+    auto pop_min = [&](size_t next_inner) {
+      if (leaf_pos < n and (inner_pos >= next_inner or
+                            count[leaves[leaf_pos]] <= count[inner_pos])) {
+        return size_t(leaves[leaf_pos++]);
+      }
+      return inner_pos++;
+    };
+    for (size_t node = n; node < 2 * n - 1; node++) {
+      size_t min1 = pop_min(node);
+      size_t min2 = pop_min(node);
+      count[node] = count[min1] + count[min2];
+      parent[min1] = parent[min2] = node;
+      branch[min2] = 1;
+    }
+
+    // Relabel inner nodes in BFS order from the root
+    const size_t root = 2 * n - 2;
+    std::vector<size_t> left(n - 1), right(n - 1);
+    for (size_t node = 0; node < 2 * n - 2; node++) {
+      auto& child = branch[node] ? right : left;
+      child[parent[node] - n] = node;
+    }
+    std::vector<Word> bfs_id(n - 1);
+    std::vector<size_t> queue{root};
+    queue.reserve(n - 1);
+    for (size_t head = 0; head < queue.size(); head++) {
+      size_t node = queue[head];
+      bfs_id[node - n] = head;
+      for (size_t child : {left[node - n], right[node - n]}) {
+        if (child >= n) { queue.push_back(child); }
+      }
+    }
+
+    // Collect paths, root first
+    std::vector<size_t> depth(2 * n - 1, 0);
+    for (size_t node = root; node-- > 0;) {
+      depth[node] = depth[parent[node]] + 1;
+    }
+    for (size_t w = 0; w < n; w++) { offsets_[w + 1] = offsets_[w] + depth[w]; }
+    steps_.resize(offsets_[n]);
+    for (size_t w = 0; w < n; w++) {
+      size_t pos = offsets_[w + 1];
+      for (size_t node = w; node != root; node = parent[node]) {
+        steps_[--pos] = Step{bfs_id[parent[node] - n], branch[node]};
+      }
+    }
+  }
+
+  /// Number of inner nodes, i.e. rows needed for the inner node table.
+  size_t num_inner() const { return num_inner_; }
+
+  /// Number of leaves (words).
+  size_t size() const { return offsets_.size() - 1; }
+
+  const Step* path_begin(Word w) const { return steps_.data() + offsets_[w]; }
+  const Step* path_end(Word w) const { return steps_.data() + offsets_[w + 1]; }
+  size_t path_size(Word w) const { return offsets_[w + 1] - offsets_[w]; }
+};
+
+} // namespace koan
+
+#endif
@@ -22,6 +22,7 @@
 #include <vector>
 
 #include "def.h"
+#include "memory.h"
 
 namespace koan {
 
@@ -55,6 +56,9 @@ class IndexMap {
 
   size_t size() const { return i2k_.size(); }
 
+  /// @returns estimated heap memory of the map, including reserved space
+  size_t bytes() const { return heap_bytes(k2i_) + heap_bytes(i2k_); }
+
   void clear() {
     k2i_.clear();
     i2k_.clear();
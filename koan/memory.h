@@ -0,0 +1,198 @@
+/*
+** Copyright 2020 Bloomberg Finance L.P.
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef KOAN_MEMORY_H
+#define KOAN_MEMORY_H
+
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "def.h"
+#include "extern/tblr.h"
+
+namespace koan {
+
+// Estimates of the heap memory owned by containers, from their capacities.
+// Allocator overheads are not included.
+
+template <typename T>
+size_t heap_bytes(const T&) {
+  static_assert(std::is_trivially_copyable_v<T>,
+                "Missing heap_bytes() overload!");
+  return 0;
+}
+
+inline size_t heap_bytes(const std::string& s) {
+  return s.capacity() > 15 ? s.capacity() + 1 : 0; // beyond small strings
+}
+
+inline size_t heap_bytes(const Vector& v) { return v.size() * sizeof(Real); }
+
+template <typename T>
+size_t heap_bytes(const std::vector<T>& v) {
+  size_t bytes = v.capacity() * sizeof(T);
+  if constexpr (not std::is_trivially_copyable_v<T>) {
+    for (auto& x : v) { bytes += heap_bytes(x); }
+  }
+  return bytes;
+}
+
+template <typename K, typename V>
+size_t heap_bytes(const std::unordered_map<K, V>& m) {
+  // bucket array, and a node with a next pointer and cached hash per entry
+  size_t bytes = m.bucket_count() * sizeof(void*) +
+                 m.size() * (sizeof(std::pair<const K, V>) + 2 * sizeof(void*));
+  if constexpr (not std::is_trivially_copyable_v<K> or
+                not std::is_trivially_copyable_v<V>) {
+    for (auto& [k, v] : m) { bytes += heap_bytes(k) + heap_bytes(v); }
+  }
+  return bytes;
+}
+
+/// Tracks the memory of the major data structures, and samples the resident
+/// set size of the process, at phase boundaries, to tell which structure
+/// drives the peak.
+class MemoryLedger {
+ public:
+  struct Sample {
+    std::string phase;         // that just ended
+    size_t rss;                // resident set size
+    size_t peak_rss;           // high water mark of rss so far
+    std::vector<size_t> bytes; // of each subsystem
+  };
+
+ private:
+  std::vector<std::string> names_;
+  std::vector<std::function<size_t()>> bytes_;
+  std::vector<Sample> samples_;
+
+  static double mb(size_t bytes) { return bytes / 1e6; }
+
+  /// @returns value of a "<field>: <n> kB" line of a /proc file in bytes, or
+  /// 0 if not available
+  static size_t proc_bytes(const std::string& path, const std::string& field) {
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line)) {
+      if (line.compare(0, field.size() + 1, field + ":") == 0) {
+        std::istringstream s(line.substr(field.size() + 1));
+        size_t kb = 0;
+        s >> kb;
+        return kb * 1024;
+      }
+    }
+    return 0;
+  }
+
+ public:
+  static size_t rss() { return proc_bytes("/proc/self/status", "VmRSS"); }
+  static size_t peak_rss() { return proc_bytes("/proc/self/status", "VmHWM"); }
+  static size_t available() {
+    return proc_bytes("/proc/meminfo", "MemAvailable");
+  }
+
+  /// Track a subsystem. Its bytes are only computed when sampling.
+  ///
+  /// @param[in] name name of subsystem
+  /// @param[in] bytes returns current memory of subsystem
+  void track(const std::string& name, std::function<size_t()> bytes) {
+    names_.push_back(name);
+    bytes_.push_back(std::move(bytes));
+    for (auto& s : samples_) { s.bytes.push_back(0); }
+  }
+
+  /// Record RSS and the memory of each subsystem at the end of a phase.
+  const Sample& sample(const std::string& phase) {
+    Sample s{phase, rss(), peak_rss(), {}};
+    for (auto& bytes : bytes_) { s.bytes.push_back(bytes()); }
+    samples_.push_back(std::move(s));
+    return samples_.back();
+  }
+
+  const std::vector<Sample>& samples() const { return samples_; }
+
+  /// @returns index of the first sample at which the final peak RSS had been
+  /// reached, i.e. the phase that caused it
+  size_t peak_sample() const {
+    size_t i = 0;
+    while (i + 1 < samples_.size() and
+           samples_[i].peak_rss < samples_.back().peak_rss) {
+      i++;
+    }
+    return i;
+  }
+
+  void print_startup() const {
+    std::cout << "Memory at startup: RSS " << mb(rss()) << " MB, available "
+              << mb(available()) << " MB" << std::endl;
+  }
+
+  /// Print RSS and tracked memory at each sampled phase, and the subsystems
+  /// at the phase where RSS peaked.
+  void print() const {
+    if (samples_.empty()) { return; }
+    auto largest = [&](const Sample& s) {
+      auto it = std::max_element(s.bytes.begin(), s.bytes.end());
+      return it == s.bytes.end() ? std::string()
+                                 : names_[it - s.bytes.begin()];
+    };
+    tblr::Table phases;
+    phases.layout(tblr::markdown())
+        .aligns({tblr::Left, tblr::Right, tblr::Right, tblr::Right, tblr::Left})
+        .precision(1)
+        .fixed();
+    phases << "After phase" << "RSS (MB)" << "Peak RSS (MB)" << "Tracked (MB)"
+           << "Largest subsystem" << tblr::endr;
+    for (auto& s : samples_) {
+      size_t tracked = 0;
+      for (auto b : s.bytes) { tracked += b; }
+      phases << s.phase << mb(s.rss) << mb(s.peak_rss) << mb(tracked)
+             << largest(s) << tblr::endr;
+    }
+    phases.print();
+
+    auto& peak = samples_[peak_sample()];
+    std::cout << "Peak RSS of " << mb(samples_.back().peak_rss)
+              << " MB was reached during " << peak.phase;
+    if (not names_.empty()) { std::cout << ", mostly by " << largest(peak); }
+    std::cout << "." << std::endl;
+    tblr::Table subsystems;
+    subsystems.layout(tblr::markdown())
+        .aligns({tblr::Left, tblr::Right, tblr::Right})
+        .precision(1)
+        .fixed();
+    subsystems << "Subsystem" << "At peak (MB)" << "Max (MB)" << tblr::endr;
+    for (size_t i = 0; i < names_.size(); i++) {
+      size_t max = 0;
+      for (auto& s : samples_) { max = std::max(max, s.bytes[i]); }
+      subsystems << names_[i] << mb(peak.bytes[i]) << mb(max) << tblr::endr;
+    }
+    subsystems.print();
+  }
+};
+
+} // namespace koan
+
+#endif
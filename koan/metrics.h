@@ -0,0 +1,168 @@
+/*
+** Copyright 2020 Bloomberg Finance L.P.
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef KOAN_METRICS_H
+#define KOAN_METRICS_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "def.h"
+#include "util.h"
+
+namespace koan {
+
+/// A value to report, NaN if not known (yet), in which case it is left out.
+struct Metric {
+  std::string name; // e.g. "tokens_per_second"
+  double value;
+  std::string help;
+  bool counter = false; // monotonic, as opposed to a gauge
+};
+
+/// Writes metrics collected from a callback every few seconds from a
+/// background thread, so that workers never do more than update the values
+/// that the callback reads. Metrics are appended as a JSON object per line
+/// to a log, and/or written in the Prometheus text exposition format to a
+/// file that is atomically replaced each time, e.g. for the textfile
+/// collector of node-exporter.
+class MetricsReporter {
+ public:
+  using Collect = std::function<std::vector<Metric>()>;
+
+ private:
+  Collect collect_;
+  std::string prefix_;
+  FILE* log_ = nullptr;
+  std::string prometheus_path_;
+  double interval_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stop_ = false;
+  std::thread thread_;
+
+  static std::string format(double x) {
+    if (not is_finite(x)) { return "null"; }
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.15g", x);
+    return buf;
+  }
+
+  void write_log(const std::vector<Metric>& metrics, double time) {
+    std::string line = "{\"time\":" + format(time);
+    for (auto& m : metrics) {
+      line += ",\"" + m.name + "\":" + format(m.value);
+    }
+    line += "}\n";
+    fputs(line.c_str(), log_);
+    fflush(log_);
+  }
+
+  void write_prometheus(const std::vector<Metric>& metrics) {
+    std::string tmp = prometheus_path_ + ".tmp";
+    FILE* out = fopen(tmp.c_str(), "w");
+    if (not out) { return; } // try again next time
+    for (auto& m : metrics) {
+      if (not is_finite(m.value)) { continue; }
+      auto name = prefix_ + m.name;
+      fprintf(out,
+              "# HELP %s %s\n# TYPE %s %s\n%s %s\n",
+              name.c_str(),
+              m.help.c_str(),
+              name.c_str(),
+              m.counter ? "counter" : "gauge",
+              name.c_str(),
+              format(m.value).c_str());
+    }
+    if (fclose(out) == 0) {
+      std::rename(tmp.c_str(), prometheus_path_.c_str());
+    }
+  }
+
+ public:
+  /// @param[in] collect returns current values of metrics. Only called from
+  /// one thread at a time.
+  /// @param[in] log_path path of JSON lines log, or "" for none
+  /// @param[in] prometheus_path path of Prometheus file, or "" for none
+  /// @param[in] interval seconds between reports
+  /// @param[in] prefix prepended to metric names in the Prometheus file
+  MetricsReporter(Collect collect,
+                  const std::string& log_path,
+                  const std::string& prometheus_path,
+                  double interval = 10,
+                  std::string prefix = "koan_")
+      : collect_(std::move(collect)),
+        prefix_(std::move(prefix)),
+        prometheus_path_(prometheus_path),
+        interval_(interval) {
+    if (not log_path.empty()) {
+      log_ = fopen(log_path.c_str(), "w");
+      KOAN_ASSERT(log_, "Could not open '" + log_path + "' to log metrics!");
+    }
+  }
+
+  MetricsReporter(const MetricsReporter&) = delete;
+  MetricsReporter& operator=(const MetricsReporter&) = delete;
+
+  ~MetricsReporter() {
+    stop();
+    if (log_) { fclose(log_); }
+  }
+
+  /// Collect and write metrics now.
+  void report() {
+    using namespace std::chrono;
+    double time =
+        duration<double>(system_clock::now().time_since_epoch()).count();
+    auto metrics = collect_();
+    if (log_) { write_log(metrics, time); }
+    if (not prometheus_path_.empty()) { write_prometheus(metrics); }
+  }
+
+  /// Start reporting every interval seconds in the background.
+  void start() {
+    thread_ = std::thread([this]() {
+      std::unique_lock<std::mutex> lock(mutex_);
+      auto interval = std::chrono::duration<double>(interval_);
+      while (not cv_.wait_for(lock, interval, [this]() { return stop_; })) {
+        report();
+      }
+    });
+  }
+
+  /// Stop reporting in the background, and report a final time if it was
+  /// started.
+  void stop() {
+    if (not thread_.joinable()) { return; }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+    report();
+  }
+};
+
+} // namespace koan
+
+#endif
@@ -0,0 +1,272 @@
+/*
+** Copyright 2020 Bloomberg Finance L.P.
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef KOAN_MODEL_H
+#define KOAN_MODEL_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <Eigen/Dense>
+
+#include "def.h"
+#include "util.h"
+
+namespace koan {
+
+/// Read-only embedding model in a binary layout that is memory mapped as is,
+/// so that any number of processes can share a single copy of it in the page
+/// cache, and loading it takes no parsing:
+///
+///   Header
+///   uint64  offsets[size + 1]    word i is strings[offsets[i], offsets[i + 1])
+///   uint32  buckets[num_buckets] open addressing hash index of words
+///   float   vectors[size * dim]
+///   float   norms[size]
+///   char    strings[offsets[size]]
+///
+/// Sections are 8 byte aligned.
+class Model {
+ public:
+  struct Header {
+    char magic[8]; // "KOANMODL"
+    uint32_t version;
+    uint32_t dim;
+    uint64_t size;
+    uint64_t num_buckets;
+  };
+
+  static constexpr char MAGIC[8] = {'K', 'O', 'A', 'N', 'M', 'O', 'D', 'L'};
+  static constexpr uint32_t VERSION = 1;
+  static constexpr uint32_t NONE = 0xFFFFFFFF; // empty bucket, or OOV word
+
+ private:
+  void* data_ = nullptr;
+  size_t bytes_ = 0;
+  const Header* header_ = nullptr;
+  const uint64_t* offsets_ = nullptr;
+  const uint32_t* buckets_ = nullptr;
+  const float* vectors_ = nullptr;
+  const float* norms_ = nullptr;
+  const char* strings_ = nullptr;
+
+  static uint64_t hash(std::string_view s) { // 64 bit FNV-1a
+    uint64_t h = 14695981039346656037ULL;
+    for (unsigned char c : s) {
+      h ^= c;
+      h *= 1099511628211ULL;
+    }
+    return h;
+  }
+
+  static size_t align8(size_t n) { return (n + 7) & ~size_t(7); }
+
+ public:
+  /// Save a model, by writing to a temporary file and renaming it, so that a
+  /// running server can map the new file while the old one is still in use.
+  ///
+  /// @param[in] path output path
+  /// @param[in] words vocabulary, in index order
+  /// @param[in] table embeddings of words
+  static void save(const std::string& path,
+                   const std::vector<std::string_view>& words,
+                   const Table& table) {
+    KOAN_ASSERT(words.size() <= table.size());
+    KOAN_ASSERT(words.size() < NONE, "Too many words for model format!");
+    Header header{};
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.dim = words.empty() ? 0 : table[0].size();
+    header.size = words.size();
+    header.num_buckets = 1;
+    while (header.num_buckets < 2 * words.size()) { header.num_buckets *= 2; }
+
+    std::vector<uint64_t> offsets(words.size() + 1, 0);
+    for (size_t i = 0; i < words.size(); i++) {
+      offsets[i + 1] = offsets[i] + words[i].size();
+    }
+    std::vector<uint32_t> buckets(header.num_buckets, NONE);
+    const uint64_t mask = header.num_buckets - 1;
+    for (size_t i = 0; i < words.size(); i++) {
+      uint64_t b = hash(words[i]) & mask;
+      while (buckets[b] != NONE) { b = (b + 1) & mask; }
+      buckets[b] = i;
+    }
+
+    std::string tmp = path + ".tmp";
+    FILE* out = fopen(tmp.c_str(), "wb");
+    KOAN_ASSERT(out, "Could not open '" + tmp + "' to save model!");
+    bool ok = true;
+    auto write = [&](const void* p, size_t bytes) {
+      ok = ok and (bytes == 0 or fwrite(p, bytes, 1, out) == 1);
+    };
+    auto pad = [&](size_t bytes) {
+      static const char zeros[8] = {};
+      write(zeros, align8(bytes) - bytes);
+    };
+    write(&header, sizeof(header));
+    write(offsets.data(), offsets.size() * sizeof(uint64_t));
+    write(buckets.data(), buckets.size() * sizeof(uint32_t));
+    pad(buckets.size() * sizeof(uint32_t));
+    std::vector<float> row(header.dim);
+    std::vector<float> norms(words.size());
+    for (size_t i = 0; i < words.size(); i++) {
+      for (size_t j = 0; j < header.dim; j++) { row[j] = table[i][j]; }
+      norms[i] = table[i].norm();
+      write(row.data(), row.size() * sizeof(float));
+    }
+    write(norms.data(), norms.size() * sizeof(float));
+    for (auto& w : words) { write(w.data(), w.size()); }
+    ok = (fclose(out) == 0) and ok;
+    ok = ok and std::rename(tmp.c_str(), path.c_str()) == 0;
+    KOAN_ASSERT(ok, "Could not write model to '" + path + "'!");
+  }
+
+  /// Map a model file.
+  ///
+  /// @param[in] path path to model
+  Model(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    KOAN_ASSERT(fd >= 0, "Could not open model '" + path + "'!");
+    struct stat st;
+    fstat(fd, &st);
+    bytes_ = st.st_size;
+    if (bytes_ >= sizeof(Header)) {
+      data_ = mmap(nullptr, bytes_, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    KOAN_ASSERT(data_ and data_ != MAP_FAILED,
+                "Could not map model '" + path + "'!");
+
+    header_ = static_cast<const Header*>(data_);
+    bool ok = std::memcmp(header_->magic, MAGIC, sizeof(MAGIC)) == 0 and
+              header_->version == VERSION;
+    const size_t n = header_->size;
+    size_t strings_begin =
+        sizeof(Header) + (n + 1) * sizeof(uint64_t) +
+        align8(header_->num_buckets * sizeof(uint32_t)) +
+        n * header_->dim * sizeof(float) + n * sizeof(float);
+    ok = ok and bytes_ >= strings_begin;
+    if (ok) {
+      auto base = static_cast<const char*>(data_);
+      offsets_ = reinterpret_cast<const uint64_t*>(base + sizeof(Header));
+      buckets_ = reinterpret_cast<const uint32_t*>(offsets_ + n + 1);
+      vectors_ = reinterpret_cast<const float*>(
+          base + sizeof(Header) + (n + 1) * sizeof(uint64_t) +
+          align8(header_->num_buckets * sizeof(uint32_t)));
+      norms_ = vectors_ + n * header_->dim;
+      strings_ = base + strings_begin;
+      ok = bytes_ == strings_begin + offsets_[n];
+    }
+    if (not ok) { munmap(data_, bytes_); }
+    KOAN_ASSERT(ok, "Invalid model '" + path + "'!");
+  }
+
+  Model(const Model&) = delete;
+  Model& operator=(const Model&) = delete;
+
+  ~Model() { munmap(data_, bytes_); }
+
+  size_t size() const { return header_->size; }
+  unsigned dim() const { return header_->dim; }
+
+  /// @returns index of word, or NONE if out of vocabulary
+  Word lookup(std::string_view word) const {
+    const uint64_t mask = header_->num_buckets - 1;
+    for (uint64_t b = hash(word) & mask;; b = (b + 1) & mask) {
+      Word i = buckets_[b];
+      if (i == NONE or this->word(i) == word) { return i; }
+    }
+  }
+
+  std::string_view word(Word i) const {
+    return {strings_ + offsets_[i], size_t(offsets_[i + 1] - offsets_[i])};
+  }
+
+  const float* vector(Word i) const { return vectors_ + size_t(i) * dim(); }
+  float norm(Word i) const { return norms_[i]; }
+
+  /// Average the vectors of words.
+  ///
+  /// @param[in] ids word indices, NONE entries are ignored
+  /// @param[out] out dim() floats, set to zero if there are no words
+  void mean(const std::vector<Word>& ids, float* out) const {
+    Eigen::Map<Eigen::VectorXf> v(out, dim());
+    v.setZero();
+    size_t n = 0;
+    for (auto i : ids) {
+      if (i == NONE) { continue; }
+      v += Eigen::Map<const Eigen::VectorXf>(vector(i), dim());
+      n++;
+    }
+    if (n > 0) { v /= n; }
+  }
+
+  /// Exact top-k words by cosine similarity to a query vector, by a single
+  /// pass over all vectors.
+  ///
+  /// @param[in] query dim() floats, need not be normalized
+  /// @param[in] k number of neighbors
+  /// @param[in] exclude word to leave out of results (e.g. the query word)
+  /// @returns (word, cosine similarity) pairs, most similar first
+  std::vector<std::pair<Word, float>>
+  top_k(const float* query, size_t k, Word exclude = NONE) const {
+    using Matrix =
+        Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+    Eigen::Map<const Matrix> m(vectors_, size(), dim());
+    Eigen::Map<const Eigen::VectorXf> q(query, dim());
+    float q_norm = q.norm();
+    static thread_local Eigen::VectorXf scores;
+    scores.noalias() = m * q;
+
+    using Entry = std::pair<float, Word>;
+    std::vector<Entry> heap; // min-heap on similarity
+    for (Word i = 0; i < size(); i++) {
+      if (i == exclude) { continue; }
+      float norms = norms_[i] * q_norm;
+      float sim = norms > 0 ? scores[i] / norms : 0;
+      if (heap.size() < k) {
+        heap.emplace_back(sim, i);
+        std::push_heap(heap.begin(), heap.end(), std::greater<>());
+      } else if (k > 0 and sim > heap.front().first) {
+        std::pop_heap(heap.begin(), heap.end(), std::greater<>());
+        heap.back() = {sim, i};
+        std::push_heap(heap.begin(), heap.end(), std::greater<>());
+      }
+    }
+    std::sort_heap(heap.begin(), heap.end(), std::greater<>());
+    std::vector<std::pair<Word, float>> result;
+    for (auto& [sim, i] : heap) { result.emplace_back(i, sim); }
+    return result;
+  }
+};
+
+} // namespace koan
+
+#endif
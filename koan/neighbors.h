@@ -0,0 +1,208 @@
+/*
+** Copyright 2020 Bloomberg Finance L.P.
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef KOAN_NEIGHBORS_H
+#define KOAN_NEIGHBORS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <Eigen/Dense>
+
+#include "def.h"
+#include "util.h"
+
+namespace koan {
+
+/// Dense single precision matrix with one embedding per row.
+using RowMatrix =
+    Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+
+/// Copy the first n rows of an embedding table into a matrix, scaled to unit
+/// norm so that dot products are cosine similarities. Zero rows stay zero.
+///
+/// @param[in] table embedding table
+/// @param[in] n number of rows to copy
+/// @param[in] threads number of threads to use
+inline RowMatrix
+normalized_rows(const Table& table, size_t n, unsigned threads = 1) {
+  KOAN_ASSERT(n <= table.size());
+  RowMatrix m(n, n > 0 ? table[0].size() : 0);
+  parallel_for(
+      0,
+      n,
+      [&](size_t i, size_t) {
+        Real norm = table[i].norm();
+        m.row(i) = (norm > 0 ? table[i] / norm : table[i]).cast<float>();
+      },
+      threads);
+  return m;
+}
+
+/// Exact top-k neighbors by cosine similarity of a set of words, stored as
+/// flat arrays (k per word, most similar first).
+///
+/// Binary file layout is a header (magic "KOANNBRS", uint32 version, uint32 k,
+/// uint64 size) followed by uint32 ids[size * k] and float sims[size * k].
+struct Neighbors {
+  static constexpr char MAGIC[8] = {'K', 'O', 'A', 'N', 'N', 'B', 'R', 'S'};
+  static constexpr uint32_t VERSION = 1;
+
+  size_t size = 0;
+  unsigned k = 0;
+  std::vector<Word> ids;
+  std::vector<float> sims;
+
+  const Word* ids_of(Word w) const { return ids.data() + size_t(w) * k; }
+  const float* sims_of(Word w) const { return sims.data() + size_t(w) * k; }
+
+  void save(const std::string& path) const {
+    FILE* out = fopen(path.c_str(), "wb");
+    KOAN_ASSERT(out, "Could not open '" + path + "' to save neighbors!");
+    uint32_t version = VERSION, k32 = k;
+    uint64_t size64 = size;
+    bool ok = fwrite(MAGIC, sizeof(MAGIC), 1, out) == 1 and
+              fwrite(&version, sizeof(version), 1, out) == 1 and
+              fwrite(&k32, sizeof(k32), 1, out) == 1 and
+              fwrite(&size64, sizeof(size64), 1, out) == 1 and
+              fwrite(ids.data(), sizeof(Word), ids.size(), out) ==
+                  ids.size() and
+              fwrite(sims.data(), sizeof(float), sims.size(), out) ==
+                  sims.size();
+    ok = (fclose(out) == 0) and ok;
+    KOAN_ASSERT(ok, "Could not write neighbors to '" + path + "'!");
+  }
+
+  static Neighbors load(const std::string& path) {
+    FILE* in = fopen(path.c_str(), "rb");
+    KOAN_ASSERT(in, "Could not open neighbors '" + path + "'!");
+    char magic[8];
+    uint32_t version, k32;
+    uint64_t size64;
+    bool ok = fread(magic, sizeof(magic), 1, in) == 1 and
+              std::memcmp(magic, MAGIC, sizeof(MAGIC)) == 0 and
+              fread(&version, sizeof(version), 1, in) == 1 and
+              version == VERSION and fread(&k32, sizeof(k32), 1, in) == 1 and
+              fread(&size64, sizeof(size64), 1, in) == 1;
+    Neighbors n;
+    if (ok) {
+      n.size = size64;
+      n.k = k32;
+      n.ids.resize(n.size * n.k);
+      n.sims.resize(n.size * n.k);
+      ok = fread(n.ids.data(), sizeof(Word), n.ids.size(), in) ==
+               n.ids.size() and
+           fread(n.sims.data(), sizeof(float), n.sims.size(), in) ==
+               n.sims.size();
+    }
+    fclose(in);
+    KOAN_ASSERT(ok, "Invalid neighbors file '" + path + "'!");
+    return n;
+  }
+};
+
+/// Compute exact top-k cosine neighbors of every row of a normalized matrix
+/// among all of its rows (excluding itself).
+///
+/// Similarities are computed block by block with matrix-matrix products, so
+/// that the full n x n similarity matrix is never formed. Each thread takes a
+/// block of query rows at a time, sweeps it over blocks of candidate rows, and
+/// keeps a bounded min-heap per query row.
+///
+/// @param[in] m matrix with unit norm rows, e.g. from normalized_rows()
+/// @param[in] k number of neighbors per row. Capped at m.rows() - 1.
+/// @param[in] threads number of threads to use
+/// @param[in] block number of rows in each query and candidate block
+inline Neighbors exact_neighbors(const RowMatrix& m,
+                                 unsigned k,
+                                 unsigned threads = 1,
+                                 size_t block = 1024) {
+  const size_t n = m.rows();
+  Neighbors result;
+  result.size = n;
+  result.k = n > 0 ? std::min<size_t>(k, n - 1) : 0;
+  k = result.k;
+  result.ids.resize(n * k);
+  result.sims.resize(n * k);
+  if (k == 0) { return result; }
+
+  using Entry = std::pair<float, Word>; // (similarity, id)
+  std::vector<RowMatrix> scores(threads);             // one per thread
+  std::vector<std::vector<std::vector<Entry>>> heaps( // one per thread
+      threads,
+      std::vector<std::vector<Entry>>(block));
+  const size_t num_blocks = (n + block - 1) / block;
+
+  parallel_for(
+      0,
+      num_blocks,
+      [&](size_t qb, size_t tid) {
+        const size_t q_begin = qb * block;
+        const size_t q_size = std::min(block, n - q_begin);
+        auto& s = scores[tid];
+        auto& qheaps = heaps[tid];
+        for (size_t i = 0; i < q_size; i++) {
+          qheaps[i].clear();
+          qheaps[i].reserve(k);
+        }
+
+        for (size_t c_begin = 0; c_begin < n; c_begin += block) {
+          const size_t c_size = std::min(block, n - c_begin);
+          s.resize(q_size, c_size);
+          s.noalias() = m.middleRows(q_begin, q_size) *
+                        m.middleRows(c_begin, c_size).transpose();
+          for (size_t i = 0; i < q_size; i++) {
+            auto& heap = qheaps[i]; // min-heap on similarity
+            const Word q = q_begin + i;
+            const float* row = s.data() + i * c_size;
+            for (size_t j = 0; j < c_size; j++) {
+              const Word c = c_begin + j;
+              if (c == q) { continue; }
+              if (heap.size() < k) {
+                heap.emplace_back(row[j], c);
+                std::push_heap(heap.begin(), heap.end(), std::greater<>());
+              } else if (row[j] > heap.front().first) {
+                std::pop_heap(heap.begin(), heap.end(), std::greater<>());
+                heap.back() = {row[j], c};
+                std::push_heap(heap.begin(), heap.end(), std::greater<>());
+              }
+            }
+          }
+        }
+
+        for (size_t i = 0; i < q_size; i++) {
+          auto& heap = qheaps[i];
+          std::sort_heap(heap.begin(), heap.end(), std::greater<>());
+          const size_t offset = (q_begin + i) * k;
+          for (size_t j = 0; j < k; j++) {
+            result.sims[offset + j] = heap[j].first;
+            result.ids[offset + j] = heap[j].second;
+          }
+        }
+      },
+      threads);
+
+  return result;
+}
+
+} // namespace koan
+
+#endif
@@ -0,0 +1,190 @@
+/*
+** Copyright 2020 Bloomberg Finance L.P.
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef KOAN_PERF_H
+#define KOAN_PERF_H
+
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "extern/tblr.h"
+#include "util.h"
+
+namespace koan {
+
+/// Hardware performance counters (via perf_event_open) of the calling thread
+/// and of every thread it starts after construction, such as the workers of
+/// each parallel_for and each background reader. The kernel gives each new
+/// thread its own counters and folds them into ours when it exits, so reading
+/// after joining threads includes all of their events.
+///
+/// Counters that cannot be opened (no PMU, e.g. in some VMs, or a restrictive
+/// perf_event_paranoid) read as NaN rather than failing.
+class PerfCounters {
+ public:
+  enum Event { Cycles, Instructions, LlcMisses, DtlbMisses, BackendStalls };
+  static constexpr size_t NUM_EVENTS = 5;
+  using Values = std::array<double, NUM_EVENTS>;
+
+ private:
+  std::array<int, NUM_EVENTS> fds_;
+  std::string error_;
+
+  static constexpr uint64_t cache(uint64_t cache) {
+    return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+           (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  }
+
+  static int open(uint32_t type, uint64_t config) {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1; // allowed with perf_event_paranoid <= 2
+    attr.exclude_hv = 1;
+    attr.read_format =
+        PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+
+ public:
+  PerfCounters() {
+    const std::array<std::pair<uint32_t, uint64_t>, NUM_EVENTS> events{{
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HW_CACHE, cache(PERF_COUNT_HW_CACHE_LL)},
+        {PERF_TYPE_HW_CACHE, cache(PERF_COUNT_HW_CACHE_DTLB)},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_BACKEND},
+    }};
+    for (size_t e = 0; e < NUM_EVENTS; e++) {
+      fds_[e] = open(events[e].first, events[e].second);
+      if (fds_[e] < 0 and error_.empty()) {
+        error_ = std::string(name(Event(e))) + ": " + std::strerror(errno);
+      }
+    }
+  }
+
+  PerfCounters(const PerfCounters&) = delete;
+  PerfCounters& operator=(const PerfCounters&) = delete;
+
+  ~PerfCounters() {
+    for (int fd : fds_) {
+      if (fd >= 0) { close(fd); }
+    }
+  }
+
+  static const char* name(Event e) {
+    static const char* names[] = {
+        "cycles", "instructions", "LLC misses", "dTLB misses",
+        "backend stalls"};
+    return names[e];
+  }
+
+  bool available(Event e) const { return fds_[e] >= 0; }
+
+  bool any_available() const {
+    for (size_t e = 0; e < NUM_EVENTS; e++) {
+      if (available(Event(e))) { return true; }
+    }
+    return false;
+  }
+
+  /// @returns why the first unavailable counter could not be opened, or ""
+  const std::string& error() const { return error_; }
+
+  /// @returns counts so far, scaled up for the time a counter was not
+  /// scheduled if the PMU was multiplexed, NaN for unavailable counters
+  Values read() const {
+    Values values;
+    for (size_t e = 0; e < NUM_EVENTS; e++) {
+      uint64_t buf[3]; // value, time enabled, time running
+      values[e] = std::numeric_limits<double>::quiet_NaN();
+      if (fds_[e] >= 0 and ::read(fds_[e], buf, sizeof(buf)) == sizeof(buf)) {
+        values[e] = buf[2] > 0 ? double(buf[0]) * buf[1] / buf[2] : 0;
+      }
+    }
+    return values;
+  }
+};
+
+inline PerfCounters::Values operator-(const PerfCounters::Values& x,
+                                      const PerfCounters::Values& y) {
+  PerfCounters::Values z;
+  for (size_t e = 0; e < z.size(); e++) { z[e] = x[e] - y[e]; }
+  return z;
+}
+
+inline PerfCounters::Values& operator+=(PerfCounters::Values& x,
+                                        const PerfCounters::Values& y) {
+  for (size_t e = 0; e < x.size(); e++) { x[e] += y[e]; }
+  return x;
+}
+
+/// Print counts per token of named phases as a table, along with
+/// instructions per cycle and the fraction of cycles stalled in the backend.
+///
+/// @param[in] phases (phase name, counts) pairs
+/// @param[in] tokens number of tokens to divide counts by
+inline void
+print_per_token(const std::vector<std::pair<std::string, PerfCounters::Values>>&
+                    phases,
+                double tokens) {
+  auto fmt = [](double x, int precision) {
+    if (not is_finite(x)) { return std::string("n/a"); }
+    std::ostringstream s;
+    s.precision(precision);
+    s << std::fixed << x;
+    return s.str();
+  };
+  tblr::Table table;
+  table.layout(tblr::markdown())
+      .aligns({tblr::Left,
+               tblr::Right,
+               tblr::Right,
+               tblr::Right,
+               tblr::Right,
+               tblr::Right,
+               tblr::Right});
+  table << "Phase" << "Cycles/tok" << "Instrs/tok" << "IPC" << "LLC miss/tok"
+        << "dTLB miss/tok" << "Backend stall %" << tblr::endr;
+  using P = PerfCounters;
+  for (auto& [name, v] : phases) {
+    table << name << fmt(v[P::Cycles] / tokens, 1)
+          << fmt(v[P::Instructions] / tokens, 1)
+          << fmt(v[P::Instructions] / v[P::Cycles], 2)
+          << fmt(v[P::LlcMisses] / tokens, 3)
+          << fmt(v[P::DtlbMisses] / tokens, 3)
+          << fmt(100 * v[P::BackendStalls] / v[P::Cycles], 1) << tblr::endr;
+  }
+  table.print();
+}
+
+} // namespace koan
+
+#endif
@@ -0,0 +1,240 @@
+/*
+** Copyright 2020 Bloomberg Finance L.P.
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef KOAN_PHRASES_H
+#define KOAN_PHRASES_H
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "def.h"
+#include "util.h"
+
+namespace koan {
+
+/// Joins detected collocations into single tokens, e.g. "new york" becomes
+/// "new_york". Each pass is applied on the output of the previous one, so n
+/// passes can produce phrases of up to 2^n words.
+class Phraser {
+ private:
+  // Each phrase is stored as its two tokens separated by a space
+  std::vector<std::unordered_set<std::string>> passes_;
+  char delim_;
+
+ public:
+  Phraser(char delim = '_') : delim_(delim) {}
+
+  void add_pass(std::unordered_set<std::string> phrases) {
+    passes_.push_back(std::move(phrases));
+  }
+
+  bool empty() const { return passes_.empty(); }
+
+  size_t num_phrases() const {
+    size_t n = 0;
+    for (auto& pass : passes_) { n += pass.size(); }
+    return n;
+  }
+
+  /// Rewrite a line by greedily joining phrases from left to right.
+  ///
+  /// @param[in] line space separated tokens
+  /// @param[out] out rewritten line. Must not alias line.
+  void apply(std::string_view line, std::string& out) const {
+    static thread_local std::string in, key;
+    static thread_local std::vector<std::string_view> words;
+    out.assign(line.data(), line.size());
+    for (auto& pass : passes_) {
+      in.swap(out);
+      out.clear();
+      words.clear();
+      split(words, in, ' ');
+      for (size_t i = 0; i < words.size(); i++) {
+        if (not out.empty()) { out += ' '; }
+        out += words[i];
+        if (i + 1 < words.size()) {
+          key.assign(words[i].data(), words[i].size());
+          key += ' ';
+          key += words[i + 1];
+          if (pass.find(key) != pass.end()) {
+            out += delim_;
+            out += words[++i];
+          }
+        }
+      }
+    }
+  }
+};
+
+/// Parameters of phrase detection, following word2phrase.
+struct PhraseParams {
+  // A bigram is a phrase if its score is above this
+  Real threshold = 100;
+  // Ignore words and bigrams appearing less than this
+  unsigned long long min_count = 5;
+  // Bound on the number of distinct unigrams and bigrams kept in memory.
+  // Rare entries are pruned when it is exceeded, as in word2vec's
+  // ReduceVocab().
+  size_t max_entries = 100'000'000;
+  // Number of lines counted in parallel at once
+  size_t chunk_size = 100'000;
+  unsigned threads = 1;
+};
+
+/// Count unigrams and bigrams in a corpus and return the bigrams with a
+/// word2phrase score of (count(a b) - min_count) / count(a) / count(b) * total
+/// above threshold.
+///
+/// Lines are counted in parallel in chunks (while the next chunk is being
+/// read) into per-thread tables, which are then merged into tables sharded by
+/// hash so that merging is also parallel.
+///
+/// @param[in] for_each_line reads the corpus, e.g. by readlines()
+/// @param[in] previous phrases from previous passes to apply before counting
+/// @param[in] params detection parameters
+/// @returns detected phrases, two tokens separated by a space
+/// @tparam R callable that takes a callable on (const std::string_view&) and
+/// calls it on each line of the corpus
+template <typename R>
+std::unordered_set<std::string> detect_phrases(R for_each_line,
+                                               const Phraser& previous,
+                                               const PhraseParams& params) {
+  using Counts = std::unordered_map<std::string, unsigned long long>;
+  const size_t threads = params.threads, shards = params.threads;
+  const size_t max_entries_per_shard =
+      std::max<size_t>(params.max_entries / shards, 1);
+  std::hash<std::string_view> hasher;
+
+  std::vector<Counts> unigrams(shards), bigrams(shards);
+  std::vector<unsigned long long> min_reduce(shards, 1);
+  // local_*[thread][shard]
+  std::vector<std::vector<Counts>> local_unigrams(threads,
+                                                  std::vector<Counts>(shards));
+  std::vector<std::vector<Counts>> local_bigrams(threads,
+                                                 std::vector<Counts>(shards));
+  std::vector<unsigned long long> total_words(threads, 0);
+
+  auto count_chunk = [&](const std::vector<std::string>& lines) {
+    parallel_for(
+        0,
+        lines.size(),
+        [&](size_t i, size_t tid) {
+          static thread_local std::string phrased, key;
+          static thread_local std::vector<std::string_view> words;
+          std::string_view line = lines[i];
+          if (not previous.empty()) {
+            previous.apply(line, phrased);
+            line = phrased;
+          }
+          words.clear();
+          split(words, line, ' ');
+          for (size_t j = 0; j < words.size(); j++) {
+            local_unigrams[tid][hasher(words[j]) % shards][std::string(
+                words[j])]++;
+            if (j + 1 < words.size()) {
+              key.assign(words[j].data(), words[j].size());
+              key += ' ';
+              key += words[j + 1];
+              local_bigrams[tid][hasher(key) % shards][key]++;
+            }
+          }
+          total_words[tid] += words.size();
+        },
+        threads);
+
+    parallel_for(
+        0,
+        shards,
+        [&](size_t s, size_t) {
+          for (size_t t = 0; t < threads; t++) {
+            for (auto& [k, v] : local_unigrams[t][s]) { unigrams[s][k] += v; }
+            for (auto& [k, v] : local_bigrams[t][s]) { bigrams[s][k] += v; }
+            local_unigrams[t][s].clear();
+            local_bigrams[t][s].clear();
+          }
+          // Prune rare entries to bound memory
+          while (unigrams[s].size() + bigrams[s].size() >
+                 max_entries_per_shard) {
+            for (auto counts : {&unigrams[s], &bigrams[s]}) {
+              for (auto it = counts->begin(); it != counts->end();) {
+                it = it->second < min_reduce[s] ? counts->erase(it) : ++it;
+              }
+            }
+            min_reduce[s]++;
+          }
+        },
+        threads);
+  };
+
+  // Read the next chunk while the previous one is being counted
+  std::vector<std::string> chunk, counting;
+  chunk.reserve(params.chunk_size);
+  std::unique_ptr<std::thread> counter;
+  auto flush = [&]() {
+    if (counter) { counter->join(); }
+    counting.swap(chunk);
+    chunk.clear();
+    counter = std::make_unique<std::thread>(
+        [&count_chunk, &counting]() { count_chunk(counting); });
+  };
+  for_each_line([&](const std::string_view& line) {
+    chunk.emplace_back(line);
+    if (chunk.size() >= params.chunk_size) { flush(); }
+  });
+  flush();
+  counter->join();
+
+  unsigned long long total = 0;
+  for (auto n : total_words) { total += n; }
+
+  // Score bigrams in parallel, by shard
+  std::vector<std::unordered_set<std::string>> phrases(shards);
+  parallel_for(
+      0,
+      shards,
+      [&](size_t s, size_t) {
+        for (auto& [bigram, count] : bigrams[s]) {
+          if (count < params.min_count) { continue; }
+          size_t pos = bigram.find(' ');
+          std::string_view a(bigram.data(), pos);
+          std::string_view b(bigram.data() + pos + 1, bigram.size() - pos - 1);
+          auto& ua = unigrams[hasher(a) % shards];
+          auto& ub = unigrams[hasher(b) % shards];
+          auto ca = ua.find(std::string(a)), cb = ub.find(std::string(b));
+          if (ca == ua.end() or cb == ub.end()) { continue; }
+          if (ca->second < params.min_count or cb->second < params.min_count) {
+            continue;
+          }
+          double score = double(count - params.min_count) / ca->second /
+                         cb->second * total;
+          if (score > params.threshold) { phrases[s].insert(bigram); }
+        }
+      },
+      threads);
+
+  std::unordered_set<std::string> all;
+  for (auto& p : phrases) { all.insert(p.begin(), p.end()); }
+  return all;
+}
+
+} // namespace koan
+
+#endif
@@ -27,6 +27,9 @@
 
 #include "def.h"
 #include "indexmap.h"
+#include "phrases.h"
+#include "timer.h"
+#include "trace.h"
 #include "util.h"
 
 #ifdef KOAN_ENABLE_ZIP
@@ -148,6 +151,14 @@ void readlines(const std::string& fname,
   readlines(fname_vec, f, read_mode, assert_no_long_lines);
 }
 
+/// Totals over the lines a reader parsed.
+struct ReadCounts {
+  size_t lines = 0;
+  size_t bytes = 0; // of text, including newlines
+  size_t words = 0; // including OOV words
+  size_t oov = 0;
+};
+
 /// Abstract class for reading from a pre-tokenized file.
 class Reader {
  protected:
@@ -159,8 +170,12 @@ class Reader {
 
   // buffers reused to avoid wasteful allocs
   std::vector<std::string_view> words_;
+  std::string phrased_;
 
   IndexMap<std::string_view>& word_map_;
+  const Phraser* phraser_; // if not null, join phrases before lookup
+
+  ReadCounts counts_;
 
   /// Split a sequence into tokens by space.  Handle out-of-vocabulary words
   /// based on the discard flag.
@@ -172,13 +187,23 @@ class Reader {
     Sentence s;
 
     words_.clear();
-    split(words_, line, ' ');
+    if (phraser_) {
+      phraser_->apply(line, phrased_);
+      split(words_, phrased_, ' ');
+    } else {
+      split(words_, line, ' ');
+    }
+
+    counts_.lines++;
+    counts_.bytes += line.size() + 1; // newline was removed
+    counts_.words += words_.size();
 
     s.reserve(words_.size());
     for (size_t t = 0; t < words_.size(); t++) {
       const auto index = word_map_.find(words_[t]);
 
       if (index == word_map_.end()) {
+        counts_.oov++;
         if (not discard_) { s.push_back(word_map_.lookup(UNK)); }
       } else {
         s.push_back(index->second);
@@ -196,21 +221,32 @@ class Reader {
   /// @param[in] read_mode define behavior for reading from files.  "text":
   /// treat all files as plain text; "gzip": treat all files as gzipped; "auto":
   /// treat *.gz as gzipped, otherwise plain text
+  /// @param[in] phraser if not null, phrases to join in each line
   Reader(IndexMap<std::string_view>& word_map,
          std::vector<std::string>& fnames,
          bool discard,
          std::string read_mode,
-         bool assert_no_long_lines = false)
+         bool assert_no_long_lines = false,
+         const Phraser* phraser = nullptr)
       : discard_(discard),
         assert_no_long_lines_(assert_no_long_lines),
         fnames_(fnames),
         read_mode_(read_mode),
-        word_map_(word_map) {
+        word_map_(word_map),
+        phraser_(phraser) {
     words_.reserve(100);
   }
   virtual ~Reader() = default;
 
   virtual bool get_next(Sentences&) = 0;
+
+  /// @returns seconds spent reading and parsing the batch last returned by
+  /// get_next() in the background, if the reader reads in the background
+  virtual double fill_seconds() const { return 0; }
+
+  /// @returns totals over the lines of the batches returned by get_next() so
+  /// far
+  virtual ReadCounts counts() const { return counts_; }
 };
 
 /// Reader used when one can store the entire training set in memory.
@@ -261,6 +297,9 @@ class AsyncReader : public Reader {
                                    // it needs to return false to reset the
                                    // loop, similar to
                                    // std::getline(ifstream, line).
+  double fill_seconds_ = 0;      // time to fill read_buffer_
+  double last_fill_seconds_ = 0; // time to fill last returned buffer
+  ReadCounts last_counts_;       // counts_ up to last returned buffer
 
  public:
   ///
@@ -269,13 +308,20 @@ class AsyncReader : public Reader {
   /// @param[in] buffer_size number of lines to read into memory at once
   /// @param[in] discard flag to toggle between discarding OOV words or
   /// replacing them with UNK
+  /// @param[in] phraser if not null, phrases to join in each line
   AsyncReader(IndexMap<std::string_view>& word_map,
               std::vector<std::string>& fnames,
               size_t buffer_size,
               bool discard,
               const std::string& read_mode,
-              bool assert_no_long_lines)
-      : Reader(word_map, fnames, discard, read_mode, assert_no_long_lines),
+              bool assert_no_long_lines,
+              const Phraser* phraser = nullptr)
+      : Reader(word_map,
+               fnames,
+               discard,
+               read_mode,
+               assert_no_long_lines,
+               phraser),
         buffer_size_(buffer_size),
         path_idx_(0) {
 
@@ -296,6 +342,8 @@ class AsyncReader : public Reader {
     reached_eofs_ = false;
 
     reader_ = std::make_unique<std::thread>([this]() {
+      KOAN_TRACE_SCOPE("reader fill");
+      Timer t;
       while (read_buffer_.size() < buffer_size_) {
         reached_eof_ = in_->gets(line_c_str_.get(), MAX_LINE_LEN) == nullptr;
         if (reached_eof_) {
@@ -309,9 +357,12 @@ class AsyncReader : public Reader {
           break;
         }
 
-        Sentence s = parseline(line_c_str_.get());
+        std::string_view line(line_c_str_.get());
+        if (not line.empty() and line.back() == '\n') { line.remove_suffix(1); }
+        Sentence s = parseline(line);
         read_buffer_.push_back(std::move(s));
       }
+      fill_seconds_ = t.s();
     });
   }
 
@@ -326,8 +377,13 @@ class AsyncReader : public Reader {
       return false;
     }
 
-    join_reader();
+    {
+      KOAN_TRACE_SCOPE("get_next");
+      join_reader();
+    }
 
+    last_fill_seconds_ = fill_seconds_;
+    last_counts_ = counts_;
     reached_eofs_prev_ = reached_eofs_;
     s = std::move(read_buffer_);
     read_buffer_ = Sentences();
@@ -338,6 +394,10 @@ class AsyncReader : public Reader {
 
     return true;
   }
+
+  double fill_seconds() const override { return last_fill_seconds_; }
+
+  ReadCounts counts() const override { return last_counts_; }
 };
 
 } // namespace koan
@@ -129,6 +129,11 @@ class AliasSampler {
   }
 
   size_t num_classes() { return n_; }
+
+  /// @returns heap memory of the alias table
+  size_t bytes() const {
+    return alias_.capacity() * sizeof(Index) + prob_.capacity() * sizeof(Real);
+  }
 };
 
 } // namespace koan
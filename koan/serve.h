@@ -0,0 +1,595 @@
+/*
+** Copyright 2020 Bloomberg Finance L.P.
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef KOAN_SERVE_H
+#define KOAN_SERVE_H
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <list>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <limits.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "def.h"
+#include "hnsw.h"
+#include "model.h"
+#include "util.h"
+
+namespace koan {
+
+/// Wire protocol of the embedding server. Each request is a RequestHeader
+/// followed by header.bytes of payload, and is answered by a ResponseHeader
+/// followed by header.bytes of payload. Requests on a connection are answered
+/// in order, and clients may send any number of requests before reading the
+/// responses (pipelining). All integers are in host byte order. Requests and
+/// responses above 1 GiB of payload are answered with an error.
+namespace serve {
+
+enum Type : uint32_t {
+  // No payload. Response has count = vocabulary size, and dim.
+  Info = 0,
+  // Payload is words separated by '\n'. Response is a uint32 index per word,
+  // Model::NONE if out of vocabulary.
+  Lookup = 1,
+  // Payload is uint32 word indices. Response is dim floats per index.
+  Vectors = 2,
+  // Payload is sentences of space separated words, separated by '\n'.
+  // Response is the mean vector (dim floats) of in-vocabulary words of each
+  // sentence, zero if there are none.
+  Sentences = 3,
+  // Payload is uint32 word indices, and header.k <= vocabulary size the
+  // number of neighbors. Response is k (uint32 index, float cosine
+  // similarity) pairs per index, padded with (Model::NONE, 0) if there are
+  // fewer than k other words.
+  Neighbors = 4,
+  // Payload is empty to reload the current model path, or a model path if
+  // the server allows reloading any path. Swaps the model (and index, if
+  // any) without dropping connections.
+  Reload = 5,
+  // Payload is uint32 word indices. Response is the words, each followed by
+  // '\n'.
+  Words = 6,
+};
+
+enum Status : uint32_t { Ok = 0, Error = 1 }; // Error payload is a message
+
+struct RequestHeader {
+  uint32_t tag; // echoed back in the response
+  uint32_t type;
+  uint32_t k;
+  uint32_t bytes;
+};
+
+struct ResponseHeader {
+  uint32_t tag;
+  uint32_t status;
+  uint32_t count; // number of items in the response
+  uint32_t dim;
+  uint32_t bytes;
+};
+
+/// Write a list of buffers fully, in as few system calls as possible.
+inline bool write_all(int fd, std::vector<iovec>& iov) {
+  size_t i = 0;
+  while (i < iov.size()) {
+    msghdr msg{};
+    msg.msg_iov = iov.data() + i;
+    msg.msg_iovlen = std::min<size_t>(iov.size() - i, IOV_MAX);
+    // Like writev(), but a closed peer is an error instead of SIGPIPE
+    ssize_t written = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (written < 0) {
+      if (errno == EINTR) { continue; }
+      return false;
+    }
+    while (i < iov.size() and size_t(written) >= iov[i].iov_len) {
+      written -= iov[i++].iov_len;
+    }
+    if (i < iov.size()) {
+      iov[i].iov_base = static_cast<char*>(iov[i].iov_base) + written;
+      iov[i].iov_len -= written;
+    }
+  }
+  return true;
+}
+
+/// Read exactly n bytes.
+inline bool read_all(int fd, void* buf, size_t n) {
+  auto p = static_cast<char*>(buf);
+  while (n > 0) {
+    ssize_t r = read(fd, p, n);
+    if (r < 0 and errno == EINTR) { continue; }
+    if (r <= 0) { return false; }
+    p += r;
+    n -= r;
+  }
+  return true;
+}
+
+inline sockaddr_un socket_address(const std::string& path) {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  KOAN_ASSERT(path.size() < sizeof(addr.sun_path),
+              "Socket path '" + path + "' is too long!");
+  std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  return addr;
+}
+
+/// Serves a model over a Unix domain socket, one thread per connection.
+///
+/// Each connection thread reads as many requests as are available, answers
+/// them, and writes all responses with a single writev(). Vectors are written
+/// straight from the mapped model (zero-copy). Requests hold a reference to
+/// the model they started on, so a reload swaps the model for subsequent
+/// requests while in-flight ones finish on the old mapping.
+class Server {
+ private:
+  struct Served {
+    Model model;
+    std::unique_ptr<HnswIndex> index; // optional, for neighbor queries
+    Served(const std::string& model_path, const std::string& index_path)
+        : model(model_path) {
+      if (not index_path.empty()) {
+        index = std::make_unique<HnswIndex>(index_path);
+        KOAN_ASSERT(index->size() == model.size() and
+                        index->dim() == model.dim(),
+                    "Index '" + index_path + "' does not match the model!");
+      }
+    }
+  };
+
+  /// Responses to a batch of requests, pointing either into the model or into
+  /// owned buffers.
+  struct Batch {
+    std::vector<iovec> iov;
+    std::deque<std::vector<char>> owned;
+    std::deque<ResponseHeader> headers;
+
+    void add(const void* p, size_t bytes) {
+      if (bytes == 0) { return; }
+      // Merge with the previous buffer if contiguous, e.g. consecutive rows
+      if (not iov.empty() and
+          static_cast<const char*>(iov.back().iov_base) + iov.back().iov_len ==
+              p) {
+        iov.back().iov_len += bytes;
+      } else {
+        iov.push_back({const_cast<void*>(p), bytes});
+      }
+    }
+    std::vector<char>& buffer(size_t bytes) {
+      owned.emplace_back(bytes);
+      return owned.back();
+    }
+    ResponseHeader& header(uint32_t tag) {
+      headers.push_back(ResponseHeader{tag, Ok, 0, 0, 0});
+      return headers.back();
+    }
+    void clear() {
+      iov.clear();
+      owned.clear();
+      headers.clear();
+    }
+  };
+
+  std::string socket_path_;
+  std::string model_path_;
+  std::string index_path_;
+  bool reload_any_path_;
+  std::shared_ptr<const Served> served_; // use atomic_load/store
+  std::mutex reload_lock_;
+  int listen_fd_ = -1;
+  std::atomic<bool> stop_{false};
+  std::atomic<bool> reload_requested_{false};
+
+  struct Connection {
+    int fd;
+    std::atomic<bool> done{false};
+    std::thread thread;
+  };
+  std::mutex connections_lock_;
+  std::list<Connection> connections_;
+
+  void error(Batch& out, ResponseHeader& h, const std::string& message) {
+    h.status = Error;
+    h.count = 0;
+    auto& buf = out.buffer(message.size());
+    std::memcpy(buf.data(), message.data(), message.size());
+    h.bytes = buf.size();
+    out.add(&h, sizeof(h));
+    out.add(buf.data(), buf.size());
+  }
+
+  /// Answer a single request, appending the response to out.
+  void handle(const RequestHeader& req,
+              const char* payload,
+              const Served& served,
+              Batch& out) {
+    const Model& model = served.model;
+    auto& h = out.header(req.tag);
+    h.dim = model.dim();
+    const size_t dim = model.dim();
+    auto ids = reinterpret_cast<const uint32_t*>(payload);
+    const size_t num_ids = req.bytes / sizeof(uint32_t);
+    auto check_ids = [&]() {
+      if (req.bytes % sizeof(uint32_t) != 0) { return false; }
+      for (size_t i = 0; i < num_ids; i++) {
+        if (ids[i] >= model.size()) { return false; }
+      }
+      return true;
+    };
+    auto for_each_line = [&](auto f) {
+      std::string_view text(payload, req.bytes);
+      size_t n = 0;
+      while (not text.empty()) {
+        size_t end = std::min(text.find('\n'), text.size());
+        f(text.substr(0, end), n++);
+        text.remove_prefix(std::min(end + 1, text.size()));
+      }
+      return n;
+    };
+
+    switch (req.type) {
+      case Info: {
+        h.count = model.size();
+        out.add(&h, sizeof(h));
+        break;
+      }
+      case Lookup: {
+        size_t n = for_each_line([](std::string_view, size_t) {});
+        if (n * sizeof(uint32_t) > MAX_REQUEST_BYTES) {
+          return error(out, h, "Response would be too large");
+        }
+        auto& buf = out.buffer(n * sizeof(uint32_t));
+        auto result = reinterpret_cast<uint32_t*>(buf.data());
+        for_each_line([&](std::string_view word, size_t i) {
+          result[i] = model.lookup(word);
+        });
+        h.count = n;
+        h.bytes = buf.size();
+        out.add(&h, sizeof(h));
+        out.add(buf.data(), buf.size());
+        break;
+      }
+      case Vectors: {
+        if (not check_ids()) { return error(out, h, "Invalid word indices"); }
+        if (num_ids * dim * sizeof(float) > MAX_REQUEST_BYTES) {
+          return error(out, h, "Response would be too large");
+        }
+        h.count = num_ids;
+        h.bytes = num_ids * dim * sizeof(float);
+        out.add(&h, sizeof(h));
+        for (size_t i = 0; i < num_ids; i++) {
+          out.add(model.vector(ids[i]), dim * sizeof(float));
+        }
+        break;
+      }
+      case Sentences: {
+        size_t n = for_each_line([](std::string_view, size_t) {});
+        if (n * dim * sizeof(float) > MAX_REQUEST_BYTES) {
+          return error(out, h, "Response would be too large");
+        }
+        auto& buf = out.buffer(n * dim * sizeof(float));
+        auto result = reinterpret_cast<float*>(buf.data());
+        static thread_local std::vector<std::string_view> words;
+        static thread_local std::vector<Word> sent;
+        for_each_line([&](std::string_view line, size_t i) {
+          words.clear();
+          sent.clear();
+          split(words, line, ' ');
+          for (auto w : words) { sent.push_back(model.lookup(w)); }
+          model.mean(sent, result + i * dim);
+        });
+        h.count = n;
+        h.bytes = buf.size();
+        out.add(&h, sizeof(h));
+        out.add(buf.data(), buf.size());
+        break;
+      }
+      case Neighbors: {
+        if (not check_ids()) { return error(out, h, "Invalid word indices"); }
+        struct Neighbor {
+          uint32_t id;
+          float sim;
+        };
+        if (req.k > model.size()) {
+          return error(out, h, "Number of neighbors is above vocabulary size");
+        }
+        if (num_ids * req.k * sizeof(Neighbor) > MAX_REQUEST_BYTES) {
+          return error(out, h, "Response would be too large");
+        }
+        auto& buf = out.buffer(num_ids * req.k * sizeof(Neighbor));
+        auto result = reinterpret_cast<Neighbor*>(buf.data());
+        for (size_t i = 0; i < num_ids; i++) {
+          auto found = served.index
+                           ? served.index->neighbors(ids[i], req.k)
+                           : model.top_k(model.vector(ids[i]), req.k, ids[i]);
+          for (size_t j = 0; j < req.k; j++) {
+            result[i * req.k + j] =
+                j < found.size() ? Neighbor{found[j].first, found[j].second}
+                                 : Neighbor{Model::NONE, 0};
+          }
+        }
+        h.count = num_ids;
+        h.bytes = buf.size();
+        out.add(&h, sizeof(h));
+        out.add(buf.data(), buf.size());
+        break;
+      }
+      case Words: {
+        if (not check_ids()) { return error(out, h, "Invalid word indices"); }
+        size_t bytes = 0;
+        for (size_t i = 0; i < num_ids; i++) {
+          bytes += model.word(ids[i]).size() + 1;
+        }
+        if (bytes > MAX_REQUEST_BYTES) {
+          return error(out, h, "Response would be too large");
+        }
+        h.count = num_ids;
+        h.bytes = bytes;
+        out.add(&h, sizeof(h));
+        for (size_t i = 0; i < num_ids; i++) {
+          auto w = model.word(ids[i]);
+          out.add(w.data(), w.size());
+          out.add("\n", 1);
+        }
+        break;
+      }
+      case Reload: {
+        std::string path(payload, req.bytes);
+        if (not reload_any_path_ and not path.empty()) {
+          std::lock_guard<std::mutex> lock(reload_lock_);
+          if (path != model_path_) {
+            return error(out, h, "Reloading another model path is not allowed");
+          }
+        }
+        try {
+          reload(path);
+          out.add(&h, sizeof(h));
+        } catch (const std::exception& e) { error(out, h, e.what()); }
+        break;
+      }
+      default: return error(out, h, "Unknown request type");
+    }
+  }
+
+  void serve_connection(Connection& c) {
+    std::vector<char> in(1 << 16);
+    size_t begin = 0, end = 0;
+    Batch out;
+    std::vector<std::shared_ptr<const Served>> used; // models out refers to
+    while (true) {
+      if (end == in.size()) { in.resize(2 * in.size()); }
+      ssize_t r = read(c.fd, in.data() + end, in.size() - end);
+      if (r < 0 and errno == EINTR) { continue; }
+      if (r <= 0) { break; }
+      end += r;
+
+      // Answer every complete request received so far
+      out.clear();
+      used.assign(1, std::atomic_load(&served_));
+      bool ok = true;
+      while (end - begin >= sizeof(RequestHeader)) {
+        RequestHeader req;
+        std::memcpy(&req, in.data() + begin, sizeof(req));
+        if (req.bytes > MAX_REQUEST_BYTES) {
+          ok = false;
+          break;
+        }
+        if (end - begin < sizeof(req) + req.bytes) {
+          if (sizeof(req) + req.bytes > in.size()) {
+            in.resize(sizeof(req) + req.bytes);
+          }
+          break;
+        }
+        try {
+          handle(req, in.data() + begin + sizeof(req), *used.back(), out);
+        } catch (const std::exception& e) {
+          // E.g. out of memory. The response may be partly written, so
+          // answer with an error and close only this connection.
+          error(out, out.header(req.tag), e.what());
+          ok = false;
+          break;
+        }
+        begin += sizeof(req) + req.bytes;
+        if (req.type == Reload) { used.push_back(std::atomic_load(&served_)); }
+      }
+      if (not write_all(c.fd, out.iov) or not ok) { break; }
+      // Move the incomplete request, if any, to the front
+      std::memmove(in.data(), in.data() + begin, end - begin);
+      end -= begin;
+      begin = 0;
+    }
+    c.done = true;
+  }
+
+ public:
+  static constexpr uint32_t MAX_REQUEST_BYTES = 1 << 30;
+
+  /// Load a model and listen on a socket.
+  ///
+  /// @param[in] socket_path path of the Unix domain socket to create
+  /// @param[in] model_path path to a model saved by Model::save()
+  /// @param[in] index_path optional path to an HNSW index over the model,
+  /// used for neighbor queries instead of exact search
+  /// @param[in] reload_any_path if true, Reload requests may name any model
+  /// path, otherwise only the current one
+  Server(const std::string& socket_path,
+         const std::string& model_path,
+         const std::string& index_path = "",
+         bool reload_any_path = false)
+      : socket_path_(socket_path),
+        model_path_(model_path),
+        index_path_(index_path),
+        reload_any_path_(reload_any_path),
+        served_(std::make_shared<Served>(model_path, index_path)) {
+    listen_fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    KOAN_ASSERT(listen_fd_ >= 0, "Could not create socket!");
+    auto addr = socket_address(socket_path_);
+    unlink(socket_path_.c_str());
+    KOAN_ASSERT(bind(listen_fd_, (sockaddr*)&addr, sizeof(addr)) == 0 and
+                    listen(listen_fd_, 128) == 0,
+                "Could not listen on '" + socket_path_ +
+                    "': " + std::strerror(errno));
+  }
+
+  ~Server() {
+    stop();
+    close(listen_fd_);
+    unlink(socket_path_.c_str());
+  }
+
+  const Model& model() const { return std::atomic_load(&served_)->model; }
+
+  /// Map a new model (and reload the index, if any) and swap it in.
+  ///
+  /// @param[in] model_path path to the new model, or empty to reload the
+  /// current path (e.g. after it was replaced by renaming a file onto it)
+  /// @returns path of the new model
+  std::string reload(const std::string& model_path = "") {
+    std::lock_guard<std::mutex> lock(reload_lock_);
+    std::string path = model_path.empty() ? model_path_ : model_path;
+    std::shared_ptr<const Served> served =
+        std::make_shared<Served>(path, index_path_);
+    std::atomic_store(&served_, served);
+    model_path_ = path;
+    return path;
+  }
+
+  /// Ask run() to reload the model from its current path. Safe to call from
+  /// a signal handler.
+  void request_reload() { reload_requested_ = true; }
+
+  /// Ask run() to return. Safe to call from a signal handler.
+  void request_stop() { stop_ = true; }
+
+  /// Accept and serve connections until stop() or request_stop() is called.
+  void run() {
+    while (not stop_) {
+      pollfd p{listen_fd_, POLLIN, 0};
+      int ready = poll(&p, 1, 100);
+      if (reload_requested_.exchange(false)) {
+        try {
+          std::cout << "Reloaded " << reload() << std::endl;
+        } catch (const std::exception& e) {
+          std::cerr << "Reload failed: " << e.what() << std::endl;
+        }
+      }
+      std::lock_guard<std::mutex> lock(connections_lock_);
+      for (auto it = connections_.begin(); it != connections_.end();) {
+        if (it->done) { // reap closed connections
+          it->thread.join();
+          close(it->fd);
+          it = connections_.erase(it);
+        } else {
+          it++;
+        }
+      }
+      if (ready <= 0 or stop_) { continue; }
+      int fd = accept(listen_fd_, nullptr, nullptr);
+      if (fd < 0) { continue; }
+      auto& c = connections_.emplace_back();
+      c.fd = fd;
+      c.thread = std::thread([this, &c]() { serve_connection(c); });
+    }
+  }
+
+  /// Stop accepting connections, and close existing ones.
+  void stop() {
+    stop_ = true;
+    std::lock_guard<std::mutex> lock(connections_lock_);
+    for (auto& c : connections_) {
+      shutdown(c.fd, SHUT_RDWR);
+      c.thread.join();
+      close(c.fd);
+    }
+    connections_.clear();
+  }
+};
+
+/// Blocking client of Server, with explicit send/receive so that requests can
+/// be pipelined.
+class Client {
+ private:
+  int fd_ = -1;
+
+ public:
+  /// Connect to a server.
+  ///
+  /// @param[in] socket_path path of the server's socket
+  Client(const std::string& socket_path) {
+    fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    KOAN_ASSERT(fd_ >= 0, "Could not create socket!");
+    auto addr = socket_address(socket_path);
+    KOAN_ASSERT(connect(fd_, (sockaddr*)&addr, sizeof(addr)) == 0,
+                "Could not connect to '" + socket_path +
+                    "': " + std::strerror(errno));
+  }
+
+  Client(const Client&) = delete;
+  Client& operator=(const Client&) = delete;
+
+  ~Client() { close(fd_); }
+
+  /// Send a request without waiting for its response.
+  void send(Type type, uint32_t tag, const void* payload, size_t bytes,
+            uint32_t k = 0) {
+    RequestHeader req{tag, type, k, uint32_t(bytes)};
+    std::vector<iovec> iov{{&req, sizeof(req)},
+                           {const_cast<void*>(payload), bytes}};
+    KOAN_ASSERT(write_all(fd_, iov), "Could not send request!");
+  }
+
+  void send(Type type, uint32_t tag, const std::string& payload,
+            uint32_t k = 0) {
+    send(type, tag, payload.data(), payload.size(), k);
+  }
+
+  void send(Type type, uint32_t tag, const std::vector<uint32_t>& ids,
+            uint32_t k = 0) {
+    send(type, tag, ids.data(), ids.size() * sizeof(uint32_t), k);
+  }
+
+  /// Receive the next response.
+  ///
+  /// @param[out] payload response payload
+  /// @returns response header
+  ResponseHeader receive(std::vector<char>& payload) {
+    ResponseHeader h;
+    KOAN_ASSERT(read_all(fd_, &h, sizeof(h)), "Connection closed!");
+    payload.resize(h.bytes);
+    KOAN_ASSERT(read_all(fd_, payload.data(), h.bytes), "Connection closed!");
+    return h;
+  }
+};
+
+} // namespace serve
+} // namespace koan
+
+#endif
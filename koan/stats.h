@@ -0,0 +1,143 @@
+/*
+** Copyright 2020 Bloomberg Finance L.P.
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef KOAN_STATS_H
+#define KOAN_STATS_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+#include "extern/mew.h"
+
+namespace koan {
+
+/// Training statistics of one thread, in a cache line of its own so that
+/// workers never write to the same line. Fields are atomic only so that they
+/// can be read (e.g. by progress displays) while being written; the owning
+/// thread updates them with relaxed loads and stores, which compile to plain
+/// moves, rather than read-modify-writes.
+struct alignas(64) ThreadStats {
+  std::atomic<size_t> sents{0};        // in this epoch
+  std::atomic<size_t> tokens{0};       // trained on in this epoch
+  std::atomic<size_t> total_tokens{0}; // trained on over all epochs
+  std::atomic<size_t> read_tokens{0};  // before filtering, in this epoch
+  std::atomic<float> lr{0};            // last learning rate used
+
+  /// Record a trained sentence. Only the owning thread may call this.
+  ///
+  /// @param[in] trained number of tokens left after filtering
+  /// @param[in] read number of tokens in the sentence
+  /// @param[in] learning_rate learning rate used
+  void add_sentence(size_t trained, size_t read, float learning_rate) {
+    auto add = [](std::atomic<size_t>& x, size_t n) {
+      x.store(x.load(std::memory_order_relaxed) + n,
+              std::memory_order_relaxed);
+    };
+    add(sents, 1);
+    add(tokens, trained);
+    add(total_tokens, trained);
+    add(read_tokens, read);
+    lr.store(learning_rate, std::memory_order_relaxed);
+  }
+};
+
+/// Per-thread training statistics, aggregated over threads only when read.
+class TrainStats {
+ private:
+  std::vector<ThreadStats> threads_;
+
+ public:
+  /// A field aggregated over threads each time it is converted to T, which
+  /// can be passed to mew displays in place of a std::atomic<T>.
+  template <typename T>
+  class Aggregate {
+   private:
+    const TrainStats& stats_;
+    std::atomic<T> ThreadStats::*field_;
+    bool max_; // max instead of sum
+
+   public:
+    Aggregate(const TrainStats& stats,
+              std::atomic<T> ThreadStats::*field,
+              bool max = false)
+        : stats_(stats), field_(field), max_(max) {}
+
+    operator T() const {
+      T value = 0;
+      for (auto& t : stats_.threads_) {
+        T x = (t.*field_).load(std::memory_order_relaxed);
+        value = max_ ? std::max(value, x) : value + x;
+      }
+      return value;
+    }
+  };
+
+  /// @param[in] threads number of threads that update statistics
+  TrainStats(size_t threads) : threads_(std::max<size_t>(threads, 1)) {}
+
+  ThreadStats& operator[](size_t tid) { return threads_[tid]; }
+
+  Aggregate<size_t> sum(std::atomic<size_t> ThreadStats::*field) const {
+    return {*this, field};
+  }
+
+  /// Maximum learning rate over threads, i.e. that of the thread that is
+  /// furthest behind in the (decreasing) schedule.
+  Aggregate<float> lr() const { return {*this, &ThreadStats::lr, true}; }
+
+  /// Zero per-epoch statistics. Must not be called while training.
+  void new_epoch() {
+    for (auto& t : threads_) {
+      t.sents = 0;
+      t.tokens = 0;
+      t.read_tokens = 0;
+    }
+  }
+};
+
+/// A value computed by a function each time it is converted to T, e.g. to
+/// pass statistics derived from others to mew displays.
+template <typename T>
+class Gauge {
+ private:
+  std::function<T()> value_;
+
+ public:
+  Gauge(std::function<T()> value) : value_(std::move(value)) {}
+
+  operator T() const { return value_(); }
+};
+
+} // namespace koan
+
+namespace mew {
+
+template <typename T>
+struct ProgressTraits<koan::TrainStats::Aggregate<T>> {
+  using value_type = T;
+};
+
+template <typename T>
+struct ProgressTraits<koan::Gauge<T>> {
+  using value_type = T;
+};
+
+} // namespace mew
+
+#endif
@@ -0,0 +1,192 @@
+/*
+** Copyright 2020 Bloomberg Finance L.P.
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef KOAN_SUBWORD_H
+#define KOAN_SUBWORD_H
+
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "def.h"
+#include "util.h"
+
+namespace koan {
+
+/// fastText style character n-gram decomposition of the vocabulary.
+///
+/// Input embedding of a word is the average of its own row and the rows of its
+/// hashed character n-gram buckets. Buckets are stored in the same table right
+/// after the words, i.e. bucket b is row (vocab size + b). The rows composing
+/// each word are precomputed once into a flat array (CSR layout), so training
+/// never hashes strings.
+class Subwords {
+ private:
+  std::vector<size_t> offsets_; // rows of word w are ids_[offsets_[w],
+                                // offsets_[w + 1])
+  std::vector<Word> ids_;
+  unsigned minn_ = 0, maxn_ = 0;
+  size_t buckets_ = 0;
+
+ public:
+  /// 32 bit FNV-1a hash
+  static uint32_t hash(std::string_view s) {
+    uint32_t h = 2166136261;
+    for (unsigned char c : s) {
+      h ^= c;
+      h *= 16777619;
+    }
+    return h;
+  }
+
+  /// Call f on the bucket of each character n-gram of word, where
+  /// minn <= n <= maxn (in UTF-8 characters). Word is wrapped in '<' and '>'
+  /// as in fastText, and the wrapped word itself is not an n-gram.
+  template <typename F>
+  static void ngrams(std::string_view word,
+                     unsigned minn,
+                     unsigned maxn,
+                     size_t buckets,
+                     F f) {
+    std::string s;
+    s.reserve(word.size() + 2);
+    s += '<';
+    s += word;
+    s += '>';
+    std::string ngram;
+    for (size_t i = 0; i < s.size(); i++) {
+      if ((s[i] & 0xC0) == 0x80) { continue; } // not the first byte of a char
+      ngram.clear();
+      for (size_t j = i, n = 1; j < s.size() and n <= maxn; n++) {
+        ngram.push_back(s[j++]);
+        while (j < s.size() and (s[j] & 0xC0) == 0x80) {
+          ngram.push_back(s[j++]);
+        }
+        if (n >= minn and not(n == 1 and (i == 0 or j == s.size()))) {
+          f(hash(ngram) % buckets);
+        }
+      }
+    }
+  }
+
+  Subwords() : offsets_(1, 0) {}
+
+  /// Precompute rows composing each word in the vocabulary.
+  ///
+  /// @param[in] words vocabulary, in index order
+  /// @param[in] minn minimum n-gram length
+  /// @param[in] maxn maximum n-gram length
+  /// @param[in] buckets number of hash buckets
+  /// @param[in] threads number of threads to use
+  Subwords(const std::vector<std::string_view>& words,
+           unsigned minn,
+           unsigned maxn,
+           size_t buckets,
+           unsigned threads = 1)
+      : offsets_(words.size() + 1, 0),
+        minn_(minn),
+        maxn_(maxn),
+        buckets_(buckets) {
+    KOAN_ASSERT(minn > 0 and minn <= maxn, "Invalid n-gram lengths!");
+    KOAN_ASSERT(buckets > 0);
+    KOAN_ASSERT(words.size() + buckets < std::numeric_limits<Word>::max(),
+                "Too many buckets for Word type!");
+    const size_t n = words.size();
+
+    auto each_row = [&](size_t w, auto f) {
+      f(Word(w));
+      if (words[w] != UNK) {
+        ngrams(words[w], minn_, maxn_, buckets_, [&](size_t b) {
+          f(Word(n + b));
+        });
+      }
+    };
+
+    // Count, then fill, so that the whole index is a single allocation
+    parallel_for(
+        0,
+        n,
+        [&](size_t w, size_t) {
+          size_t count = 0;
+          each_row(w, [&](Word) { count++; });
+          offsets_[w + 1] = count;
+        },
+        threads);
+    for (size_t w = 0; w < n; w++) { offsets_[w + 1] += offsets_[w]; }
+    ids_.resize(offsets_[n]);
+    parallel_for(
+        0,
+        n,
+        [&](size_t w, size_t) {
+          size_t pos = offsets_[w];
+          each_row(w, [&](Word row) { ids_[pos++] = row; });
+        },
+        threads);
+  }
+
+  bool empty() const { return ids_.empty(); }
+
+  /// Number of words covered
+  size_t size() const { return offsets_.size() - 1; }
+
+  size_t num_buckets() const { return buckets_; }
+  unsigned minn() const { return minn_; }
+  unsigned maxn() const { return maxn_; }
+
+  /// Rows of the table composing word w (its own row first)
+  const Word* begin(Word w) const { return ids_.data() + offsets_[w]; }
+  const Word* end(Word w) const { return ids_.data() + offsets_[w + 1]; }
+  size_t num_rows(Word w) const { return offsets_[w + 1] - offsets_[w]; }
+
+  /// Compute the input embedding of an in-vocabulary word.
+  ///
+  /// @param[in] w word index
+  /// @param[in] table embedding table of words followed by buckets
+  /// @param[out] out composed embedding
+  void compose(Word w, const Table& table, Vector& out) const {
+    out = Vector::Zero(table[w].size());
+    for (auto row = begin(w); row != end(w); row++) { out += table[*row]; }
+    out /= Real(num_rows(w));
+  }
+
+  /// Compute the embedding of an out-of-vocabulary word from its n-gram
+  /// buckets alone.
+  ///
+  /// @param[in] word OOV word
+  /// @param[in] buckets bucket embeddings (without word rows)
+  /// @param[in] minn minimum n-gram length used in training
+  /// @param[in] maxn maximum n-gram length used in training
+  /// @returns composed embedding, zero if the word has no n-grams
+  static Vector compose_oov(std::string_view word,
+                            const Table& buckets,
+                            unsigned minn,
+                            unsigned maxn) {
+    Vector out = Vector::Zero(buckets.empty() ? 0 : buckets[0].size());
+    size_t count = 0;
+    ngrams(word, minn, maxn, buckets.size(), [&](size_t b) {
+      out += buckets[b];
+      count++;
+    });
+    if (count > 0) { out /= Real(count); }
+    return out;
+  }
+};
+
+} // namespace koan
+
+#endif
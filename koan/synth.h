@@ -0,0 +1,247 @@
+/*
+** Copyright 2020 Bloomberg Finance L.P.
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef KOAN_SYNTH_H
+#define KOAN_SYNTH_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifdef KOAN_ENABLE_ZIP
+#include <zlib.h>
+#endif
+
+#include "def.h"
+#include "sample.h"
+
+namespace koan {
+
+/// @returns Zipf distribution p(i) ~ 1 / (i + 1)^s over n outcomes, i.e.
+/// word frequencies of a vocabulary sorted by count
+inline std::vector<Real> zipf_probs(size_t n, double s = 1) {
+  std::vector<Real> probs(n);
+  double sum = 0;
+  for (size_t i = 0; i < n; i++) { sum += probs[i] = std::pow(i + 1., -s); }
+  for (auto& p : probs) { p /= sum; }
+  return probs;
+}
+
+/// Generates a synthetic corpus whose word frequencies follow Zipf's law, so
+/// that performance can be measured and reported without sharing data.
+///
+/// Words are named by their frequency rank in bijective base 26 ("a", ...,
+/// "z", "aa", "ab", ...), so that frequent words are short, as in natural
+/// language. The same parameters always generate the same corpus.
+class SyntheticCorpus {
+ public:
+  struct Params {
+    size_t vocab_size = 100'000;
+    double zipf = 1;                 // exponent s of p(rank) ~ 1 / rank^s
+    size_t tokens = 10'000'000;      // in total
+    double sentence_length = 20;     // mean
+    std::string lengths = "poisson"; // fixed | uniform | poisson
+    unsigned seed = 123457;
+  };
+
+  /// Header of the binary format, which is followed by the vocabulary (a
+  /// uint32 vocabulary size, and each word as a uint32 length and its
+  /// characters), then by each sentence as a uint32 length and uint32 word
+  /// indices, in native byte order.
+  static constexpr char BINARY_MAGIC[8] = {
+      'K', 'O', 'A', 'N', 'S', 'Y', 'N', '1'};
+
+ private:
+  Params params_;
+
+ public:
+  SyntheticCorpus(Params params) : params_(std::move(params)) {
+    KOAN_ASSERT(params_.vocab_size > 0 and params_.vocab_size <= UINT32_MAX,
+                "Vocabulary size should be in [1, 2^32)!");
+    KOAN_ASSERT(params_.sentence_length >= 1,
+                "Mean sentence length should be >= 1!");
+    KOAN_ASSERT(params_.lengths == "fixed" or params_.lengths == "uniform" or
+                    params_.lengths == "poisson",
+                "Unknown sentence length distribution: " + params_.lengths);
+  }
+
+  const Params& params() const { return params_; }
+
+  /// @returns name of word of a frequency rank
+  static std::string word(size_t rank) {
+    std::string w;
+    for (size_t n = rank + 1; n > 0; n = (n - 1) / 26) {
+      w += char('a' + (n - 1) % 26);
+    }
+    std::reverse(w.begin(), w.end());
+    return w;
+  }
+
+  /// Call f on each sentence, until params().tokens words were generated.
+  /// The last sentence is cut short if needed.
+  ///
+  /// @tparam F callable on const Sentence&
+  template <typename F>
+  void generate(F f) const {
+    AliasSampler words(zipf_probs(params_.vocab_size, params_.zipf));
+    words.set_seed(params_.seed);
+    std::mt19937 rng(params_.seed);
+    const double mean = params_.sentence_length;
+    std::uniform_int_distribution<size_t> uniform(1, 2 * size_t(mean) - 1);
+    std::poisson_distribution<size_t> poisson(mean - 1);
+    Sentence sent;
+    for (size_t left = params_.tokens; left > 0;) {
+      size_t len = params_.lengths == "fixed"     ? size_t(mean)
+                   : params_.lengths == "uniform" ? uniform(rng)
+                                                  : 1 + poisson(rng);
+      len = std::min(len, left);
+      sent.clear();
+      for (size_t i = 0; i < len; i++) { sent.push_back(words.sample()); }
+      f(static_cast<const Sentence&>(sent));
+      left -= len;
+    }
+  }
+
+  /// Write the corpus to a file.
+  ///
+  /// @param[in] path path of file
+  /// @param[in] format "text" (a sentence of space separated words per line,
+  /// as koan reads them), "gzip" (the same, gzipped, which requires
+  /// KOAN_ENABLE_ZIP) or "binary" (see BINARY_MAGIC and read_binary())
+  /// @returns number of sentences written
+  size_t write(const std::string& path, const std::string& format) const {
+    std::vector<std::string> vocab;
+    for (size_t i = 0; i < params_.vocab_size; i++) {
+      vocab.push_back(word(i));
+    }
+    size_t sentences = 0;
+    bool ok = true; // every write was complete, e.g. the disk is not full
+    if (format == "binary") {
+      FILE* out = fopen(path.c_str(), "wb");
+      KOAN_ASSERT(out, "Could not open '" + path + "' to write corpus!");
+      auto write = [&](const void* p, size_t size, size_t n) {
+        ok = ok and fwrite(p, size, n, out) == n;
+      };
+      auto put = [&](uint32_t x) { write(&x, sizeof(x), 1); };
+      write(BINARY_MAGIC, 1, sizeof(BINARY_MAGIC));
+      put(vocab.size());
+      for (auto& w : vocab) {
+        put(w.size());
+        write(w.data(), 1, w.size());
+      }
+      std::vector<uint32_t> ids;
+      generate([&](const Sentence& s) {
+        ids.assign(s.begin(), s.end());
+        put(ids.size());
+        write(ids.data(), sizeof(uint32_t), ids.size());
+        sentences++;
+      });
+      ok = fclose(out) == 0 and ok;
+      KOAN_ASSERT(ok, "Could not write corpus to '" + path + "'!");
+      return sentences;
+    }
+
+    std::string line;
+    auto to_line = [&](const Sentence& s) {
+      line.clear();
+      for (auto w : s) {
+        if (not line.empty()) { line += ' '; }
+        line += vocab[w];
+      }
+      line += '\n';
+      sentences++;
+    };
+    if (format == "gzip") {
+#ifdef KOAN_ENABLE_ZIP
+      gzFile out = gzopen(path.c_str(), "wb");
+      KOAN_ASSERT(out, "Could not open '" + path + "' to write corpus!");
+      generate([&](const Sentence& s) {
+        to_line(s);
+        ok = ok and gzwrite(out, line.data(), line.size()) == int(line.size());
+      });
+      ok = gzclose(out) == Z_OK and ok;
+      KOAN_ASSERT(ok, "Could not write corpus to '" + path + "'!");
+      return sentences;
+#else
+      KOAN_ASSERT(false,
+                  "Writing gzip requires building with KOAN_ENABLE_ZIP!");
+#endif
+    }
+    KOAN_ASSERT(format == "text", "Unknown corpus format: " + format);
+    FILE* out = fopen(path.c_str(), "w");
+    KOAN_ASSERT(out, "Could not open '" + path + "' to write corpus!");
+    generate([&](const Sentence& s) {
+      to_line(s);
+      ok = ok and fwrite(line.data(), 1, line.size(), out) == line.size();
+    });
+    ok = fclose(out) == 0 and ok;
+    KOAN_ASSERT(ok, "Could not write corpus to '" + path + "'!");
+    return sentences;
+  }
+
+  /// Read a corpus written in binary format.
+  ///
+  /// @param[in] path path of file
+  /// @param[in] f called on each sentence
+  /// @returns vocabulary, indexed by the word indices of sentences
+  /// @tparam F callable on const Sentence&
+  template <typename F>
+  static std::vector<std::string> read_binary(const std::string& path, F f) {
+    FILE* in = fopen(path.c_str(), "rb");
+    KOAN_ASSERT(in, "Could not open corpus '" + path + "'!");
+    bool ok = true;
+    auto read = [&](void* p, size_t size, size_t n) {
+      ok = ok and fread(p, size, n, in) == n;
+      return ok;
+    };
+    auto get = [&]() {
+      uint32_t x = 0;
+      read(&x, sizeof(x), 1);
+      return x;
+    };
+    char magic[sizeof(BINARY_MAGIC)];
+    read(magic, 1, sizeof(magic));
+    ok = ok and std::equal(magic, magic + sizeof(magic), BINARY_MAGIC);
+    std::vector<std::string> vocab(ok ? get() : 0);
+    for (auto& w : vocab) {
+      w.resize(get());
+      read(w.data(), 1, w.size());
+    }
+    std::vector<uint32_t> ids;
+    Sentence sent;
+    uint32_t len;
+    while (ok and fread(&len, sizeof(len), 1, in) == 1) {
+      ids.resize(len);
+      if (not read(ids.data(), sizeof(uint32_t), len)) { break; }
+      ok = std::all_of(ids.begin(), ids.end(), [&](uint32_t id) {
+        return id < vocab.size();
+      });
+      sent.assign(ids.begin(), ids.end());
+      if (ok) { f(static_cast<const Sentence&>(sent)); }
+    }
+    fclose(in);
+    KOAN_ASSERT(ok, "Corpus '" + path + "' is not a valid binary corpus!");
+    return vocab;
+  }
+};
+
+} // namespace koan
+
+#endif
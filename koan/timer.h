@@ -17,7 +17,12 @@
 #ifndef KOAN_TIMER_H
 #define KOAN_TIMER_H
 
+#include <algorithm>
 #include <chrono>
+#include <string>
+#include <vector>
+
+#include "extern/tblr.h"
 
 namespace koan {
 
@@ -33,6 +38,139 @@ class Timer {
   }
 };
 
+/// Registry of named phases, each accumulating time and number of calls
+/// separately per thread. The slots of each thread are stored inline in
+/// their own cache lines, so that threads never share a cache line.
+///
+/// Names are paths separated by '/', e.g. "train/batch/kernel", and are
+/// printed as an indented tree in registration order. Register all phases
+/// before any thread adds to them.
+class Profile {
+ public:
+  using Phase = size_t;
+
+ private:
+  struct Slot {
+    double seconds = 0;
+    size_t calls = 0;
+  };
+  static constexpr size_t SLOTS_PER_LINE = 4;
+  struct alignas(64) Line {
+    Slot slots[SLOTS_PER_LINE];
+  };
+
+  std::vector<std::string> names_;
+  size_t threads_;
+  size_t lines_per_thread_ = 0;
+  std::vector<Line> lines_; // lines_per_thread_ per thread
+
+  Slot& slot(Phase p, size_t tid) {
+    return lines_[tid * lines_per_thread_ + p / SLOTS_PER_LINE]
+        .slots[p % SLOTS_PER_LINE];
+  }
+  const Slot& slot(Phase p, size_t tid) const {
+    return const_cast<Profile*>(this)->slot(p, tid);
+  }
+
+ public:
+  /// @param[in] threads number of threads that may add to phases
+  Profile(unsigned threads = 1) : threads_(std::max(threads, 1u)) {}
+
+  /// Register a phase, or find it if it was already registered.
+  ///
+  /// @param[in] name path of phase, e.g. "train/batch"
+  Phase phase(const std::string& name) {
+    auto it = std::find(names_.begin(), names_.end(), name);
+    if (it != names_.end()) { return it - names_.begin(); }
+    names_.push_back(name);
+    size_t per_thread = (names_.size() + SLOTS_PER_LINE - 1) / SLOTS_PER_LINE;
+    if (per_thread > lines_per_thread_) { // add a line to each thread
+      std::vector<Line> lines(threads_ * per_thread);
+      for (size_t tid = 0; tid < threads_; tid++) {
+        std::copy_n(lines_.begin() + tid * lines_per_thread_,
+                    lines_per_thread_,
+                    lines.begin() + tid * per_thread);
+      }
+      lines_ = std::move(lines);
+      lines_per_thread_ = per_thread;
+    }
+    return names_.size() - 1;
+  }
+
+  /// Add time to a phase, from thread tid.
+  void add(Phase p, double seconds, size_t tid = 0) {
+    auto& s = slot(p, tid);
+    s.seconds += seconds;
+    s.calls++;
+  }
+
+  /// @returns time spent in a phase, summed over threads
+  double seconds(Phase p) const {
+    double sum = 0;
+    for (size_t tid = 0; tid < threads_; tid++) { sum += slot(p, tid).seconds; }
+    return sum;
+  }
+
+  /// @returns number of times a phase was entered, summed over threads
+  size_t calls(Phase p) const {
+    size_t sum = 0;
+    for (size_t tid = 0; tid < threads_; tid++) { sum += slot(p, tid).calls; }
+    return sum;
+  }
+
+  /// Adds the lifetime of the scope to a phase.
+  class Scope {
+   private:
+    Profile& profile_;
+    Phase phase_;
+    size_t tid_;
+    Timer t_;
+
+   public:
+    Scope(Profile& profile, Phase phase, size_t tid = 0)
+        : profile_(profile), phase_(phase), tid_(tid) {}
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+    ~Scope() { profile_.add(phase_, t_.s(), tid_); }
+  };
+
+  Scope scope(Phase p, size_t tid = 0) { return Scope(*this, p, tid); }
+
+  /// Print phases that were entered as a table. Seconds are summed over
+  /// threads, and the slowest thread is shown for phases that ran on more
+  /// than one.
+  void print() const {
+    tblr::Table table;
+    table.layout(tblr::markdown())
+        .aligns({tblr::Left, tblr::Right, tblr::Right, tblr::Right})
+        .precision(3)
+        .fixed();
+    table << "Phase" << "Calls" << "Seconds" << "Slowest thread"
+          << tblr::endr;
+    for (Phase p = 0; p < names_.size(); p++) {
+      if (calls(p) == 0) { continue; }
+      auto& name = names_[p];
+      size_t depth = std::count(name.begin(), name.end(), '/');
+      auto leaf = name.substr(name.rfind('/') + 1);
+      double slowest = 0;
+      size_t active = 0;
+      for (size_t tid = 0; tid < threads_; tid++) {
+        slowest = std::max(slowest, slot(p, tid).seconds);
+        active += slot(p, tid).calls > 0;
+      }
+      table << std::string(2 * depth, ' ') + leaf << std::to_string(calls(p))
+            << seconds(p);
+      if (active > 1) {
+        table << slowest;
+      } else {
+        table << "";
+      }
+      table << tblr::endr;
+    }
+    table.print();
+  }
+};
+
 } // namespace koan
 
 #endif
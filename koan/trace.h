@@ -0,0 +1,256 @@
+/*
+** Copyright 2020 Bloomberg Finance L.P.
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef KOAN_TRACE_H
+#define KOAN_TRACE_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "def.h"
+#include "util.h"
+
+/// Record the lifetime of the enclosing scope as a trace event named name (a
+/// string literal). Compiles to nothing unless KOAN_ENABLE_TRACE is defined,
+/// e.g. with cmake -DKOAN_ENABLE_TRACE=ON.
+#ifdef KOAN_ENABLE_TRACE
+#define KOAN_TRACE_SCOPE(name)                                                 \
+  ::koan::trace::Scope KOAN_TRACE_CAT(koan_trace_scope_, __LINE__)(name)
+#else
+#define KOAN_TRACE_SCOPE(name) static_cast<void>(0)
+#endif
+
+#define KOAN_TRACE_CAT_(a, b) a##b
+#define KOAN_TRACE_CAT(a, b) KOAN_TRACE_CAT_(a, b)
+
+namespace koan {
+namespace trace {
+
+#ifdef KOAN_ENABLE_TRACE
+constexpr bool ENABLED = true;
+#else
+constexpr bool ENABLED = false;
+#endif
+
+/// A completed scope.
+struct Event {
+  const char* name;
+  uint64_t begin_ns; // since the tracer was created
+  uint64_t duration_ns;
+};
+
+/// Bounded ring of events, written by a single thread at a time without
+/// locks. Memory grows with the events recorded, up to the capacity. Once
+/// full, new events overwrite the oldest ones.
+class Ring {
+ private:
+  std::vector<Event> events_;
+  size_t capacity_;
+  std::atomic<uint64_t> written_{0};
+  unsigned tid_;
+
+ public:
+  Ring(size_t capacity, unsigned tid)
+      : capacity_(std::max<size_t>(capacity, 1)), tid_(tid) {}
+
+  void push(const Event& e) {
+    uint64_t n = written_.load(std::memory_order_relaxed);
+    size_t i = n % capacity_;
+    if (i < events_.size()) {
+      events_[i] = e;
+    } else {
+      events_.push_back(e);
+    }
+    written_.store(n + 1, std::memory_order_release);
+  }
+
+  unsigned tid() const { return tid_; }
+  uint64_t written() const { return written_.load(std::memory_order_acquire); }
+  size_t capacity() const { return capacity_; }
+  void clear() { written_.store(0, std::memory_order_release); }
+
+  /// Call f on retained events, oldest first. Must not race with push().
+  template <typename F>
+  void for_each(F f) const {
+    uint64_t n = written();
+    for (uint64_t i = n - std::min<uint64_t>(n, capacity_); i < n; i++) {
+      f(events_[i % capacity_]);
+    }
+  }
+};
+
+/// Process wide collection of rings. A thread takes a ring the first time it
+/// records an event, and gives it back when it exits (the only times a lock
+/// is taken). Since worker and reader threads are started anew for every
+/// batch, rings are reused, so that there are only as many rings (and trace
+/// tracks) as threads that ever recorded at the same time.
+class Tracer {
+ private:
+  using Clock = std::chrono::steady_clock;
+  Clock::time_point start_ = Clock::now();
+  std::mutex lock_;
+  std::vector<std::unique_ptr<Ring>> rings_;
+  std::vector<Ring*> free_; // rings of exited threads
+  size_t capacity_ = 1 << 18;
+
+  /// Gives the ring of a thread back when the thread exits.
+  struct Lease {
+    Tracer* tracer = nullptr;
+    Ring* ring = nullptr;
+    Lease() = default;
+    Lease(const Lease&) = delete;
+    Lease& operator=(const Lease&) = delete;
+    ~Lease() {
+      if (ring) {
+        std::lock_guard<std::mutex> lock(tracer->lock_);
+        tracer->free_.push_back(ring);
+      }
+    }
+  };
+
+  Tracer() = default;
+
+  static std::string escape(const char* s) {
+    std::string out;
+    for (; *s; s++) {
+      if (*s == '"' or *s == '\\') { out += '\\'; }
+      out += *s;
+    }
+    return out;
+  }
+
+ public:
+  static Tracer& get() {
+    static Tracer tracer;
+    return tracer;
+  }
+
+  uint64_t now_ns() const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() -
+                                                                start_)
+        .count();
+  }
+
+  /// Set the number of events retained per ring. Only affects rings that are
+  /// not created yet.
+  void set_capacity(size_t capacity) {
+    std::lock_guard<std::mutex> lock(lock_);
+    capacity_ = std::max<size_t>(capacity, 1);
+  }
+
+  /// @returns ring of the calling thread
+  Ring& ring() {
+    thread_local Lease lease;
+    if (not lease.ring) {
+      std::lock_guard<std::mutex> lock(lock_);
+      if (free_.empty()) {
+        rings_.push_back(std::make_unique<Ring>(capacity_, rings_.size()));
+        free_.push_back(rings_.back().get());
+      }
+      lease.tracer = this;
+      lease.ring = free_.back();
+      free_.pop_back();
+    }
+    return *lease.ring;
+  }
+
+  /// @returns number of rings, i.e. of threads that recorded at the same time
+  size_t rings() {
+    std::lock_guard<std::mutex> lock(lock_);
+    return rings_.size();
+  }
+
+  /// Drop all recorded events.
+  void clear() {
+    std::lock_guard<std::mutex> lock(lock_);
+    for (auto& r : rings_) { r->clear(); }
+  }
+
+  /// @returns number of events retained over all threads
+  size_t size() {
+    std::lock_guard<std::mutex> lock(lock_);
+    size_t n = 0;
+    for (auto& r : rings_) {
+      n += std::min<uint64_t>(r->written(), r->capacity());
+    }
+    return n;
+  }
+
+  /// Save retained events in Chrome trace event format, to be opened in
+  /// chrome://tracing or https://ui.perfetto.dev. Should be called when no
+  /// other thread is recording.
+  ///
+  /// @param[in] path output path
+  void dump(const std::string& path) {
+    std::lock_guard<std::mutex> lock(lock_);
+    FILE* out = fopen(path.c_str(), "w");
+    KOAN_ASSERT(out, "Could not open '" + path + "' to save trace!");
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", out);
+    bool first = true;
+    for (auto& r : rings_) {
+      fprintf(out,
+              "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+              "\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}",
+              first ? "" : ",\n",
+              r->tid(),
+              r->tid());
+      first = false;
+      r->for_each([&](const Event& e) {
+        fprintf(out,
+                ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+                "\"ts\":%.3f,\"dur\":%.3f}",
+                escape(e.name).c_str(),
+                r->tid(),
+                e.begin_ns / 1e3,
+                e.duration_ns / 1e3);
+      });
+    }
+    fputs("\n]}\n", out);
+    bool ok = fclose(out) == 0;
+    KOAN_ASSERT(ok, "Could not write trace to '" + path + "'!");
+  }
+};
+
+/// Records its lifetime as an event. See KOAN_TRACE_SCOPE.
+class Scope {
+ private:
+  const char* name_;
+  Ring& ring_;
+  uint64_t begin_;
+
+ public:
+  Scope(const char* name)
+      : name_(name),
+        ring_(Tracer::get().ring()),
+        begin_(Tracer::get().now_ns()) {}
+  Scope(const Scope&) = delete;
+  Scope& operator=(const Scope&) = delete;
+  ~Scope() {
+    ring_.push({name_, begin_, Tracer::get().now_ns() - begin_});
+  }
+};
+
+} // namespace trace
+} // namespace koan
+
+#endif
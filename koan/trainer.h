@@ -17,16 +17,22 @@
 #ifndef KOAN_TRAINER_H
 #define KOAN_TRAINER_H
 
+#include <atomic>
+#include <cmath>
 #include <random>
 #include <vector>
 
+#include "contention.h"
 #include "def.h"
+#include "huffman.h"
 #include "sample.h"
 #include "sigmoid.h"
+#include "subword.h"
 
 namespace koan {
 
-/// Main class to train CBOW and SG word embeddings by negative sampling.
+/// Main class to train CBOW and SG word embeddings by negative sampling or
+/// hierarchical softmax.
 class Trainer {
  public:
   /// Salient parameters of Word2Vec training.
@@ -47,6 +53,31 @@ class Trainer {
     unsigned threads = 8;
 
     bool use_bad_update = false;
+
+    // Use hierarchical softmax instead of negative sampling. Output embeddings
+    // (ctx) then hold the inner nodes of the Huffman tree instead of words.
+    bool hs = false;
+
+    // Fraction of updates in train() whose loss is computed, from the
+    // sigmoids the update computes anyway, for a running training loss
+    Real loss_sample = 0;
+  };
+
+  /// Product of the likelihoods of a sampled update, to take a single log of
+  /// instead of one per term.
+  struct LossProduct {
+    double p = 1;
+    double log_p = 0;
+
+    void add(Real likelihood) {
+      p *= std::max(likelihood, MIN_SIGMOID_IN_LOSS);
+      if (p < 1e-200) { // e.g. long paths of hierarchical softmax
+        log_p += std::log(p);
+        p = 1;
+      }
+    }
+
+    double loss() const { return -(log_p + std::log(p)); }
   };
 
  private:
@@ -57,12 +88,28 @@ class Trainer {
   std::vector<Real> filter_probs_;
   std::vector<Vector> scratch_;                             // one per thread
   std::vector<Vector> scratch2_;                            // one per thread
+  std::vector<Vector> scratch3_;                            // one per thread
   std::vector<std::mt19937> gens_;                          // one per thread
   std::vector<std::uniform_real_distribution<Real>> dists_; // one per thread
   std::vector<koan::AliasSampler> neg_samplers_;            // one per thread
+  HuffmanTree tree_;  // only used for hierarchical softmax
+  Subwords subwords_; // only used for character n-gram inputs
+
+  Table& table_; // Input word embeddings (syn1), followed by n-gram bucket
+                 // embeddings if using subwords
+  Table& ctx_;   // Output word embeddings (syn0), or inner node embeddings of
+                 // the Huffman tree for hierarchical softmax
 
-  Table& table_; // Input word embeddings (syn1)
-  Table& ctx_;   // Output word embeddings (syn0)
+  ContentionProfiler* contention_ = nullptr; // only set when profiling
+
+  struct alignas(64) SampledLoss {
+    size_t countdown = 0; // updates to skip until the next sample
+    bool active = false;  // whether the current update is sampled
+    std::atomic<double> sum{0};
+    std::atomic<size_t> count{0};
+  };
+  std::vector<SampledLoss> sampled_loss_; // one per thread
+  size_t loss_period_ = 0; // sampled updates are 1 to loss_period_ apart
 
  public:
   /// Create trainer
@@ -73,36 +120,170 @@ class Trainer {
   /// @param[in] filter_probs probability of skipping each word, downsampling
   /// frequent words
   /// @param[in] neg_probs negative sampling probability over vocabulary
+  /// @param[in] tree Huffman tree over vocabulary, required if params.hs. ctx
+  /// should then have at least tree.num_inner() rows.
+  /// @param[in] subwords if nonempty, compose input embeddings from words and
+  /// their character n-grams. table should then also have a row per bucket.
   Trainer(Params params,
           Table& table,
           Table& ctx,
           std::vector<Real> filter_probs,
-          const std::vector<Real>& neg_probs)
+          const std::vector<Real>& neg_probs,
+          HuffmanTree tree = HuffmanTree(),
+          Subwords subwords = Subwords())
       : params_(params),
         filter_probs_(std::move(filter_probs)),
         scratch_(params_.threads),
         scratch2_(params_.threads),
+        scratch3_(params_.threads),
         neg_samplers_(params_.threads, neg_probs),
+        tree_(std::move(tree)),
+        subwords_(std::move(subwords)),
         table_(table),
-        ctx_(ctx) {
+        ctx_(ctx),
+        sampled_loss_(params_.threads) {
+    if (params_.loss_sample > 0) {
+      // i.e. 1 / loss_sample apart on average
+      loss_period_ =
+          std::max<long>(std::lround(2 / params_.loss_sample) - 1, 1);
+    }
     for (unsigned i = 0; i < params_.threads; i++) {
       gens_.emplace_back(123457 + i);
       dists_.emplace_back(0., 1.);
     }
+    if (params_.hs) {
+      KOAN_ASSERT(tree_.size() == filter_probs_.size(),
+                  "Huffman tree should cover the entire vocabulary!");
+      KOAN_ASSERT(ctx_.size() >= tree_.num_inner(),
+                  "Not enough rows for the inner nodes of the Huffman tree!");
+    }
+    if (not subwords_.empty()) {
+      KOAN_ASSERT(table_.size() ==
+                      subwords_.size() + subwords_.num_buckets(),
+                  "Input table should have a row per word and bucket!");
+    }
+  }
+
+ private:
+  /// Add the input embedding of word w to out. This is the row of w, or the
+  /// average of the rows of w and its n-gram buckets if using subwords.
+  void add_input(Word w, Vector& out) {
+    if (subwords_.empty()) {
+      out += table_[w];
+    } else {
+      Real scale = 1_R / subwords_.num_rows(w);
+      for (auto row = subwords_.begin(w); row != subwords_.end(w); row++) {
+        out += table_[*row] * scale;
+      }
+    }
+  }
+
+  /// Record a row write from thread tid, if profiling contention.
+  void wrote(ContentionProfiler::Side side, size_t row, size_t tid) {
+    if (contention_) { contention_->write(side, row, tid); }
+  }
+
+  /// Add the loss of a sampled update from thread tid.
+  void record_loss(const LossProduct& product, size_t tid) {
+    auto& s = sampled_loss_[tid];
+    s.sum.store(s.sum.load(std::memory_order_relaxed) + product.loss(),
+                std::memory_order_relaxed);
+    s.count.store(s.count.load(std::memory_order_relaxed) + 1,
+                  std::memory_order_relaxed);
+  }
+
+  /// Add scale * delta to the input embedding of word w, i.e. backpropagate it
+  /// to each row composing w.
+  void update_input(Word w, size_t tid, const Vector& delta, Real scale = 1) {
+    if (subwords_.empty()) {
+      table_[w] += delta * scale;
+      wrote(ContentionProfiler::Input, w, tid);
+    } else {
+      scale /= subwords_.num_rows(w);
+      for (auto row = subwords_.begin(w); row != subwords_.end(w); row++) {
+        table_[*row] += delta * scale;
+        wrote(ContentionProfiler::Input, *row, tid);
+      }
+    }
+  }
+
+  /// Hierarchical softmax step for predicting a single target word from a
+  /// hidden (input) vector: walk the path of target in the Huffman tree,
+  /// update the inner node embeddings, and accumulate the gradient wrt hidden.
+  ///
+  /// @param[in] hidden input representation (center word or context average)
+  /// @param[in] target word to predict
+  /// @param[in,out] hidden_grad gradient wrt hidden (times lr and scale) is
+  /// added to this
+  /// @param[in] lr current learning rate
+  /// @param[in] scale multiplier for hidden_grad only, e.g. to normalize by
+  /// the number of contexts
+  /// @param[in] compute_loss whether to also compute and return the loss
+  /// @param[in] tid thread index
+  /// @param[in,out] sampled if not null, likelihoods are multiplied into this
+  Real hs_update(const Vector& hidden,
+                 Word target,
+                 Vector& hidden_grad,
+                 Real lr,
+                 Real scale,
+                 bool compute_loss,
+                 size_t tid,
+                 LossProduct* sampled) {
+    Real loss = 0;
+    for (auto step = tree_.path_begin(target); step != tree_.path_end(target);
+         step++) {
+      auto& node = ctx_[step->node];
+      // forward pass: code 0 is the positive label, as in word2vec
+      Real sig = sigmoid(hidden.dot(node));
+      Real label = 1_R - step->code;
+      if (compute_loss) {
+        loss -= std::log(std::max(label > 0 ? sig : 1_R - sig,
+                                  MIN_SIGMOID_IN_LOSS));
+      }
+      if (sampled) { sampled->add(label > 0 ? sig : 1_R - sig); }
+      // backward pass
+      Real g = (sig - label) * lr;
+      if (g != 0) {
+        hidden_grad += node * (g * scale);
+        node -= hidden * g;
+        wrote(ContentionProfiler::Output, step->node, tid);
+      }
+    }
+    return loss;
+  }
+
+ public:
+
+  // Accessors
+
+  const HuffmanTree& tree() const { return tree_; }
+  const Subwords& subwords() const { return subwords_; }
+
+  /// @returns heap memory of the negative samplers, one copy per thread
+  size_t sampler_bytes() const {
+    size_t bytes = 0;
+    for (auto& s : neg_samplers_) { bytes += s.bytes(); }
+    return bytes;
+  }
+
+  /// Record row writes in a profiler (or stop, if nullptr). The profiler should
+  /// cover all rows of both tables and params.threads threads.
+  void set_contention_profiler(ContentionProfiler* profiler) {
+    contention_ = profiler;
   }
 
   // Operations
 
   /// Update embeddings for a single input sentence, center word, and context
   /// window according to Continuous bag of words (CBOW) objective by negative
-  /// sampling.
+  /// sampling (or hierarchical softmax if params.hs).
   ///
   /// @param[in] sent input sentence
   /// @param[in] center_idx index of the center word
   /// @param[in] left index of the leftmost context word (inclusive)
   /// @param[in] right index of the rightmost context word (exclusive)
   /// @param[in] tid thread index
-  /// @param[in] lr current learning rate
+  /// @param[in] lr current learning rate. If 0, embeddings are not updated.
   /// @param[in] compute_loss whether to also compute and return the CBOW loss.
   /// Used for numerically checking gradient.  If false, will return 0.0
   Real cbow_update(const Sentence& sent,
@@ -119,28 +300,47 @@ class Trainer {
     // https://github.com/tmikolov/word2vec/blob/20c129af10659f7c50e86e3be406df663beff438/word2vec.c#L460
     // https://github.com/RaRe-Technologies/gensim/issues/697
     Real loss = 0;
-    auto& center_word = ctx_[sent[center_idx]];
+    LossProduct product;
+    LossProduct* sampled = sampled_loss_[tid].active ? &product : nullptr;
+    const auto dim = table_[sent[center_idx]].size();
     Vector& avg = scratch_[tid];
     Vector& source_idx_grad = scratch2_[tid];
-    avg = Vector::Zero(center_word.size());
-    source_idx_grad = Vector::Zero(center_word.size());
+    avg = Vector::Zero(dim);
+    source_idx_grad = Vector::Zero(dim);
 
     // collect embeddings for context words
-    static thread_local std::vector<Vector*> sources;
+    static thread_local std::vector<Word> sources;
     sources.clear();
     sources.reserve(right - left - 1);
 
     for (size_t source_idx = left; source_idx < right; source_idx++) {
       if (source_idx != center_idx) {
-        auto& v = table_[sent[source_idx]];
-        avg += v;
-        sources.push_back(&v);
+        add_input(sent[source_idx], avg);
+        sources.push_back(sent[source_idx]);
       }
     }
 
     Real num_source_ids = static_cast<Real>(sources.size());
-    if (num_source_ids > 0.) {
+    if (num_source_ids > 0. and params_.hs) {
+      avg /= num_source_ids;
+      // ISSUE above applies to hierarchical softmax as well
+      Real scale = params_.use_bad_update ? 1_R : 1_R / num_source_ids;
+      loss += hs_update(avg,
+                        sent[center_idx],
+                        source_idx_grad,
+                        lr,
+                        scale,
+                        compute_loss,
+                        tid,
+                        sampled);
+      if (lr != 0) {
+        for (auto source : sources) {
+          update_input(source, tid, source_idx_grad, -1);
+        }
+      }
+    } else if (num_source_ids > 0.) {
       avg /= num_source_ids;
+      auto& center_word = ctx_[sent[center_idx]];
 
       // Update for positive sample
       // forward pass
@@ -148,8 +348,9 @@ class Trainer {
       if (compute_loss) {
         loss -= std::log(std::max(sig_pos, MIN_SIGMOID_IN_LOSS));
       }
+      if (sampled) { sampled->add(sig_pos); }
       // backward pass
-      if (sig_pos < 1.) {
+      if (lr != 0 and sig_pos < 1.) {
         if (params_.use_bad_update) {
           // ISSUE above, typical, wrong update!
           source_idx_grad += center_word * ((sig_pos - 1.) * lr);
@@ -160,6 +361,7 @@ class Trainer {
               center_word * ((sig_pos - 1.) * lr) / num_source_ids;
         }
         center_word -= avg * ((sig_pos - 1.) * lr);
+        wrote(ContentionProfiler::Output, sent[center_idx], tid);
       }
 
       // Updates for negative samples
@@ -172,8 +374,9 @@ class Trainer {
         if (compute_loss) {
           loss -= std::log(std::max(1._R - sig_neg, MIN_SIGMOID_IN_LOSS));
         }
+        if (sampled) { sampled->add(1._R - sig_neg); }
         // backward
-        if (sig_neg > 0.) {
+        if (lr != 0 and sig_neg > 0.) {
           if (params_.use_bad_update) {
             // ISSUE above, typical, wrong update!
             source_idx_grad += rw * (sig_neg * lr);
@@ -182,18 +385,23 @@ class Trainer {
             source_idx_grad += rw * (sig_neg * lr) / num_source_ids;
           }
           rw -= avg * (sig_neg * lr);
+          wrote(ContentionProfiler::Output, random_idx, tid);
         }
       }
-      for (auto source : sources) { // update each source (context)
-        *source -= source_idx_grad;
+      if (lr != 0) {
+        for (auto source : sources) { // update each source (context)
+          update_input(source, tid, source_idx_grad, -1);
+        }
       }
     }
 
+    if (sampled) { record_loss(product, tid); }
     return loss;
   }
 
   /// Update embeddings for a single input sentence, center word, and context
-  /// window according to Skipgram (SG) objective by negative sampling.
+  /// window according to Skipgram (SG) objective by negative sampling (or
+  /// hierarchical softmax if params.hs).
   ///
   /// @param[in] sent input sentence
   /// @param[in] center_idx index of the source center word
@@ -201,7 +409,7 @@ class Trainer {
   /// @param[in] right index of the rightmost context word to predict
   /// (exclusive)
   /// @param[in] tid thread index
-  /// @param[in] lr current learning rate
+  /// @param[in] lr current learning rate. If 0, embeddings are not updated.
   /// @param[in] compute_loss whether to also compute and return the SG loss.
   /// Used for numerically checking the gradient.  If false, will return 0.0
   Real sg_update(const Sentence& sent,
@@ -212,10 +420,38 @@ class Trainer {
                  Real lr,
                  bool compute_loss = false) {
     Real loss = 0;
-    auto& center_word = table_.at(sent[center_idx]);
+    LossProduct product;
+    LossProduct* sampled = sampled_loss_[tid].active ? &product : nullptr;
+    const Word center = sent[center_idx];
+    const Vector* center_ptr = &table_.at(center);
+    if (not subwords_.empty()) {
+      subwords_.compose(center, table_, scratch3_[tid]);
+      center_ptr = &scratch3_[tid];
+    }
+    const Vector& center_word = *center_ptr;
     auto& cw_local = scratch_[tid];
     cw_local = Vector::Zero(center_word.size());
 
+    if (params_.hs) {
+      auto& cw_grad = scratch2_[tid];
+      cw_grad = Vector::Zero(center_word.size());
+      for (size_t target_idx = left; target_idx < right; target_idx++) {
+        if (target_idx != center_idx) {
+          loss += hs_update(center_word,
+                            sent[target_idx],
+                            cw_grad,
+                            lr,
+                            1,
+                            compute_loss,
+                            tid,
+                            sampled);
+        }
+      }
+      if (lr != 0) { update_input(center, tid, cw_grad, -1); }
+      if (sampled) { record_loss(product, tid); }
+      return loss;
+    }
+
     // Predict each context word given the center
     for (size_t target_idx = left; target_idx < right; target_idx++) {
       if (target_idx != center_idx) {
@@ -226,10 +462,12 @@ class Trainer {
         if (compute_loss) {
           loss -= std::log(std::max(sig_pos, MIN_SIGMOID_IN_LOSS));
         }
+        if (sampled) { sampled->add(sig_pos); }
         // backward pass
-        if (sig_pos < 1.) {
+        if (lr != 0 and sig_pos < 1.) {
           cw_local -= target_word * ((sig_pos - 1.) * lr);
           target_word -= center_word * ((sig_pos - 1.) * lr);
+          wrote(ContentionProfiler::Output, sent[target_idx], tid);
         }
 
         // Update for negative samples
@@ -241,16 +479,19 @@ class Trainer {
           if (compute_loss) {
             loss -= std::log(std::max(1 - sig_neg, MIN_SIGMOID_IN_LOSS));
           }
+          if (sampled) { sampled->add(1 - sig_neg); }
           // backward
-          if (sig_neg > 0.) {
+          if (lr != 0 and sig_neg > 0.) {
             cw_local -= random_word * (sig_neg * lr);
             random_word -= center_word * (sig_neg * lr);
+            wrote(ContentionProfiler::Output, random_i, tid);
           }
         }
       }
     }
     // cw_local itself is a descent direction, so sign is +=
-    center_word += cw_local;
+    if (lr != 0) { update_input(center, tid, cw_local); }
+    if (sampled) { record_loss(product, tid); }
     return loss;
   }
 
@@ -270,7 +511,14 @@ class Trainer {
       if (dists_[tid](gens_[tid]) >= filter_probs_.at(w)) { sent.push_back(w); }
     }
 
+    auto& sampled_loss = sampled_loss_[tid];
     for (size_t center_idx = 0; center_idx < sent.size(); center_idx++) {
+      if (loss_period_ > 0) {
+        sampled_loss.active = sampled_loss.countdown-- == 0;
+        if (sampled_loss.active) {
+          sampled_loss.countdown = gens_[tid]() % loss_period_;
+        }
+      }
       // Sample a contexts width from 1 to maximum context width
       size_t ctxs = 1 + (gens_[tid]() % params_.ctxs);
       size_t left = center_idx > ctxs ? center_idx - ctxs : 0;
@@ -282,9 +530,75 @@ class Trainer {
         sg_update(sent, center_idx, left, right, tid, lr);
       }
     }
+    sampled_loss.active = false;
 
     return sent.size();
   }
+
+  /// @returns mean loss of the updates sampled by train() (see
+  /// Params::loss_sample) since the last reset, or NaN if there were none
+  double sampled_loss() const {
+    double sum = 0;
+    size_t count = 0;
+    for (auto& s : sampled_loss_) {
+      sum += s.sum.load(std::memory_order_relaxed);
+      count += s.count.load(std::memory_order_relaxed);
+    }
+    return count > 0 ? sum / count : std::nan("");
+  }
+
+  /// Forget sampled losses, e.g. at the start of an epoch. Must not be called
+  /// while training.
+  void reset_sampled_loss() {
+    for (auto& s : sampled_loss_) {
+      s.sum = 0;
+      s.count = 0;
+    }
+  }
+
+  /// Restart the random number generators and the loss sampling of every
+  /// thread as in a new trainer, e.g. after throwaway updates, so that
+  /// training afterwards draws the same samples. Must not be called while
+  /// training.
+  void reset_random() {
+    for (unsigned i = 0; i < params_.threads; i++) {
+      gens_[i].seed(123457 + i);
+      dists_[i].reset();
+      neg_samplers_[i].set_seed(std::minstd_rand::default_seed);
+      sampled_loss_[i].countdown = 0;
+      sampled_loss_[i].active = false;
+    }
+    reset_sampled_loss();
+  }
+
+  /// Compute the loss over a set of sentences without updating embeddings.
+  /// Unlike train(), every word is used as center with the full context
+  /// window and nothing is downsampled. Negative samples are drawn with a fixed
+  /// seed, so that losses computed at different times are comparable.
+  ///
+  /// @param[in] sents input sentences
+  /// @param[in] cbow true if using CBOW loss, else SG
+  /// @param[in] tid thread index
+  /// @returns average loss per center word
+  Real loss(const Sentences& sents, bool cbow, size_t tid = 0) {
+    neg_samplers_[tid].set_seed(123457);
+    double total = 0;
+    size_t centers = 0;
+    for (auto& sent : sents) {
+      for (size_t center_idx = 0; center_idx < sent.size(); center_idx++) {
+        size_t left = center_idx > params_.ctxs ? center_idx - params_.ctxs : 0;
+        size_t right = std::min<size_t>(center_idx + params_.ctxs + 1,
+                                        sent.size());
+        if (cbow) {
+          total += cbow_update(sent, center_idx, left, right, tid, 0, true);
+        } else {
+          total += sg_update(sent, center_idx, left, right, tid, 0, true);
+        }
+      }
+      centers += sent.size();
+    }
+    return centers > 0 ? total / centers : 0;
+  }
 };
 
 } // namespace koan
@@ -19,6 +19,8 @@
 
 #include <algorithm>
 #include <atomic>
+#include <cstdint>
+#include <cstring>
 #include <numeric>
 #include <sstream>
 #include <stdexcept>
@@ -55,6 +57,14 @@ auto split(const IN& s, char delim = ' ') {
   return ret;
 }
 
+/// Whether x is neither NaN nor infinite. Checks the bits, since koan is built
+/// with -Ofast, under which std::isnan() and std::isinf() fold to false.
+inline bool is_finite(double x) {
+  uint64_t bits;
+  std::memcpy(&bits, &x, sizeof(bits));
+  return (bits & 0x7FF0000000000000ULL) != 0x7FF0000000000000ULL;
+}
+
 /// Parallel for implementation without any explicit allocation of elements per
 /// thread.
 ///
@@ -0,0 +1,221 @@
+#!/usr/bin/env python3
+#
+# Copyright 2020 Bloomberg Finance L.P.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Time koan against the reference word2vec C tool (and optionally gensim)
+on the same corpus across thread counts, and write the timings as CSV and,
+if matplotlib is installed, as the plots shown in the README.
+
+The reference tool is built from a local copy of its source (--word2vec-src),
+or cloned at the commit koan's trainer refers to. Without --corpus, a
+synthetic corpus is generated with `koan synth`.
+
+Example:
+    scripts/word2vec_comparison.py --koan build/koan --threads 1 2 4 8 16
+"""
+
+import argparse
+import csv
+import os
+import statistics
+import subprocess
+import sys
+import time
+
+WORD2VEC_REPO = "https://github.com/tmikolov/word2vec"
+WORD2VEC_COMMIT = "20c129af10659f7c50e86e3be406df663beff438"
+
+GENSIM = """
+import sys
+from gensim.models import Word2Vec
+corpus, threads, cbow, dim, window, negatives, sample, min_count, epochs = \\
+    sys.argv[1:]
+Word2Vec(corpus_file=corpus, workers=int(threads), sg=1 - int(cbow),
+         vector_size=int(dim), window=int(window), negative=int(negatives),
+         sample=float(sample), min_count=int(min_count), epochs=int(epochs))
+"""
+
+
+def build_word2vec(src, work_dir):
+    """Build the word2vec binary from src, cloning it first if src is empty,
+    with the flags of its makefile. Returns path of binary."""
+    if not src:
+        src = os.path.join(work_dir, "word2vec-src")
+        if not os.path.isdir(src):
+            subprocess.run(["git", "clone", WORD2VEC_REPO, src], check=True)
+        subprocess.run(["git", "-C", src, "checkout", WORD2VEC_COMMIT],
+                       check=True)
+    c_file = os.path.join(src, "word2vec.c")
+    if not os.path.exists(c_file):  # repository layout with a src directory
+        c_file = os.path.join(src, "src", "word2vec.c")
+    binary = os.path.join(work_dir, "word2vec")
+    subprocess.run([
+        "gcc", c_file, "-o", binary, "-lm", "-pthread", "-O3",
+        "-march=native", "-funroll-loops", "-Wno-unused-result"
+    ], check=True)
+    return binary
+
+
+def command(tool, args, binaries, corpus, threads, cbow, out):
+    """Command line training one epoch with equivalent hyperparameters."""
+    if tool == "koan":
+        return [
+            binaries["koan"], "-f", corpus, "-t", str(threads), "-b",
+            "true" if cbow else "false", "-d", str(args.dim), "-c",
+            str(args.window), "-n", str(args.negatives), "-o",
+            str(args.sample), "-k", str(args.min_count), "-e",
+            str(args.epochs), "-p", out, "-P"
+        ]
+    if tool == "word2vec":
+        return [
+            binaries["word2vec"], "-train", corpus, "-output", out,
+            "-threads", str(threads), "-cbow", "1" if cbow else "0", "-size",
+            str(args.dim), "-window", str(args.window), "-negative",
+            str(args.negatives), "-hs", "0", "-sample", str(args.sample),
+            "-min-count", str(args.min_count), "-iter", str(args.epochs)
+        ]
+    return [
+        sys.executable, "-c", GENSIM, corpus, str(threads),
+        str(int(cbow)), str(args.dim), str(args.window), str(args.negatives),
+        str(args.sample), str(args.min_count), str(args.epochs)
+    ]
+
+
+def plot(rows, tools, mode, path):
+    import matplotlib
+    matplotlib.use("Agg")
+    import matplotlib.pyplot as plt
+
+    fig, ax = plt.subplots(figsize=(5, 4))
+    for tool in tools:
+        points = sorted((r["threads"], r["seconds"]) for r in rows
+                        if r["tool"] == tool and r["mode"] == mode)
+        ax.plot([p[0] for p in points], [p[1] for p in points],
+                marker="o", label=tool)
+    ax.set_xscale("log", base=2)
+    ax.set_xlabel("Threads")
+    ax.set_ylabel("Seconds per epoch")
+    ax.set_title("CBOW" if mode == "cbow" else "Skipgram")
+    ax.legend()
+    fig.tight_layout()
+    fig.savefig(path, dpi=150)
+    plt.close(fig)
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--koan", default="build/koan", help="koan binary")
+    parser.add_argument("--word2vec-src",
+                        default="",
+                        help="directory with word2vec.c. If empty, "
+                        "the reference repository is cloned.")
+    parser.add_argument("--tools",
+                        nargs="+",
+                        default=["koan", "word2vec"],
+                        choices=["koan", "word2vec", "gensim"])
+    parser.add_argument("--modes",
+                        nargs="+",
+                        default=["cbow", "sg"],
+                        choices=["cbow", "sg"])
+    parser.add_argument("--threads",
+                        nargs="+",
+                        type=int,
+                        default=[1, 2, 4, 8, 16])
+    parser.add_argument("--corpus",
+                        default="",
+                        help="training corpus. If empty, a synthetic one is "
+                        "generated with koan synth.")
+    parser.add_argument("--tokens",
+                        type=int,
+                        default=10000000,
+                        help="words of the synthetic corpus")
+    parser.add_argument("--vocab-size",
+                        type=int,
+                        default=100000,
+                        help="vocabulary of the synthetic corpus")
+    parser.add_argument("--dim", type=int, default=300)
+    parser.add_argument("--window", type=int, default=5)
+    parser.add_argument("--negatives", type=int, default=5)
+    parser.add_argument("--sample", type=float, default=1e-3)
+    parser.add_argument("--min-count", type=int, default=5)
+    parser.add_argument("--epochs", type=int, default=1)
+    parser.add_argument("--repeats",
+                        type=int,
+                        default=1,
+                        help="runs per configuration, of which the median "
+                        "time is reported")
+    parser.add_argument("--output-dir", default="word2vec_comparison")
+    args = parser.parse_args()
+
+    os.makedirs(args.output_dir, exist_ok=True)
+    binaries = {"koan": args.koan}
+    if "word2vec" in args.tools:
+        binaries["word2vec"] = build_word2vec(args.word2vec_src,
+                                              args.output_dir)
+
+    corpus = args.corpus
+    if not corpus:
+        corpus = os.path.join(args.output_dir, "synthetic.txt")
+        subprocess.run([
+            args.koan, "synth", "-o", corpus, "--tokens",
+            str(args.tokens), "--vocab-size",
+            str(args.vocab_size)
+        ], check=True)
+
+    rows = []
+    out = os.path.join(args.output_dir, "embeddings.txt")
+    for mode in args.modes:
+        for tool in args.tools:
+            for threads in args.threads:
+                cmd = command(tool, args, binaries, corpus, threads,
+                              mode == "cbow", out)
+                seconds = []
+                for _ in range(args.repeats):
+                    start = time.perf_counter()
+                    subprocess.run(cmd,
+                                   check=True,
+                                   stdout=subprocess.DEVNULL,
+                                   stderr=subprocess.DEVNULL)
+                    seconds.append(time.perf_counter() - start)
+                rows.append({
+                    "tool": tool,
+                    "mode": mode,
+                    "threads": threads,
+                    "seconds": statistics.median(seconds)
+                })
+                print("{} {} threads={}: {:.2f}s".format(
+                    tool, mode, threads, rows[-1]["seconds"]))
+
+    csv_path = os.path.join(args.output_dir, "train_times.csv")
+    with open(csv_path, "w", newline="") as f:
+        writer = csv.DictWriter(f, ["tool", "mode", "threads", "seconds"])
+        writer.writeheader()
+        writer.writerows(rows)
+    print("Wrote " + csv_path)
+
+    try:
+        for mode in args.modes:
+            path = os.path.join(args.output_dir,
+                                "word2vec_train_times_{}.png".format(mode))
+            plot(rows, args.tools, mode, path)
+            print("Wrote " + path)
+    except ImportError:
+        print("Install matplotlib to also plot the timings.")
+
+
+if __name__ == "__main__":
+    main()
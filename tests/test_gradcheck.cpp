@@ -3,6 +3,8 @@
 
 #include <catch.hpp>
 
+#include <koan/glove.h>
+#include <koan/heldout.h>
 #include <koan/indexmap.h>
 #include <koan/trainer.h>
 
@@ -217,3 +219,351 @@ TEST_CASE("Skipgram", "[grad]") {
     }
   }
 }
+
+/// Compare the analytic gradients applied by an update against two-sided
+/// numerical gradients of the loss it returns, for every parameter.
+///
+/// @param[in,out] table input embeddings
+/// @param[in,out] ctx output embeddings
+/// @param[in] update callable that applies a single update with lr 1 and
+/// returns the loss
+template <typename F>
+void check_gradients(Table& table, Table& ctx, F update) {
+  // Keep a copy of original weights
+  Table table_orig(table), ctx_orig(ctx);
+
+  update();
+
+  // analytic gradients
+  Table table_agrad(table), ctx_agrad(ctx);
+  for (size_t i = 0; i < table.size(); i++) {
+    table_agrad[i] = table_orig[i] - table[i];
+  }
+  for (size_t i = 0; i < ctx.size(); i++) {
+    ctx_agrad[i] = ctx_orig[i] - ctx[i];
+  }
+
+  // Compute numeric gradients for every parameter
+  Table table_ngrad(table_orig), ctx_ngrad(ctx_orig);
+
+  table = table_orig;
+  ctx = ctx_orig;
+
+  for (auto [tab, ngrad] : {std::make_pair(&table, &table_ngrad),
+                            std::make_pair(&ctx, &ctx_ngrad)}) {
+    for (size_t i = 0; i < tab->size(); i++) {
+      for (unsigned j = 0; j < tab->at(i).size(); j++) {
+        const static Real eps = 1e-4;
+        Real tmp = tab->at(i)[j];
+        tab->at(i)[j] += eps;
+        Real loss_up = update();
+        table = table_orig;
+        ctx = ctx_orig;
+
+        tab->at(i)[j] = tmp - eps;
+        Real loss_down = update();
+        table = table_orig;
+        ctx = ctx_orig;
+
+        ngrad->at(i)[j] = (loss_up - loss_down) / (2 * eps);
+      }
+    }
+  }
+
+  // compare numeric and analytical gradients
+  for (size_t i = 0; i < table.size(); i++) {
+    for (unsigned j = 0; j < table[i].size(); j++) {
+      CHECK(table_agrad[i][j] == Approx(table_ngrad[i][j]));
+    }
+  }
+  for (size_t i = 0; i < ctx.size(); i++) {
+    for (unsigned j = 0; j < ctx[i].size(); j++) {
+      CHECK(ctx_agrad[i][j] == Approx(ctx_ngrad[i][j]));
+    }
+  }
+}
+
+TEST_CASE("Cbow hierarchical softmax", "[grad]") {
+  static_assert(std::is_same<Real, double>::value);
+
+  Table table, ctx;
+  unsigned dim = 5;
+  size_t vocab = 5;
+
+  std::vector<double> filter_probs(vocab, 0);
+  std::vector<double> neg_probs(vocab, 1. / vocab);
+  HuffmanTree tree({10, 6, 3, 2, 1});
+
+  Sentence sent{0, 3, 1, 4}; // center word 4 has the longest path
+
+  for (size_t i = 0; i < vocab; i++) { table.push_back(Vector::Random(dim)); }
+  for (size_t i = 0; i < tree.num_inner(); i++) {
+    ctx.push_back(Vector::Random(dim));
+  }
+
+  auto make_trainer = [&](bool use_bad_update) {
+    return Trainer(Trainer::Params{.dim = dim,
+                                   .ctxs = 5,
+                                   .negatives = 1,
+                                   .threads = 1,
+                                   .use_bad_update = use_bad_update,
+                                   .hs = true},
+                   table,
+                   ctx,
+                   filter_probs,
+                   neg_probs,
+                   tree);
+  };
+  Trainer t = make_trainer(false), t_bad = make_trainer(true);
+
+  auto update = [&](Trainer& trainer) {
+    return trainer.cbow_update(sent,
+                               /*center*/ 3,
+                               /*left*/ 0,
+                               /*right*/ 4,
+                               /*tid*/ 0,
+                               /*lr*/ 1,
+                               /*compute_loss*/ true);
+  };
+
+  check_gradients(table, ctx, [&]() { return update(t); });
+
+  // The faulty update does not normalize by the number of contexts, so the
+  // step for context embeddings is off by exactly that factor.
+  Table table_orig(table), ctx_orig(ctx);
+  update(t);
+  Vector good_step = table_orig[0] - table[0];
+  table = table_orig;
+  ctx = ctx_orig;
+  update(t_bad);
+  Vector bad_step = table_orig[0] - table[0];
+  for (unsigned j = 0; j < dim; j++) {
+    CHECK(bad_step[j] == Approx(good_step[j] * 3));
+  }
+}
+
+TEST_CASE("Skipgram hierarchical softmax", "[grad]") {
+  static_assert(std::is_same<Real, double>::value);
+
+  Table table, ctx;
+  unsigned dim = 5;
+  size_t vocab = 5;
+
+  std::vector<double> filter_probs(vocab, 0);
+  std::vector<double> neg_probs(vocab, 1. / vocab);
+  HuffmanTree tree({10, 6, 3, 2, 1});
+
+  // A single target, since consecutive targets share the inner nodes near the
+  // root and the update is not a single gradient step otherwise.
+  Sentence sent{4, 3}; // target word 4 has the longest path
+
+  for (size_t i = 0; i < vocab; i++) { table.push_back(Vector::Random(dim)); }
+  for (size_t i = 0; i < tree.num_inner(); i++) {
+    ctx.push_back(Vector::Random(dim));
+  }
+
+  Trainer t(Trainer::Params{.dim = dim,
+                            .ctxs = 5,
+                            .negatives = 1,
+                            .threads = 1,
+                            .hs = true},
+            table,
+            ctx,
+            filter_probs,
+            neg_probs,
+            tree);
+
+  check_gradients(table, ctx, [&]() {
+    return t.sg_update(sent,
+                       /*center*/ 1,
+                       /*left*/ 0,
+                       /*right*/ 2,
+                       /*tid*/ 0,
+                       /*lr*/ 1,
+                       /*compute_loss*/ true);
+  });
+}
+
+TEST_CASE("Subwords", "[grad]") {
+  static_assert(std::is_same<Real, double>::value);
+
+  Table table, ctx;
+  unsigned dim = 5;
+  size_t buckets = 7;
+
+  std::vector<std::string_view> words{"hello", "world", "!", "."};
+  Subwords subwords(words, 2, 3, buckets);
+
+  // Prevent trainer from randomly dropping any word.
+  std::vector<double> filter_probs{0, 0, 0, 0};
+
+  // Force trainer to sample "." as the negative word.
+  std::vector<double> neg_probs{0, 0, 0, 1};
+
+  // Words first, followed by n-gram buckets
+  for (size_t i = 0; i < words.size() + buckets; i++) {
+    table.push_back(Vector::Random(dim));
+  }
+  for (size_t i = 0; i < words.size(); i++) {
+    ctx.push_back(Vector::Random(dim));
+  }
+
+  Trainer t(
+      Trainer::Params{.dim = dim, .ctxs = 5, .negatives = 1, .threads = 1},
+      table,
+      ctx,
+      filter_probs,
+      neg_probs,
+      HuffmanTree(),
+      subwords);
+
+  SECTION("Cbow") {
+    Sentence sent{0, 1, 2}; // hello world !
+    check_gradients(table, ctx, [&]() {
+      return t.cbow_update(sent,
+                           /*center*/ 1,
+                           /*left*/ 0,
+                           /*right*/ 3,
+                           /*tid*/ 0,
+                           /*lr*/ 1,
+                           /*compute_loss*/ true);
+    });
+  }
+
+  SECTION("Skipgram") {
+    Sentence sent{0, 1}; // hello world
+    check_gradients(table, ctx, [&]() {
+      return t.sg_update(sent,
+                         /*center*/ 1,
+                         /*left*/ 0,
+                         /*right*/ 2,
+                         /*tid*/ 0,
+                         /*lr*/ 1,
+                         /*compute_loss*/ true);
+    });
+  }
+}
+
+TEST_CASE("Glove", "[grad]") {
+  static_assert(std::is_same<Real, double>::value);
+
+  Table table, ctx;
+  unsigned dim = 5;
+
+  for (size_t i = 0; i < 3; i++) {
+    table.push_back(Vector::Random(dim));
+    ctx.push_back(Vector::Random(dim));
+  }
+
+  // Below and above x_max
+  for (Real value : {3., 150.}) {
+    Cooccurrence c{1, 2, value};
+    // First AdaGrad step is a plain gradient step, since squared gradient sums
+    // start at one. Biases are internal to the trainer, so use a fresh one for
+    // each update.
+    check_gradients(table, ctx, [&]() {
+      GloveTrainer t(GloveTrainer::Params{.threads = 1}, table, ctx);
+      return t.update(c, /*tid*/ 0, /*lr*/ 1);
+    });
+  }
+}
+
+TEST_CASE("Held-out loss", "[grad]") {
+  Table table, ctx;
+  unsigned dim = 5;
+
+  std::vector<double> filter_probs{0, 0, 0, 0};
+  std::vector<double> neg_probs{0.25, 0.25, 0.25, 0.25};
+  Sentences sents{{0, 1, 2}, {3, 2, 1, 0}};
+
+  for (size_t i = 0; i < 4; i++) {
+    table.push_back(Vector::Random(dim));
+    ctx.push_back(Vector::Random(dim));
+  }
+  Table table_orig(table), ctx_orig(ctx);
+
+  Trainer::Params params{.dim = dim, .ctxs = 2, .negatives = 2, .threads = 1};
+  Trainer t(params, table, ctx, filter_probs, neg_probs);
+
+  for (bool cbow : {true, false}) {
+    // Read only, and deterministic despite negative sampling
+    Real loss = t.loss(sents, cbow);
+    CHECK(loss > 0);
+    CHECK(t.loss(sents, cbow) == loss);
+    for (size_t i = 0; i < table.size(); i++) {
+      CHECK(table[i] == table_orig[i]);
+      CHECK(ctx[i] == ctx_orig[i]);
+    }
+
+    // Same loss on a snapshot in the background
+    HeldoutEvaluator heldout(
+        cbow, params, table, ctx, filter_probs, neg_probs, {}, {});
+    for (auto& sent : sents) { heldout.add(sent); }
+    heldout.start(table, ctx);
+    CHECK(heldout.pending());
+    CHECK(heldout.get() == loss);
+    CHECK(not heldout.pending());
+  }
+}
+
+TEST_CASE("Sampled training loss", "[grad]") {
+  Table table, ctx;
+  unsigned dim = 5;
+
+  std::vector<double> filter_probs{0, 0, 0, 0};
+  std::vector<double> neg_probs{0, 0, 0, 1}; // deterministic negatives
+  Sentences sents{{0, 1, 2}, {3, 2, 1, 0}};
+
+  for (size_t i = 0; i < 4; i++) {
+    table.push_back(Vector::Random(dim));
+    ctx.push_back(Vector::Random(dim));
+  }
+
+  // With a single context width, train() uses the same windows as loss()
+  Trainer::Params params{.dim = dim, .ctxs = 1, .negatives = 1, .threads = 1};
+  for (Real loss_sample : {0., 1.}) {
+    params.loss_sample = loss_sample;
+    Trainer t(params, table, ctx, filter_probs, neg_probs);
+    for (bool cbow : {true, false}) {
+      t.reset_sampled_loss();
+      CHECK(not is_finite(t.sampled_loss()));
+      for (auto& sent : sents) { t.train(sent, 0, /*lr*/ 0, cbow); }
+      if (loss_sample > 0) {
+        CHECK(t.sampled_loss() == Approx(t.loss(sents, cbow)));
+      } else {
+        CHECK(not is_finite(t.sampled_loss()));
+      }
+    }
+  }
+}
+
+TEST_CASE("Reset random state", "[grad]") {
+  Table table, ctx;
+  unsigned dim = 5;
+  std::vector<double> filter_probs{0.5, 0.5, 0.5, 0.5};
+  std::vector<double> neg_probs{0.25, 0.25, 0.25, 0.25};
+  Sentences sents{{0, 1, 2}, {3, 2, 1, 0}};
+  for (size_t i = 0; i < 4; i++) {
+    table.push_back(Vector::Random(dim));
+    ctx.push_back(Vector::Random(dim));
+  }
+  const Table table0 = table, ctx0 = ctx;
+
+  Trainer::Params params{
+      .dim = dim, .ctxs = 2, .negatives = 2, .threads = 1, .loss_sample = .5};
+  Trainer t(params, table, ctx, filter_probs, neg_probs);
+  for (auto& sent : sents) { t.train(sent, 0, 0.1, true); }
+  const Table table1 = table, ctx1 = ctx;
+  const double loss1 = t.sampled_loss();
+
+  // Throwaway updates, then the same training again
+  table = table0;
+  ctx = ctx0;
+  t.reset_random();
+  for (auto& sent : sents) { t.train(sent, 0, 0.1, true); }
+  for (size_t i = 0; i < 4; i++) {
+    CHECK(table[i] == table1[i]);
+    CHECK(ctx[i] == ctx1[i]);
+  }
+  CHECK(t.sampled_loss() == loss1);
+}
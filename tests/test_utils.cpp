@@ -4,10 +4,37 @@
 
 #include <algorithm>
 #include <cstdlib>
+#include <dirent.h>
+#include <fstream>
+#include <map>
+#include <set>
+#include <thread>
 #include <vector>
 
+#include <koan/autotune.h>
+#include <koan/bench.h>
+#include <koan/compress.h>
+#include <koan/contention.h>
+#include <koan/cooccur.h>
+#include <koan/embed.h>
+#include <koan/evaluate.h>
+#include <koan/hnsw.h>
+#include <koan/huffman.h>
 #include <koan/indexmap.h>
+#include <koan/memory.h>
+#include <koan/metrics.h>
+#include <koan/model.h>
+#include <koan/neighbors.h>
+#include <koan/perf.h>
+#include <koan/phrases.h>
+#include <koan/reader.h>
 #include <koan/sample.h>
+#include <koan/serve.h>
+#include <koan/stats.h>
+#include <koan/subword.h>
+#include <koan/synth.h>
+#include <koan/timer.h>
+#include <koan/trace.h>
 #include <koan/trainer.h>
 
 using namespace koan;
@@ -137,3 +164,1129 @@ TEST_CASE("IndexMap", "[indexmap]") {
     CHECK_THROWS(imap.reverse_lookup(1));
   }
 }
+
+TEST_CASE("HuffmanTree", "[huffman]") {
+  std::vector<unsigned long long> counts{3, 10, 1, 6, 2, 2};
+  HuffmanTree tree(counts);
+
+  CHECK(tree.size() == counts.size());
+  CHECK(tree.num_inner() == counts.size() - 1);
+
+  // Every path starts at the root, and inner nodes are in BFS order so
+  // parents always precede their children.
+  for (Word w = 0; w < tree.size(); w++) {
+    REQUIRE(tree.path_size(w) > 0);
+    CHECK(tree.path_begin(w)->node == 0);
+    for (auto step = tree.path_begin(w) + 1; step != tree.path_end(w); step++) {
+      CHECK((step - 1)->node < step->node);
+    }
+  }
+
+  // More frequent words never have longer codes
+  CHECK(tree.path_size(1) <= tree.path_size(3));
+  CHECK(tree.path_size(3) <= tree.path_size(0));
+  CHECK(tree.path_size(0) <= tree.path_size(2));
+
+  // Codes are prefix-free
+  auto code = [&](Word w) {
+    std::string s;
+    for (auto step = tree.path_begin(w); step != tree.path_end(w); step++) {
+      s += char('0' + step->code);
+    }
+    return s;
+  };
+  for (Word a = 0; a < tree.size(); a++) {
+    for (Word b = 0; b < tree.size(); b++) {
+      if (a != b) { CHECK(code(b).rfind(code(a), 0) != 0); }
+    }
+  }
+
+  SECTION("Single word") {
+    HuffmanTree single({5});
+    CHECK(single.num_inner() == 0);
+    CHECK(single.path_size(0) == 0);
+  }
+}
+
+TEST_CASE("Subwords", "[subword]") {
+  std::vector<std::string_view> words{UNK, "ab", "çay"};
+  Subwords subwords(words, 1, 3, 1000);
+
+  auto ngrams = [](std::string_view w, unsigned minn, unsigned maxn) {
+    std::vector<size_t> ret;
+    Subwords::ngrams(w, minn, maxn, 1000, [&](size_t b) { ret.push_back(b); });
+    return ret;
+  };
+  auto bucket = [](std::string_view s) { return Subwords::hash(s) % 1000; };
+
+  // <ab>: a, b, <a, ab, b>, <ab, ab>
+  CHECK(ngrams("ab", 1, 3) == std::vector<size_t>{bucket("<a"),
+                                                  bucket("<ab"),
+                                                  bucket("a"),
+                                                  bucket("ab"),
+                                                  bucket("ab>"),
+                                                  bucket("b"),
+                                                  bucket("b>")});
+  // n-grams are counted in UTF-8 characters, not bytes
+  CHECK(ngrams("çay", 3, 3) == std::vector<size_t>{bucket("<ça"),
+                                                   bucket("çay"),
+                                                   bucket("ay>")});
+
+  // Rows of each word are the word itself, followed by its n-gram buckets
+  // offset by vocab size. UNK has no n-grams.
+  CHECK(subwords.size() == 3);
+  CHECK(subwords.num_rows(0) == 1);
+  CHECK(*subwords.begin(0) == 0);
+  CHECK(subwords.num_rows(1) == 8);
+  CHECK(*subwords.begin(1) == 1);
+  for (auto row = subwords.begin(1) + 1; row != subwords.end(1); row++) {
+    CHECK(*row >= 3);
+  }
+  CHECK(subwords.num_rows(2) == 1 + ngrams("çay", 1, 3).size());
+}
+
+TEST_CASE("Phrases", "[phrases]") {
+  // "new york" is a strong collocation, "york city" is weaker
+  std::vector<std::string> corpus;
+  for (size_t i = 0; i < 100; i++) {
+    auto n = std::to_string(i);
+    corpus.push_back("x" + n + " new york y" + n);
+    if (i < 20) { corpus.push_back("new york city z" + n); }
+    if (i < 80) { corpus.push_back("city w" + n); }
+  }
+  auto for_each_line = [&](auto f) {
+    for (auto& line : corpus) { f(std::string_view(line)); }
+  };
+
+  PhraseParams params;
+  params.threshold = 2;
+  params.min_count = 5;
+  params.chunk_size = 7;
+  params.threads = 3;
+
+  Phraser phraser;
+  phraser.add_pass(detect_phrases(for_each_line, phraser, params));
+  CHECK(phraser.num_phrases() == 1);
+
+  std::string out;
+  phraser.apply("a new york city", out);
+  CHECK(out == "a new_york city");
+
+  SECTION("Second pass joins longer phrases") {
+    params.threshold = 0.5;
+    phraser.add_pass(detect_phrases(for_each_line, phraser, params));
+    CHECK(phraser.num_phrases() == 2);
+    phraser.apply("a new york city", out);
+    CHECK(out == "a new_york_city");
+    phraser.apply("new york", out);
+    CHECK(out == "new_york");
+  }
+}
+
+TEST_CASE("CooccurrenceCounter", "[cooccur]") {
+  char dir[] = "/tmp/koan_test_XXXXXX";
+  REQUIRE(mkdtemp(dir));
+  auto files = [&]() {
+    std::vector<std::string> names;
+    DIR* d = opendir(dir);
+    REQUIRE(d);
+    while (auto entry = readdir(d)) {
+      std::string name = entry->d_name;
+      if (name != "." and name != "..") { names.push_back(name); }
+    }
+    closedir(d);
+    return names;
+  };
+
+  Sentences sents;
+  for (Word i = 0; i < 200; i++) {
+    Sentence sent;
+    for (Word j = 0; j < 3 + i % 7; j++) { sent.push_back((i + j * j) % 23); }
+    sents.push_back(sent);
+  }
+
+  for (bool symmetric : {true, false}) {
+    CooccurrenceCounter::Params params;
+    params.window = 3;
+    params.symmetric = symmetric;
+    params.max_entries = 30; // spills each thread every few sentences
+    params.tmp_dir = dir;
+    params.threads = 3;
+    CooccurrenceCounter counter(params);
+
+    std::map<std::pair<Word, Word>, double> expected;
+    for (size_t i = 0; i < sents.size(); i++) {
+      auto& sent = sents[i];
+      counter.add(sent, i % params.threads);
+      for (size_t a = 0; a < sent.size(); a++) {
+        for (size_t b = a + 1; b < sent.size() and b <= a + 3; b++) {
+          expected[{sent[a], sent[b]}] += 1. / (b - a);
+          if (symmetric) { expected[{sent[b], sent[a]}] += 1. / (b - a); }
+        }
+      }
+    }
+
+    // Several runs (spills) of every thread
+    std::vector<std::set<size_t>> runs(params.threads);
+    for (auto& name : files()) { // koan_cooccur_<pid>_<tid>_<run>_<shard>.bin
+      size_t tid, run;
+      REQUIRE(sscanf(name.c_str(), "koan_cooccur_%*d_%zu_%zu_", &tid, &run) ==
+              2);
+      REQUIRE(tid < params.threads);
+      runs[tid].insert(run);
+    }
+    for (auto& thread_runs : runs) { CHECK(thread_runs.size() > 1); }
+
+    auto shards = counter.finish();
+    REQUIRE(shards.size() == params.threads);
+    size_t total = 0;
+    for (size_t s = 0; s < shards.size(); s++) {
+      CHECK(std::is_sorted(shards[s].begin(), shards[s].end()));
+      for (auto& c : shards[s]) {
+        CHECK(c.row % shards.size() == s);
+        auto it = expected.find({c.row, c.col});
+        REQUIRE(it != expected.end());
+        CHECK(c.value == Approx(it->second));
+        total++;
+      }
+    }
+    // Every cell appears once, i.e. duplicates were summed
+    CHECK(total == expected.size());
+    CHECK(files().empty()); // runs are removed after merging
+  }
+  rmdir(dir);
+}
+
+TEST_CASE("Hnsw", "[hnsw]") {
+  const size_t n = 2000, dim = 16, k = 10;
+  Table table;
+  for (size_t i = 0; i < n; i++) { table.push_back(Vector::Random(dim)); }
+  table.push_back(Vector::Random(dim)); // not indexed
+
+  HnswBuilder builder(table, n, {.m = 8, .ef_construction = 100, .threads = 4});
+  REQUIRE(builder.size() == n);
+  REQUIRE(builder.dim() == dim);
+
+  // Exact neighbors by brute force
+  auto exact = [&](const Vector& q) {
+    std::vector<std::pair<Real, Word>> sims;
+    for (size_t i = 0; i < n; i++) {
+      sims.emplace_back(-q.dot(table[i]) / table[i].norm(), i);
+    }
+    std::partial_sort(sims.begin(), sims.begin() + k, sims.end());
+    std::vector<Word> ids;
+    for (size_t i = 0; i < k; i++) { ids.push_back(sims[i].second); }
+    return ids;
+  };
+
+  std::vector<std::vector<Word>> expected;
+  std::vector<Vector> queries;
+  for (size_t i = 0; i < 100; i++) {
+    queries.push_back(Vector::Random(dim));
+    expected.push_back(exact(queries.back()));
+  }
+
+  auto recall = [&](const HnswGraph& index) {
+    size_t found = 0;
+    for (size_t i = 0; i < queries.size(); i++) {
+      std::vector<float> q(queries[i].data(), queries[i].data() + dim);
+      auto result = index.search(q.data(), k);
+      REQUIRE(result.size() == k);
+      for (size_t j = 1; j < k; j++) {
+        CHECK(result[j - 1].second >= result[j].second);
+      }
+      for (auto& [id, sim] : result) {
+        found += std::count(expected[i].begin(), expected[i].end(), id);
+      }
+    }
+    return double(found) / (queries.size() * k);
+  };
+
+  double built_recall = recall(builder);
+  CHECK(built_recall > 0.95);
+
+  auto neighbors = builder.neighbors(3, k);
+  REQUIRE(neighbors.size() == k);
+  for (auto& [id, sim] : neighbors) { CHECK(id != 3); }
+
+  SECTION("Saved index gives the same results") {
+    std::string path = "/tmp/koan_test_" + std::to_string(getpid()) + ".hnsw";
+    builder.save(path);
+    {
+      HnswIndex index(path);
+      REQUIRE(index.size() == n);
+      REQUIRE(index.dim() == dim);
+      CHECK(recall(index) == built_recall);
+      CHECK(index.neighbors(3, k) == neighbors);
+    }
+    std::remove(path.c_str());
+  }
+}
+
+TEST_CASE("Neighbors", "[neighbors]") {
+  const size_t n = 100, dim = 8;
+  const unsigned k = 5;
+  Table table;
+  for (size_t i = 0; i < n; i++) { table.push_back(Vector::Random(dim)); }
+  table.push_back(Vector::Random(dim)); // not in head
+
+  auto m = normalized_rows(table, n, 2);
+  REQUIRE(m.rows() == n);
+  CHECK(m.row(7).norm() == Approx(1));
+
+  // Blocks that do not divide n
+  auto neighbors = exact_neighbors(m, k, 3, 7);
+  REQUIRE(neighbors.size == n);
+  REQUIRE(neighbors.k == k);
+
+  for (Word w = 0; w < n; w++) {
+    std::vector<std::pair<Real, Word>> sims;
+    for (Word c = 0; c < n; c++) {
+      if (c != w) {
+        sims.emplace_back(-table[w].dot(table[c]) / table[c].norm(), c);
+      }
+    }
+    std::sort(sims.begin(), sims.end());
+    for (unsigned j = 0; j < k; j++) {
+      CHECK(neighbors.ids_of(w)[j] == sims[j].second);
+      CHECK(neighbors.sims_of(w)[j] ==
+            Approx(-sims[j].first / table[w].norm()).epsilon(1e-4));
+    }
+  }
+
+  SECTION("k is capped") {
+    auto all = exact_neighbors(m.topRows(3), k);
+    CHECK(all.k == 2);
+    CHECK(all.ids.size() == 6);
+  }
+
+  SECTION("Save and load") {
+    std::string path =
+        "/tmp/koan_test_" + std::to_string(getpid()) + ".neighbors";
+    neighbors.save(path);
+    auto loaded = Neighbors::load(path);
+    std::remove(path.c_str());
+    CHECK(loaded.size == n);
+    CHECK(loaded.k == k);
+    CHECK(loaded.ids == neighbors.ids);
+    CHECK(loaded.sims == neighbors.sims);
+  }
+}
+
+TEST_CASE("Evaluate", "[evaluate]") {
+  std::vector<std::string> words{"man", "woman", "king", "queen", "apple"};
+  IndexMap<std::string_view> word_map;
+  for (auto& w : words) { word_map.insert(w); }
+
+  Table table;
+  for (auto v : {std::vector<Real>{1, 0, 0, 0},
+                 std::vector<Real>{1, 1, 0, 0},
+                 std::vector<Real>{1, 0, 1, 0},
+                 std::vector<Real>{1, 1, 1, 0},
+                 std::vector<Real>{0, 0, 0, 1}}) {
+    table.push_back(Eigen::Map<Vector>(v.data(), v.size()));
+  }
+
+  std::string path = "/tmp/koan_test_" + std::to_string(getpid()) + ".txt";
+
+  SECTION("Analogies") {
+    {
+      std::ofstream out(path);
+      out << ": gender\n"
+          << "Man Woman King Queen\n"
+          << "man woman king apple\n"
+          << "man woman pear queen\n"
+          << ":  other \n"
+          << "man king woman queen\n"
+          << "man apple woman queen\n";
+    }
+    auto sections = read_analogies(path, word_map, 4);
+    std::remove(path.c_str());
+    REQUIRE(sections.size() == 2);
+    CHECK(sections[0].name == "gender");
+    CHECK(sections[0].queries.size() == 1); // apple is not in restricted vocab
+    CHECK(sections[0].skipped == 2);
+    CHECK(sections[1].name == "other ");
+    CHECK(sections[1].queries.size() == 1);
+    CHECK(sections[1].skipped == 1);
+
+    auto m = normalized_rows(table, 4);
+    auto results = evaluate_analogies(m, sections, 2, 1);
+    REQUIRE(results.size() == 2);
+    for (auto& r : results) {
+      CHECK(r.total == 1);
+      CHECK(r.correct_add == 1);
+      CHECK(r.correct_mul == 1);
+    }
+  }
+
+  SECTION("Similarities") {
+    {
+      std::ofstream out(path);
+      out << "Word 1,Word 2,Human (mean)\n"
+          << "man,woman,9\n"
+          << "king,queen,10\n"
+          << "man,apple,1\n"
+          << "king,pear,5\n"
+          << "man,queen,6\n";
+    }
+    size_t skipped;
+    auto pairs = read_similarities(path, word_map, skipped);
+    std::remove(path.c_str());
+    REQUIRE(pairs.size() == 4);
+    CHECK(skipped == 1);
+    CHECK(evaluate_similarity(table, pairs) == Approx(1));
+    for (auto& p : pairs) { p.gold = -p.gold; }
+    CHECK(evaluate_similarity(table, pairs) == Approx(-1));
+  }
+
+  SECTION("Ranks") {
+    CHECK(fractional_ranks({3, 1, 3, 2}) == std::vector<Real>{2.5, 0, 2.5, 1});
+  }
+}
+
+TEST_CASE("Model", "[model]") {
+  const size_t n = 50, dim = 8;
+  std::vector<std::string> strings;
+  Table table;
+  for (size_t i = 0; i < n; i++) {
+    strings.push_back("w" + std::to_string(i));
+    table.push_back(Vector::Random(dim));
+  }
+  std::vector<std::string_view> words(strings.begin(), strings.end());
+  std::string path = "/tmp/koan_test_" + std::to_string(getpid()) + ".model";
+  Model::save(path, words, table);
+
+  SECTION("Lookup and vectors") {
+    Model model(path);
+    REQUIRE(model.size() == n);
+    REQUIRE(model.dim() == dim);
+    for (Word i = 0; i < n; i++) {
+      CHECK(model.lookup(words[i]) == i);
+      CHECK(model.word(i) == words[i]);
+      CHECK(model.vector(i)[3] == Approx(table[i][3]));
+      CHECK(model.norm(i) == Approx(table[i].norm()));
+    }
+    CHECK(model.lookup("w") == Model::NONE);
+    CHECK(model.lookup("") == Model::NONE);
+
+    std::vector<float> mean(dim);
+    model.mean({0, Model::NONE, 1}, mean.data());
+    CHECK(mean[5] == Approx((table[0][5] + table[1][5]) / 2));
+    model.mean({Model::NONE}, mean.data());
+    CHECK(mean[5] == 0);
+
+    auto top = model.top_k(model.vector(7), 3, 7);
+    REQUIRE(top.size() == 3);
+    for (Word c = 0; c < n; c++) {
+      Real sim = table[7].dot(table[c]) / table[7].norm() / table[c].norm();
+      auto found = std::find_if(
+          top.begin(), top.end(), [&](auto& p) { return p.first == c; });
+      if (found != top.end()) {
+        CHECK(sim == Approx(found->second));
+      } else if (c != 7) {
+        CHECK(sim <= top[2].second + 1e-5);
+      }
+    }
+  }
+
+  SECTION("Serve") {
+    std::string socket = path + ".sock";
+    serve::Server server(socket, path);
+    std::thread runner([&]() { server.run(); });
+    serve::Client client(socket);
+    std::vector<char> out;
+
+    // Pipelined requests are answered in order
+    client.send(serve::Lookup, 1, std::string("w3\nnope\nw9"));
+    client.send(serve::Vectors, 2, std::vector<uint32_t>{9, 3});
+    client.send(serve::Sentences, 3, std::string("w1 w2 nope\n"));
+    client.send(serve::Neighbors, 4, std::vector<uint32_t>{7}, 3);
+    client.send(serve::Words, 5, std::vector<uint32_t>{4, 12});
+    client.send(serve::Vectors, 6, std::vector<uint32_t>{uint32_t(n)});
+    client.send(serve::Neighbors, 10, std::vector<uint32_t>{7}, 1u << 31);
+    // Sentences of a request below the limit whose response would exceed it
+    client.send(serve::Sentences, 12, std::string((1 << 25) + 1, '\n'));
+
+    auto h = client.receive(out);
+    REQUIRE(h.tag == 1);
+    REQUIRE(h.count == 3);
+    auto ids = reinterpret_cast<const uint32_t*>(out.data());
+    CHECK(ids[0] == 3);
+    CHECK(ids[1] == Model::NONE);
+    CHECK(ids[2] == 9);
+
+    h = client.receive(out);
+    REQUIRE(h.tag == 2);
+    REQUIRE(h.bytes == 2 * dim * sizeof(float));
+    auto floats = reinterpret_cast<const float*>(out.data());
+    CHECK(floats[0] == Approx(table[9][0]));
+    CHECK(floats[dim + 1] == Approx(table[3][1]));
+
+    h = client.receive(out);
+    REQUIRE(h.tag == 3);
+    REQUIRE(h.count == 1);
+    floats = reinterpret_cast<const float*>(out.data());
+    CHECK(floats[2] == Approx((table[1][2] + table[2][2]) / 2));
+
+    h = client.receive(out);
+    REQUIRE(h.tag == 4);
+    REQUIRE(h.bytes == 3 * 2 * sizeof(uint32_t));
+    Model model(path);
+    auto top = model.top_k(model.vector(7), 3, 7);
+    ids = reinterpret_cast<const uint32_t*>(out.data());
+    CHECK(ids[0] == top[0].first);
+    CHECK(ids[4] == top[2].first);
+
+    h = client.receive(out);
+    REQUIRE(h.tag == 5);
+    CHECK(std::string(out.begin(), out.end()) == "w4\nw12\n");
+
+    h = client.receive(out);
+    CHECK(h.tag == 6);
+    CHECK(h.status == serve::Error);
+
+    h = client.receive(out);
+    CHECK(h.tag == 10);
+    CHECK(h.status == serve::Error);
+
+    h = client.receive(out);
+    CHECK(h.tag == 12);
+    CHECK(h.status == serve::Error);
+
+    // Hot swap to a model with another vocabulary, replaced at the same path
+    // since the server does not allow reloading other paths
+    std::string path2 = path + "2";
+    Model::save(path2, {"x", "y"}, table);
+    client.send(serve::Reload, 11, path2);
+    CHECK(client.receive(out).status == serve::Error);
+    REQUIRE(std::rename(path2.c_str(), path.c_str()) == 0);
+    client.send(serve::Reload, 7, nullptr, 0);
+    client.send(serve::Info, 8, nullptr, 0);
+    client.send(serve::Lookup, 9, std::string("y"));
+    CHECK(client.receive(out).status == serve::Ok);
+    CHECK(client.receive(out).count == 2);
+    client.receive(out);
+    CHECK(reinterpret_cast<const uint32_t*>(out.data())[0] == 1);
+
+    server.request_stop();
+    runner.join();
+  }
+  std::remove(path.c_str());
+}
+
+TEST_CASE("Embed", "[embed]") {
+  const size_t dim = 4;
+  Table table;
+  for (size_t i = 0; i < 3; i++) { table.push_back(Vector::Random(dim)); }
+  std::string path = "/tmp/koan_test_" + std::to_string(getpid());
+  Model::save(path + ".model", {"a", "b", "c"}, table);
+  Model model(path + ".model");
+
+  DocumentEmbedder embedder(model, 2);
+  std::vector<std::string> lines{"a b", "", "c nope c", "nope"};
+  RowMatrix docs;
+  embedder.embed(lines, docs, true);
+  REQUIRE(docs.rows() == 4);
+  REQUIRE(docs.cols() == dim);
+  CHECK(docs(0, 1) == Approx((table[0][1] + table[1][1]) / 2));
+  CHECK(docs.row(1).norm() == 0);
+  CHECK(docs(2, 3) == Approx(table[2][3]));
+  CHECK(docs.row(3).norm() == 0);
+
+  SECTION("SIF weights") {
+    embedder.set_sif_weights({{"a", 1}, {"b", 3}}, 0.5);
+    CHECK(embedder.weight(0) == Approx(0.5 / (0.5 + 0.25)));
+    CHECK(embedder.weight(1) == Approx(0.5 / (0.5 + 0.75)));
+    CHECK(embedder.weight(2) == 1);
+    embedder.embed(lines, docs);
+    CHECK(docs(0, 0) == Approx((embedder.weight(0) * table[0][0] +
+                                embedder.weight(1) * table[1][0]) /
+                               2));
+  }
+
+  SECTION("Save, load and remove common component") {
+    MatrixWriter writer(path + ".matrix", dim);
+    writer.write(docs.data(), 2);
+    writer.write(docs.data() + 2 * dim, 2);
+    writer.close();
+    auto loaded = load_matrix(path + ".matrix");
+    REQUIRE(loaded.rows() == 4);
+    CHECK(loaded == docs);
+
+    Eigen::VectorXf u = embedder.common_component();
+    CHECK(u.norm() == Approx(1));
+    remove_component(path + ".matrix", u, 3);
+    loaded = load_matrix(path + ".matrix");
+    CHECK((loaded * u).norm() == Approx(0).margin(1e-5));
+    CHECK(loaded.row(0).isApprox(docs.row(0) -
+                                 docs.row(0).dot(u) * u.transpose()));
+    std::remove((path + ".matrix").c_str());
+  }
+  std::remove((path + ".model").c_str());
+}
+
+TEST_CASE("Compress", "[compress]") {
+  // Rank 3 data plus a little noise, around a nonzero mean
+  const size_t n = 2000, dim = 12;
+  RowMatrix basis = RowMatrix::Random(3, dim);
+  RowMatrix x = RowMatrix::Random(n, 3) * basis;
+  x += 0.01 * RowMatrix::Random(n, dim);
+  x.rowwise() += Eigen::RowVectorXf::Constant(dim, 2);
+
+  SECTION("PCA") {
+    auto pca = randomized_pca(x, 3, 2);
+    REQUIRE(pca.k() == 3);
+    CHECK(pca.mean[0] == Approx(x.col(0).mean()).epsilon(1e-4));
+    CHECK((pca.components * pca.components.transpose())
+              .isApprox(RowMatrix::Identity(3, 3), 1e-4));
+    CHECK(pca.variances[0] >= pca.variances[1]);
+    CHECK(pca.variances.sum() / pca.total_variance > 0.999);
+    auto r = pca.reconstruct(pca.project(x, 3));
+    CHECK(reconstruction_error(x, r) < 1e-3);
+  }
+
+  SECTION("Product quantization") {
+    ProductQuantizer::Params params;
+    params.subspaces = 4;
+    params.sample = 1000;
+    params.threads = 2;
+    auto pq = ProductQuantizer::train(x, params);
+    REQUIRE(pq.dim() == dim);
+    REQUIRE(pq.sub_dim() == 3);
+    auto codes = pq.encode(x, 3);
+    REQUIRE(codes.size() == n * 4);
+
+    RowMatrix decoded(n, dim);
+    for (size_t i = 0; i < n; i++) {
+      pq.decode(&codes[i * 4], decoded.data() + i * dim);
+    }
+    CHECK(reconstruction_error(x, decoded) <
+          0.1 * reconstruction_error(x, RowMatrix::Zero(n, dim)));
+
+    std::vector<float> table(4 * ProductQuantizer::CENTROIDS);
+    pq.inner_product_table(x.data(), table.data());
+    float ip = 0;
+    for (size_t s = 0; s < 4; s++) {
+      ip += table[s * ProductQuantizer::CENTROIDS + codes[s]];
+    }
+    CHECK(ip == Approx(x.row(0).dot(decoded.row(0))).epsilon(1e-4));
+
+    SECTION("Save and load") {
+      std::vector<std::string> strings;
+      for (size_t i = 0; i < n; i++) { strings.push_back(std::to_string(i)); }
+      std::vector<std::string_view> words(strings.begin(), strings.end());
+      std::string path = "/tmp/koan_test_" + std::to_string(getpid()) + ".pq";
+      auto pca = randomized_pca(x, 8);
+      auto reduced = pca.project(x);
+      auto pq8 = ProductQuantizer::train(reduced, params);
+      PqModel::save(path, words, &pca, pq8, pq8.encode(reduced));
+      PqModel model(path);
+
+      // Corrupt files are rejected before allocating or reading past them
+      std::string bytes;
+      {
+        std::ifstream in(path, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(in), {});
+      }
+      auto load_with = [&](size_t pos, uint64_t value) {
+        std::string corrupt = bytes;
+        std::memcpy(&corrupt[pos], &value, sizeof(value));
+        std::ofstream(path, std::ios::binary) << corrupt;
+        PqModel corrupt_model(path);
+      };
+      size_t string_bytes = 0;
+      for (auto& s : strings) { string_bytes += s.size(); }
+      const size_t offsets = bytes.size() - string_bytes - (n + 1) * 8;
+      CHECK_THROWS(load_with(24, uint64_t(1) << 60)); // size
+      CHECK_THROWS(load_with(24, n + 1));
+      CHECK_THROWS(load_with(offsets, 1));
+      CHECK_THROWS(load_with(offsets + 8, string_bytes + 1)); // not monotonic
+      bytes.pop_back(); // truncated
+      std::ofstream(path, std::ios::binary) << bytes;
+      CHECK_THROWS(PqModel(path));
+      std::remove(path.c_str());
+      REQUIRE(model.size() == n);
+      REQUIRE(model.dim() == dim);
+      CHECK(model.lookup("17") == 17);
+      CHECK(model.lookup("x") == PqModel::NONE);
+
+      RowMatrix all(n, dim);
+      for (Word i = 0; i < n; i++) { model.decode(i, all.data() + i * dim); }
+      CHECK(all.row(5).isApprox(x.row(5), 0.1));
+
+      // Asymmetric distance scores are exact inner products with decoded
+      // vectors, so ranking matches brute force over them
+      Eigen::RowVectorXf q = x.row(9).normalized();
+      auto top = model.top_k(q.data(), 5, 9);
+      REQUIRE(top.size() == 5);
+      Eigen::VectorXf sims = all * q.transpose();
+      sims[9] = -1e9;
+      for (auto& [i, sim] : top) {
+        CHECK(sim == Approx(sims[i]).epsilon(1e-3));
+        Eigen::Index best;
+        sims.maxCoeff(&best);
+        CHECK(sims[best] == Approx(sim).epsilon(1e-3));
+        sims[i] = -1e9;
+      }
+    }
+  }
+}
+
+TEST_CASE("Profile", "[timer]") {
+  Profile profile(3);
+  auto outer = profile.phase("outer");
+  auto inner = profile.phase("outer/inner");
+  CHECK(profile.phase("outer") == outer);
+
+  {
+    auto scope = profile.scope(outer);
+    parallel_for(
+        0, 30, [&](size_t, size_t tid) { profile.add(inner, 0.5, tid); }, 3);
+  }
+  CHECK(profile.calls(outer) == 1);
+  CHECK(profile.calls(inner) == 30);
+  CHECK(profile.seconds(inner) == Approx(15));
+  CHECK(profile.seconds(outer) >= 0);
+
+  // Phases registered later keep earlier totals
+  for (int i = 0; i < 10; i++) {
+    profile.add(profile.phase("later" + std::to_string(i)), i, 2);
+  }
+  CHECK(profile.calls(inner) == 30);
+  CHECK(profile.seconds(inner) == Approx(15));
+  CHECK(profile.seconds(profile.phase("later9")) == 9);
+  CHECK(profile.calls(profile.phase("later0")) == 1);
+}
+
+TEST_CASE("TrainStats", "[stats]") {
+  TrainStats stats(4);
+  auto sents = stats.sum(&ThreadStats::sents);
+  auto tokens = stats.sum(&ThreadStats::tokens);
+  auto total_tokens = stats.sum(&ThreadStats::total_tokens);
+  auto read_tokens = stats.sum(&ThreadStats::read_tokens);
+  auto lr = stats.lr();
+  CHECK(size_t(sents) == 0);
+  CHECK(float(lr) == 0);
+
+  for (size_t epoch = 0; epoch < 2; epoch++) {
+    stats.new_epoch();
+    parallel_for(
+        0,
+        1000,
+        [&](size_t, size_t tid) {
+          stats[tid].add_sentence(2, 3, 0.01f * (tid + 1));
+        },
+        4);
+    CHECK(size_t(sents) == 1000);
+    CHECK(size_t(tokens) == 2000);
+    CHECK(size_t(read_tokens) == 3000);
+    CHECK(size_t(total_tokens) == 2000 * (epoch + 1));
+  }
+  CHECK(float(lr) <= 0.04f);
+  CHECK(float(lr) >= 0.01f);
+}
+
+TEST_CASE("Memory", "[memory]") {
+  SECTION("Heap bytes") {
+    std::vector<float> floats;
+    floats.reserve(100);
+    CHECK(heap_bytes(floats) == 400);
+    Sentences sents(2, Sentence(10));
+    CHECK(heap_bytes(sents) ==
+          2 * sizeof(Sentence) + 2 * sents[0].capacity() * sizeof(Word));
+    Table table(3, Vector::Zero(5));
+    CHECK(heap_bytes(table) == 3 * sizeof(Vector) + 15 * sizeof(Real));
+    CHECK(heap_bytes(std::string("short")) == 0);
+    std::unordered_map<std::string, size_t> map{{std::string(100, 'a'), 1}};
+    CHECK(heap_bytes(map) > 100);
+  }
+
+  SECTION("Ledger") {
+    MemoryLedger memory;
+    std::vector<char> big;
+    memory.track("big", [&]() { return heap_bytes(big); });
+    CHECK(MemoryLedger::rss() > 0);
+    memory.sample("before");
+    big.assign(64 << 20, 1);
+    memory.sample("allocate");
+    big = std::vector<char>();
+    memory.sample("free");
+    REQUIRE(memory.samples().size() == 3);
+    CHECK(memory.samples()[1].bytes[0] == size_t(64 << 20));
+    CHECK(memory.samples()[2].bytes[0] == 0);
+    CHECK(memory.samples()[1].rss > memory.samples()[0].rss);
+    CHECK(memory.peak_sample() <= 1); // earlier tests may have peaked higher
+  }
+}
+
+TEST_CASE("Metrics", "[metrics]") {
+  double tokens = 0;
+  auto collect = [&]() {
+    tokens += 10;
+    return std::vector<Metric>{{"tokens_total", tokens, "Tokens", true},
+                               {"loss", std::nan(""), "Loss"}};
+  };
+  auto read = [](const std::string& path) {
+    std::ifstream in(path);
+    return std::string((std::istreambuf_iterator<char>(in)),
+                       std::istreambuf_iterator<char>());
+  };
+  {
+    MetricsReporter metrics(collect, "tmp_metrics.jsonl", "tmp_metrics.prom");
+    metrics.report();
+    metrics.report();
+  }
+  auto log = read("tmp_metrics.jsonl");
+  CHECK(std::count(log.begin(), log.end(), '\n') == 2);
+  CHECK(log.find("\"tokens_total\":10,\"loss\":null}") != std::string::npos);
+  CHECK(log.find("\"tokens_total\":20,") != std::string::npos);
+  CHECK(read("tmp_metrics.prom") ==
+        "# HELP koan_tokens_total Tokens\n"
+        "# TYPE koan_tokens_total counter\n"
+        "koan_tokens_total 20\n");
+
+  {
+    MetricsReporter metrics(collect, "tmp_metrics.jsonl", "", 0.01);
+    metrics.start();
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  } // stops and reports once more
+  log = read("tmp_metrics.jsonl");
+  CHECK(std::count(log.begin(), log.end(), '\n') >= 2);
+  std::remove("tmp_metrics.jsonl");
+  std::remove("tmp_metrics.prom");
+}
+
+TEST_CASE("ContentionProfiler", "[contention]") {
+  using P = ContentionProfiler;
+  P profiler(20, 10, 3, 4, 5); // rows 0-3, then 4, 9, 14, 19 are sampled
+  CHECK(profiler.sampled(3));
+  CHECK(profiler.sampled(9));
+  CHECK(not profiler.sampled(10));
+  CHECK(profiler.weight(2) == 1);
+  CHECK(profiler.weight(9) == 5);
+
+  for (size_t tid : {0, 0, 1, 2, 2, 0}) { profiler.write(P::Input, 1, tid); }
+  profiler.write(P::Input, 10, 1); // not sampled
+  profiler.write(P::Output, 1, 1);
+  profiler.write(P::Output, 1, 1);
+
+  auto input = profiler.rows(P::Input);
+  REQUIRE(input.size() == 8);
+  CHECK(input[1].row == 1);
+  CHECK(input[1].writes == 6);
+  CHECK(input[1].conflicts == 3);
+  for (auto& r : input) {
+    if (r.row != 1) { CHECK(r.writes == 0); }
+  }
+  auto output = profiler.rows(P::Output);
+  REQUIRE(output.size() == 6);
+  CHECK(output[1].writes == 2);
+  CHECK(output[1].conflicts == 0);
+}
+
+TEST_CASE("PerfCounters", "[perf]") {
+  // Counters may be unavailable on the test machine, which should only make
+  // them read as NaN
+  PerfCounters perf;
+  auto before = perf.read();
+  parallel_for(0, 1000, [](size_t, size_t) {}, 2);
+  auto delta = perf.read() - before;
+  bool all_available = true;
+  for (size_t e = 0; e < PerfCounters::NUM_EVENTS; e++) {
+    bool available = perf.available(PerfCounters::Event(e));
+    all_available = all_available and available;
+    CHECK(std::isnan(delta[e]) != available);
+    if (available) { CHECK(delta[e] >= 0); }
+  }
+  CHECK(perf.error().empty() == all_available);
+
+  PerfCounters::Values sum{};
+  sum += PerfCounters::Values{1, 2, 3, 4, 5};
+  sum += PerfCounters::Values{1, 2, 3, 4, 5};
+  CHECK(sum == PerfCounters::Values{2, 4, 6, 8, 10});
+  CHECK(sum - sum == PerfCounters::Values{});
+}
+
+TEST_CASE("Trace", "[trace]") {
+  SECTION("Ring") {
+    trace::Ring ring(4, 0);
+    for (uint64_t i = 0; i < 6; i++) { ring.push({"e", i, 1}); }
+    std::vector<uint64_t> begins;
+    ring.for_each([&](const trace::Event& e) { begins.push_back(e.begin_ns); });
+    CHECK(begins == std::vector<uint64_t>{2, 3, 4, 5});
+  }
+
+  SECTION("Rings of exited threads are reused") {
+    auto& tracer = trace::Tracer::get();
+    std::atomic<int> started{0};
+    auto both = [&](size_t, size_t) { // so that they hold two rings at once
+      trace::Scope scope("a");
+      started++;
+      while (started < 2) { std::this_thread::yield(); }
+    };
+    parallel_for(0, 2, both, 2);
+    size_t rings = tracer.rings();
+    for (int batch = 0; batch < 5; batch++) {
+      parallel_for(0, 2, [](size_t, size_t) { trace::Scope scope("b"); }, 2);
+    }
+    CHECK(tracer.rings() == rings);
+  }
+
+  SECTION("Dump") {
+    auto& tracer = trace::Tracer::get();
+    tracer.clear();
+    std::thread worker([]() { trace::Scope scope("worker"); });
+    worker.join();
+    { trace::Scope scope("main \"quoted\""); }
+    CHECK(tracer.size() == 2);
+
+    std::string path = "tmp_trace.json";
+    tracer.dump(path);
+    std::ifstream in(path);
+    std::string json((std::istreambuf_iterator<char>(in)),
+                     std::istreambuf_iterator<char>());
+    CHECK(json.find("\"traceEvents\"") != std::string::npos);
+    CHECK(json.find("\"name\":\"worker\",\"ph\":\"X\"") !=
+          std::string::npos);
+    CHECK(json.find("main \\\"quoted\\\"") != std::string::npos);
+    std::remove(path.c_str());
+  }
+}
+
+TEST_CASE("Bench", "[bench]") {
+  bench::Runner runner(1e-3, 3, "sum/");
+  size_t calls = 0;
+  for (std::string name : {"sum", "total"}) {
+    const double dim = 10;
+    runner.run(name, {{"dim", dim}}, "add", dim, [&](size_t n) {
+      calls++;
+      double sum = 0;
+      for (size_t i = 0; i < n * dim; i++) { sum += i; }
+      bench::keep(sum);
+    });
+  }
+  REQUIRE(runner.results().size() == 1); // "total" is filtered out
+  auto& r = runner.results()[0];
+  CHECK(r.id() == "sum/dim=10");
+  CHECK(calls > 3); // calibration, and then repetitions
+  CHECK(r.iterations > 1);
+  CHECK(r.ns_per_unit_min <= r.ns_per_unit);
+  CHECK(r.ns_per_unit > 0);
+
+  CHECK(r.samples.size() == 3);
+
+  auto json = runner.json({{"seed", "1"}});
+  CHECK(json.find("\"context\": {\"seed\": 1}") != std::string::npos);
+  CHECK(json.find("{\"id\": \"sum/dim=10\", \"name\": \"sum\", "
+                  "\"params\": {\"dim\": 10}, \"unit\": \"add\", ") !=
+        std::string::npos);
+
+  // Results are read back as saved
+  bench::Results results{{{"cpu", "\"Some CPU @ 2GHz\""}, {"real_bytes", "4"}},
+                         runner.results()};
+  results.save("tmp_bench.json");
+  auto loaded = bench::Results::load("tmp_bench.json");
+  std::remove("tmp_bench.json");
+  CHECK(loaded.json() == results.json());
+  CHECK(loaded.baseline_name() == "Some-CPU-2GHz_4.json");
+  auto parsed = bench::Json::parse(
+      " {\"a\": [1, -2.5e1, true, false, null, \"x\\\"y\"], \"b\": {}} ");
+  REQUIRE(parsed.get("a"));
+  auto& a = parsed.get("a")->array;
+  REQUIRE(a.size() == 6);
+  CHECK(a[1].number == -25);
+  CHECK((a[2].type == bench::Json::Bool and a[2].number == 1));
+  CHECK(a[4].type == bench::Json::Null);
+  CHECK(a[5].string == "x\"y");
+  CHECK(parsed.get("b")->object.empty());
+  CHECK(not parsed.get("c"));
+  CHECK_THROWS(bench::Json::parse("{\"a\": [1, 2}"));
+
+  // Exact p-values of the Mann-Whitney U test: 2 of the C(6, 3) orderings
+  // separate samples of 3 completely, 2 of C(10, 5) samples of 5
+  CHECK(bench::mann_whitney_p({1, 2, 3}, {4, 5, 6}) == Approx(0.1));
+  CHECK(bench::mann_whitney_p({1, 2, 3, 4, 5}, {6, 7, 8, 9, 10}) ==
+        Approx(2. / 252));
+  CHECK(bench::mann_whitney_p({1, 3, 5}, {2, 4, 6}) > 0.5);
+  CHECK(bench::mann_whitney_p({1, 2, 3}, {1, 2, 3}) == Approx(1));
+  std::vector<double> x(60), y(60); // normal approximation
+  for (size_t i = 0; i < 60; i++) {
+    x[i] = i;
+    y[i] = i + 30;
+  }
+  CHECK(bench::mann_whitney_p(x, y) < 1e-4);
+  CHECK(bench::mann_whitney_p(x, x) > 0.9);
+
+  auto result = [](std::string name, std::vector<double> samples) {
+    auto sorted = samples;
+    std::sort(sorted.begin(), sorted.end());
+    return bench::Result{
+        name, {}, "op", 1, sorted[sorted.size() / 2], sorted[0], samples};
+  };
+  std::vector<bench::Result> baseline{result("a", {10, 11, 10, 12, 11}),
+                                      result("b", {10, 11, 10, 12, 11}),
+                                      result("c", {10, 11, 10, 12, 11})};
+  std::vector<bench::Result> current{result("a", {20, 21, 20, 22, 21}),
+                                     result("b", {5, 6, 5, 6, 5}),
+                                     result("c", {10, 12, 11, 11, 10}),
+                                     result("d", {1, 1, 1, 1, 1})};
+  auto changes = bench::compare(baseline, current);
+  REQUIRE(changes.size() == 3); // "d" has no baseline
+  CHECK(changes[0].ratio == Approx(21. / 11));
+  CHECK(changes[2].p > 0.5);
+  CHECK(bench::print_changes(changes) == 1); // only "a" is a regression
+}
+
+TEST_CASE("SyntheticCorpus", "[synth]") {
+  auto probs = zipf_probs(1000);
+  CHECK(std::accumulate(probs.begin(), probs.end(), 0.) == Approx(1));
+  CHECK(probs[0] == Approx(2 * probs[1]));
+  CHECK(zipf_probs(3, 2)[0] == Approx(4 * zipf_probs(3, 2)[1]));
+
+  CHECK(SyntheticCorpus::word(0) == "a");
+  CHECK(SyntheticCorpus::word(25) == "z");
+  CHECK(SyntheticCorpus::word(26) == "aa");
+  CHECK(SyntheticCorpus::word(26 + 26 * 26) == "aaa");
+
+  for (std::string lengths : {"fixed", "uniform", "poisson"}) {
+    SyntheticCorpus corpus({.vocab_size = 100,
+                            .zipf = 1,
+                            .tokens = 10003,
+                            .sentence_length = 10,
+                            .lengths = lengths});
+    std::vector<Sentence> sents;
+    std::vector<size_t> counts(100, 0);
+    size_t tokens = 0;
+    corpus.generate([&](const Sentence& s) {
+      sents.push_back(s);
+      tokens += s.size();
+      for (auto w : s) { counts[w]++; }
+    });
+    CHECK(tokens == 10003);
+    CHECK(sents.size() > 500);
+    CHECK(counts[0] > counts[10]);
+    CHECK(counts[10] > counts[90]);
+    if (lengths == "fixed") {
+      CHECK(sents.size() == 1001);
+      CHECK(sents.back().size() == 3);
+    }
+    std::vector<Sentence> again; // deterministic
+    corpus.generate([&](const Sentence& s) { again.push_back(s); });
+    CHECK(again == sents);
+  }
+
+  SyntheticCorpus corpus({.vocab_size = 30, .tokens = 100});
+  CHECK(corpus.write("tmp_synth.txt", "text") ==
+        corpus.write("tmp_synth.bin", "binary"));
+  std::vector<std::string> lines;
+  readlines(
+      "tmp_synth.txt",
+      [&](std::string_view line) { lines.emplace_back(line); },
+      "text",
+      true);
+  std::vector<Sentence> sents;
+  auto vocab = SyntheticCorpus::read_binary(
+      "tmp_synth.bin", [&](const Sentence& s) { sents.push_back(s); });
+  REQUIRE(vocab.size() == 30);
+  REQUIRE(sents.size() == lines.size());
+  for (size_t i = 0; i < sents.size(); i++) {
+    std::string decoded;
+    for (auto id : sents[i]) {
+      decoded += (decoded.empty() ? "" : " ") + vocab[id];
+    }
+    CHECK(decoded == lines[i]);
+  }
+  CHECK_THROWS(
+      SyntheticCorpus::read_binary("tmp_synth.txt", [](const Sentence&) {}));
+  std::remove("tmp_synth.txt");
+  std::remove("tmp_synth.bin");
+}
+
+TEST_CASE("Autotuner", "[autotune]") {
+  using namespace koan;
+
+  auto cpus = CpuTopology::detect();
+  CHECK(cpus.physical >= 1);
+  CHECK(cpus.physical <= cpus.logical);
+  CHECK(cpus.logical <= std::max(std::thread::hardware_concurrency(), 1u));
+
+  CHECK(Autotuner::thread_candidates(4, {16, 8}) ==
+        std::vector<unsigned>{4, 8, 16});
+  CHECK(Autotuner::thread_candidates(0, {2, 2}) ==
+        std::vector<unsigned>{1, 2});
+
+  CHECK(Autotuner::buffer_candidates(1000, 6000) ==
+        std::vector<size_t>{500, 1000, 2000});
+  CHECK(Autotuner::buffer_candidates(1000, 4000) ==
+        std::vector<size_t>{500, 1000});
+  CHECK(Autotuner::buffer_candidates(1000, 2000) == std::vector<size_t>{1000});
+
+  // Fastest with 8 threads, partitioned and the largest buffer
+  size_t calls = 0;
+  Autotuner tuner([&](const LoopSettings& s) {
+    calls++;
+    return 100. * std::min(s.threads, 8u) - (s.threads > 8 ? 50 : 0) +
+           (s.partitioned ? 10 : 0) + s.buffer_size / 1000.;
+  });
+  auto best = tuner.tune({4, 8, 16}, {500, 1000, 2000});
+  CHECK(best == LoopSettings{8, true, 2000});
+  CHECK(best.str() == "-t 8 -L true -B 2000");
+  CHECK(calls == 8); // 3 x 2 in the first stage, 2 new buffer sizes
+  CHECK(tuner.trials().size() == calls);
+}
+
+TEST_CASE("Reader", "[reader]") {
+  using namespace koan;
+
+  {
+    std::ofstream out("tmp_reader.txt");
+    out << "a b c\nb x c\n\na a\n";
+  }
+  IndexMap<std::string_view> word_map;
+  for (auto w : {"a", "b", "c"}) { word_map.insert(w); }
+  std::vector<std::string> fnames{"tmp_reader.txt"};
+
+  OnceReader once(word_map, fnames, true, "text");
+  Sentences sentences;
+  while (once.get_next(sentences)) {}
+  CHECK(sentences == Sentences{{0, 1, 2}, {1, 2}, {}, {0, 0}});
+  auto counts = once.counts();
+  CHECK(counts.lines == 4);
+  CHECK(counts.bytes == 17);
+  CHECK(counts.words == 8);
+  CHECK(counts.oov == 1);
+
+  AsyncReader async(word_map, fnames, 3, true, "text", false);
+  size_t lines = 0;
+  while (async.get_next(sentences)) {
+    lines += sentences.size();
+    CHECK(async.counts().lines == lines); // up to the returned batch
+  }
+  CHECK(async.counts().lines == 4);
+  CHECK(async.counts().bytes == 17);
+  std::remove("tmp_reader.txt");
+}
+
+TEST_CASE("AsyncReader", "[reader]") {
+  using namespace koan;
+
+  {
+    std::ofstream out("tmp_async_reader.txt");
+    out << "a b c\nb x c\n\na a\n";
+  }
+  IndexMap<std::string_view> word_map;
+  for (auto w : {"a", "b", "c"}) { word_map.insert(w); }
+  std::vector<std::string> fnames{"tmp_async_reader.txt"};
+
+  // Same sentences as OnceReader: the newline is not part of the last word
+  AsyncReader async(word_map, fnames, 3, true, "text", false);
+  Sentences all, batch;
+  while (async.get_next(batch)) {
+    all.insert(all.end(), batch.begin(), batch.end());
+  }
+  CHECK(all == Sentences{{0, 1, 2}, {1, 2}, {}, {0, 0}});
+  CHECK(async.counts().words == 8);
+  CHECK(async.counts().oov == 1);
+  std::remove("tmp_async_reader.txt");
+}